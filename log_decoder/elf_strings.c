@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "elf_strings.h"
+
+#define ELF_CLASS_32        (1)
+#define ELF_CLASS_64        (2)
+#define ELF_DATA_LSB        (1)
+#define ELF_SHT_NOBITS      (8)
+#define ELF_SHF_ALLOC       (0x2)
+#define ELF_SHF_EXECINSTR   (0x4)
+
+static uint64_t read_le(const uint8_t *p, int len)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++)
+    {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+// Data sections of the image (ALLOC with file contents, no code): .flash.rodata, .dram0.data, .rodata ..
+static bool load_sections(elf_strings_t *elf)
+{
+    const uint8_t *f = elf->file;
+    bool is64;
+
+    if (elf->file_len < 52 || memcmp(f, "\x7f" "ELF", 4) != 0 || f[5] != ELF_DATA_LSB)
+    {
+        return false;
+    }
+    if (f[4] == ELF_CLASS_32)
+    {
+        is64 = false;
+    }
+    else if (f[4] == ELF_CLASS_64 && elf->file_len >= 64)
+    {
+        is64 = true;
+    }
+    else
+    {
+        return false;
+    }
+
+    uint64_t shoff = is64 ? read_le(f + 0x28, 8) : read_le(f + 0x20, 4);
+    uint64_t shentsize = read_le(f + (is64 ? 0x3A : 0x2E), 2);
+    uint64_t shnum = read_le(f + (is64 ? 0x3C : 0x30), 2);
+
+    if (shentsize < (is64 ? 64u : 40u) || shoff > elf->file_len || shnum * shentsize > elf->file_len - shoff)
+    {
+        return false;
+    }
+    for (uint64_t i = 0; i < shnum; i++)
+    {
+        const uint8_t *sh = f + shoff + i * shentsize;
+        uint64_t type = read_le(sh + 4, 4);
+        uint64_t flags = is64 ? read_le(sh + 8, 8) : read_le(sh + 8, 4);
+        uint64_t addr = is64 ? read_le(sh + 16, 8) : read_le(sh + 12, 4);
+        uint64_t offset = is64 ? read_le(sh + 24, 8) : read_le(sh + 16, 4);
+        uint64_t size = is64 ? read_le(sh + 32, 8) : read_le(sh + 20, 4);
+
+        if (type == ELF_SHT_NOBITS || (flags & ELF_SHF_ALLOC) == 0 || (flags & ELF_SHF_EXECINSTR) != 0 || size == 0 ||
+            offset > elf->file_len || size > elf->file_len - offset)
+        {
+            continue;
+        }
+        if (elf->section_count == ELF_STRINGS_MAX_SECTIONS)
+        {
+            break;
+        }
+        elf_section_t *section = &elf->sections[elf->section_count++];
+        section->addr = addr;
+        section->size = size;
+        section->data = f + offset;
+    }
+    return elf->section_count > 0;
+}
+
+bool elf_strings_load(elf_strings_t *elf, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    long len;
+
+    memset(elf, 0, sizeof(*elf));
+    if (file == NULL)
+    {
+        return false;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return false;
+    }
+    elf->file = malloc(len);
+    elf->file_len = len;
+    if (elf->file == NULL || fread(elf->file, 1, len, file) != (size_t)len || !load_sections(elf))
+    {
+        fclose(file);
+        elf_strings_free(elf);
+        return false;
+    }
+    fclose(file);
+    return true;
+}
+
+void elf_strings_free(elf_strings_t *elf)
+{
+    free(elf->file);
+    memset(elf, 0, sizeof(*elf));
+}
+
+const char *elf_strings_get(const elf_strings_t *elf, uint64_t addr)
+{
+    for (int i = 0; i < elf->section_count; i++)
+    {
+        const elf_section_t *section = &elf->sections[i];
+        if (addr >= section->addr && addr - section->addr < section->size)
+        {
+            const char *s = (const char *)section->data + (addr - section->addr);
+            size_t room = section->size - (addr - section->addr);
+            size_t len = strnlen(s, room);
+            if (len == room)
+            {
+                return NULL;
+            }
+            // An address of another build lands anywhere, a string is text
+            for (size_t j = 0; j < len; j++)
+            {
+                unsigned char c = s[j];
+                if (c < 0x20 && c != '\n' && c != '\r' && c != '\t' && c != 0x1B)
+                {
+                    return NULL;
+                }
+            }
+            return s;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef ELF_STRINGS_H
+#define ELF_STRINGS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Strings of a firmware ELF by address: the tags and format strings deferred_log sends
+ * as flash addresses. Reads the section headers only, ELF32 (ESP32-C3/S3) and ELF64
+ * (the host check) little-endian.
+ */
+
+#define ELF_STRINGS_MAX_SECTIONS    (64)
+
+typedef struct
+{
+    uint64_t addr;
+    uint64_t size;
+    const uint8_t *data;
+} elf_section_t;
+
+typedef struct
+{
+    uint8_t *file;
+    size_t file_len;
+    elf_section_t sections[ELF_STRINGS_MAX_SECTIONS];
+    int section_count;
+} elf_strings_t;
+
+bool elf_strings_load(elf_strings_t *elf, const char *path);
+void elf_strings_free(elf_strings_t *elf);
+
+// The 0 terminated text at addr, NULL when no data section of the image holds one there
+const char *elf_strings_get(const elf_strings_t *elf, uint64_t addr);
+
+#endif // ELF_STRINGS_H
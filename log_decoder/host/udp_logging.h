@@ -0,0 +1,9 @@
+#ifndef UDP_LOGGING_H
+#define UDP_LOGGING_H
+
+#include <stddef.h>
+
+// The record output of deferred_log.c, for its host build
+void udp_logging_write(const char *line, size_t len);
+
+#endif // UDP_LOGGING_H
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "deferred_log.h"
+#include "elf_strings.h"
+#include "record_decode.h"
+
+/*
+ * Rebuilds the text of the deferred_log records in a log stream (a raw UART capture, stdin
+ * or the datagrams of udp_logging) from the strings of the firmware ELF, text lines pass
+ * unchanged. --check encodes log calls with deferred_log.c, decodes them with the ELF of
+ * this program and compares with vsnprintf, then prints record size and encode time.
+ */
+
+#define DECODER_TEXT_MAX        (1024)
+#define DECODER_DATAGRAM_MAX    (2048)
+#define CHECK_TIME_MS           (1234567)
+#define CHECK_TAG               "ESPNOW_MASTER"
+#define CHECK_MACSTR            "%02x:%02x:%02x:%02x:%02x:%02x"
+
+static record_decode_stats_t s_stats;
+static elf_strings_t s_self;
+static int s_failures = 0;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s --elf FIRMWARE.elf [FILE]    decode FILE (default stdin), a raw UART capture\n"
+            "       %s --elf FIRMWARE.elf --udp PORT  decode the datagrams of udp_logging\n"
+            "       %s --check [--rounds N]           encode, decode and compare, print size and time\n",
+            name, name, name);
+}
+
+static void decode_line(const elf_strings_t *elf, const uint8_t *line, size_t len)
+{
+    char text[DECODER_TEXT_MAX];
+
+    if (len > 0 && line[0] == DEFERRED_LOG_MARKER)
+    {
+        record_decode(elf, line, len, text, sizeof(text), &s_stats);
+        printf("%s\n", text);
+    }
+    else
+    {
+        fwrite(line, 1, len, stdout);
+    }
+}
+
+static int decode_stream(const elf_strings_t *elf, FILE *in)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, in)) > 0)
+    {
+        decode_line(elf, (const uint8_t *)line, len);
+        fflush(stdout);
+    }
+    free(line);
+    return 0;
+}
+
+// udp_logging packs whole lines, a datagram never ends inside one
+static int decode_udp(const elf_strings_t *elf, int port)
+{
+    static uint8_t datagram[DECODER_DATAGRAM_MAX];
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("udp");
+        return 1;
+    }
+    while (1)
+    {
+        ssize_t len = recv(fd, datagram, sizeof(datagram), 0);
+        if (len < 0)
+        {
+            perror("recv");
+            close(fd);
+            return 1;
+        }
+        size_t start = 0;
+        for (size_t i = 0; i < (size_t)len; i++)
+        {
+            if (datagram[i] == '\n' || i + 1 == (size_t)len)
+            {
+                decode_line(elf, datagram + start, i + 1 - start);
+                start = i + 1;
+            }
+        }
+        fflush(stdout);
+    }
+}
+
+// Host side of what deferred_log.c calls
+esp_log_level_t esp_log_level_get(const char *tag)
+{
+    return ESP_LOG_VERBOSE;
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return CHECK_TIME_MS;
+}
+
+void udp_logging_write(const char *line, size_t len)
+{
+}
+
+static size_t encode(char *line, size_t size, const char *tag, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t len = deferred_log_encode(line, size, ESP_LOG_INFO, CHECK_TIME_MS, tag, format, args);
+    va_end(args);
+    return len;
+}
+
+#define CHECK(cond, fmt, ...) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+            s_failures++; \
+        } \
+    } while (0)
+
+// Record of the call decoded from this ELF equals what ESP_LOGI would have printed
+static void check_call(const char *tag, const char *format, ...)
+{
+    char expected[DECODER_TEXT_MAX];
+    char text[DECODER_TEXT_MAX];
+    char line[DEFERRED_LOG_MAX_LEN];
+    va_list args;
+    va_list copy;
+
+    va_start(args, format);
+    va_copy(copy, args);
+    int prefix = snprintf(expected, sizeof(expected), "I (%d) %s: ", CHECK_TIME_MS, tag);
+    vsnprintf(expected + prefix, sizeof(expected) - prefix, format, copy);
+    va_end(copy);
+    size_t len = deferred_log_encode(line, sizeof(line), ESP_LOG_INFO, CHECK_TIME_MS, tag, format, args);
+    va_end(args);
+
+    CHECK(line[0] == DEFERRED_LOG_MARKER && line[len - 1] == '\n', "record framing of \"%s\"", format);
+    CHECK(memchr(line, '\n', len - 1) == NULL && memchr(line, '\r', len) == NULL, "newline in the record of \"%s\"", format);
+    record_decode(&s_self, (const uint8_t *)line, len, text, sizeof(text), &s_stats);
+    CHECK(strcmp(text, expected) == 0, "\n  decoded  \"%s\"\n  expected \"%s\"", text, expected);
+}
+
+static void check(void)
+{
+    char line[DEFERRED_LOG_MAX_LEN];
+    char text[DECODER_TEXT_MAX];
+    uint8_t mac[6] = { 0x34, 0x85, 0x18, 0x0a, 0x0d, 0x10 };
+
+    check_call(CHECK_TAG, "Receive ESPNOW data too short, len:%d", 5);
+    check_call(CHECK_TAG, "         MCU Temperature: %.2f", 41.25);
+    check_call(CHECK_TAG, "         RSSI: %d", -67);
+    check_call(CHECK_TAG, "Send callback: MAC Address " CHECK_MACSTR ", Status: %s",
+               mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], "Success");
+    check_call(CHECK_TAG, "CRC check failed. Calculated CRC: %d, Received CRC: %d", 0xBEEF, 0x0A0D);
+    check_call(CHECK_TAG, "Remaining time to wait before retry_send_callback: %lld us", -123456789012LL);
+    check_call(CHECK_TAG, "| %-17s | %-7s | %-7d | %-12.2f | %8.3e |", "34:85:18:0a:0d:10", "Online", -3, 7.25, 1e-7);
+    check_call(CHECK_TAG, "%5.*f|%*d|%c|%#x|%X|%o|%hhu|%hd|%zu|%lu|%%|%p", 3, 3.14159, 6, 42, 'Z', 0xDEADBEEFu, 10u,
+               13u, 300, 70000, (size_t)12345, 16ul, (void *)0x1234);
+    check_call("TELEMETRY", "Batch of %d samples, %d B", 8, 288);
+    check_call("TELEMETRY", "no arguments");
+
+    // Strings are cut to DEFERRED_LOG_MAX_STRING
+    encode(line, sizeof(line), CHECK_TAG, "message: %s", "0123456789012345678901234567890123456789012345678901234567890123");
+    record_decode(&s_self, (const uint8_t *)line, sizeof(line), text, sizeof(text), &s_stats);
+    CHECK(strcmp(text, "I (1234567) " CHECK_TAG ": message: 012345678901234567890123456789012345678901234567") == 0,
+          "long string: %s", text);
+
+    // Arguments past DEFERRED_LOG_MAX_LEN are left out and flagged
+    size_t len = encode(line, sizeof(line), CHECK_TAG, "%f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f",
+                        1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0, 16.0);
+    uint32_t truncated = s_stats.truncated;
+    record_decode(&s_self, (const uint8_t *)line, len, text, sizeof(text), &s_stats);
+    CHECK(len <= DEFERRED_LOG_MAX_LEN && s_stats.truncated == truncated + 1 && strstr(text, " [cut]") != NULL,
+          "overflow not flagged: %s", text);
+
+    // A format that is not in the ELF (built at run time) is reported, not guessed
+    char *heap_format = strdup("value %d");
+    uint32_t unresolved = s_stats.unresolved;
+    len = encode(line, sizeof(line), CHECK_TAG, heap_format, 1);
+    record_decode(&s_self, (const uint8_t *)line, len, text, sizeof(text), &s_stats);
+    CHECK(s_stats.unresolved == unresolved + 1 && strstr(text, "not in the ELF") != NULL, "heap format: %s", text);
+    free(heap_format);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// One log call: the line ESP_LOGI prints ("I (time) TAG: message\n") against its record
+static void benchmark_call(int rounds, const char *name, const char *format, ...)
+{
+    char text[DECODER_TEXT_MAX];
+    char line[DEFERRED_LOG_MAX_LEN];
+    size_t text_len = 0;
+    size_t record_len = 0;
+    va_list args;
+    va_list copy;
+
+    // Header and message, the '\n' counted too
+    va_start(args, format);
+    int64_t start = now_ns();
+    for (int i = 0; i < rounds; i++)
+    {
+        va_copy(copy, args);
+        int prefix = snprintf(text, sizeof(text), "I (%lu) %s: ", (unsigned long)CHECK_TIME_MS, CHECK_TAG);
+        text_len = prefix + vsnprintf(text + prefix, sizeof(text) - prefix, format, copy) + 1;
+        va_end(copy);
+    }
+    double text_ns = (double)(now_ns() - start) / rounds;
+
+    start = now_ns();
+    for (int i = 0; i < rounds; i++)
+    {
+        va_copy(copy, args);
+        record_len = deferred_log_encode(line, sizeof(line), ESP_LOG_INFO, CHECK_TIME_MS, CHECK_TAG, format, copy);
+        va_end(copy);
+    }
+    double record_ns = (double)(now_ns() - start) / rounds;
+    va_end(args);
+
+    printf("%-14s %8zu %10zu %7.0f%% %10.1f %10.1f\n", name, text_len, record_len,
+           100.0 * record_len / text_len, text_ns, record_ns);
+}
+
+static void benchmark(int rounds)
+{
+    uint8_t mac[6] = { 0x34, 0x85, 0x18, 0x0a, 0x0d, 0x10 };
+
+    printf("%-14s %8s %10s %8s %10s %10s\n", "call", "text B", "record B", "ratio", "text ns", "record ns");
+    benchmark_call(rounds, "static", "CRC check passed.");
+    benchmark_call(rounds, "int", "     seq_num: %d", 1234);
+    benchmark_call(rounds, "float", "         MCU Temperature: %.2f", 41.25);
+    benchmark_call(rounds, "mac+string", "Send callback: MAC Address " CHECK_MACSTR ", Status: %s",
+                   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], "Success");
+    benchmark_call(rounds, "table row", "| %-17s | %-7s | %-7d | %-12.2f | %-12.2f | %-12.2f | %-8.2f | %-8.2f | %-7s |",
+                   "34:85:18:0a:0d:10", "Online", -67, 28.37, 6.82, 28.41, 7.24, 41.0, "On");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "elf",            required_argument, NULL, 'e' },
+        { "udp",            required_argument, NULL, 'u' },
+        { "check",          no_argument,       NULL, 'c' },
+        { "rounds",         required_argument, NULL, 'n' },
+        { "help",           no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *elf_path = NULL;
+    int port = 0;
+    bool run_check = false;
+    int rounds = 100000;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'e':
+                elf_path = optarg;
+                break;
+            case 'u':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                run_check = true;
+                break;
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (run_check)
+    {
+        if (rounds < 1 || !elf_strings_load(&s_self, "/proc/self/exe"))
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        if (elf_strings_get(&s_self, (uintptr_t)CHECK_TAG) == NULL)
+        {
+            fprintf(stderr, "Strings of this program not found by address, build it without PIE\n");
+            return 1;
+        }
+        check();
+        if (s_failures > 0)
+        {
+            fprintf(stderr, "%d checks failed\n", s_failures);
+            return 1;
+        }
+        printf("Records decoded from the ELF and equal to vsnprintf\n\n");
+        benchmark(rounds);
+        elf_strings_free(&s_self);
+        return 0;
+    }
+
+    elf_strings_t elf;
+    if (elf_path == NULL || optind + 1 < argc)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!elf_strings_load(&elf, elf_path))
+    {
+        fprintf(stderr, "%s: not an ELF with loaded sections\n", elf_path);
+        return 1;
+    }
+
+    int ret;
+    if (port > 0)
+    {
+        ret = decode_udp(&elf, port);
+    }
+    else if (optind < argc)
+    {
+        FILE *in = fopen(argv[optind], "rb");
+        if (in == NULL)
+        {
+            perror(argv[optind]);
+            elf_strings_free(&elf);
+            return 1;
+        }
+        ret = decode_stream(&elf, in);
+        fclose(in);
+    }
+    else
+    {
+        ret = decode_stream(&elf, stdin);
+    }
+    if (s_stats.unresolved > 0 || s_stats.truncated > 0)
+    {
+        fprintf(stderr, "%u records, %u not in %s, %u cut\n", s_stats.records, s_stats.unresolved, elf_path,
+                s_stats.truncated);
+    }
+    elf_strings_free(&elf);
+    return ret;
+}
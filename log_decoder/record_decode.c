@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "record_decode.h"
+#include "deferred_log.h"
+
+typedef struct
+{
+    uint8_t raw[DEFERRED_LOG_MAX_LEN];
+    size_t len;
+    size_t pos;
+} record_reader_t;
+
+typedef struct
+{
+    char *text;
+    size_t size;
+    size_t len;
+} text_writer_t;
+
+static void text_append(text_writer_t *t, const char *format, ...)
+{
+    va_list args;
+
+    if (t->len + 1 >= t->size)
+    {
+        return;
+    }
+    va_start(args, format);
+    int len = vsnprintf(t->text + t->len, t->size - t->len, format, args);
+    va_end(args);
+    if (len > 0)
+    {
+        t->len += ((size_t)len < t->size - t->len) ? (size_t)len : t->size - t->len - 1;
+    }
+}
+
+static bool read_varint(record_reader_t *r, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (r->pos >= r->len)
+        {
+            return false;
+        }
+        uint8_t byte = r->raw[r->pos++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_signed(record_reader_t *r, int64_t *value)
+{
+    uint64_t zigzag;
+    if (!read_varint(r, &zigzag))
+    {
+        return false;
+    }
+    *value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    return true;
+}
+
+static bool read_le(record_reader_t *r, int len, uint64_t *value)
+{
+    if (r->len - r->pos < (size_t)len)
+    {
+        return false;
+    }
+    *value = 0;
+    for (int i = 0; i < len; i++)
+    {
+        *value |= (uint64_t)r->raw[r->pos++] << (8 * i);
+    }
+    return true;
+}
+
+static bool read_string(record_reader_t *r, char *s, size_t size)
+{
+    uint64_t len;
+    if (!read_varint(r, &len) || len >= size || r->len - r->pos < len)
+    {
+        return false;
+    }
+    memcpy(s, r->raw + r->pos, len);
+    s[len] = '\0';
+    r->pos += len;
+    return true;
+}
+
+// One conversion of format at *p (just after '%'), its arguments read from r
+static bool format_conversion(record_reader_t *r, const char **p, text_writer_t *t)
+{
+    char spec[32] = "%";
+    size_t spec_len = 1;
+    const char *s = *p;
+
+    while (*s != '\0' && strchr("-+ #0", *s) != NULL && spec_len < 8)
+    {
+        spec[spec_len++] = *s++;
+    }
+    for (int field = 0; field < 2; field++)
+    {
+        if (field == 1)
+        {
+            if (*s != '.')
+            {
+                break;
+            }
+            spec[spec_len++] = *s++;
+        }
+        if (*s == '*')
+        {
+            int64_t value;
+            if (!read_signed(r, &value))
+            {
+                return false;
+            }
+            spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len - 4, "%d", (int)value);
+            s++;
+        }
+        while (*s >= '0' && *s <= '9' && spec_len < sizeof(spec) - 8)
+        {
+            spec[spec_len++] = *s++;
+        }
+    }
+
+    // The device sent the value in full, its size only matters for h and hh
+    int shorts = 0;
+    while (*s == 'h' || *s == 'l' || *s == 'z' || *s == 'j' || *s == 't' || *s == 'L')
+    {
+        shorts += (*s == 'h');
+        s++;
+    }
+    char conversion = *s;
+    if (conversion == '\0')
+    {
+        *p = s - 1;
+        return true;
+    }
+    *p = s;
+    spec[spec_len] = '\0';
+
+    switch (conversion)
+    {
+        case 'd':
+        case 'i':
+        {
+            int64_t value;
+            if (!read_signed(r, &value))
+            {
+                return false;
+            }
+            value = (shorts == 2) ? (signed char)value : (shorts == 1) ? (short)value : value;
+            strcat(spec, "lld");
+            text_append(t, spec, (long long)value);
+            return true;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+        {
+            uint64_t value;
+            if (!read_varint(r, &value))
+            {
+                return false;
+            }
+            value = (shorts == 2) ? (unsigned char)value : (shorts == 1) ? (unsigned short)value : value;
+            if (conversion == 'c')
+            {
+                strcat(spec, "c");
+                text_append(t, spec, (int)value);
+            }
+            else
+            {
+                size_t len = strlen(spec);
+                snprintf(spec + len, sizeof(spec) - len, "ll%c", conversion);
+                text_append(t, spec, (unsigned long long)value);
+            }
+            return true;
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+        {
+            uint64_t bits;
+            double value;
+            size_t len = strlen(spec);
+            if (!read_le(r, 8, &bits))
+            {
+                return false;
+            }
+            memcpy(&value, &bits, sizeof(value));
+            snprintf(spec + len, sizeof(spec) - len, "%c", conversion);
+            text_append(t, spec, value);
+            return true;
+        }
+        case 's':
+        {
+            char value[DEFERRED_LOG_MAX_STRING + 1];
+            if (!read_string(r, value, sizeof(value)))
+            {
+                return false;
+            }
+            strcat(spec, "s");
+            text_append(t, spec, value);
+            return true;
+        }
+        case 'p':
+        {
+            uint64_t value;
+            if (!read_varint(r, &value))
+            {
+                return false;
+            }
+            text_append(t, "0x%llx", (unsigned long long)value);
+            return true;
+        }
+        case 'n':
+            return true;
+        default:
+            // Unknown conversion, printed as written, no argument
+            text_append(t, "%s%c", spec, conversion);
+            return true;
+    }
+}
+
+size_t record_decode(const elf_strings_t *elf, const uint8_t *line, size_t len, char *text, size_t size,
+                     record_decode_stats_t *stats)
+{
+    static const char levels[] = "NEWIDV";
+    record_reader_t r = { .len = 0, .pos = 0 };
+    text_writer_t t = { .text = text, .size = size, .len = 0 };
+    uint64_t time_ms, tag, format;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    text[0] = '\0';
+    stats->records++;
+
+    // Without the marker, the escapes resolved, the '\n' (and '\r' of the console) dropped
+    for (size_t i = 1; i < len && line[i] != '\n' && line[i] != '\r' && r.len < sizeof(r.raw); i++)
+    {
+        uint8_t byte = line[i];
+        if (byte == DEFERRED_LOG_ESCAPE && i + 1 < len)
+        {
+            byte = line[++i] ^ DEFERRED_LOG_ESCAPE_XOR;
+        }
+        r.raw[r.len++] = byte;
+    }
+
+    if (r.len < 1)
+    {
+        stats->truncated++;
+        text_append(&t, "<empty record>");
+        return t.len;
+    }
+    uint8_t level = r.raw[r.pos++];
+    bool truncated = (level & DEFERRED_LOG_TRUNCATED) != 0;
+    level &= ~DEFERRED_LOG_TRUNCATED;
+    if (!read_varint(&r, &time_ms) || !read_le(&r, 4, &tag) || !read_le(&r, 4, &format))
+    {
+        stats->truncated++;
+        text_append(&t, "<record cut>");
+        return t.len;
+    }
+
+    const char *tag_s = elf_strings_get(elf, tag);
+    const char *format_s = elf_strings_get(elf, format);
+    text_append(&t, "%c (%llu) %s: ", level < sizeof(levels) - 1 ? levels[level] : '?',
+                (unsigned long long)time_ms, tag_s != NULL ? tag_s : "?");
+    if (format_s == NULL)
+    {
+        stats->unresolved++;
+        text_append(&t, "<format 0x%08llx not in the ELF>", (unsigned long long)format);
+        return t.len;
+    }
+    if (tag_s == NULL)
+    {
+        stats->unresolved++;
+    }
+
+    for (const char *p = format_s; *p != '\0'; p++)
+    {
+        if (*p != '%')
+        {
+            const char *end = strchr(p, '%');
+            int run = (end != NULL) ? (int)(end - p) : (int)strlen(p);
+            text_append(&t, "%.*s", run, p);
+            p += run - 1;
+            continue;
+        }
+        if (*++p == '%')
+        {
+            text_append(&t, "%%");
+            continue;
+        }
+        if (!format_conversion(&r, &p, &t))
+        {
+            truncated = true;
+            text_append(&t, "<?>");
+            break;
+        }
+    }
+    if (truncated)
+    {
+        stats->truncated++;
+        text_append(&t, " [cut]");
+    }
+    return t.len;
+}
@@ -0,0 +1,26 @@
+#ifndef RECORD_DECODE_H
+#define RECORD_DECODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "elf_strings.h"
+
+/*
+ * Text of a deferred_log record (mqttS3/components/deferred_log), the line ESP_LOGx would
+ * have printed: "I (time) TAG: message". Written from the record layout of deferred_log.h,
+ * the arguments are formatted by the host printf with the conversions of the format string.
+ */
+
+typedef struct
+{
+    uint32_t records;
+    uint32_t unresolved;        // Tag or format not in the ELF (wrong ELF for the firmware)
+    uint32_t truncated;         // Arguments left out on the device, or the record is cut
+} record_decode_stats_t;
+
+// Length written to text (0 terminated, cut to size - 1), line is one record with or without its '\n'
+size_t record_decode(const elf_strings_t *elf, const uint8_t *line, size_t len, char *text, size_t size,
+                     record_decode_stats_t *stats);
+
+#endif // RECORD_DECODE_H
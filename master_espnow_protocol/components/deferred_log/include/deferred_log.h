@@ -0,0 +1,50 @@
+#ifndef DEFERRED_LOG_H
+#define DEFERRED_LOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_log.h"
+
+/* Deferred formatting: DLOGx writes the flash addresses of its tag and format string and the
+ * raw arguments instead of the text, log_decoder rebuilds the text on the host from the strings
+ * of the firmware ELF. A record is one line of the log stream, on the UART and in udp_logging:
+ *
+ *   DEFERRED_LOG_MARKER, level, time ms (varint), tag (u32), format (u32), arguments, '\n'
+ *
+ * Integers are varints (zigzag for %d and %i), doubles 8 bytes, strings a varint length and
+ * their first DEFERRED_LOG_MAX_STRING bytes. '\n', '\r' and DEFERRED_LOG_ESCAPE in the record
+ * are escaped so the line survives the newline handling of the console. The format must be a
+ * string literal, it is read from the ELF and never sent. */
+#define DEFERRED_LOG_ENABLE         (0)         // 1: DLOGx write records, 0: DLOGx are ESP_LOGx
+#define DEFERRED_LOG_MARKER         (0x02)      // First byte of a record, text lines never start with it
+#define DEFERRED_LOG_ESCAPE         (0x10)      // Followed by the escaped byte XOR DEFERRED_LOG_ESCAPE_XOR
+#define DEFERRED_LOG_ESCAPE_XOR     (0x20)
+#define DEFERRED_LOG_TRUNCATED      (0x80)      // In the level byte: arguments left out, no room
+#define DEFERRED_LOG_MAX_LEN        (128)       // Record with escapes, within UDP_LOGGING_LINE_MAX
+#define DEFERRED_LOG_MAX_STRING     (48)
+
+#if DEFERRED_LOG_ENABLE
+#define DLOG_LEVEL(level, tag, format, ...) do { \
+        if (LOG_LOCAL_LEVEL >= (level)) { \
+            deferred_log_write((level), (tag), "" format "", ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define DLOGE(tag, format, ...) DLOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) DLOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) DLOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...) DLOG_LEVEL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#else
+#define DLOGE(tag, format, ...) ESP_LOGE(tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) ESP_LOGW(tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...) ESP_LOGD(tag, format, ##__VA_ARGS__)
+#endif
+
+void deferred_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+size_t deferred_log_encode(char *line, size_t size, esp_log_level_t level, uint32_t time_ms,
+                           const char *tag, const char *format, va_list args);
+
+#endif // DEFERRED_LOG_H
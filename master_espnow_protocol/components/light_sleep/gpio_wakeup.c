@@ -2,6 +2,10 @@
 
 void wait_gpio_inactive(void)
 {
+    if (gpio_get_level(GPIO_WAKEUP_NUM) != GPIO_WAKEUP_LEVEL)
+    {
+        return;
+    }
     printf("Waiting for GPIO%d to go high...\n", GPIO_WAKEUP_NUM);
     while (gpio_get_level(GPIO_WAKEUP_NUM) == GPIO_WAKEUP_LEVEL) 
     {
@@ -17,7 +21,7 @@ esp_err_t register_gpio_wakeup(void)
             .pin_bit_mask = BIT64(GPIO_WAKEUP_NUM),
             .mode = GPIO_MODE_INPUT,
             .pull_down_en = false,
-            .pull_up_en = false,
+            .pull_up_en = true,     // Doorbell stays inactive when S3 is not wired
             .intr_type = GPIO_INTR_DISABLE
     };
     ESP_RETURN_ON_ERROR(gpio_config(&config), TAG_LIGHT_SLEEP, "Initialize GPIO%d failed", GPIO_WAKEUP_NUM);
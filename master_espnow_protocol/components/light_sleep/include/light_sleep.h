@@ -38,8 +38,9 @@
 
 /* Use boot button as gpio input */
 // #define GPIO_WAKEUP_NUM         BOOT_BUTTON_NUM
-#define GPIO_WAKEUP_NUM         4
-/* "Boot" button is active low */
+/* Doorbell from S3 (DOORBELL_GPIO_NUM of mqttS3), GPIO4 is UART RX */
+#define GPIO_WAKEUP_NUM         6
+/* S3 pulls the doorbell low while it talks to the master */
 #define GPIO_WAKEUP_LEVEL       0
 
 extern int64_t sleep_duration;
@@ -105,6 +105,9 @@ void light_sleep_task(void *args)
             {
                 xEventGroupClearBits(xEventGroupLightSleep, all_slaves_bits);
 
+                /* S3 holds the doorbell until its requests are answered, the level would wake up the chip at once */
+                wait_gpio_inactive();
+
                 printf("Entering light sleep\n");
                 /* To make sure the complete line is printed before entering sleep mode,
                 * need to wait until UART TX FIFO is empty:
@@ -141,6 +144,11 @@ void light_sleep_task(void *args)
                     case ESP_SLEEP_WAKEUP_GPIO:
                         wakeup_reason = "pin";
 
+                        // Woken by the doorbell, answer S3 before anything else, its requests follow in one burst.
+                        // S3 releases the doorbell later, wait_gpio_inactive() runs before the next sleep.
+                        send_frame(FRAME_WOKE_UP, 0, NULL, 0);
+                        ESP_LOGI(TAG_LIGHT_SLEEP, "Doorbell wake up, WOKE_UP sent %lld us after wake up", esp_timer_get_time() - t_after_us);
+
                         sleep_duration = (t_after_us - t_before_us);
                         ESP_LOGI(TAG_LIGHT_SLEEP, "Slept for: %lld us", sleep_duration);
                         timer_wakeup = TIMER_WAKEUP_TIME_US - sleep_duration;
@@ -171,15 +179,6 @@ void light_sleep_task(void *args)
                     printf("Returned from light sleep, reason: %s, t=%lld ms, slept for %lld ms\n",
                         wakeup_reason, t_after_us / 1000, (t_after_us - t_before_us) / 1000);
                 #endif
-                if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) 
-                {
-                    /* Waiting for the gpio inactive, or the chip will continuously trigger wakeup*/
-                    wait_gpio_inactive();
-
-                    // Response wakeup uart to S3
-                    dump_uart((uint8_t *)WOKE_UP,sizeof(WOKE_UP));
-                }
-
                 processing_after_lightsleep(); 
             }
         }
@@ -192,6 +191,6 @@ void light_sleep_init()
 {
     // Enable wakeup from light sleep by timer
     register_timer_wakeup(timer_wakeup);
-    // Enable wakeup from light sleep by gpio
-    // register_gpio_wakeup();
+    // Enable wakeup from light sleep by the doorbell of S3
+    register_gpio_wakeup();
 }
@@ -12,10 +12,39 @@
 
 typedef enum {
     DEVICE_RELAY,
+    DEVICE_RELAY_GROUP,
     DISCONNECT_NODE,
     DEVICE_UNKNOWN
 } device_type_t;
 
-void handle_device(device_type_t device_type, bool state); 
+#define SLAVE_COMMAND_QUEUE_SIZE        4
+#define SLAVE_COMMAND_TIMEOUT_MS        1000                    // Wait for the answer of the slave when the requester gives none
+#define SLAVE_COMMAND_MAX_TIMEOUT_MS    5000
+
+typedef enum {
+    SLAVE_COMMAND_OK,                   // Slave answered, record holds its data (group: every target acknowledged)
+    SLAVE_COMMAND_TIMEOUT,              // No answer within the timeout (group: some targets missing)
+    SLAVE_COMMAND_OFFLINE,              // Slave unknown or offline, nothing sent
+    SLAVE_COMMAND_UNSUPPORTED           // Device type has no answer to wait for
+} slave_command_status_t;
+
+typedef struct {
+    uint16_t tag;                                   // Id given by the requester, returned as it is
+    device_type_t device_type;
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    slave_command_status_t status;
+    uint32_t queue_us;                              // Queued to sent over ESP-NOW
+    uint32_t espnow_us;                             // Sent to answer of the slave (or timeout)
+    table_device_t record;                          // Data of the slave from its answer, SLAVE_COMMAND_OK only
+    uint8_t group_targets;                          // DEVICE_RELAY_GROUP: online slaves addressed
+    uint8_t group_acked;                            // DEVICE_RELAY_GROUP: GROUP_ack received
+} slave_command_result_t;
+
+/* Called from slave_command_task once per command of slave_command_send(). */
+typedef void (*slave_command_done_cb_t)(const slave_command_result_t *result);
+
+void handle_device(device_type_t device_type, const uint8_t *mac, bool state); 
+void slave_command_init(slave_command_done_cb_t cb);
+bool slave_command_send(device_type_t device_type, const uint8_t *mac, uint16_t tag, uint32_t timeout_ms);
 
 #endif //MASTER_CONTROLLER_H
\ No newline at end of file
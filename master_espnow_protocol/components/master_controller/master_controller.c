@@ -1,30 +1,68 @@
 #include "master_controller.h"
 
-uint8_t mac_address[ESP_NOW_ETH_ALEN] = {0xec, 0xda, 0x3b, 0x54, 0xb5, 0x9c};  // MAC demo
 const list_slaves_t default_slave = {0};
 
+typedef struct {
+    device_type_t device_type;
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    uint16_t tag;
+    uint32_t timeout_ms;
+    int64_t queued_time;
+} slave_command_t;
+
+static QueueHandle_t slave_command_queue;
+static TaskHandle_t slave_command_handle = NULL;
+static slave_command_done_cb_t s_slave_command_done_cb = NULL;
+static portMUX_TYPE s_slave_command_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_slave_command_waiting = false;                    // Under s_slave_command_lock
+static uint8_t s_slave_command_mac[ESP_NOW_ETH_ALEN];           // Slave whose answer is waited for
+static sensor_data_t s_slave_command_answer;
+
+// Collect the online slaves as targets of a group command
+static int get_online_targets(uint8_t (*targets)[ESP_NOW_ETH_ALEN], int *target_index)
+{
+    int count = 0;
+
+    for (int i = 0; i < MAX_SLAVES && count < MAX_GROUP_TARGETS; i++) 
+    {
+        if (allowed_connect_slaves[i].status)
+        {
+            memcpy(targets[count], allowed_connect_slaves[i].peer_addr, ESP_NOW_ETH_ALEN);
+            target_index[count] = i;
+            count++;
+        }
+    }
+
+    return count;
+}
+
 void disconnect_node_task(void *pvParameters) 
 {
-    bool has_online_devices = true;
+    uint8_t targets[MAX_GROUP_TARGETS][ESP_NOW_ETH_ALEN];
+    int target_index[MAX_GROUP_TARGETS];
+    int count = get_online_targets(targets, target_index);
 
-    while (has_online_devices) 
+    while (count > 0) 
     {
         ESP_LOGE(TAG, "Task disconnect_node_task");
 
-        has_online_devices = false;  // Initial assumption is that there are no more devices online
+        // One group frame for all online devices, only the missing ones are retried
+        uint32_t acked = group_command_send(DISCONNECT_NODE_MSG, targets, count);
 
-        // Browse the list of devices
-        for (int i = 0; i < MAX_SLAVES; i++) 
+        for (int k = 0; k < count; k++)
         {
-            if (allowed_connect_slaves[i].status)
+            if (acked & (1UL << k))
             {
-                has_online_devices = true; // If there is a device online, keep the task running
-                memcpy(allowed_connect_slaves[i].message_retry_fail, DISCONNECT_NODE_MSG, sizeof(DISCONNECT_NODE_MSG));
-                response_specified_mac(allowed_connect_slaves[i].peer_addr, DISCONNECT_NODE_MSG);        
+                memset(&allowed_connect_slaves[target_index[k]], 0, sizeof(list_slaves_t));
+                erase_table_devices(target_index[k]);
             }
         }
 
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        count = get_online_targets(targets, target_index);
+        if (count > 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+        }
     }
 
     for (int i = 0; i < MAX_SLAVES; i++) 
@@ -52,19 +90,48 @@ void disconnect_node_task(void *pvParameters)
     vTaskDelete(NULL);
 }
 
-void handle_device(device_type_t device_type, bool state)
+// Toggle the relay of every online slave with one group command, return the number of GROUP_ack
+static int relay_group_send(int *count)
+{
+    uint8_t targets[MAX_GROUP_TARGETS][ESP_NOW_ETH_ALEN];
+    int target_index[MAX_GROUP_TARGETS];
+    int acked = 0;
+
+    *count = get_online_targets(targets, target_index);
+    uint32_t bitmap = group_command_send(CONTROL_RELAY_MSG, targets, *count);
+    for (int k = 0; k < *count; k++)
+    {
+        acked += (bitmap >> k) & 1;
+    }
+    return acked;
+}
+
+// mac is the target of DEVICE_RELAY, the other device types do not use it
+void handle_device(device_type_t device_type, const uint8_t *mac, bool state)
 {
     switch (device_type) 
     {
         case DEVICE_RELAY:
             // Controller Relay
 
-            ESP_LOGI(TAG_MASTER_CONTROLLER, "Processing RELAY");
+            ESP_LOGI(TAG_MASTER_CONTROLLER, "Processing RELAY " MACSTR, MAC2STR(mac));
             
-            response_specified_mac(mac_address, CONTROL_RELAY_MSG);
+            response_specified_mac(mac, CONTROL_RELAY_MSG);
 
             break;
         
+        case DEVICE_RELAY_GROUP:
+        {
+            // Controller Relay of all online slaves
+
+            ESP_LOGI(TAG_MASTER_CONTROLLER, "Processing RELAY GROUP");
+
+            int count;
+            relay_group_send(&count);
+
+            break;
+        }
+
         case DISCONNECT_NODE:
             // Disconnect node
 
@@ -79,4 +146,146 @@ void handle_device(device_type_t device_type, bool state)
 
             break;
     }
-}
\ No newline at end of file
+}
+
+static bool slave_is_online(const uint8_t *mac)
+{
+    for (int i = 0; i < MAX_SLAVES; i++) 
+    {
+        if (allowed_connect_slaves[i].status && memcmp(allowed_connect_slaves[i].peer_addr, mac, ESP_NOW_ETH_ALEN) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs in the WiFi task (master_espnow_recv_cb) for every answer of a slave to a command, must not block
+static void slave_command_answer(const uint8_t *mac_addr, const char *message, const sensor_data_t *data)
+{
+    bool matched = false;
+
+    taskENTER_CRITICAL(&s_slave_command_lock);
+    if (s_slave_command_waiting && memcmp(mac_addr, s_slave_command_mac, ESP_NOW_ETH_ALEN) == 0)
+    {
+        s_slave_command_answer = *data;
+        s_slave_command_waiting = false;
+        matched = true;
+    }
+    taskEXIT_CRITICAL(&s_slave_command_lock);
+
+    if (matched)
+    {
+        xTaskNotifyGive(slave_command_handle);
+    }
+}
+
+// Send one command at a time and wait for the answer of its slave, the requester is not blocked meanwhile
+static void slave_command_task(void *pvParameters)
+{
+    slave_command_t cmd;
+
+    while (1)
+    {
+        if (!xQueueReceive(slave_command_queue, &cmd, portMAX_DELAY))
+        {
+            continue;
+        }
+
+        slave_command_result_t result = {
+            .tag = cmd.tag,
+            .device_type = cmd.device_type,
+            .status = SLAVE_COMMAND_OFFLINE,
+        };
+        memcpy(result.mac, cmd.mac, ESP_NOW_ETH_ALEN);
+
+        int64_t send_time = esp_timer_get_time();
+        result.queue_us = (uint32_t)(send_time - cmd.queued_time);
+
+        if (cmd.device_type == DEVICE_RELAY_GROUP)
+        {
+            // Answered by the GROUP_ack of the targets, not by their data
+            int count;
+            int acked = relay_group_send(&count);
+
+            result.group_targets = count;
+            result.group_acked = acked;
+            if (count > 0)
+            {
+                result.status = (acked == count) ? SLAVE_COMMAND_OK : SLAVE_COMMAND_TIMEOUT;
+            }
+            result.espnow_us = (uint32_t)(esp_timer_get_time() - send_time);
+        }
+        else if (cmd.device_type != DEVICE_RELAY)
+        {
+            result.status = SLAVE_COMMAND_UNSUPPORTED;
+        }
+        else if (slave_is_online(cmd.mac))
+        {
+            // Drop an answer that came after the previous command timed out, then arm before sending
+            ulTaskNotifyTake(pdTRUE, 0);
+            taskENTER_CRITICAL(&s_slave_command_lock);
+            memcpy(s_slave_command_mac, cmd.mac, ESP_NOW_ETH_ALEN);
+            s_slave_command_waiting = true;
+            taskEXIT_CRITICAL(&s_slave_command_lock);
+
+            handle_device(cmd.device_type, cmd.mac, true);
+
+            if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(cmd.timeout_ms)) > 0)
+            {
+                result.status = SLAVE_COMMAND_OK;
+                memcpy(result.record.peer_addr, cmd.mac, ESP_NOW_ETH_ALEN);
+                result.record.status = true;
+                result.record.data = s_slave_command_answer;
+            }
+            else
+            {
+                taskENTER_CRITICAL(&s_slave_command_lock);
+                s_slave_command_waiting = false;
+                taskEXIT_CRITICAL(&s_slave_command_lock);
+                result.status = SLAVE_COMMAND_TIMEOUT;
+            }
+            result.espnow_us = (uint32_t)(esp_timer_get_time() - send_time);
+        }
+
+        ESP_LOGI(TAG_MASTER_CONTROLLER, "Command %d to MAC " MACSTR ": status %d, queue %lu us, espnow %lu us",
+                cmd.tag, MAC2STR(cmd.mac), result.status, (unsigned long)result.queue_us, (unsigned long)result.espnow_us);
+
+        if (s_slave_command_done_cb != NULL)
+        {
+            s_slave_command_done_cb(&result);
+        }
+    }
+}
+
+void slave_command_init(slave_command_done_cb_t cb)
+{
+    s_slave_command_done_cb = cb;
+    slave_command_queue = xQueueCreate(SLAVE_COMMAND_QUEUE_SIZE, sizeof(slave_command_t));
+    register_slave_response_cb(slave_command_answer);
+    xTaskCreate(slave_command_task, "slave_command_task", 4096, NULL, 4, &slave_command_handle);
+}
+
+/* Queue a command for one slave, cb of slave_command_init() reports its result with tag.
+   timeout_ms 0 waits SLAVE_COMMAND_TIMEOUT_MS. Returns false when the queue is full. */
+bool slave_command_send(device_type_t device_type, const uint8_t *mac, uint16_t tag, uint32_t timeout_ms)
+{
+    slave_command_t cmd = {
+        .device_type = device_type,
+        .tag = tag,
+        .timeout_ms = timeout_ms,
+        .queued_time = esp_timer_get_time(),
+    };
+
+    if (cmd.timeout_ms == 0)
+    {
+        cmd.timeout_ms = SLAVE_COMMAND_TIMEOUT_MS;
+    }
+    else if (cmd.timeout_ms > SLAVE_COMMAND_MAX_TIMEOUT_MS)
+    {
+        cmd.timeout_ms = SLAVE_COMMAND_MAX_TIMEOUT_MS;
+    }
+    memcpy(cmd.mac, mac, ESP_NOW_ETH_ALEN);
+
+    return xQueueSend(slave_command_queue, &cmd, 0) == pdTRUE;
+}
@@ -0,0 +1,163 @@
+#include "master_espnow_protocol.h"
+
+static const uint8_t s_group_broadcast_mac[ESP_NOW_ETH_ALEN] = MASTER_BROADCAST_MAC;
+static master_espnow_send_param_t send_param_group;
+static SemaphoreHandle_t group_command_mutex;
+static EventGroupHandle_t xEventGroupGroup;
+static uint16_t s_group_seq = 0;
+// Written by the sending task, read by group_command_ack in the WiFi task, under s_group_lock
+static portMUX_TYPE s_group_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_group_id;
+static uint8_t s_group_targets[MAX_GROUP_TARGETS][ESP_NOW_ETH_ALEN];
+static int s_group_count = 0;
+static uint32_t s_group_acked = 0;
+
+void group_command_init(void)
+{
+    group_command_mutex = xSemaphoreCreateMutex();
+    xEventGroupGroup = xEventGroupCreate();
+
+    // Random start so that a rebooted master does not reuse the id a slave has just executed
+    s_group_id = (uint8_t)esp_random();
+}
+
+/* Prepare group frame with the targets that have not answered yet. */
+static int group_data_prepare(const char *command, uint32_t acked)
+{
+    espnow_group_data_t *buf = (espnow_group_data_t *)send_param_group.buffer;
+
+    memset(send_param_group.buffer, 0, sizeof(send_param_group.buffer));
+    send_param_group.len = MAX_DATA_LEN;
+    memcpy(send_param_group.dest_mac, s_group_broadcast_mac, ESP_NOW_ETH_ALEN);
+
+    buf->type = ESPNOW_DATA_BROADCAST;
+    buf->seq_num = s_group_seq++;
+    buf->crc = 0;
+    strncpy(buf->message, GROUP_COMMAND_MSG, PACKED_MSG_SIZE - 1);
+    strncpy(buf->command, command, PACKED_MSG_SIZE - 1);
+    buf->group_id = s_group_id;
+    buf->slot_time_ms = GROUP_ACK_SLOT_MS;
+    buf->count = 0;
+
+    for (int i = 0; i < s_group_count; i++)
+    {
+        if (!(acked & (1UL << i)))
+        {
+            memcpy(buf->targets[buf->count], s_group_targets[i], ESP_NOW_ETH_ALEN);
+            buf->count++;
+        }
+    }
+
+    buf->crc = esp_crc16_le(UINT16_MAX, (uint8_t const *)buf, send_param_group.len);
+
+    return buf->count;
+}
+
+/* Parse GROUP_ack received from a slave. */
+void group_command_ack(const uint8_t *mac_addr, const uint8_t *data, int len)
+{
+    espnow_group_data_t *buf = (espnow_group_data_t *)data;
+
+    if (len < sizeof(espnow_group_data_t))
+    {
+        ESP_LOGE(TAG, "Receive %s too short, len:%d", GROUP_ACK_MSG, len);
+        return;
+    }
+
+    int slot = -1;
+    bool done = false;
+
+    taskENTER_CRITICAL(&s_group_lock);
+    bool current = (buf->group_id == s_group_id);
+    if (current)
+    {
+        for (int i = 0; i < s_group_count; i++)
+        {
+            if (memcmp(s_group_targets[i], mac_addr, ESP_NOW_ETH_ALEN) == 0)
+            {
+                s_group_acked |= (1UL << i);
+                slot = i;
+                break;
+            }
+        }
+        uint32_t all_targets = (s_group_count >= 32) ? UINT32_MAX : ((1UL << s_group_count) - 1);
+        done = (s_group_count > 0) && ((s_group_acked & all_targets) == all_targets);
+    }
+    taskEXIT_CRITICAL(&s_group_lock);
+
+    if (!current)
+    {
+        ESP_LOGW(TAG, "Ignore %s of old group id %d from MAC " MACSTR, GROUP_ACK_MSG, buf->group_id, MAC2STR(mac_addr));
+        return;
+    }
+    if (slot >= 0)
+    {
+        ESP_LOGI(TAG, "%s id %d from MAC " MACSTR " at slot %d", GROUP_ACK_MSG, buf->group_id, MAC2STR(mac_addr), slot);
+    }
+    if (done)
+    {
+        xEventGroupSetBits(xEventGroupGroup, GROUP_DONE_BIT);
+    }
+}
+
+/* Send one command to many slaves with a broadcast frame, retransmit only to the missing targets.
+   Return the bitmap of targets that acknowledged the command. */
+uint32_t group_command_send(const char *command, uint8_t (*targets)[ESP_NOW_ETH_ALEN], int count)
+{
+    if (count <= 0)
+    {
+        return 0;
+    }
+    if (count > MAX_GROUP_TARGETS)
+    {
+        ESP_LOGW(TAG, "Group command limited to %d targets", MAX_GROUP_TARGETS);
+        count = MAX_GROUP_TARGETS;
+    }
+
+    xSemaphoreTake(group_command_mutex, portMAX_DELAY);
+
+    // An ACK in the WiFi task sees either the former command or the new one, never a mix
+    taskENTER_CRITICAL(&s_group_lock);
+    s_group_id++;
+    memcpy(s_group_targets, targets, count * ESP_NOW_ETH_ALEN);
+    s_group_count = count;
+    s_group_acked = 0;
+    taskEXIT_CRITICAL(&s_group_lock);
+    xEventGroupClearBits(xEventGroupGroup, GROUP_DONE_BIT);
+
+    int64_t start_time = esp_timer_get_time();
+
+    for (int round = 0; round < GROUP_MAX_ROUNDS; round++)
+    {
+        taskENTER_CRITICAL(&s_group_lock);
+        uint32_t acked = s_group_acked;
+        taskEXIT_CRITICAL(&s_group_lock);
+
+        int missing = group_data_prepare(command, acked);
+        if (missing == 0)
+        {
+            break;
+        }
+
+        ESP_LOGW(TAG, "---------------------------------");
+        ESP_LOGW(TAG, "Send %s %s id %d to %d slaves, round %d", GROUP_COMMAND_MSG, command, s_group_id, missing, round + 1);
+
+        esp_err_t ret_val = esp_now_send(send_param_group.dest_mac, send_param_group.buffer, send_param_group.len);
+        log_send_espnow_result(ret_val);
+
+        // Wait until every slot is over
+        TickType_t window = pdMS_TO_TICKS((missing + 1) * GROUP_ACK_SLOT_MS + ESPNOW_MAXDELAY / 4);
+        xEventGroupWaitBits(xEventGroupGroup, GROUP_DONE_BIT, pdTRUE, pdTRUE, window);
+    }
+
+    taskENTER_CRITICAL(&s_group_lock);
+    uint32_t acked = s_group_acked;
+    s_group_count = 0;
+    taskEXIT_CRITICAL(&s_group_lock);
+
+    ESP_LOGI(TAG, "Group command %s done in %lld us, acked bitmap 0x%08lx", command, esp_timer_get_time() - start_time, (unsigned long)acked);
+
+    xSemaphoreGive(group_command_mutex);
+
+    return acked;
+}
@@ -23,6 +23,7 @@
 #include "deep_sleep.h"
 #include "light_sleep.h"
 #include "udp_logging.h"
+#include "deferred_log.h"
 
 /* ESPNOW can work in both station and softap mode. It is configured in menuconfig. */
 #if CONFIG_ESPNOW_WIFI_MODE_STATION
@@ -71,6 +72,10 @@
 #define STILL_CONNECTED_MSG         "KEEP_connect"
 #define CONTROL_RELAY_MSG           "CONTROL_relay"
 #define DISCONNECT_NODE_MSG         "DISCONNECT_node"
+#define UPLINK_DATA_MSG             "UPLINK_data"
+#define UPLINK_ACK_MSG              "UPLINK_ack"
+#define GROUP_COMMAND_MSG           "GROUP_cmd"
+#define GROUP_ACK_MSG               "GROUP_ack"
 #define NVS_NAMESPACE               "storage"
 #define NVS_KEY_SLAVES              "waiting_slaves"
 #define WIFI_CONNECTED_BIT          BIT0
@@ -92,6 +97,10 @@
 #define CONFIG_ESPNOW_WITH_WIFI     0
 #define SEND_CALLBACK_RETRY         10
 #define EVENT_BIT_CONTINUE          (1 << 0)
+#define MAX_GROUP_TARGETS           32                   // Max slaves addressed by one group frame
+#define GROUP_ACK_SLOT_MS           20                   // Each target answers GROUP_ack in its own slot
+#define GROUP_MAX_ROUNDS            3                    // Group frame is retransmitted only to the missing targets
+#define GROUP_DONE_BIT              (1 << 1)
 
 #if CONFIG_POWER_SAVE_MIN_MODEM
 #define DEFAULT_PS_MODE WIFI_PS_MIN_MODEM
@@ -170,12 +179,31 @@ typedef struct {
     sensor_data_t payload;
 } __attribute__((packed)) espnow_data_t;
 
+typedef struct {
+    uint8_t type;                                           // [1 bytes]    Broadcast or unicast ESPNOW data.
+    uint16_t seq_num;                                       // [2 bytes]    Sequence number of ESPNOW data.
+    uint16_t crc;                                           // [2 bytes]    CRC16 value of ESPNOW data.
+    char message[PACKED_MSG_SIZE];                          // [20 bytes]   GROUP_cmd or GROUP_ack
+    char command[PACKED_MSG_SIZE];                          // [20 bytes]   Command executed by the targets
+    uint8_t group_id;                                       // [1 bytes]    Id of the command, kept for retransmission
+    uint8_t slot_time_ms;                                   // [1 bytes]    Duration of one ack slot
+    uint8_t count;                                          // [1 bytes]    Number of targets
+    uint8_t targets[MAX_GROUP_TARGETS][ESP_NOW_ETH_ALEN];   // [192 bytes]  Target MAC, its position is the ack slot
+} __attribute__((packed)) espnow_group_data_t;
+
 typedef struct {
     uint8_t peer_addr[ESP_NOW_ETH_ALEN];    // [6 bytes] ESPNOW peer MAC address
     bool status;                            // [1 bytes] Variable status has two statuses online: 1 and offline: 0
     sensor_data_t data;                     // Data devices
 } table_device_t;
 
+/* Called after a record of table_devices changed, version is table_devices_version after the change. */
+typedef void (*table_devices_change_cb_t)(int index, const table_device_t *record, uint32_t version);
+
+/* Called from the WiFi task (master_espnow_recv_cb) for an answer of a slave to a command sent by
+   response_specified_mac, data is the payload of the answer. Must not block. */
+typedef void (*slave_response_cb_t)(const uint8_t *mac_addr, const char *message, const sensor_data_t *data);
+
 /* Parameters of sending ESPNOW data. */
 typedef struct {
     bool unicast;                         //Send unicast ESPNOW data.
@@ -193,6 +221,7 @@ typedef struct {
 extern list_slaves_t allowed_connect_slaves[MAX_SLAVES];
 extern list_slaves_t waiting_connect_slaves[MAX_SLAVES];
 extern table_device_t table_devices[MAX_SLAVES];
+extern uint32_t table_devices_version;
 extern TaskHandle_t master_espnow_handle;
 extern TaskHandle_t retry_connect_lost_handle;
 extern QueueHandle_t slave_disconnect_queue;
@@ -219,9 +248,14 @@ void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, voi
 void master_wifi_init(void);
 
 // Function to master espnow
+void log_send_espnow_result(esp_err_t result);
 void erase_table_devices(int i); 
 void log_table_devices();
 void write_table_devices(const uint8_t *peer_addr, const sensor_data_t *esp_data, bool status);
+uint32_t read_table_devices(table_device_t *table);
+bool read_table_device(const uint8_t *peer_addr, table_device_t *record);
+void register_table_devices_change_cb(table_devices_change_cb_t cb);
+void register_slave_response_cb(slave_response_cb_t cb);
 void prepare_payload(espnow_data_t *espnow_data, float temperature_mcu, int rssi, float temperature_rdo, float do_value, float temperature_phg, float ph_value, bool relay_state); 
 void parse_payload(espnow_data_t *espnow_data); 
 void espnow_data_prepare(master_espnow_send_param_t *send_param, const char *message);
@@ -233,6 +267,9 @@ esp_err_t response_specified_mac(const uint8_t *dest_mac, const char *message);
 void master_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status);
 void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *data, int len);
 void master_espnow_task(void *pvParameter);
+void group_command_init(void);
+void group_command_ack(const uint8_t *mac_addr, const uint8_t *data, int len);
+uint32_t group_command_send(const char *command, uint8_t (*targets)[ESP_NOW_ETH_ALEN], int count);
 void retry_connect_lost_task(void *pvParameter);
 esp_err_t master_espnow_init(void);
 void master_espnow_deinit();
@@ -18,6 +18,10 @@ list_slaves_t waiting_connect_slaves[MAX_SLAVES];
 sensor_data_t esp_data_sensor;
 table_device_t table_devices[MAX_SLAVES];
 SemaphoreHandle_t table_devices_mutex;
+uint32_t table_devices_version = 0;                         // Incremented on every change of table_devices
+static table_devices_change_cb_t s_table_change_cb = NULL;
+static slave_response_cb_t s_slave_response_cb = NULL;
+static SemaphoreHandle_t send_specified_mutex;             // send_param_specified is shared by the tasks that answer slaves
 EventGroupHandle_t xEventGroup;
 EventGroupHandle_t xEventGroupLightSleep;
 QueueHandle_t slave_disconnect_queue;
@@ -28,58 +32,122 @@ void log_send_espnow_result(esp_err_t result)
 {
     if (result == ESP_OK) 
     {
-        ESP_LOGI(TAG, "Send Success");
+        DLOGI(TAG, "Send Success");
     } 
     else if (result == ESP_ERR_ESPNOW_NOT_INIT) 
     {
-        ESP_LOGE(TAG, "ESPNOW not initialized");
+        DLOGE(TAG, "ESPNOW not initialized");
     } 
     else if (result == ESP_ERR_ESPNOW_ARG) 
     {
-        ESP_LOGE(TAG, "Invalid argument");
+        DLOGE(TAG, "Invalid argument");
     } 
     else if (result == ESP_ERR_ESPNOW_INTERNAL) 
     {
-        ESP_LOGE(TAG, "Internal error");
+        DLOGE(TAG, "Internal error");
     } 
     else if (result == ESP_ERR_ESPNOW_NO_MEM) 
     {
-        ESP_LOGE(TAG, "Out of memory");
+        DLOGE(TAG, "Out of memory");
     } 
     else if (result == ESP_ERR_ESPNOW_NOT_FOUND) 
     {
-        ESP_LOGE(TAG, "Peer is not found");
+        DLOGE(TAG, "Peer is not found");
     } 
     else if (result == ESP_ERR_ESPNOW_IF) 
     {
-        ESP_LOGE(TAG, "Current Wi-Fi interface doesn't match that of peer");
+        DLOGE(TAG, "Current Wi-Fi interface doesn't match that of peer");
     } 
     else if (result == ESP_ERR_ESPNOW_CHAN) 
     {
-        ESP_LOGE(TAG, "Current Wi-Fi channel doesn't match that of peer");
+        DLOGE(TAG, "Current Wi-Fi channel doesn't match that of peer");
     } 
     else 
     {
-        ESP_LOGE(TAG, "Unknown error code: %d", result);
+        DLOGE(TAG, "Unknown error code: %d", result);
+    }
+}
+
+void register_table_devices_change_cb(table_devices_change_cb_t cb)
+{
+    s_table_change_cb = cb;
+}
+
+void register_slave_response_cb(slave_response_cb_t cb)
+{
+    s_slave_response_cb = cb;
+}
+
+/* Copy table_devices, return its version. */
+uint32_t read_table_devices(table_device_t *table)
+{
+    uint32_t version = 0;
+
+    if (xSemaphoreTake(table_devices_mutex, portMAX_DELAY)) 
+    {
+        memcpy(table, table_devices, sizeof(table_devices));
+        version = table_devices_version;
+        xSemaphoreGive(table_devices_mutex);
+    }
+    return version;
+}
+
+/* Copy the record of peer_addr, return false when it is not in table_devices. */
+bool read_table_device(const uint8_t *peer_addr, table_device_t *record)
+{
+    bool found = false;
+
+    if (xSemaphoreTake(table_devices_mutex, portMAX_DELAY)) 
+    {
+        for (int i = 0; i < MAX_SLAVES; i++)
+        {
+            if (memcmp(peer_addr, table_devices[i].peer_addr, ESP_NOW_ETH_ALEN) == 0)
+            {
+                *record = table_devices[i];
+                found = true;
+                break;
+            }
+        }
+        xSemaphoreGive(table_devices_mutex);
+    }
+    return found;
+}
+
+// Call the change callback outside of table_devices_mutex
+static void notify_table_devices_change(int i, const table_device_t *old_record, const table_device_t *new_record, uint32_t version)
+{
+    if (s_table_change_cb != NULL && memcmp(old_record, new_record, sizeof(table_device_t)) != 0)
+    {
+        s_table_change_cb(i, new_record, version);
     }
 }
 
 void erase_table_devices(int i) 
 {
+    table_device_t old_record, new_record;
+    uint32_t version = 0;
+
     if (xSemaphoreTake(table_devices_mutex, portMAX_DELAY)) 
     {
+        old_record = table_devices[i];
         memset(&table_devices[i], 0, sizeof(table_device_t));
+        new_record = table_devices[i];
+        if (memcmp(&old_record, &new_record, sizeof(table_device_t)) != 0)
+        {
+            version = ++table_devices_version;
+        }
         ESP_LOGE(TAG, "Erase Table Devices at index %d", i);
         log_table_devices();
 
         xSemaphoreGive(table_devices_mutex);
+
+        notify_table_devices_change(i, &old_record, &new_record, version);
     } 
     else 
     {
         ESP_LOGE(TAG, "Failed to take mutex to erase device from table_devices");
     }
 }
-
 void log_table_devices() 
 {
     ESP_LOGI(TAG, "-------------------------------------------------------------------------------------------------------------------");
@@ -114,6 +182,10 @@ void log_table_devices()
 
 void write_table_devices(const uint8_t *peer_addr, const sensor_data_t *esp_data, bool status) 
 {
+    table_device_t old_record, new_record;
+    uint32_t version = 0;
+    int index = -1;
+
     if (xSemaphoreTake(table_devices_mutex, portMAX_DELAY)) 
     {
         for (int i = 0; i < MAX_SLAVES; i++) 
@@ -121,53 +193,54 @@ void write_table_devices(const uint8_t *peer_addr, const sensor_data_t *esp_data
             // Check if the MAC address already exists in the table
             if (memcmp(table_devices[i].peer_addr, peer_addr, ESP_NOW_ETH_ALEN) == 0) 
             {
-                // Update data if it already exists
-                table_devices[i].status = status;
-
-                // Only update data if esp_data is not NULL
-                if (esp_data != NULL) 
-                {
-                    table_devices[i].data = *esp_data;
-                }
-                
-                log_table_devices();
-
-                // Free the mutex
-                xSemaphoreGive(table_devices_mutex);
-                return;
+                index = i;
+                break;
             }
         }
 
         // If the MAC address does not exist, add it to the table
-        for (int i = 0; i < MAX_SLAVES; i++) 
+        for (int i = 0; i < MAX_SLAVES && index < 0; i++) 
         {
             // Find blank cells (blank MAC address)
             if (memcmp(table_devices[i].peer_addr, "\0\0\0\0\0\0", ESP_NOW_ETH_ALEN) == 0) 
             {
-                // Copy MAC address and save data
+                // Copy MAC address
                 memcpy(table_devices[i].peer_addr, peer_addr, ESP_NOW_ETH_ALEN);
-                table_devices[i].status = status;
-
-                // Only update data if esp_data is not NULL
-                if (esp_data != NULL) 
-                {
-                    table_devices[i].data = *esp_data;
-                }
-                
-                log_table_devices();
-                
-                // Free the mutex
-                xSemaphoreGive(table_devices_mutex);
-                return;
+                index = i;
             }
         }
 
-        ESP_LOGW(TAG, "Table device is full. Cannot add new device");
+        if (index >= 0)
+        {
+            old_record = table_devices[index];
+            table_devices[index].status = status;
+
+            // Only update data if esp_data is not NULL
+            if (esp_data != NULL) 
+            {
+                table_devices[index].data = *esp_data;
+            }
+
+            new_record = table_devices[index];
+            if (memcmp(&old_record, &new_record, sizeof(table_device_t)) != 0)
+            {
+                version = ++table_devices_version;
+            }
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Table device is full. Cannot add new device");
+        }
 
         log_table_devices();
 
         // Free the mutex
         xSemaphoreGive(table_devices_mutex);
+
+        if (index >= 0)
+        {
+            notify_table_devices_change(index, &old_record, &new_record, version);
+        }
     }
     else 
     {
@@ -187,14 +260,14 @@ void prepare_payload(espnow_data_t *espnow_data, float temperature_mcu, int rssi
     espnow_data->payload.relay_state = relay_state;
 
     // Print payload size and data for testing
-    ESP_LOGI(TAG, "     Payload size: %d bytes", sizeof(sensor_data_t));
-    ESP_LOGI(TAG, "         MCU Temperature: %.2f", espnow_data->payload.temperature_mcu);
-    ESP_LOGI(TAG, "         RSSI: %d", espnow_data->payload.rssi);
-    ESP_LOGI(TAG, "         RDO Temperature: %.2f", espnow_data->payload.temperature_rdo);
-    ESP_LOGI(TAG, "         DO Value: %.2f", espnow_data->payload.do_value);
-    ESP_LOGI(TAG, "         PHG Temperature: %.2f", espnow_data->payload.temperature_phg);
-    ESP_LOGI(TAG, "         PH Value: %.2f", espnow_data->payload.ph_value);
-    ESP_LOGI(TAG, "         Relay State: %s", espnow_data->payload.relay_state ? "On" : "Off");
+    DLOGI(TAG, "     Payload size: %d bytes", sizeof(sensor_data_t));
+    DLOGI(TAG, "         MCU Temperature: %.2f", espnow_data->payload.temperature_mcu);
+    DLOGI(TAG, "         RSSI: %d", espnow_data->payload.rssi);
+    DLOGI(TAG, "         RDO Temperature: %.2f", espnow_data->payload.temperature_rdo);
+    DLOGI(TAG, "         DO Value: %.2f", espnow_data->payload.do_value);
+    DLOGI(TAG, "         PHG Temperature: %.2f", espnow_data->payload.temperature_phg);
+    DLOGI(TAG, "         PH Value: %.2f", espnow_data->payload.ph_value);
+    DLOGI(TAG, "         Relay State: %s", espnow_data->payload.relay_state ? "On" : "Off");
 }
 
 /* Parse ESPNOW data payload. */
@@ -210,14 +283,14 @@ void parse_payload(espnow_data_t *espnow_data)
     esp_data_sensor.relay_state = espnow_data->payload.relay_state;
 
     // Directly access the fields of the payload
-    ESP_LOGI(TAG, "     Parsed ESPNOW payload:");
-    ESP_LOGI(TAG, "         MCU Temperature: %.2f", espnow_data->payload.temperature_mcu);
-    ESP_LOGI(TAG, "         RSSI: %d", espnow_data->payload.rssi);
-    ESP_LOGI(TAG, "         RDO Temperature: %.2f", espnow_data->payload.temperature_rdo);
-    ESP_LOGI(TAG, "         DO Value: %.2f", espnow_data->payload.do_value);
-    ESP_LOGI(TAG, "         PHG Temperature: %.2f", espnow_data->payload.temperature_phg);
-    ESP_LOGI(TAG, "         PH Value: %.2f", espnow_data->payload.ph_value);
-    ESP_LOGI(TAG, "         Relay State: %s", espnow_data->payload.relay_state ? "On" : "Off");
+    DLOGI(TAG, "     Parsed ESPNOW payload:");
+    DLOGI(TAG, "         MCU Temperature: %.2f", espnow_data->payload.temperature_mcu);
+    DLOGI(TAG, "         RSSI: %d", espnow_data->payload.rssi);
+    DLOGI(TAG, "         RDO Temperature: %.2f", espnow_data->payload.temperature_rdo);
+    DLOGI(TAG, "         DO Value: %.2f", espnow_data->payload.do_value);
+    DLOGI(TAG, "         PHG Temperature: %.2f", espnow_data->payload.temperature_phg);
+    DLOGI(TAG, "         PH Value: %.2f", espnow_data->payload.ph_value);
+    DLOGI(TAG, "         Relay State: %s", espnow_data->payload.relay_state ? "On" : "Off");
 
 }
 
@@ -244,11 +317,11 @@ void espnow_data_prepare(master_espnow_send_param_t *send_param, const char *mes
     saved_message_check_connect[message_size] = '\0';
 
     // Log the data received
-    ESP_LOGI(TAG, "Parsed ESPNOW packed:");
-    ESP_LOGI(TAG, "     type: %d", buf->type);
-    ESP_LOGI(TAG, "     seq_num: %d", buf->seq_num);
-    ESP_LOGI(TAG, "     crc: %d", buf->crc);
-    ESP_LOGI(TAG, "     message: %s", buf->message);
+    DLOGI(TAG, "Parsed ESPNOW packed:");
+    DLOGI(TAG, "     type: %d", buf->type);
+    DLOGI(TAG, "     seq_num: %d", buf->seq_num);
+    DLOGI(TAG, "     crc: %d", buf->crc);
+    DLOGI(TAG, "     message: %s", buf->message);
 
     // float temperature = read_internal_temperature_sensor();
     // prepare_payload(buf, temperature, rssi, 23.1, 7.6, 24.0, 7.2, esp_data_sensor.relay_state);
@@ -264,19 +337,19 @@ void espnow_data_parse(uint8_t *data, uint16_t data_len)
 
     if (data_len < sizeof(espnow_data_t)) 
     {
-        ESP_LOGE(TAG, "Receive ESPNOW data too short, len:%d", data_len);
+        DLOGE(TAG, "Receive ESPNOW data too short, len:%d", data_len);
         return;
     }
     
     // Log the data received
-    ESP_LOGI(TAG, "Parsed ESPNOW packed:");
-    ESP_LOGI(TAG, "     type: %d", buf->type);
-    ESP_LOGI(TAG, "     seq_num: %d", buf->seq_num);
-    ESP_LOGI(TAG, "     crc: %d", buf->crc);
+    DLOGI(TAG, "Parsed ESPNOW packed:");
+    DLOGI(TAG, "     type: %d", buf->type);
+    DLOGI(TAG, "     seq_num: %d", buf->seq_num);
+    DLOGI(TAG, "     crc: %d", buf->crc);
 
     // Copy the full message array safely
     memcpy(message_packed, buf->message, sizeof(buf->message));
-    ESP_LOGI(TAG, "     message: %s", message_packed);
+    DLOGI(TAG, "     message: %s", message_packed);
 
     // Log the payload if present
     if (data_len > sizeof(espnow_data_t)) 
@@ -285,7 +358,7 @@ void espnow_data_parse(uint8_t *data, uint16_t data_len)
     } 
     else 
     {
-        ESP_LOGI(TAG, "  No payload data.");
+        DLOGI(TAG, "  No payload data.");
     }
 
     crc = buf->crc;
@@ -294,11 +367,11 @@ void espnow_data_parse(uint8_t *data, uint16_t data_len)
 
     if (crc_cal == crc) 
     {
-        ESP_LOGI(TAG, "CRC check passed.");
+        DLOGI(TAG, "CRC check passed.");
     } 
     else 
     {
-        ESP_LOGE(TAG, "CRC check failed. Calculated CRC: %d, Received CRC: %d", crc_cal, crc);
+        DLOGE(TAG, "CRC check failed. Calculated CRC: %d, Received CRC: %d", crc_cal, crc);
         return;
     }
 }
@@ -393,6 +466,8 @@ void add_waiting_connect_slaves(const uint8_t *mac_addr)
 /* Function responds with the specified MAC and content*/
 esp_err_t response_specified_mac(const uint8_t *dest_mac, const char *message)
 {
+    xSemaphoreTake(send_specified_mutex, portMAX_DELAY);
+
     send_param_specified.len = MAX_DATA_LEN;
     memcpy(send_param_specified.dest_mac, dest_mac, ESP_NOW_ETH_ALEN);
 
@@ -422,6 +497,8 @@ esp_err_t response_specified_mac(const uint8_t *dest_mac, const char *message)
         // vTaskDelete(NULL);
     }
 
+    xSemaphoreGive(send_specified_mutex);
+
     return ESP_OK;
 }
 
@@ -432,7 +509,7 @@ void master_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status
 
     if (mac_addr == NULL) 
     {
-        ESP_LOGE(TAG, "Send cb arg error");
+        DLOGE(TAG, "Send cb arg error");
         return;
     }
 
@@ -440,7 +517,7 @@ void master_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status
     memcpy(send_cb->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
     send_cb->status = status;
 
-    ESP_LOGI(TAG, "Send callback: MAC Address " MACSTR ", Status: %s",
+    DLOGI(TAG, "Send callback: MAC Address " MACSTR ", Status: %s",
         MAC2STR(mac_addr), (status == ESP_NOW_SEND_SUCCESS) ? "Success" : "Fail");
     
     // Check if the received data is SLAVE_SAVED_MAC_MSG to change status of MAC Online
@@ -455,17 +532,17 @@ void master_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status
                 {
                     allowed_connect_slaves[i].count_retry++; 
                     count_retry_send_callback = allowed_connect_slaves[i].count_retry;
-                    ESP_LOGW(TAG, "Number of retry_send_callback to MAC  " MACSTR " | : %d", MAC2STR(mac_addr), allowed_connect_slaves[i].count_retry);
+                    DLOGW(TAG, "Number of retry_send_callback to MAC  " MACSTR " | : %d", MAC2STR(mac_addr), allowed_connect_slaves[i].count_retry);
 
                     response_specified_mac(allowed_connect_slaves[i].peer_addr, allowed_connect_slaves[i].message_retry_fail);     
                 }
                 else if ((allowed_connect_slaves[i].count_retry == SEND_CALLBACK_RETRY))
                 {
                     allowed_connect_slaves[i].check_connect_errors++;
-                    ESP_LOGW(TAG, "Number of check_connection to MAC  " MACSTR " | : %d", MAC2STR(mac_addr), allowed_connect_slaves[i].check_connect_errors);
+                    DLOGW(TAG, "Number of check_connection to MAC  " MACSTR " | : %d", MAC2STR(mac_addr), allowed_connect_slaves[i].check_connect_errors);
 
 
-                    ESP_LOGI(TAG, "Continue signal received, resuming task...");
+                    DLOGI(TAG, "Continue signal received, resuming task...");
                     xEventGroupSetBits(xEventGroup, EVENT_BIT_CONTINUE);
                     xQueueSend(slave_disconnect_queue, &i, portMAX_DELAY);
                     xEventGroupSetBits(xEventGroupLightSleep, (1 << i));
@@ -488,9 +565,9 @@ void master_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status
 
                     count_retry_send_callback = allowed_connect_slaves[i].count_retry;
                     allowed_connect_slaves[i].check_connect_errors++;
-                    ESP_LOGW(TAG, "Number of check_connection to MAC  " MACSTR "| : %d", MAC2STR(mac_addr), allowed_connect_slaves[i].check_connect_errors);
+                    DLOGW(TAG, "Number of check_connection to MAC  " MACSTR "| : %d", MAC2STR(mac_addr), allowed_connect_slaves[i].check_connect_errors);
 
-                    ESP_LOGI(TAG, "Continue signal received, resuming task...");
+                    DLOGI(TAG, "Continue signal received, resuming task...");
                     xEventGroupSetBits(xEventGroup, EVENT_BIT_CONTINUE);
                     xEventGroupSetBits(xEventGroupLightSleep, (1 << i));
                 }
@@ -511,7 +588,7 @@ void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
 
     if (mac_addr == NULL || data == NULL || len <= 0) 
     {
-        ESP_LOGE(TAG, "Receive cb arg error");
+        DLOGE(TAG, "Receive cb arg error");
         return;
     }
 
@@ -520,7 +597,7 @@ void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
 
     if (len > MAX_DATA_LEN)
     {
-        ESP_LOGE(TAG, "Received data length exceeds the maximum allowed");
+        DLOGE(TAG, "Received data length exceeds the maximum allowed");
         return;
     }
 
@@ -529,8 +606,8 @@ void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
 
     if (IS_BROADCAST_ADDR(des_addr)) 
     {   
-        ESP_LOGI(TAG, "_________________________________");
-        ESP_LOGI(TAG, "Receive broadcast ESPNOW data");
+        DLOGI(TAG, "_________________________________");
+        DLOGI(TAG, "Receive broadcast ESPNOW data");
 
         bool found = false;
         // Check if the source MAC address is in the allowed slaves list
@@ -547,8 +624,8 @@ void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
                     {
                         // Call a function to response agree connect
                         allowed_connect_slaves[i].start_time = esp_timer_get_time();
-                        ESP_LOGW(TAG, "---------------------------------");
-                        ESP_LOGW(TAG, "Response %s to MAC " MACSTR "",RESPONSE_AGREE_CONNECT,  MAC2STR(recv_cb->mac_addr));
+                        DLOGW(TAG, "---------------------------------");
+                        DLOGW(TAG, "Response %s to MAC " MACSTR "",RESPONSE_AGREE_CONNECT,  MAC2STR(recv_cb->mac_addr));
 
                         add_peer(recv_cb->mac_addr, false);
                         response_specified_mac(recv_cb->mac_addr, RESPONSE_AGREE_CONNECT);
@@ -561,15 +638,15 @@ void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
         if (!found) 
         {
             // Call a function to add the slave to the waiting_connect_slaves list
-            ESP_LOGW(TAG, "Add MAC " MACSTR " to WAITING_CONNECT_SLAVES_LIST",  MAC2STR(recv_cb->mac_addr));
+            DLOGW(TAG, "Add MAC " MACSTR " to WAITING_CONNECT_SLAVES_LIST",  MAC2STR(recv_cb->mac_addr));
             add_waiting_connect_slaves(recv_cb->mac_addr);
         }  
     } 
     else 
     {  
-        ESP_LOGI(TAG, "_________________________________");
-        ESP_LOGI(TAG, "Receive unicast ESPNOW data");
-        ESP_LOGW(TAG, "Receive unicast MAC " MACSTR "", MAC2STR(recv_cb->mac_addr));
+        DLOGI(TAG, "_________________________________");
+        DLOGI(TAG, "Receive unicast ESPNOW data");
+        DLOGW(TAG, "Receive unicast MAC " MACSTR "", MAC2STR(recv_cb->mac_addr));
 
         // Check if the received data is SLAVE_SAVED_MAC_MSG to change status of MAC Online
         for (int i = 0; i < MAX_SLAVES; i++) 
@@ -590,7 +667,7 @@ void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
                         devices_online++;
                     }
 
-                    ESP_LOGI(TAG, "Updated MAC " MACSTR " status to %s", MAC2STR(recv_cb->mac_addr),  allowed_connect_slaves[i].status ? "online" : "offline");
+                    DLOGI(TAG, "Updated MAC " MACSTR " status to %s", MAC2STR(recv_cb->mac_addr),  allowed_connect_slaves[i].status ? "online" : "offline");
 
                     allowed_connect_slaves[i].start_time = 0;
                     allowed_connect_slaves[i].number_retry = 0;
@@ -617,9 +694,37 @@ void master_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
 
                     break;
                 }
+                else if (recv_cb->data_len >= strlen(GROUP_ACK_MSG) && strstr((char *)message_packed, GROUP_ACK_MSG) != NULL)
+                {
+                    group_command_ack(recv_cb->mac_addr, recv_cb->data, recv_cb->data_len);
+
+                    break;
+                }
+                else if (recv_cb->data_len >= strlen(UPLINK_DATA_MSG) && strstr((char *)message_packed, UPLINK_DATA_MSG) != NULL)
+                {
+                    // Data pushed by the slave on relay change or threshold event, no need to wait for CHECK_connect
+                    if (allowed_connect_slaves[i].status)
+                    {
+                        write_table_devices(allowed_connect_slaves[i].peer_addr, &esp_data_sensor, allowed_connect_slaves[i].status);
+                        DLOGW(TAG, "Response %s to MAC " MACSTR "", UPLINK_ACK_MSG, MAC2STR(recv_cb->mac_addr));
+                        response_specified_mac(recv_cb->mac_addr, UPLINK_ACK_MSG);
+                    }
+
+                    break;
+                }
                 else if (recv_cb->data_len >= strlen(CONTROL_RELAY_MSG) && strstr((char *)message_packed, CONTROL_RELAY_MSG) != NULL)
                 {
+                    // Answer of a relay command, carries the data after the change
+                    if (allowed_connect_slaves[i].status)
+                    {
+                        write_table_devices(allowed_connect_slaves[i].peer_addr, &esp_data_sensor, allowed_connect_slaves[i].status);
+                    }
+                    if (s_slave_response_cb != NULL)
+                    {
+                        s_slave_response_cb(recv_cb->mac_addr, CONTROL_RELAY_MSG, &esp_data_sensor);
+                    }
 
+                    break;
                 }
                 else if (recv_cb->data_len >= strlen(DISCONNECT_NODE_MSG) && strstr((char *)message_packed, DISCONNECT_NODE_MSG) != NULL)
                 {
@@ -786,6 +891,9 @@ esp_err_t master_espnow_init(void)
     /* Set primary master key. */
     ESP_ERROR_CHECK( esp_now_set_pmk((uint8_t *)CONFIG_ESPNOW_PMK) ); 
 
+    /* Add broadcast peer information to peer list, used by group commands. */
+    add_peer(s_master_broadcast_mac, false);
+
     return ESP_OK;
 }
 
@@ -798,9 +906,11 @@ void master_espnow_protocol()
 {
     // Initialize xFreeRTOS
     table_devices_mutex = xSemaphoreCreateMutex();
+    send_specified_mutex = xSemaphoreCreateMutex();
     xEventGroup = xEventGroupCreate();
     xEventGroupLightSleep = xEventGroupCreate();
     slave_disconnect_queue = xQueueCreate(10, sizeof(uint32_t));
+    group_command_init();
 
     // Initialize NVS
     esp_err_t ret = nvs_flash_init();
@@ -15,33 +15,35 @@
 #include "esp_timer.h"
 #include "cJSON.h"
 
-#include "mbedtls/aes.h"
+#include "esp_random.h"
 
-// #include "master_espnow_protocol.h"
+#include "uart_frame.h"
+#include "uart_cipher.h"
 
-#include "master_controller.h"
+// #include "master_espnow_protocol.h"
 
 #define TAG_READ_SERIAL                 "READ_SERIAL"
 
-// #define REQUEST_UART                    "KEEP_connect"
-#define REQUEST_UART                    "CONNECT_request"
-#define RESPONSE_AGREE                  "AGREE_connect"
-#define RESPONSE_CONNECTED              "CONNECTED"
-#define REQUEST_CONNECTION_MSG          "CONNECT_request"
-#define WOKE_UP                         "WOKE_UP"
-#define WAKE_UP_COMMAND                 "WAKE_UP"
-
-#define BUTTON_MSG                      "BUTTON_MSG"
-#define GET_DATA                        "GET_DATA"
-#define GET_FULL_DATA                   "GET_FULL_DATA"
-
 // #define PATTERN_CHR_NUM                 (3)                  /*!< Set the number of consecutive and identical characters received by receiver which defines a UART pattern*/
 #define UART_NUM_P2                     UART_NUM_1              // Sử dụng UART1
 #define TX_GPIO_NUM                     5                       // Chân TX (thay đổi nếu cần)
 #define RX_GPIO_NUM                     4                       // Chân RX (thay đổi nếu cần)
-#define BAUD_RATE                       115200                  // Tốc độ baud
+#define RTS_GPIO_NUM                    UART_PIN_NO_CHANGE      // RTS pin, UART_PIN_NO_CHANGE when not wired
+#define CTS_GPIO_NUM                    UART_PIN_NO_CHANGE      // CTS pin, UART_PIN_NO_CHANGE when not wired
+#define FLOW_CTRL_WIRED                 ((RTS_GPIO_NUM >= 0) && (CTS_GPIO_NUM >= 0))
+#define BAUD_RATE                       115200                  // Tốc độ baud, used until the link is negotiated
+#define MAX_BAUD_RATE                   2000000                 // Highest rate accepted in FRAME_CONNECT_REQUEST
+#define FLOW_CTRL_THRESHOLD             100                     // RX FIFO level that deasserts RTS
+#define LINK_CONFIRM_TIMEOUT_MS         500                     // Time to receive FRAME_CONNECTED at the new rate
+#define UART_LINK_KEY                   "7832477891326794"      // AES-128 pre-shared key of the link (16 bytes)
 #define BUF_SIZE                        (1024)
 #define RD_BUF_SIZE                     (BUF_SIZE)
+#define UART_RX_CHUNK_SIZE              128                     // Bytes read from driver per call, fed to the frame decoder
+#define UART_RX_TIMEOUT_SYMBOLS         3                       // Idle time (in symbols) after which the driver posts UART_DATA
+#define UART_RX_FULL_THRESHOLD          64                      // FIFO level that posts UART_DATA while bytes keep coming
+#define UART_EVENT_QUEUE_SIZE           20
+#define UART_DELTA_QUEUE_SIZE           (2 * MAX_SLAVES)        // Changes of table_devices waiting for FRAME_DELTA, a lost one makes S3 resync
+#define UART_STATS_INTERVAL             10000000                // Period of the rx throughput report (us)
 #define MAX_SLAVES                      3
 
 // uint8_t reponse_connect_uart[20];
@@ -73,6 +75,22 @@ typedef struct {
     sensor_data_tt data;                            // Data devices
 } table_device_tt;
 
+// Records in one FRAME_TABLE_CHUNK, the frame still fits when it is encrypted
+#define TABLE_CHUNK_RECORDS             ((UART_FRAME_MAX_PAYLOAD - UART_CIPHER_COUNTER_SIZE - sizeof(uart_chunk_header_t)) / sizeof(table_device_tt))
+
+typedef struct {
+    uint32_t baud_rate;                             // Current rate of the link
+    bool flow_ctrl;                                 // RTS/CTS enabled
+    bool pending;                                   // Switched, waiting for FRAME_CONNECTED at the new rate
+    int64_t switch_time;                            // Time of the last switch (us)
+} uart_link_t;
+
+typedef struct {
+    uint64_t rx_bytes;                              // Bytes read from the driver since start_time
+    int64_t busy_time;                              // Time spent reading and decoding (us)
+    int64_t start_time;                             // Start of the report period (us)
+} uart_rx_stats_t;
+
 typedef struct {
     uint8_t type;                                   //[1 bytes] Broadcast or unicast ESPNOW data.
     uint16_t seq_num;                               //[2 bytes] Sequence number of ESPNOW data.
@@ -80,23 +98,17 @@ typedef struct {
     uint8_t payload[120];                           //Real payload of ESPNOW data.
 } __attribute__((packed)) espnow_data_tt;
 
-typedef struct {
-    char message[20];
-    uint8_t mac[6] ;
-} messages_request;
-
 // extern table_device_tt table_devices[MAX_SLAVES];
 extern TaskHandle_t uart_event_handle;
 
 void uart_config(void);
-void encrypt_message(const unsigned char *input, unsigned char *output, size_t length);
 void dump_uart(uint8_t *message, size_t len);
+void send_frame(uint8_t type, uint16_t req_id, const void *payload, size_t len);
 void add_json();
 void uart_event(void *pvParameters);
 void delay(int x);
 void check_timeout();
 void uart_event_task(void);
-void accept_connect(uint8_t *message);
 uint8_t wait_connect_serial();
 
 #endif // READ_SERIAL_H
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include "read_serial.h"
+// Not in read_serial.h: master_espnow_protocol.h includes it (through light_sleep.h) before its types are defined
+#include "master_controller.h"
 
 int time_now=0;
 int time_check=0;
@@ -6,9 +8,31 @@ int timeout=10000000;
 bool connect_check=true;
 
 static QueueHandle_t uart0_queue;
+static SemaphoreHandle_t uart_tx_mutex;
+static uart_frame_decoder_t s_uart_decoder;
+static uint8_t s_tx_frame[UART_FRAME_ENCODED_SIZE];
+static uint8_t s_tx_payload[UART_FRAME_MAX_PAYLOAD];       // Payload encrypted in place before encoding
+static uart_cipher_t s_cipher;
+static uart_rx_stats_t s_rx_stats;
+static uart_link_stats_t s_link_stats;                      // tx_x under uart_tx_mutex, the rest in the rx task
+static uart_link_t s_link = { .baud_rate = BAUD_RATE };
+static bool s_subscribed = false;                           // S3 wants FRAME_DELTA
+static table_device_t s_table_snapshot[MAX_SLAVES];         // Table served by FRAME_TABLE_CHUNK
+static uint32_t s_snapshot_version;
+static bool s_snapshot_valid = false;
+static QueueHandle_t s_delta_queue;                         // Changes of table_devices, sent by uart_delta_task
+
+typedef struct {
+    uint16_t index;
+    uint32_t version;
+    table_device_t record;
+} table_delta_t;
 
 TaskHandle_t uart_event_handle = NULL;
 
+static void table_devices_changed(int index, const table_device_t *record, uint32_t version);
+static void slave_command_done(const slave_command_result_t *result);
+
 void uart_config(void)
 {
     uart_config_t uart_config = 
@@ -21,38 +45,30 @@ void uart_config(void)
         .source_clk = UART_SCLK_DEFAULT,
     };
     // uart_driver_install(UART_NUM_P2, BUF_SIZE, BUF_SIZE, 0, NULL, 0);
-    uart_driver_install(UART_NUM_P2, BUF_SIZE, BUF_SIZE, 10, &uart0_queue, 0);
+    uart_driver_install(UART_NUM_P2, BUF_SIZE, BUF_SIZE, UART_EVENT_QUEUE_SIZE, &uart0_queue, 0);
 
     // uart_driver_install(UART_NUM_P2, BUF_SIZE * 2, BUF_SIZE * 2, 20, &uart0_queue, 0);
     uart_param_config(UART_NUM_P2, &uart_config);
     // uart_set_pin(UART_NUM_P2, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    uart_set_pin(UART_NUM_P2, TX_GPIO_NUM, RX_GPIO_NUM, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_set_pin(UART_NUM_P2, TX_GPIO_NUM, RX_GPIO_NUM, RTS_GPIO_NUM, CTS_GPIO_NUM);
+
+    // UART_DATA is posted when the line goes idle or the FIFO fills up, so a frame is not split into many events
+    uart_set_rx_timeout(UART_NUM_P2, UART_RX_TIMEOUT_SYMBOLS);
+    uart_set_rx_full_threshold(UART_NUM_P2, UART_RX_FULL_THRESHOLD);
+
+    uart_tx_mutex = xSemaphoreCreateMutex();
+    s_delta_queue = xQueueCreate(UART_DELTA_QUEUE_SIZE, sizeof(table_delta_t));
+    uart_frame_decoder_init(&s_uart_decoder);
+    uart_cipher_init(&s_cipher, (const uint8_t *)UART_LINK_KEY, UART_CIPHER_DIR_C3_TO_S3);
+    register_table_devices_change_cb(table_devices_changed);
+    slave_command_init(slave_command_done);
     // uart0_queue = xQueueCreate(10, BUF_SIZE);
 
     // uart_set_pin(EX_UART_NUM_P2, TX_PIN, RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
 }
 
-void encrypt_message(const unsigned char *input, unsigned char *output, size_t length) 
-{
-    mbedtls_aes_context aes;
-    unsigned char key[16] = "7832477891326794";
-    unsigned char iv[16] =  "4892137489723148";
-    
-    mbedtls_aes_init(&aes);
-    mbedtls_aes_setkey_enc(&aes, key, 128);
-    mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, length, iv, input, output);
-    mbedtls_aes_free(&aes);
-}
-
 void dump_uart(uint8_t *message, size_t len)
 {
-
-    // len = sizeof(len);
-    printf("send \n");
-    uint8_t encrypted_message[len]; // AES block size = 16 bytes
-    // Mã hóa tin nhắn
-    encrypt_message((unsigned char *)message, encrypted_message, len);
-    // uart_write_bytes(UART_NUM_P2, (const char *)message, sizeof(sensor_data_t));
     uart_write_bytes(UART_NUM_P2, (unsigned char *)message, len);
     time_check=esp_timer_get_time(); 
 }
@@ -81,78 +97,547 @@ void add_json()
     uart_write_bytes(UART_NUM_P2,json_string, strlen(json_string));
 }
 
+/* Encode one frame and write it to S3, req_id of a response is the req_id of its request. */
+void send_frame(uint8_t type, uint16_t req_id, const void *payload, size_t len)
+{
+    size_t frame_len = 0;
+
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+
+    if (!s_cipher.enabled)
+    {
+        frame_len = uart_frame_encode(type, 0, req_id, (const uint8_t *)payload, len, s_tx_frame, sizeof(s_tx_frame));
+    }
+    else if (len + UART_CIPHER_COUNTER_SIZE <= sizeof(s_tx_payload))
+    {
+        if (len > 0)
+        {
+            memcpy(s_tx_payload, payload, len);
+        }
+        len = uart_cipher_encrypt(&s_cipher, s_tx_payload, len, sizeof(s_tx_payload));
+        frame_len = uart_frame_encode(type, UART_FRAME_FLAG_ENCRYPTED, req_id, s_tx_payload, len, s_tx_frame, sizeof(s_tx_frame));
+    }
+
+    if (frame_len == 0)
+    {
+        ESP_LOGE(TAG_READ_SERIAL, "Encode frame type 0x%02x failed, len %d", type, (int)len);
+    }
+    else
+    {
+        dump_uart(s_tx_frame, frame_len);
+        s_link_stats.tx_bytes += frame_len;
+        s_link_stats.tx_frames++;
+    }
+
+    xSemaphoreGive(uart_tx_mutex);
+}
+
+// Change rate and flow control once the frames sent at the old rate are out
+static void uart_link_apply(uint32_t baud_rate, bool flow_ctrl)
+{
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+
+    uart_wait_tx_done(UART_NUM_P2, pdMS_TO_TICKS(100));
+    uart_set_baudrate(UART_NUM_P2, baud_rate);
+    uart_set_hw_flow_ctrl(UART_NUM_P2, flow_ctrl ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE, FLOW_CTRL_THRESHOLD);
+    s_link.baud_rate = baud_rate;
+    s_link.flow_ctrl = flow_ctrl;
+
+    xSemaphoreGive(uart_tx_mutex);
+
+    ESP_LOGI(TAG_READ_SERIAL, "UART link %lu baud, flow control %s", (unsigned long)baud_rate, flow_ctrl ? "RTS/CTS" : "off");
+}
+
+// Start (session_id) or stop (NULL) encryption between two frames sent by other tasks
+static void uart_link_cipher(const uint8_t *session_id)
+{
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+    if (session_id != NULL)
+    {
+        uart_cipher_start(&s_cipher, session_id);
+    }
+    else
+    {
+        uart_cipher_stop(&s_cipher);
+    }
+    xSemaphoreGive(uart_tx_mutex);
+}
+
+static void uart_link_fallback(const char *reason)
+{
+    s_link.pending = false;
+    if (s_link.baud_rate != BAUD_RATE || s_link.flow_ctrl)
+    {
+        ESP_LOGW(TAG_READ_SERIAL, "UART link fallback to %d baud: %s", BAUD_RATE, reason);
+        s_link_stats.link_fallbacks++;
+        uart_link_cipher(NULL);
+        uart_link_apply(BAUD_RATE, false);
+        uart_frame_decoder_resync(&s_uart_decoder);
+    }
+}
+
+// Select the highest rate both sides support, a request without payload keeps the default rate
+static void uart_link_accept(const uart_frame_t *frame)
+{
+    uart_link_params_t agreed = { .baud_rate = BAUD_RATE, .flow_ctrl = 0, .encrypt = 0 };
+    uint8_t session_id[UART_CIPHER_SESSION_ID_SIZE];
+
+    if (frame->len >= sizeof(uart_link_params_t))
+    {
+        uart_link_params_t request;
+        memcpy(&request, frame->payload, sizeof(uart_link_params_t));
+
+        agreed.baud_rate = (request.baud_rate < MAX_BAUD_RATE) ? request.baud_rate : MAX_BAUD_RATE;
+        if (agreed.baud_rate < BAUD_RATE)
+        {
+            agreed.baud_rate = BAUD_RATE;
+        }
+        agreed.flow_ctrl = (request.flow_ctrl && FLOW_CTRL_WIRED) ? 1 : 0;
+        agreed.encrypt = request.encrypt ? 1 : 0;
+
+        // Session id = nonce of S3 | nonce of C3
+        esp_fill_random(agreed.nonce, sizeof(agreed.nonce));
+        memcpy(session_id, request.nonce, sizeof(request.nonce));
+        memcpy(session_id + sizeof(request.nonce), agreed.nonce, sizeof(agreed.nonce));
+    }
+
+    // The agree frame is in clear, every frame after it uses the new session
+    uart_link_cipher(NULL);
+    send_frame(FRAME_CONNECT_AGREE, frame->req_id, &agreed, sizeof(agreed));
+    if (agreed.encrypt)
+    {
+        uart_link_cipher(session_id);
+    }
+    uart_link_apply(agreed.baud_rate, agreed.flow_ctrl);
+
+    s_link.pending = true;
+    s_link.switch_time = esp_timer_get_time();
+}
+
+// S3 did not confirm the new rate in time, the switch failed on one side
+static void uart_link_check_pending(void)
+{
+    if (s_link.pending && (esp_timer_get_time() - s_link.switch_time) > LINK_CONFIRM_TIMEOUT_MS * 1000)
+    {
+        uart_link_fallback("no FRAME_CONNECTED");
+    }
+}
+
+/* Runs in the task that changed table_devices, the WiFi task for the data of a slave: only queue
+   the record, the UART is written by uart_delta_task. */
+static void table_devices_changed(int index, const table_device_t *record, uint32_t version)
+{
+    table_delta_t delta = {
+        .index = index,
+        .version = version,
+        .record = *record,
+    };
+
+    if (!s_subscribed || !connect_check)
+    {
+        return;
+    }
+    if (xQueueSend(s_delta_queue, &delta, 0) != pdTRUE)
+    {
+        // S3 sees the version gap and reads the table again
+        ESP_LOGW(TAG_READ_SERIAL, "Delta queue full, drop version %lu", (unsigned long)version);
+    }
+}
+
+// Stream the changed records of table_devices to S3
+static void uart_delta_task(void *pvParameters)
+{
+    uint8_t payload[sizeof(uart_delta_header_t) + sizeof(table_device_tt)];
+    table_delta_t delta;
+
+    while (true)
+    {
+        if (!xQueueReceive(s_delta_queue, &delta, portMAX_DELAY))
+        {
+            continue;
+        }
+
+        uart_delta_header_t header = {
+            .version = delta.version,
+            .index = delta.index,
+        };
+        memcpy(payload, &header, sizeof(header));
+        memcpy(payload + sizeof(header), &delta.record, sizeof(table_device_tt));
+        send_frame(FRAME_DELTA, 0, payload, sizeof(payload));
+    }
+}
+
+static void send_nack(const uart_frame_t *frame)
+{
+    s_link_stats.nacks++;
+    send_frame(FRAME_NACK, frame->req_id, &frame->type, 1);
+}
+
+// Runs in slave_command_task, answers the FRAME_SLAVE_COMMAND whose req_id is the tag
+static void slave_command_done(const slave_command_result_t *result)
+{
+    uint8_t payload[sizeof(uart_slave_result_t) + sizeof(table_device_tt) + sizeof(uart_group_result_t)];
+    uart_slave_result_t header = {
+        .queue_us = result->queue_us,
+        .espnow_us = result->espnow_us,
+    };
+    size_t len = sizeof(header);
+
+    switch (result->status)
+    {
+        case SLAVE_COMMAND_OK:          header.status = UART_SLAVE_OK;          break;
+        case SLAVE_COMMAND_TIMEOUT:     header.status = UART_SLAVE_TIMEOUT;     break;
+        case SLAVE_COMMAND_OFFLINE:     header.status = UART_SLAVE_OFFLINE;     break;
+        default:                        header.status = UART_SLAVE_UNSUPPORTED; break;
+    }
+    memcpy(header.mac, result->mac, ESP_NOW_ETH_ALEN);
+    memcpy(payload, &header, sizeof(header));
+    if (result->device_type == DEVICE_RELAY_GROUP)
+    {
+        uart_group_result_t group = {
+            .targets = result->group_targets,
+            .acked = result->group_acked,
+        };
+        memcpy(payload + len, &group, sizeof(group));
+        len += sizeof(group);
+    }
+    else if (result->status == SLAVE_COMMAND_OK)
+    {
+        memcpy(payload + len, &result->record, sizeof(table_device_tt));
+        len += sizeof(table_device_tt);
+    }
+    send_frame(FRAME_SLAVE_RESULT, result->tag, payload, len);
+}
+
+// Answer FRAME_GET_TABLE_CHUNK with a range of the snapshot, S3 requests several chunks at once
+static void send_table_chunk(const uart_frame_t *frame)
+{
+    uart_chunk_request_t request;
+    uart_chunk_header_t header;
+    uint8_t payload[sizeof(uart_chunk_header_t) + TABLE_CHUNK_RECORDS * sizeof(table_device_tt)];
+
+    if (frame->len < sizeof(request))
+    {
+        send_nack(frame);
+        return;
+    }
+    memcpy(&request, frame->payload, sizeof(request));
+
+    if (request.snapshot)
+    {
+        s_snapshot_version = read_table_devices(s_table_snapshot);
+        s_snapshot_valid = true;
+    }
+    else if (!s_snapshot_valid || request.version != s_snapshot_version)
+    {
+        // Snapshot replaced (or lost on restart), S3 starts again
+        ESP_LOGW(TAG_READ_SERIAL, "Table chunk of version %lu refused", (unsigned long)request.version);
+        send_nack(frame);
+        return;
+    }
+
+    if (request.first >= MAX_SLAVES)
+    {
+        send_nack(frame);
+        return;
+    }
+
+    header.version = s_snapshot_version;
+    header.total = MAX_SLAVES;
+    header.first = request.first;
+    header.count = request.count;
+    if (header.count > MAX_SLAVES - header.first)
+    {
+        header.count = MAX_SLAVES - header.first;
+    }
+    if (header.count > TABLE_CHUNK_RECORDS)
+    {
+        header.count = TABLE_CHUNK_RECORDS;
+    }
+
+    memcpy(payload, &header, sizeof(header));
+    memcpy(payload + sizeof(header), &s_table_snapshot[header.first], header.count * sizeof(table_device_tt));
+    send_frame(FRAME_TABLE_CHUNK, frame->req_id, payload, sizeof(header) + header.count * sizeof(table_device_tt));
+}
+
+// Decrypt the payload in place, return false when the frame must be dropped
+static bool uart_frame_unwrap(uart_frame_t *frame)
+{
+    if (frame->flags & UART_FRAME_FLAG_ENCRYPTED)
+    {
+        int len = s_cipher.enabled ? uart_cipher_decrypt(&s_cipher, frame->payload, frame->len) : -1;
+        if (len < 0)
+        {
+            ESP_LOGW(TAG_READ_SERIAL, "Drop encrypted frame type 0x%02x id %d", frame->type, frame->req_id);
+            return false;
+        }
+        frame->len = len;
+        return true;
+    }
+
+    // Only the handshake is accepted in clear once the session is encrypted
+    if (s_cipher.enabled && frame->type != FRAME_CONNECT_REQUEST)
+    {
+        ESP_LOGW(TAG_READ_SERIAL, "Drop frame type 0x%02x id %d in clear", frame->type, frame->req_id);
+        return false;
+    }
+    return true;
+}
+
+// Handle one frame, the answer is sent before returning
+static void uart_frame_process(uart_frame_t *frame)
+{
+    if (!uart_frame_unwrap(frame))
+    {
+        return;
+    }
+
+    ESP_LOGI(TAG_READ_SERIAL, "Receive frame type 0x%02x id %d len %d", frame->type, frame->req_id, frame->len);
+
+    switch (frame->type)
+    {
+        case FRAME_CONNECT_REQUEST:
+            // New session, S3 subscribes again once it has read the table
+            s_subscribed = false;
+            uart_link_accept(frame);
+            time_now = esp_timer_get_time();
+            return;
+
+        case FRAME_CONNECT_AGREE:
+            // Answer of the CONNECT_REQUEST sent by check_timeout
+            send_frame(FRAME_CONNECTED, frame->req_id, NULL, 0);
+            connect_check = true;
+            time_now = esp_timer_get_time();
+            ESP_LOGI(TAG_READ_SERIAL, "connected");
+            return;
+
+        case FRAME_CONNECTED:
+            // Received at the new rate, echo it so S3 knows the switch worked on both sides
+            s_link.pending = false;
+            send_frame(FRAME_CONNECTED, frame->req_id, NULL, 0);
+            connect_check = true;
+            time_now = esp_timer_get_time();
+            ESP_LOGI(TAG_READ_SERIAL, "connected at %lu baud", (unsigned long)s_link.baud_rate);
+            return;
+
+        default:
+            break;
+    }
+
+    if (!connect_check)
+    {
+        send_nack(frame);
+        return;
+    }
+
+    time_now = esp_timer_get_time();
+
+    switch (frame->type)
+    {
+        case FRAME_WAKE_UP:
+            send_frame(FRAME_WOKE_UP, frame->req_id, NULL, 0);
+            break;
+
+        case FRAME_GET_DATA:
+        {
+            if (frame->len < ESP_NOW_ETH_ALEN)
+            {
+                send_nack(frame);
+                break;
+            }
+
+            // Copied under the table lock, the ESP-NOW receive callback rewrites the record meanwhile
+            table_device_t record;
+            if (read_table_device(frame->payload, &record))
+            {
+                ESP_LOGI(TAG_READ_SERIAL, "GET_DATA MAC " MACSTR, MAC2STR(frame->payload));
+                send_frame(FRAME_DATA, frame->req_id, &record, sizeof(table_device_tt));
+            }
+            else
+            {
+                ESP_LOGW(TAG_READ_SERIAL, "GET_DATA unknown MAC " MACSTR, MAC2STR(frame->payload));
+                send_nack(frame);
+            }
+            break;
+        }
+
+        case FRAME_GET_FULL_DATA:
+        {
+            // Table and version from the same snapshot, so S3 can apply the deltas that follow
+            table_device_t table[MAX_SLAVES];
+            uint8_t payload[sizeof(uint32_t) + sizeof(table_device_tt) * MAX_SLAVES];
+            uint32_t version = read_table_devices(table);
+            memcpy(payload, &version, sizeof(version));
+            memcpy(payload + sizeof(version), table, sizeof(table_device_tt) * MAX_SLAVES);
+            log_table_devices();
+            send_frame(FRAME_FULL_DATA, frame->req_id, payload, sizeof(uint32_t) + sizeof(table_device_tt) * MAX_SLAVES);
+            break;
+        }
+
+        case FRAME_GET_TABLE_CHUNK:
+            send_table_chunk(frame);
+            break;
+
+        case FRAME_SUBSCRIBE:
+        {
+            uint32_t version = table_devices_version;
+            s_subscribed = true;
+            send_frame(FRAME_SUBSCRIBED, frame->req_id, &version, sizeof(version));
+            break;
+        }
+
+        case FRAME_BUTTON:
+            ESP_LOGE(TAG_READ_SERIAL, "Reicv BUTTON");
+            break;
+
+        case FRAME_SLAVE_COMMAND:
+        {
+            uart_slave_command_t command;
+            if (frame->len < sizeof(command))
+            {
+                send_nack(frame);
+                break;
+            }
+            memcpy(&command, frame->payload, sizeof(command));
+
+            // Answered by slave_command_done once the slave replied or timed out
+            device_type_t device_type = DEVICE_UNKNOWN;
+            if (command.command == UART_SLAVE_CMD_RELAY)
+            {
+                device_type = DEVICE_RELAY;
+            }
+            else if (command.command == UART_SLAVE_CMD_RELAY_GROUP)
+            {
+                device_type = DEVICE_RELAY_GROUP;
+            }
+            if (!slave_command_send(device_type, command.mac, frame->req_id, command.timeout_ms))
+            {
+                ESP_LOGW(TAG_READ_SERIAL, "Slave command queue full, refuse id %d", frame->req_id);
+                send_nack(frame);
+            }
+            break;
+        }
+
+        default:
+            ESP_LOGW(TAG_READ_SERIAL, "Unknown frame type 0x%02x", frame->type);
+            send_nack(frame);
+            break;
+    }
+}
+
+// Called by the decoder for every frame with a valid CRC
+static void uart_frame_handler(const uart_frame_t *decoded, void *ctx)
+{
+    int64_t start_time = esp_timer_get_time();
+
+    // Decoder buffer, decrypted in place
+    uart_frame_process((uart_frame_t *)decoded);
+    uart_latency_hist_add(&s_link_stats.latency, (uint32_t)(esp_timer_get_time() - start_time));
+}
+
+// Report throughput of the rx path and the share of CPU time it uses
+static void log_uart_stats(void)
+{
+    int64_t elapsed_time = esp_timer_get_time() - s_rx_stats.start_time;
+    if (elapsed_time < UART_STATS_INTERVAL)
+    {
+        return;
+    }
+
+    ESP_LOGI(TAG_READ_SERIAL, "UART rx %lu baud: %llu B/s, cpu %.2f%%, frames %lu, crc err %lu, framing err %lu, overflow %lu",
+            (unsigned long)s_link.baud_rate,
+            s_rx_stats.rx_bytes * 1000000ULL / elapsed_time,
+            (float)s_rx_stats.busy_time * 100 / elapsed_time,
+            (unsigned long)s_uart_decoder.frames_ok, (unsigned long)s_uart_decoder.crc_errors,
+            (unsigned long)s_uart_decoder.framing_errors, (unsigned long)s_uart_decoder.overflow_errors);
+
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+    uint64_t tx_bytes = s_link_stats.tx_bytes;
+    uint32_t tx_frames = s_link_stats.tx_frames;
+    xSemaphoreGive(uart_tx_mutex);
+
+    // Request handling time of the period, buckets up to 1, 2, 5, 10, 20, 50, 100 ms and above
+    const uart_latency_hist_t *lat = &s_link_stats.latency;
+    ESP_LOGI(TAG_READ_SERIAL, "UART link: tx %llu B %lu frames, rx %llu B, nack %lu, fallback %lu, handling avg %lu us max %lu us [%lu %lu %lu %lu %lu %lu %lu %lu]",
+            tx_bytes, (unsigned long)tx_frames, s_link_stats.rx_bytes,
+            (unsigned long)s_link_stats.nacks, (unsigned long)s_link_stats.link_fallbacks,
+            (unsigned long)(lat->count ? lat->sum_us / lat->count : 0), (unsigned long)lat->max_us,
+            (unsigned long)lat->bucket[0], (unsigned long)lat->bucket[1], (unsigned long)lat->bucket[2], (unsigned long)lat->bucket[3],
+            (unsigned long)lat->bucket[4], (unsigned long)lat->bucket[5], (unsigned long)lat->bucket[6], (unsigned long)lat->bucket[7]);
+    memset(&s_link_stats.latency, 0, sizeof(s_link_stats.latency));
+
+    s_rx_stats.rx_bytes = 0;
+    s_rx_stats.busy_time = 0;
+    s_rx_stats.start_time = esp_timer_get_time();
+}
+
+// Move everything the driver ring buffer holds into the frame decoder
+static void uart_rx_drain(void)
+{
+    uint8_t dtmp[UART_RX_CHUNK_SIZE];
+    size_t buffered_size = 0;
+    int64_t start_time = esp_timer_get_time();
+
+    uart_get_buffered_data_len(UART_NUM_P2, &buffered_size);
+    while (buffered_size > 0)
+    {
+        size_t chunk = (buffered_size < sizeof(dtmp)) ? buffered_size : sizeof(dtmp);
+        int length = uart_read_bytes(UART_NUM_P2, dtmp, chunk, 0);
+        if (length <= 0)
+        {
+            break;
+        }
+        uart_frame_decoder_feed(&s_uart_decoder, dtmp, length, uart_frame_handler, NULL);
+        s_rx_stats.rx_bytes += length;
+        s_link_stats.rx_bytes += length;
+        buffered_size -= length;
+    }
+
+    s_rx_stats.busy_time += esp_timer_get_time() - start_time;
+}
+
 void uart_event(void *pvParameters)
 {
     uart_event_t event;
-    size_t buffered_size;
-    uint8_t* dtmp = (uint8_t*) malloc(BUF_SIZE);
-    unsigned char decrypted_message[BUF_SIZE];
-   
+
+    s_rx_stats.start_time = esp_timer_get_time();
+
     while (true)
     {
-        if (xQueueReceive(uart0_queue, (void *)&event, (TickType_t)portMAX_DELAY)) 
+        TickType_t wait = s_link.pending ? pdMS_TO_TICKS(LINK_CONFIRM_TIMEOUT_MS) : pdMS_TO_TICKS(UART_STATS_INTERVAL / 1000);
+        if (xQueueReceive(uart0_queue, (void *)&event, wait))
         {
-            // bzero(dtmp, RD_BUF_SIZE);
-            memset(decrypted_message, 0, BUF_SIZE);
-            if (event.type == UART_DATA)
+            switch (event.type)
             {
-                uart_read_bytes(UART_NUM_P2, decrypted_message, event.size, 100 / portTICK_PERIOD_MS);
-                uart_flush(UART_NUM_P2);
-                ESP_LOGE(TAG_READ_SERIAL, "Reicv %d bytes : ",event.size);
-                printf("%s \n",decrypted_message);
-
-
-                accept_connect((uint8_t *)decrypted_message);
-
-                if (connect_check)
-                {
-                    if (strcmp((char *)decrypted_message, REQUEST_UART) == 0) 
-                    {
-                        time_now=esp_timer_get_time(); 
-                        // connect_check=true;
-                    }
-                    else if (strcmp((char *)decrypted_message, BUTTON_MSG) == 0) 
-                    {
-                        time_now=esp_timer_get_time();
-                        ESP_LOGE(TAG_READ_SERIAL, "Reicv %s ",decrypted_message);
-                    }
-                    else if ((memcmp((char *)decrypted_message, GET_DATA, 6) == 0))
-                    {
-                        table_device_tt sensor_data;
-                        messages_request* mess_get= (messages_request*)decrypted_message;
-                            // ESP_LOGE(TAG_READ_SERIAL, "size table_device_tt %d ",sizeof(table_device_tt)ư3r);
-                        for (int i = 0; i < MAX_SLAVES; i++)
-                        {
-                            if (memcmp(mess_get->mac, table_devices[i].peer_addr, 6)==0)
-                            {
-                                memcpy(&sensor_data,&table_devices[i], sizeof(table_device_tt));
-                                ESP_LOGI("MAC Address", "MAC: %02X:%02X:%02X:%02X:%02X:%02X",
-                                mess_get->mac[0], mess_get->mac[1], mess_get->mac[2], mess_get->mac[3], mess_get->mac[4], mess_get->mac[5]);
-                                dump_uart((uint8_t*)&sensor_data, sizeof(table_device_tt));
-                            }
-                        }
-                    }
-                    else if (strcmp((char *)decrypted_message,WAKE_UP_COMMAND)== 0)
-                    {
-                        dump_uart((uint8_t *)WOKE_UP,sizeof(WOKE_UP));
-                    }
-                    else if (memcmp((char *)decrypted_message, GET_FULL_DATA, 6) == 0)
-                    {   
-                        log_table_devices();
-                        dump_uart((uint8_t*)&table_devices, sizeof(table_device_tt)*MAX_SLAVES);
-
-                    }
-                }
-                // if ((strcmp((char *)decrypted_message, RESPONSE_AGREE) == 0)&&(!connect_check)) 
-                // {
-                //     connect_check=true;
-                // }
-
+                case UART_DATA:
+                    // One drain can take the bytes of several queued events, later events find the buffer empty
+                    uart_rx_drain();
+                    break;
+
+                case UART_FIFO_OVF:
+                case UART_BUFFER_FULL:
+                    // Bytes were lost, the current frame can not be completed
+                    ESP_LOGE(TAG_READ_SERIAL, "UART overflow, event %d", event.type);
+                    uart_flush_input(UART_NUM_P2);
+                    xQueueReset(uart0_queue);
+                    uart_frame_decoder_resync(&s_uart_decoder);
+                    break;
+
+                case UART_FRAME_ERR:
+                case UART_PARITY_ERR:
+                case UART_BREAK:
+                    // Symbol errors at a negotiated rate mean S3 restarted at the default rate
+                    ESP_LOGE(TAG_READ_SERIAL, "UART error, event %d", event.type);
+                    uart_link_fallback("symbol error");
+                    break;
+
+                default:
+                    break;
             }
         }
+        uart_link_check_pending();
+        log_uart_stats();
     }
-    free(dtmp);
-    dtmp = NULL;
     vTaskDelete(NULL);
 }
 
@@ -163,9 +648,8 @@ void delay(int x)
 
 void check_timeout()
 {
-    messages_request mess;
-    memcpy(mess.message, REQUEST_UART, sizeof(REQUEST_UART));
-    esp_wifi_get_mac(ESP_IF_WIFI_STA, mess.mac);
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
 
     while (1)
     {
@@ -188,7 +672,7 @@ void check_timeout()
         if (!connect_check)
         {
             ESP_LOGE(TAG_READ_SERIAL, "connect_check UART");
-            dump_uart((uint8_t *) &mess,  sizeof(mess));
+            send_frame(FRAME_CONNECT_REQUEST, 0, mac, sizeof(mac));
         }
         delay(1000);
 
@@ -199,58 +683,26 @@ void uart_event_task(void)
 {
     // wait_connect_serial();
     xTaskCreate(uart_event, "uart_event", 4096, NULL, 12, &uart_event_handle);
+    xTaskCreate(uart_delta_task, "uart_delta", 3072, NULL, 11, NULL);
     // check_timeout();
     // xTaskCreate(check_timeout, "check_timeout", 4096, NULL, 12, NULL);
 }
 
-// connect_request mess;
-// strncpy(mess.message, request_connect, sizeof(request_connect));
-
-void accept_connect(uint8_t *message)
-{
-    if (!strncmp(REQUEST_CONNECTION_MSG ,(char *)message,sizeof(REQUEST_CONNECTION_MSG)))
-    {
-        dump_uart((uint8_t *)RESPONSE_AGREE,sizeof(RESPONSE_AGREE));
-        // connect_check=true;
-        ESP_LOGI(TAG_READ_SERIAL, RESPONSE_AGREE);
-    }
-    if (!strncmp(RESPONSE_CONNECTED ,(char *)message,sizeof(RESPONSE_CONNECTED)))
-    {
-        // dump_uart((uint8_t *)RESPONSE_AGREE,sizeof(RESPONSE_AGREE));
-        connect_check=true;
-        ESP_LOGI(TAG_READ_SERIAL, "connected");
-    }
-}
-
 uint8_t wait_connect_serial()
 {
-    uint8_t reponse_connect_uart[20]; 
-    messages_request mess;
-    memcpy(mess.message, REQUEST_UART, sizeof(REQUEST_UART));
-    esp_wifi_get_mac(ESP_IF_WIFI_STA, mess.mac);
-    uint8_t mac[6];
-    memcpy(mac, mess.mac, sizeof(mess.mac));
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
     ESP_LOGI("MAC Address", "MAC: %02X:%02X:%02X:%02X:%02X:%02X",
                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-    while (true)
-    {   
-        vTaskDelay(pdMS_TO_TICKS(2000));
+    // FRAME_CONNECT_AGREE is answered by uart_frame_handler which sets connect_check
+    connect_check = false;
+    while (!connect_check)
+    {
         ESP_LOGW(TAG_READ_SERIAL,"wait_connect_serial");
-        uart_flush(UART_NUM_P2);
-        dump_uart((uint8_t *) &mess.message,  sizeof(mess.message));
-
-        memset(reponse_connect_uart, 0, sizeof(reponse_connect_uart));
-
-        uart_read_bytes(UART_NUM_P2, reponse_connect_uart, sizeof(reponse_connect_uart), pdMS_TO_TICKS(200));
-            
-        if (strcmp((char *)reponse_connect_uart, RESPONSE_AGREE) == 0) 
-        {
-            ESP_LOGI(TAG_READ_SERIAL, "CONNECTED");
-            dump_uart((uint8_t *) RESPONSE_CONNECTED,  sizeof(RESPONSE_CONNECTED));
-            break;
-        }
-
+        send_frame(FRAME_CONNECT_REQUEST, 0, mac, sizeof(mac));
+        vTaskDelay(pdMS_TO_TICKS(2000));
     }
+    ESP_LOGI(TAG_READ_SERIAL, "CONNECTED");
     return 1;
-}
\ No newline at end of file
+}
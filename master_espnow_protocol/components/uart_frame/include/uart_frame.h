@@ -0,0 +1,173 @@
+#ifndef UART_FRAME_H
+#define UART_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Frame on the C3 <-> S3 UART link:
+ *
+ *   COBS( type[1] | flags[1] | req_id[2] | len[2] | payload[len] | crc16[2] ) | 0x00
+ *
+ * Multi-byte fields are little endian. CRC16-CCITT covers header and payload.
+ * COBS removes every 0x00 from the frame so 0x00 only appears as delimiter,
+ * a receiver can resynchronize at the next delimiter after any error.
+ */
+
+#define UART_FRAME_DELIMITER            0x00
+#define UART_FRAME_MAX_PAYLOAD          256
+#define UART_FRAME_HEADER_SIZE          6
+#define UART_FRAME_CRC_SIZE             2
+#define UART_FRAME_RAW_SIZE             (UART_FRAME_HEADER_SIZE + UART_FRAME_MAX_PAYLOAD + UART_FRAME_CRC_SIZE)
+#define UART_FRAME_ENCODED_SIZE         (UART_FRAME_RAW_SIZE + (UART_FRAME_RAW_SIZE / 254) + 2)
+
+#define UART_FRAME_FLAG_ENCRYPTED       0x01        // Payload is frame counter | AES-CTR ciphertext (uart_cipher)
+
+typedef enum {
+    FRAME_CONNECT_REQUEST       = 0x01,     // S3 -> C3     Start of link, payload: uart_link_params_t (capabilities of S3)
+    FRAME_CONNECT_AGREE         = 0x02,     // C3 -> S3     Answer of FRAME_CONNECT_REQUEST, payload: uart_link_params_t (selected)
+    FRAME_CONNECTED             = 0x03,     // Both         Sent by S3 at the selected rate, echoed by C3 to confirm it
+    FRAME_WAKE_UP               = 0x04,     // S3 -> C3     Wake up master
+    FRAME_WOKE_UP               = 0x05,     // C3 -> S3     Master is awake
+    FRAME_GET_DATA              = 0x10,     // S3 -> C3     payload: MAC of slave [6]
+    FRAME_DATA                  = 0x11,     // C3 -> S3     payload: table_device_t
+    FRAME_GET_FULL_DATA         = 0x12,     // S3 -> C3     No payload
+    FRAME_FULL_DATA             = 0x13,     // C3 -> S3     payload: version[4] | table_device_t[MAX_SLAVES]
+    FRAME_SUBSCRIBE             = 0x14,     // S3 -> C3     Start streaming FRAME_DELTA, also used as keepalive
+    FRAME_SUBSCRIBED            = 0x15,     // C3 -> S3     payload: version[4] of the table
+    FRAME_DELTA                 = 0x16,     // C3 -> S3     req_id 0, payload: uart_delta_header_t | table_device_t
+    FRAME_GET_TABLE_CHUNK       = 0x17,     // S3 -> C3     payload: uart_chunk_request_t
+    FRAME_TABLE_CHUNK           = 0x18,     // C3 -> S3     payload: uart_chunk_header_t | table_device_t[count]
+    FRAME_BUTTON                = 0x20,     // S3 -> C3     Button long press
+    FRAME_SLAVE_COMMAND         = 0x21,     // S3 -> C3     payload: uart_slave_command_t
+    FRAME_SLAVE_RESULT          = 0x22,     // C3 -> S3     payload: uart_slave_result_t | table_device_t (UART_SLAVE_OK only) or uart_group_result_t (group)
+    FRAME_NACK                  = 0x7F,     // Both         payload: type of the refused request [1]
+} uart_frame_type_t;
+
+typedef struct {
+    uint8_t type;                                   // uart_frame_type_t
+    uint8_t flags;                                  // UART_FRAME_FLAG_x
+    uint16_t req_id;                                // Request id, echoed in the response
+    uint16_t len;                                   // Length of payload
+    uint8_t payload[UART_FRAME_MAX_PAYLOAD];
+} uart_frame_t;
+
+/* Link parameters negotiated by FRAME_CONNECT_REQUEST / FRAME_CONNECT_AGREE.
+   Both sides switch after FRAME_CONNECT_AGREE and go back to the default rate
+   when FRAME_CONNECTED is not exchanged at the new rate. */
+typedef struct {
+    uint32_t baud_rate;                             // Highest rate of the sender (request) or selected rate (agree)
+    uint8_t flow_ctrl;                              // RTS/CTS wired on the sender (request) or enabled (agree)
+    uint8_t encrypt;                                // Encryption wanted (request) or enabled (agree)
+    uint8_t nonce[4];                               // Random half of the cipher session id from each side
+} __attribute__((packed)) uart_link_params_t;
+
+/* Header of FRAME_DELTA, version is the table version after this change. A receiver
+   that sees a version other than its own + 1 has missed a delta and reads the full table. */
+typedef struct {
+    uint32_t version;
+    uint8_t index;                                  // Index of the record in the table
+} __attribute__((packed)) uart_delta_header_t;
+
+/* Chunked read of the table: C3 takes a snapshot of the table on a request with snapshot = 1
+   and serves any range of it while no other snapshot is taken. A request for another version
+   is refused (FRAME_NACK), the reader then starts again with a new snapshot. Every chunk is
+   checked by the frame CRC, a lost or damaged chunk is requested again on its own. */
+typedef struct {
+    uint32_t version;                               // Version of the snapshot, ignored when snapshot = 1
+    uint16_t first;                                 // Index of the first record
+    uint16_t count;                                 // Records wanted, C3 sends fewer when they do not fit
+    uint8_t snapshot;                               // 1: take a new snapshot first
+} __attribute__((packed)) uart_chunk_request_t;
+
+typedef struct {
+    uint32_t version;                               // Version of the snapshot
+    uint16_t total;                                 // Records in the table
+    uint16_t first;
+    uint16_t count;                                 // Records following the header
+} __attribute__((packed)) uart_chunk_header_t;
+
+/* Command routed to one slave. C3 queues it (FRAME_NACK when its queue is full), sends it
+   over ESP-NOW and answers with FRAME_SLAVE_RESULT, same req_id, once the slave replied or
+   timeout_ms passed. The result carries the time spent on C3 so S3 can split the latency. */
+#define UART_SLAVE_CMD_RELAY            0x01        // Toggle the relay, the slave answers with its data
+#define UART_SLAVE_CMD_RELAY_GROUP      0x02        // Toggle the relay of every online slave with one group command, mac unused
+
+typedef enum {
+    UART_SLAVE_OK               = 0,            // Slave answered, its record follows the result
+    UART_SLAVE_TIMEOUT          = 1,            // No answer of the slave within timeout_ms
+    UART_SLAVE_OFFLINE          = 2,            // Slave unknown or offline, nothing sent
+    UART_SLAVE_UNSUPPORTED      = 3,            // Unknown command
+} uart_slave_status_t;
+
+typedef struct {
+    uint8_t mac[6];
+    uint8_t command;                                // UART_SLAVE_CMD_x
+    uint16_t timeout_ms;                            // Wait for the slave, 0: default of C3
+} __attribute__((packed)) uart_slave_command_t;
+
+typedef struct {
+    uint8_t mac[6];
+    uint8_t status;                                 // uart_slave_status_t
+    uint32_t queue_us;                              // Command received to ESP-NOW send, on C3
+    uint32_t espnow_us;                             // ESP-NOW send to answer of the slave (or timeout)
+} __attribute__((packed)) uart_slave_result_t;
+
+// Follows the result of UART_SLAVE_CMD_RELAY_GROUP, UART_SLAVE_OK when every target acknowledged
+typedef struct {
+    uint8_t targets;                                // Online slaves addressed
+    uint8_t acked;                                  // GROUP_ack received
+} __attribute__((packed)) uart_group_result_t;
+
+/* Latency histogram, bucket i counts latencies up to UART_LATENCY_BOUNDS_US[i],
+   the last bucket counts the rest. */
+#define UART_LATENCY_BUCKETS            8
+#define UART_LATENCY_BOUNDS_US          { 1000, 2000, 5000, 10000, 20000, 50000, 100000 }
+
+typedef struct {
+    uint32_t bucket[UART_LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+} uart_latency_hist_t;
+
+/* Counters of one side of the link, since boot unless noted. */
+typedef struct {
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    uint32_t tx_frames;
+    uint32_t rx_frames;                             // Frames with a valid CRC
+    uint32_t crc_errors;
+    uint32_t framing_errors;
+    uint32_t overflow_errors;
+    uint32_t timeouts;                              // Requests without response
+    uint32_t nacks;                                 // FRAME_NACK received (S3) or sent (C3)
+    uint32_t retries;                               // Requests sent again after a loss
+    uint32_t wake_failures;                         // FRAME_WAKE_UP without FRAME_WOKE_UP
+    uint32_t link_fallbacks;                        // Returns to the default rate
+    uart_latency_hist_t latency;                    // Request to response (S3) or request handling (C3)
+} uart_link_stats_t;
+
+typedef void (*uart_frame_handler_t)(const uart_frame_t *frame, void *ctx);
+
+/* Streaming decoder, bytes can be fed in any split: partial and concatenated frames are handled. */
+typedef struct {
+    uint8_t buffer[UART_FRAME_ENCODED_SIZE];        // Encoded bytes of the current frame
+    size_t len;                                     // Number of bytes in buffer
+    bool overflow;                                  // Frame too long, drop bytes until next delimiter
+    uint32_t frames_ok;
+    uint32_t crc_errors;
+    uint32_t framing_errors;
+    uint32_t overflow_errors;
+    uart_frame_t frame;                             // Last decoded frame
+} uart_frame_decoder_t;
+
+uint16_t uart_frame_crc16(uint16_t crc, const uint8_t *data, size_t len);
+size_t uart_frame_encode(uint8_t type, uint8_t flags, uint16_t req_id, const uint8_t *payload, size_t len, uint8_t *out, size_t out_size);
+void uart_frame_decoder_init(uart_frame_decoder_t *decoder);
+void uart_frame_decoder_resync(uart_frame_decoder_t *decoder);
+size_t uart_frame_decoder_feed(uart_frame_decoder_t *decoder, const uint8_t *data, size_t len, uart_frame_handler_t handler, void *ctx);
+void uart_latency_hist_add(uart_latency_hist_t *hist, uint32_t latency_us);
+
+#endif // UART_FRAME_H
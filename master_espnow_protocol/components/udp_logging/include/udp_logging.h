@@ -1,19 +1,43 @@
+#ifndef UDP_LOGGING_H
+#define UDP_LOGGING_H
+
 #ifndef UDP_LOGGING_MAX_PAYLOAD_LEN
-#define UDP_LOGGING_MAX_PAYLOAD_LEN 2048
+#define UDP_LOGGING_MAX_PAYLOAD_LEN 1400        // One datagram, below the MTU so it is never fragmented
+#endif
+#ifndef UDP_LOGGING_LINE_MAX
+#define UDP_LOGGING_LINE_MAX        160         // Longer lines are cut
+#endif
+#ifndef UDP_LOGGING_SLOTS
+#define UDP_LOGGING_SLOTS           64          // Lines waiting for the shipper, power of 2
 #endif
+#define UDP_LOGGING_FLUSH_MS        200         // Lines wait at most this long for more lines to share their datagram
+#define UDP_LOGGING_BACKOFF_MIN_MS  500         // Wait after a failed send, doubled per failure
+#define UDP_LOGGING_BACKOFF_MAX_MS  30000
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #include "global.h"
-extern int udp_log_fd;
+
+typedef struct {
+    uint32_t lines;         // Lines put in the ring
+    uint32_t dropped;       // Lines lost, ring full
+    uint32_t truncated;     // Lines cut to UDP_LOGGING_LINE_MAX
+    uint32_t datagrams;     // Datagrams sent
+    uint32_t bytes;         // Payload bytes sent
+    uint32_t send_errors;   // Failed sendto, the datagram is tried again after the backoff
+    uint32_t reconnects;    // Sockets opened
+} udp_logging_stats_t;
 
 int udp_logging_init(const char *ipaddr, unsigned long port, vprintf_like_t func);
 int udp_logging_vprintf( const char *str, va_list l );
-int vsprintfunc(const char* buf, const char *str, va_list l);
-void udp_logging_free(va_list l);
+void udp_logging_write(const char *line, size_t len);
+void udp_logging_free(void);
+void udp_logging_stats_get(udp_logging_stats_t *stats);
 
 #ifdef __cplusplus
 }
 #endif
+
+#endif // UDP_LOGGING_H
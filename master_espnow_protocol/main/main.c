@@ -8,7 +8,9 @@ void app_main(void)
     light_sleep_init();
 
     uart_config();
-    uart_event_task();
 
+    // Mutexes of table_devices first, the rx task answers FRAME_SUBSCRIBE and FRAME_GET_TABLE from its table
     master_espnow_protocol();
+
+    uart_event_task();
 }
\ No newline at end of file
@@ -3,7 +3,7 @@
 // subcribe_to_topic("v1/devices/me/rpc/request/+",2);
 
 // sprintf(data, "temperature_rdo: %f, do: %f, temperature_phg: %f, ph: 0",sin_angle,sin_angle2,sin_angle3);
-// data_to_mqtt(data, "v1/devices/me/telemetry",500, 1);
+// mqtt_publish("v1/devices/me/telemetry", data, 1);
 
 
 #ifndef PUB_SUBCLIENT_H
@@ -14,15 +14,52 @@
 #include "string.h"
 #include "esp_log.h"
 
+#define MQTT_PUBLISH_QUEUE_SIZE     (12)        // Messages waiting for the publish task
+#define MQTT_PUBLISH_TOPIC_SIZE     (64)
+#define MQTT_PUBLISH_MAX_PAYLOAD    (1024)      // Room for a batch of telemetry samples
+#define MQTT_PUBLISH_WINDOW         (4)         // QoS 1 messages sent and not yet acknowledged by the broker
+#define MQTT_PUBLISH_MAX_WINDOW     (8)
+#define MQTT_PUBLISH_ACK_TIMEOUT_MS (10000)     // Give up the slot of a message without PUBACK
 
+/* Warm reconnect: the broker keeps the session (clean_session=0, the client id must stay the
+ * same, the default ESP32_<chip id> does), a CONNACK with session present skips the subscribes.
+ * An mqtts:// broker gets a TLS transport that keeps the session ticket (or id) of the last
+ * handshake, the next one resumes it (CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS). */
+#define MQTT_PERSISTENT_SESSION     (1)
+#define MQTT_SUBSCRIPTION_MAX       (4)         // Topics subscribed again on a new session
+#define MQTT_RECONNECT_TIMEOUT_MS   (2000)      // Wait before a reconnect (client default 10 s), skipped when WiFi gets its IP back
+#define MQTT_TLS_PORT               (8883)
 
+typedef struct {
+    uint32_t queued;        // Accepted by mqtt_publish
+    uint32_t dropped;       // Refused, queue full or payload too long
+    uint32_t sent;          // Written to the client
+    uint32_t acked;         // PUBACK received (QoS 1)
+    uint32_t failed;        // Deleted from the outbox or without PUBACK in time
+    uint32_t in_flight;
+    uint32_t ack_max_us;    // Longest publish to PUBACK
+    uint32_t connects;      // MQTT_EVENT_CONNECTED, a new session with the broker each
+    uint32_t resumed;       // Connects with the former session kept by the broker
+    uint32_t connect_us;    // Last connect, start of the TCP (and TLS) setup to CONNACK
+    uint32_t reconnect_us;  // Last link loss (or mqtt_init) to the first PUBACK of the new session
+} mqtt_publish_stats_t;
+
+/* Result of a message of mqtt_publish_tracked: acked on its PUBACK, false when deleted from
+ * the client outbox or without PUBACK in time. */
+typedef void (*mqtt_publish_done_cb_t)(bool acked, void *ctx);
 
 // void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data);
-// void parse_and_add_to_json(const char *input_string, cJSON *json_obj);
-void data_to_mqtt(char *data, char *topic,int delay_time_ms,int qos);
+bool mqtt_publish(const char *topic, const char *data, int qos);
+bool mqtt_publish_len(const char *topic, const void *data, size_t len, int qos);
+bool mqtt_publish_tracked(const char *topic, const void *data, size_t len, mqtt_publish_done_cb_t done, void *ctx);
+void mqtt_publish_set_window(int window);
+int mqtt_publish_pending(void);
+bool mqtt_is_connected(void);
+void mqtt_reconnect(void);
+void mqtt_publish_stats_get(mqtt_publish_stats_t *stats);
 void mqtt_init(char *broker_uri, char *username, char *client_id);
 void subcribe_to_topic(char *topic,int qos);
 void get_data_subcribe_topic( uint16_t *data);
 void mqtt_subcriber(esp_mqtt_event_handle_t event);
-void response_mqtt(char *data,char* topic);
+void response_mqtt(const char *data,const char* topic);
 #endif // PUB_SUBCLIENT
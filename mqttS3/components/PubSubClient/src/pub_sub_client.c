@@ -1,4 +1,9 @@
 #include "pub_sub_client.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_netif.h"
+#include "esp_transport_ssl.h"
+#include "esp_crt_bundle.h"
 
 const char *MQTT_TAG = "MQTT";
 esp_mqtt_client_handle_t g_mqtt_client;  
@@ -9,6 +14,88 @@ const int g_constant_PublishedBit = BIT1;
 double g_salinity_value=0;
 extern QueueHandle_t g_mqtt_queue;
 
+#define MQTT_PUBLISH_TICK_MS        (100)       // Max wait of the publish task, bounds the delay of an ack timeout
+#define MQTT_PUBLISH_RETRY_MS       (200)       // Wait before a message refused by the client is sent again
+#define MQTT_EARLY_ACKS             (4)
+
+typedef struct
+{
+    char topic[MQTT_PUBLISH_TOPIC_SIZE];
+    uint16_t len;
+    uint8_t qos;
+    mqtt_publish_done_cb_t done;        // QoS 1 result of mqtt_publish_tracked, NULL: none
+    void *ctx;
+    char data[MQTT_PUBLISH_MAX_PAYLOAD];
+} mqtt_publish_msg_t;
+
+typedef struct
+{
+    int msg_id;
+    int64_t sent_time;
+    mqtt_publish_done_cb_t done;
+    void *ctx;
+} mqtt_in_flight_t;
+
+typedef struct
+{
+    char topic[MQTT_PUBLISH_TOPIC_SIZE];
+    uint8_t qos;
+    uint32_t session;                   // s_publish_stats.connects when subscribed, 0: not yet
+} mqtt_subscription_t;
+
+static QueueHandle_t s_publish_queue;
+static SemaphoreHandle_t s_publish_mutex;                       // s_in_flight, s_early_acks, s_publish_in_hand and s_publish_stats
+static TaskHandle_t s_publish_task_handle;
+static mqtt_publish_msg_t s_publish_msg;                        // Message of the publish task
+static mqtt_in_flight_t s_in_flight[MQTT_PUBLISH_MAX_WINDOW];   // msg_id 0: free slot
+static int s_early_acks[MQTT_EARLY_ACKS];                       // PUBACK handled before the msg_id was recorded
+static int s_early_ack_index = 0;
+static int s_publish_window = MQTT_PUBLISH_WINDOW;
+static mqtt_publish_stats_t s_publish_stats;
+static bool s_publish_in_hand = false;                          // s_publish_msg left the queue and is not tracked yet (refused ones wait for a retry)
+static mqtt_subscription_t s_subscriptions[MQTT_SUBSCRIPTION_MAX];  // Under s_publish_mutex, as the times below
+static int s_subscription_count = 0;
+static bool s_session_active = false;                           // From mqtt_session_start to MQTT_EVENT_DISCONNECTED
+static int64_t s_connect_start_time = 0;                        // MQTT_EVENT_BEFORE_CONNECT
+static int64_t s_link_lost_time = 0;                            // Until the first PUBACK of the next session, 0: none lost
+
+static void mqtt_publish_done(int msg_id, bool acked);
+static bool mqtt_publish_queue(const char *topic, const void *data, size_t len, int qos, mqtt_publish_done_cb_t done, void *ctx);
+
+/* New session with the broker, runs in the MQTT client task. Topics the broker does not hold
+ * for us (no session present, or never subscribed) are subscribed, no other task subscribes
+ * while holding s_publish_mutex. */
+static void mqtt_session_start(esp_mqtt_client_handle_t client, bool session_present)
+{
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    s_session_active = true;
+    s_publish_stats.connects++;
+    s_publish_stats.connect_us = (uint32_t)(esp_timer_get_time() - s_connect_start_time);
+    if (session_present)
+    {
+        s_publish_stats.resumed++;
+    }
+    for (int i = 0; i < s_subscription_count; i++)
+    {
+        mqtt_subscription_t *subscription = &s_subscriptions[i];
+        if (session_present && subscription->session != 0)
+        {
+            subscription->session = s_publish_stats.connects;
+            continue;
+        }
+        if (esp_mqtt_client_subscribe(client, subscription->topic, subscription->qos) < 0)
+        {
+            ESP_LOGE(MQTT_TAG, "Failed to subscribe to %s", subscription->topic);
+            subscription->session = 0;
+            continue;
+        }
+        subscription->session = s_publish_stats.connects;
+    }
+    xSemaphoreGive(s_publish_mutex);
+
+    ESP_LOGI(MQTT_TAG, "Session %s in %lu us", session_present ? "resumed" : "new", (unsigned long)s_publish_stats.connect_us);
+}
+
 /**
  * @brief Handles MQTT events.
  *
@@ -30,14 +117,24 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
     esp_mqtt_event_handle_t event = event_data;
     switch ((esp_mqtt_event_id_t)event->event_id)
     {
+        case MQTT_EVENT_BEFORE_CONNECT:
+            s_connect_start_time = esp_timer_get_time();
+            break;
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_CONNECTED");
+            mqtt_session_start(event->client, event->session_present);
             xEventGroupSetBits(g_mqtt_event_group,g_constant_ConnectBit);
-            esp_mqtt_client_subscribe(g_mqtt_event_group,"v1/devices/me/rpc/request/+",0);
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_DISCONNECTED");
             xEventGroupClearBits(g_mqtt_event_group,g_constant_ConnectBit);
+            xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+            s_session_active = false;
+            if (s_link_lost_time == 0)
+            {
+                s_link_lost_time = esp_timer_get_time();
+            }
+            xSemaphoreGive(s_publish_mutex);
             break;
         case MQTT_EVENT_SUBSCRIBED:
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_SUBSCRIBED");
@@ -47,7 +144,13 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
             break;
         case MQTT_EVENT_PUBLISHED:
             xEventGroupSetBits(g_mqtt_event_group,g_constant_PublishedBit);
-            ESP_LOGI(MQTT_TAG, "MQTT_EVENT_PUBLISHED");
+            ESP_LOGD(MQTT_TAG, "MQTT_EVENT_PUBLISHED msg_id %d", event->msg_id);
+            mqtt_publish_done(event->msg_id, true);
+            break;
+        case MQTT_EVENT_DELETED:
+            // Expired in the outbox of the client, no PUBACK will come
+            ESP_LOGW(MQTT_TAG, "MQTT_EVENT_DELETED msg_id %d", event->msg_id);
+            mqtt_publish_done(event->msg_id, false);
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGI(MQTT_TAG, "MQTT_RECEIVED DATA");
@@ -62,6 +165,346 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
             break;
     }
 }
+// Free the window slot of msg_id, runs in the MQTT client task
+static void mqtt_publish_done(int msg_id, bool acked)
+{
+    bool found = false;
+    mqtt_publish_done_cb_t done = NULL;
+    void *ctx = NULL;
+
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_PUBLISH_MAX_WINDOW; i++)
+    {
+        if (s_in_flight[i].msg_id == msg_id)
+        {
+            uint32_t ack_us = (uint32_t)(esp_timer_get_time() - s_in_flight[i].sent_time);
+            if (acked && ack_us > s_publish_stats.ack_max_us)
+            {
+                s_publish_stats.ack_max_us = ack_us;
+            }
+            done = s_in_flight[i].done;
+            ctx = s_in_flight[i].ctx;
+            s_in_flight[i].msg_id = 0;
+            s_publish_stats.in_flight--;
+            found = true;
+            break;
+        }
+    }
+    if (found)
+    {
+        if (acked)
+        {
+            s_publish_stats.acked++;
+            if (s_link_lost_time != 0)
+            {
+                s_publish_stats.reconnect_us = (uint32_t)(esp_timer_get_time() - s_link_lost_time);
+                s_link_lost_time = 0;
+            }
+        }
+        else
+        {
+            s_publish_stats.failed++;
+        }
+    }
+    else if (acked)
+    {
+        // The publish task has not recorded the msg_id yet
+        s_early_acks[s_early_ack_index] = msg_id;
+        s_early_ack_index = (s_early_ack_index + 1) % MQTT_EARLY_ACKS;
+    }
+    xSemaphoreGive(s_publish_mutex);
+
+    if (done != NULL)
+    {
+        done(acked, ctx);
+    }
+    xTaskNotifyGive(s_publish_task_handle);
+}
+
+// Record the QoS 1 message s_publish_msg sent as msg_id, unless its PUBACK is already in
+static void mqtt_publish_track(int msg_id)
+{
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    // Counted as in flight from here, mqtt_publish_pending never misses it
+    s_publish_in_hand = false;
+    s_publish_stats.sent++;
+    for (int i = 0; i < MQTT_EARLY_ACKS; i++)
+    {
+        if (s_early_acks[i] == msg_id)
+        {
+            s_early_acks[i] = 0;
+            s_publish_stats.acked++;
+            xSemaphoreGive(s_publish_mutex);
+            if (s_publish_msg.done != NULL)
+            {
+                s_publish_msg.done(true, s_publish_msg.ctx);
+            }
+            return;
+        }
+    }
+    for (int i = 0; i < MQTT_PUBLISH_MAX_WINDOW; i++)
+    {
+        if (s_in_flight[i].msg_id == 0)
+        {
+            s_in_flight[i].msg_id = msg_id;
+            s_in_flight[i].sent_time = esp_timer_get_time();
+            s_in_flight[i].done = s_publish_msg.done;
+            s_in_flight[i].ctx = s_publish_msg.ctx;
+            s_publish_stats.in_flight++;
+            break;
+        }
+    }
+    xSemaphoreGive(s_publish_mutex);
+}
+
+// Free the slots of messages without PUBACK, the client keeps retransmitting them on its own
+static int mqtt_publish_window_used(void)
+{
+    int64_t now = esp_timer_get_time();
+    int used = 0;
+    mqtt_in_flight_t expired[MQTT_PUBLISH_MAX_WINDOW];
+    int expired_count = 0;
+
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_PUBLISH_MAX_WINDOW; i++)
+    {
+        if (s_in_flight[i].msg_id == 0)
+        {
+            continue;
+        }
+        if ((now - s_in_flight[i].sent_time) > MQTT_PUBLISH_ACK_TIMEOUT_MS * 1000LL)
+        {
+            ESP_LOGW(MQTT_TAG, "No PUBACK for msg_id %d", s_in_flight[i].msg_id);
+            expired[expired_count++] = s_in_flight[i];
+            s_in_flight[i].msg_id = 0;
+            s_publish_stats.in_flight--;
+            s_publish_stats.failed++;
+            continue;
+        }
+        used++;
+    }
+    xSemaphoreGive(s_publish_mutex);
+
+    // The client may still deliver it, the sender is told to count on nothing
+    for (int i = 0; i < expired_count; i++)
+    {
+        if (expired[i].done != NULL)
+        {
+            expired[i].done(false, expired[i].ctx);
+        }
+    }
+    return used;
+}
+
+/**
+ * @brief Drains the publish queue while the client is connected.
+ *
+ * Up to s_publish_window QoS 1 messages are outstanding at once, a slot is freed by
+ * MQTT_EVENT_PUBLISHED (matched by msg_id) or after MQTT_PUBLISH_ACK_TIMEOUT_MS.
+ * A message refused by the client (disconnected, outbox full) is sent again later.
+ */
+static void mqtt_publish_task(void *pvParameters)
+{
+    while (1)
+    {
+        xEventGroupWaitBits(g_mqtt_event_group, g_constant_ConnectBit, false, true, portMAX_DELAY);
+
+        if (mqtt_publish_window_used() >= s_publish_window)
+        {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MQTT_PUBLISH_TICK_MS));
+            continue;
+        }
+        if (!s_publish_in_hand)
+        {
+            // In hand before it leaves the queue, mqtt_publish_pending counts it all along
+            if (!xQueuePeek(s_publish_queue, &s_publish_msg, pdMS_TO_TICKS(MQTT_PUBLISH_TICK_MS)))
+            {
+                continue;
+            }
+            xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+            s_publish_in_hand = true;
+            xSemaphoreGive(s_publish_mutex);
+            xQueueReceive(s_publish_queue, &s_publish_msg, 0);
+        }
+
+        int msg_id = esp_mqtt_client_publish(g_mqtt_client, s_publish_msg.topic, s_publish_msg.data, s_publish_msg.len, s_publish_msg.qos, 0);
+        if (msg_id < 0)
+        {
+            ESP_LOGW(MQTT_TAG, "Publish to %s refused (%d), retry", s_publish_msg.topic, msg_id);
+            vTaskDelay(pdMS_TO_TICKS(MQTT_PUBLISH_RETRY_MS));
+            continue;
+        }
+
+        if (s_publish_msg.qos > 0)
+        {
+            mqtt_publish_track(msg_id);
+        }
+        else
+        {
+            xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+            s_publish_in_hand = false;
+            s_publish_stats.sent++;
+            xSemaphoreGive(s_publish_mutex);
+        }
+        ESP_LOGD(MQTT_TAG, "Published msg_id %d to %s: %.*s", msg_id, s_publish_msg.topic, s_publish_msg.len, s_publish_msg.data);
+    }
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Queues a message for the publish task without blocking.
+ *
+ * @param[in] topic The MQTT topic to publish to.
+ * @param[in] data Payload (JSON text), copied into the queue.
+ * @param[in] qos 0 or 1, QoS 1 messages take a slot of the in-flight window until PUBACK.
+ *
+ * @return true when queued, false when the queue is full or the message too long.
+ */
+bool mqtt_publish(const char *topic, const char *data, int qos)
+{
+    return mqtt_publish_len(topic, data, strlen(data), qos);
+}
+
+/**
+ * @brief Queues a payload of len bytes, binary payloads (protobuf) may hold 0 bytes.
+ *
+ * @return true when queued, false when the queue is full or the message too long.
+ */
+bool mqtt_publish_len(const char *topic, const void *data, size_t len, int qos)
+{
+    return mqtt_publish_queue(topic, data, len, qos, NULL, NULL);
+}
+
+/**
+ * @brief Queues a QoS 1 payload whose delivery the sender waits for.
+ *
+ * done is called once the message is settled: acked true on its PUBACK, false when the
+ * client deleted it from its outbox or no PUBACK came within MQTT_PUBLISH_ACK_TIMEOUT_MS.
+ * It runs in the MQTT client task or the publish task and must not block.
+ *
+ * @return true when queued, done is then called exactly once. false when the queue is full
+ *         or the message too long, done is not called.
+ */
+bool mqtt_publish_tracked(const char *topic, const void *data, size_t len, mqtt_publish_done_cb_t done, void *ctx)
+{
+    return mqtt_publish_queue(topic, data, len, 1, done, ctx);
+}
+
+static bool mqtt_publish_queue(const char *topic, const void *data, size_t len, int qos, mqtt_publish_done_cb_t done, void *ctx)
+{
+    mqtt_publish_msg_t msg;
+    bool queued = false;
+
+    if (len == 0 || len > MQTT_PUBLISH_MAX_PAYLOAD || strlen(topic) >= MQTT_PUBLISH_TOPIC_SIZE)
+    {
+        ESP_LOGE(MQTT_TAG, "Message to %s too long (%d B)", topic, (int)len);
+    }
+    else
+    {
+        strlcpy(msg.topic, topic, sizeof(msg.topic));
+        memcpy(msg.data, data, len);
+        msg.len = len;
+        msg.qos = qos;
+        msg.done = done;
+        msg.ctx = ctx;
+        queued = (xQueueSend(s_publish_queue, &msg, 0) == pdTRUE);
+    }
+
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    if (queued)
+    {
+        s_publish_stats.queued++;
+    }
+    else
+    {
+        s_publish_stats.dropped++;
+    }
+    xSemaphoreGive(s_publish_mutex);
+
+    return queued;
+}
+
+/**
+ * @brief Sets the number of QoS 1 messages outstanding at once (1..MQTT_PUBLISH_MAX_WINDOW).
+ */
+void mqtt_publish_set_window(int window)
+{
+    if (window < 1)
+    {
+        window = 1;
+    }
+    else if (window > MQTT_PUBLISH_MAX_WINDOW)
+    {
+        window = MQTT_PUBLISH_MAX_WINDOW;
+    }
+    s_publish_window = window;
+    xTaskNotifyGive(s_publish_task_handle);
+}
+
+/**
+ * @brief Messages queued, held by the publish task (also waiting for a retry) or without
+ *        PUBACK yet. Not a proof of delivery, a message without PUBACK in time leaves the
+ *        count, see mqtt_publish_tracked.
+ */
+int mqtt_publish_pending(void)
+{
+    // Queue first: a message taken meanwhile is already in hand when the mutex is held
+    int pending = uxQueueMessagesWaiting(s_publish_queue);
+
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    pending += s_publish_stats.in_flight + (s_publish_in_hand ? 1 : 0);
+    xSemaphoreGive(s_publish_mutex);
+
+    return pending;
+}
+
+bool mqtt_is_connected(void)
+{
+    // The connectivity monitor asks before mqtt_init
+    return g_mqtt_event_group != NULL && (xEventGroupGetBits(g_mqtt_event_group) & g_constant_ConnectBit) != 0;
+}
+
+void mqtt_publish_stats_get(mqtt_publish_stats_t *stats)
+{
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    *stats = s_publish_stats;
+    xSemaphoreGive(s_publish_mutex);
+}
+
+/* TLS transport of an mqtts:// broker. It keeps the session of the last handshake and offers it
+ * on the next connect, the broker resumes it (ticket or session id) without the certificate
+ * exchange and the ECDHE computation, the expensive part of the handshake on the S3. */
+static esp_transport_handle_t mqtt_tls_transport(void)
+{
+    esp_transport_handle_t ssl = esp_transport_ssl_init();
+
+    esp_transport_set_default_port(ssl, MQTT_TLS_PORT);
+    esp_transport_ssl_crt_bundle_attach(ssl, esp_crt_bundle_attach);
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    esp_transport_ssl_session_tickets_enable(ssl);
+#else
+    ESP_LOGW(MQTT_TAG, "CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS is off, every connect does a full handshake");
+#endif
+    return ssl;
+}
+
+/**
+ * @brief Reconnects now instead of after MQTT_RECONNECT_TIMEOUT_MS, the link is known to be
+ *        back (WiFi got its IP, the connectivity monitor reached the internet).
+ */
+void mqtt_reconnect(void)
+{
+    if (g_mqtt_client != NULL && !mqtt_is_connected())
+    {
+        esp_mqtt_client_reconnect(g_mqtt_client);
+    }
+}
+
+static void mqtt_got_ip_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    mqtt_reconnect();
+}
+
 /**
  * @brief Initializes and starts the MQTT client.
  *
@@ -77,95 +520,49 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
 void mqtt_init(char *broker_uri, char *username, char *client_id)
 {
     g_mqtt_event_group = xEventGroupCreate();
+    s_publish_queue = xQueueCreate(MQTT_PUBLISH_QUEUE_SIZE, sizeof(mqtt_publish_msg_t));
+    s_publish_mutex = xSemaphoreCreateMutex();
+    s_link_lost_time = esp_timer_get_time();
+    xTaskCreate(mqtt_publish_task, "mqtt_publish", 4096, NULL, 5, &s_publish_task_handle);
     esp_mqtt_client_config_t mqtt_cfg = 
     {
         .broker.address.uri = broker_uri,  // MQTT broker URI from configuration
         .credentials.username = username,
         .credentials.client_id = client_id,
-        .session.keepalive = 30
+        .session.keepalive = 30,
+        .session.disable_clean_session = MQTT_PERSISTENT_SESSION,
+        .network.reconnect_timeout_ms = MQTT_RECONNECT_TIMEOUT_MS,
     };
+    if (strncmp(broker_uri, "mqtts://", 8) == 0)
+    {
+        mqtt_cfg.network.transport = mqtt_tls_transport();
+    }
     g_mqtt_client = esp_mqtt_client_init(&mqtt_cfg);  // Initialize the MQTT client
     esp_mqtt_client_register_event(g_mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);  // Register the event handler
+    esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, mqtt_got_ip_handler, NULL);
     esp_mqtt_client_start(g_mqtt_client);
 }
 /**
- * @brief Parses an input string and adds key-value pairs to a JSON object.
- *
- * This function tokenizes the input string using delimiters (": " and ", ") to extract
- * key-value pairs. It converts the value strings to double and adds them to the provided
- * cJSON object. If memory allocation fails, an error message is printed.
+ * @brief Answers a ThingsBoard RPC request with a JSON payload.
  *
- * @param[in] input_string The input string containing key-value pairs.
- * @param[in,out] json_obj The cJSON object to which key-value pairs are added.
- *
- * @note Make sure the cJSON library is initialized before calling this function.
+ * @param[in] data JSON text of the response.
+ * @param[in] topic Topic of the request, v1/devices/me/rpc/request/<id>.
  */
-void parse_and_add_to_json(const char *input_string, cJSON *json_obj) 
-{
-    char *input_copy = strdup(input_string);
-    if (input_copy == NULL) 
-    {
-        printf("Failed to allocate memory.\n");
-        return;
-    }
-    char * obj;
-    char * val;
-    obj = strtok(input_copy, ": ");
-    val = strtok(NULL, ", ");
-    cJSON_AddNumberToObject(json_obj, obj, strtod(val,NULL));
-    while(obj!=NULL && val!=NULL)
-    {
-        obj = strtok(NULL, ": ");
-        val = strtok(NULL, ", ");
-        if(obj!=NULL && val!=NULL)
-        {
-            cJSON_AddNumberToObject(json_obj, obj, strtod(val,NULL));
-        }
-    }    // Free the copy of input string
-    free(input_copy);
-}
-extern QueueHandle_t g_mqtt_queue;
-
-
-char data_test[200];
-
-void response_mqtt(char *data,char* topic)
+void response_mqtt(const char *data, const char *topic)
 {
     char requestId[50];
-    uint8_t sensor_data;
-    // char data[200];
 
-    sscanf(topic, "v1/devices/me/rpc/request/%s", requestId);
+    sscanf(topic, "v1/devices/me/rpc/request/%49s", requestId);
     ESP_LOGI(MQTT_TAG, "Extracted requestId: %s", requestId);
 
     // Tạo topic để gửi ACK
     char responseTopic[100];
     snprintf(responseTopic, sizeof(responseTopic), "v1/devices/me/rpc/response/%s", requestId);
 
-    // Dữ liệu ACK để gửi lên ThingsBoard
-            
-    // if(xQueueReceive(g_mqtt_queue,&sensor_data,(TickType_t)portMAX_DELAY))
-    // sprintf(data, "temperature_rdo: %f, do: %f, temperature_phg: %f, ph: %f, cpu_temp: %f ",sensor_data.temperature_rdo,sensor_data.ph_value,sensor_data.temperature_phg, sensor_data.do_value, sensor_data.temperature_mcu);
-
-        // const char *ack_data = "{sjkdhfhgjksdfhjksfd:}";
-        data[strlen(data)] = '\0';  // Null-terminate the received data
-        // // Publish the data to the MQTT broker
-        cJSON *json_obj = cJSON_CreateObject();
-        if (json_obj == NULL) 
-        {
-            printf("Failed to create JSON object.\n");
-            return;
-        }
-        parse_and_add_to_json(data,json_obj);
-        char *json_data = cJSON_Print(json_obj);
-    // Gửi ACK
-        cJSON_Delete(json_obj);
-    esp_mqtt_client_publish(g_mqtt_client, responseTopic, json_data, 0, 1, 0);
-    // esp_mqtt_client_publish(g_mqtt_client, topic, json_data, strlen(json_data), 1, 0);
-
-    ESP_LOGI(MQTT_TAG, "Sent ACK to topic: %s", responseTopic);
-            free(json_data);
-
+    if (mqtt_publish(responseTopic, data, 1))
+    {
+        ESP_LOGI(MQTT_TAG, "Sent ACK to topic: %s", responseTopic);
+    }
 }
 
 // void mqtt_subcriber(esp_mqtt_event_handle_t event)
@@ -201,84 +598,61 @@ void response_mqtt(char *data,char* topic)
 // }
 
 /**
- * @brief Publishes data to an MQTT topic.
+ * @brief Subscribes to an MQTT topic with the specified quality of service (QoS).
  *
- * This function publishes the provided data to the specified MQTT topic using the configured MQTT client.
- * It creates a JSON object from the data, converts it to a string, and publishes it.
- * If the publishing fails, appropriate log messages are generated.
+ * Does not wait for the broker. The topic is remembered (up to MQTT_SUBSCRIPTION_MAX) and
+ * subscribed at once when a session is up, else by MQTT_EVENT_CONNECTED, then again in every
+ * new session unless the broker kept the former one.
+ * If the subscription fails, an error message is logged.
  *
- * @param[in] data The data to be published.
- * @param[in] topic The MQTT topic to publish to.
- * @param[in] delay_time_ms The delay time (in milliseconds) after publishing.
+ * @param[in] topic The topic to subscribe to.
  * @param[in] qos The desired quality of service (0, 1, or 2).
- *
- * @note Make sure the MQTT client is connected before calling this function.
  */
-void data_to_mqtt(char *data, char *topic, int delay_time_ms, int qos)
+void subcribe_to_topic(char *topic,int qos)
 {
-    xEventGroupWaitBits(g_mqtt_event_group,g_constant_ConnectBit,false,true,portMAX_DELAY);
-    int len = strlen(data);
-    // data_test
-    strcpy(data_test, data);
+    mqtt_subscription_t *subscription = NULL;
 
-    if (len > 0) 
+    // Remembered to be subscribed again in a new session
+    xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+    for (int i = 0; i < s_subscription_count; i++)
     {
-        data[len] = '\0';  // Null-terminate the received data
-        // Publish the data to the MQTT broker
-        cJSON *json_obj = cJSON_CreateObject();
-        if (json_obj == NULL) 
+        if (strcmp(s_subscriptions[i].topic, topic) == 0)
         {
-            printf("Failed to create JSON object.\n");
-            return;
+            subscription = &s_subscriptions[i];
         }
-        parse_and_add_to_json(data,json_obj);
-        char *json_data = cJSON_Print(json_obj);
-   
+    }
+    if (subscription == NULL && s_subscription_count < MQTT_SUBSCRIPTION_MAX && strlen(topic) < MQTT_PUBLISH_TOPIC_SIZE)
+    {
+        subscription = &s_subscriptions[s_subscription_count++];
+        strlcpy(subscription->topic, topic, sizeof(subscription->topic));
+        subscription->session = 0;
+    }
+    if (subscription != NULL)
+    {
+        subscription->qos = qos;
+    }
+    // Claimed here, not subscribed a second time by a session starting before the call below
+    bool subscribe = s_session_active && (subscription == NULL || subscription->session == 0);
+    if (subscribe && subscription != NULL)
+    {
+        subscription->session = s_publish_stats.connects;
+    }
+    xSemaphoreGive(s_publish_mutex);
 
-        int ret=esp_mqtt_client_publish(g_mqtt_client, topic, json_data, strlen(json_data), qos, 0);
-        if (ret == -1)
-        {
-            ESP_LOGE(MQTT_TAG, "Failed to publish data!");
-            // cJSON_Delete(json_obj);
-            // free(json_data);
-            // return 1;
-        }
-        else if (ret == -2)
-        {
-            ESP_LOGW(MQTT_TAG, "Data buffer full!");
-            // cJSON_Delete(json_obj);
-            // free(json_data);
-            // return 1;
-        }
-        else
-        {
-            ESP_LOGW("\n \033[37m Message sent: ","%s \033[0m", json_data);
-            // cJSON_Delete(json_obj);
-            // free(json_data);
-        }
-        cJSON_Delete(json_obj);
-        free(json_data);
+    if (subscription == NULL)
+    {
+        ESP_LOGW(MQTT_TAG, "%s not kept, it is not subscribed again after a reconnect", topic);
     }
-    vTaskDelay(delay_time_ms/portTICK_PERIOD_MS);
-    xEventGroupWaitBits(g_mqtt_event_group,g_constant_PublishedBit,true,true,portMAX_DELAY);
-}
-/**
- * @brief Subscribes to an MQTT topic with the specified quality of service (QoS).
- *
- * This function subscribes to an MQTT topic using the provided client and topic name.
- * If the subscription fails, an error message is logged.
- *
- * @param[in] topic The topic to subscribe to.
- * @param[in] qos The desired quality of service (0, 1, or 2).
- *
- * @note Make sure the MQTT client is connected before calling this function.
- */
-void subcribe_to_topic(char *topic,int qos)
-{
-    xEventGroupWaitBits(g_mqtt_event_group,g_constant_ConnectBit,false,true,portMAX_DELAY);
-    if(esp_mqtt_client_subscribe(g_mqtt_client,topic,qos) == -1) 
+    // Outside of the mutex, the client task holds its own lock while it calls mqtt_session_start
+    if (subscribe && esp_mqtt_client_subscribe(g_mqtt_client, topic, qos) == -1)
     {
         ESP_LOGE(MQTT_TAG,"Failed to subcribe to topic");
+        if (subscription != NULL)
+        {
+            xSemaphoreTake(s_publish_mutex, portMAX_DELAY);
+            subscription->session = 0;
+            xSemaphoreGive(s_publish_mutex);
+        }
     }
 }
 void get_data_subcribe_topic( uint16_t *data)
@@ -1,16 +1,43 @@
 #ifndef CONNECT_WIFI_H
 #define CONNECT_WIFI_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef enum {
     Internet     = 1,
     NoInternet  = 0
 }INTERNET_CHECK;
 
+/* Connectivity monitor: a live session of the application (the MQTT keepalive) vouches for the
+ * link at no cost, only without one the monitor probes the host of its URL, a DNS lookup and a
+ * TCP connect (no TLS, no request). A failed probe is retried after CONNECTIVITY_RETRY_MIN_MS,
+ * doubled up to CONNECTIVITY_RETRY_MAX_MS, WiFi events end the wait at once. */
+#define CONNECTIVITY_LINK_INTERVAL_MS   (5000)      // Check of the session, no traffic
+#define CONNECTIVITY_PROBE_INTERVAL_MS  (30000)     // Probe passed and still no session
+#define CONNECTIVITY_RETRY_MIN_MS       (5000)
+#define CONNECTIVITY_RETRY_MAX_MS       (120000)
+#define CONNECTIVITY_PROBE_TIMEOUT_MS   (3000)      // TCP connect
+#define CONNECTIVITY_HOST_SIZE          (64)
+
+typedef bool (*connectivity_link_cb_t)(void);                   // true: the session is up
+typedef void (*connectivity_change_cb_t)(INTERNET_CHECK state); // Called by the monitor task
+
+typedef struct {
+    uint32_t link_checks;   // Checks answered by the session, no probe
+    uint32_t probes;        // DNS lookup and TCP connect
+    uint32_t dns_failures;
+    uint32_t tcp_failures;
+    uint32_t changes;       // Internet <-> NoInternet
+    uint32_t probe_max_us;  // Longest probe
+    uint32_t interval_ms;   // Wait before the next check
+} connectivity_stats_t;
+
 void wifi_init_sta(const char* w_ssid,const char* w_pass);
 void wifi_init_softap(const char* w_ssid,const char* w_pass);
+void connectivity_monitor_start(const char *url, connectivity_link_cb_t link_up, connectivity_change_cb_t on_change);
+void connectivity_stats_get(connectivity_stats_t *stats);
 void https_ping(const char* urrl);
-// void https_pingg(void *pvParameters);
-void https_request_check(const char* urrl);
 void wifi_init(void);
 void https_cofig(const char* urrl);
 int check_internet(void);
@@ -19,4 +46,4 @@ void set_wifi_max_tx_power(int rssid);
 void print_ap_channel();
 void print_wifi_channel();
 void wifi_scan();
-#endif
\ No newline at end of file
+#endif
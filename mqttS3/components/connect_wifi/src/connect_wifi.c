@@ -6,10 +6,11 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "string.h"
-#include "esp_crt_bundle.h"
-#include "esp_http_client.h"
 #include "esp_timer.h"
 #include <esp_now.h>
+#include <errno.h>
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
 #include "udp_logging.h"
 
 // #include "protocol_examples_common.h"
@@ -29,6 +30,22 @@ ip_event_got_ip_t* event;
 
 static INTERNET_CHECK Internet_State;
 
+// Connectivity monitor
+static TaskHandle_t s_monitor_task = NULL;
+static char s_monitor_host[CONNECTIVITY_HOST_SIZE];
+static char s_monitor_port[6];
+static connectivity_link_cb_t s_link_up = NULL;
+static connectivity_change_cb_t s_on_change = NULL;
+static connectivity_stats_t s_connectivity_stats;
+static volatile bool s_sta_got_ip = false;
+
+// WiFi event, the monitor checks again now instead of at the end of its interval
+static void connectivity_wake(void){
+    if (s_monitor_task != NULL) {
+        xTaskNotifyGive(s_monitor_task);
+    }
+}
+
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
@@ -36,7 +53,9 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         ESP_LOGE("Disconnected","Wifi Disconnected");
+        s_sta_got_ip = false;
         Internet_State=NoInternet;
+        connectivity_wake();
         esp_wifi_connect();
         // xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
@@ -53,6 +72,8 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
     unsigned long udp_port = 5010; // 5006 - 5013
     udp_logging_init(udp_ip, udp_port, udp_logging_vprintf);
 
+    s_sta_got_ip = true;
+    connectivity_wake();
     }
     else if (event_base == WIFI_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
                 ESP_LOGI(TAG,"Wifi Connectedddđd");
@@ -259,68 +280,159 @@ void wifi_init_softap(const char* w_ssid,const char* w_pass) {
 
 
 
-static void http_cleanup(esp_http_client_handle_t client)
-{
-    esp_http_client_close(client);
-    esp_http_client_cleanup(client);
-}
+// scheme://host[:port][/path], without a port the one of the scheme
+static bool connectivity_parse_url(const char *url){
+    const char *host = strstr(url, "://");
+    const char *port = "443";
+    size_t host_len;
+    size_t port_len;
 
+    host = (host != NULL) ? host + 3 : url;
+    if (strncmp(url, "http://", 7) == 0) {
+        port = "80";
+    } else if (strncmp(url, "mqtt://", 7) == 0) {
+        port = "1883";
+    } else if (strncmp(url, "mqtts://", 8) == 0) {
+        port = "8883";
+    }
+    host_len = strcspn(host, ":/");
+    if (host_len == 0 || host_len >= sizeof(s_monitor_host)) {
+        return false;
+    }
+    if (host[host_len] == ':') {
+        port = host + host_len + 1;
+    }
+    port_len = strcspn(port, "/");
+    if (port_len == 0 || port_len >= sizeof(s_monitor_port)) {
+        return false;
+    }
+    memcpy(s_monitor_host, host, host_len);
+    s_monitor_host[host_len] = '\0';
+    memcpy(s_monitor_port, port, port_len);
+    s_monitor_port[port_len] = '\0';
+    return true;
+}
 
+/* DNS lookup (lwIP caches the answer for its TTL) and a non-blocking TCP connect, closed as soon
+ * as it is answered. A refused connect is an answer of the host as well. */
+static bool connectivity_probe(void){
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    int64_t start_time = esp_timer_get_time();
+    bool reached = false;
 
-// https_requestt();
-void https_request_check(const char* urrl){
-    int log=0;
-    static bool log_esp = true;
+    s_connectivity_stats.probes++;
+    if (getaddrinfo(s_monitor_host, s_monitor_port, &hints, &res) != 0 || res == NULL) {
+        s_connectivity_stats.dns_failures++;
+        ESP_LOGW(TAG, "DNS lookup of %s failed", s_monitor_host);
+    } else {
+        int sock = socket(res->ai_family, res->ai_socktype, 0);
+        if (sock >= 0) {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+            if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+                reached = true;
+            } else if (errno == EINPROGRESS) {
+                struct timeval timeout = {
+                    .tv_sec = CONNECTIVITY_PROBE_TIMEOUT_MS / 1000,
+                    .tv_usec = (CONNECTIVITY_PROBE_TIMEOUT_MS % 1000) * 1000,
+                };
+                fd_set write_fds;
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+
+                FD_ZERO(&write_fds);
+                FD_SET(sock, &write_fds);
+                reached = select(sock + 1, NULL, &write_fds, NULL, &timeout) == 1 &&
+                          getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 &&
+                          (err == 0 || err == ECONNREFUSED);
+            }
+            close(sock);
+        }
+        freeaddrinfo(res);
+        if (!reached) {
+            s_connectivity_stats.tcp_failures++;
+            ESP_LOGW(TAG, "No TCP connect to %s:%s", s_monitor_host, s_monitor_port);
+        }
+    }
 
-    esp_http_client_handle_t client=NULL;
-    // esp_http_client_config_t config={};
-    esp_http_client_config_t config = {
-        .url = urrl,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-        .timeout_ms = 5000,
-        .keep_alive_enable = true,
-        };
-    client = esp_http_client_init(&config);
+    uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - start_time);
+    if (elapsed_us > s_connectivity_stats.probe_max_us) {
+        s_connectivity_stats.probe_max_us = elapsed_us;
+    }
+    return reached;
+}
 
-    int64_t start_time = esp_timer_get_time();
-    // Perform the request
-    esp_err_t err = esp_http_client_perform(client);
-    // Record the end time
-    int64_t end_time = esp_timer_get_time();
-    // Calculate the elapsed time in milliseconds
-    int64_t time_ms = (end_time - start_time) / 1000;
-    if (err == ESP_OK) {
-        if (log_esp){
-        printf("________________________________\n");
-        ESP_LOGI(TAG,"Reply from: %s",urrl);
-        ESP_LOGI(TAG, "HTTPS Status = %d",esp_http_client_get_status_code(client));
-        ESP_LOGI(TAG, " content_length = %"PRId64  ,esp_http_client_get_content_length(client));
-        ESP_LOGI(TAG,"ms: %"PRId64 ,time_ms);
-        printf("________________________________\n");
+static void connectivity_monitor_task(void *pvParameters){
+    INTERNET_CHECK reported = NoInternet;
+    uint32_t retry_ms = CONNECTIVITY_RETRY_MIN_MS;
+
+    while (1) {
+        INTERNET_CHECK state = NoInternet;
+        uint32_t interval_ms;
+
+        if (s_link_up != NULL && s_link_up()) {
+            // The keepalive of the session already proves the link
+            s_connectivity_stats.link_checks++;
+            state = Internet;
+            interval_ms = CONNECTIVITY_LINK_INTERVAL_MS;
+            retry_ms = CONNECTIVITY_RETRY_MIN_MS;
+        } else if (!s_sta_got_ip) {
+            // Nothing to probe, GOT_IP wakes the task
+            interval_ms = CONNECTIVITY_RETRY_MAX_MS;
+            retry_ms = CONNECTIVITY_RETRY_MIN_MS;
+        } else if (connectivity_probe()) {
+            state = Internet;
+            interval_ms = CONNECTIVITY_PROBE_INTERVAL_MS;
+            retry_ms = CONNECTIVITY_RETRY_MIN_MS;
+        } else {
+            interval_ms = retry_ms;
+            retry_ms = (retry_ms * 2 < CONNECTIVITY_RETRY_MAX_MS) ? retry_ms * 2 : CONNECTIVITY_RETRY_MAX_MS;
         }
-        Internet_State=Internet;
-        // return 0;
-    } 
-    else {
-        if (log_esp){
-        ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+
+        Internet_State = state;
+        if (state != reported) {
+            reported = state;
+            s_connectivity_stats.changes++;
+            ESP_LOGI(TAG, "Internet %s", (state == Internet) ? "up" : "down");
+            if (s_on_change != NULL) {
+                s_on_change(state);
+            }
         }
-        Internet_State=NoInternet;
+        s_connectivity_stats.interval_ms = interval_ms;
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(interval_ms));
     }
-    http_cleanup(client);
-    vTaskDelay(pdMS_TO_TICKS(5000));
 }
-void https_pingg(void *pvParameters){
-    // configure_client(&client);
-    char *urrl = (char *)pvParameters;
-    while (1)
-    {
-    https_request_check(urrl);
+
+/**
+ * @brief Starts the task behind check_internet().
+ * @param url Its host is probed while link_up is NULL or returns false, any scheme
+ *            (https, http, mqtt, mqtts) or an explicit port.
+ * @param link_up Session whose keepalive vouches for the link (mqtt_is_connected), can be NULL.
+ * @param on_change Called on each change of the state, can be NULL.
+ */
+void connectivity_monitor_start(const char *url, connectivity_link_cb_t link_up, connectivity_change_cb_t on_change){
+    if (s_monitor_task != NULL) {
+        return;
     }
+    if (!connectivity_parse_url(url)) {
+        ESP_LOGE(TAG, "No host to probe in %s", url);
+        return;
+    }
+    s_link_up = link_up;
+    s_on_change = on_change;
+    xTaskCreate(&connectivity_monitor_task, "connectivity", 3072, NULL, 5, &s_monitor_task);
+}
+
+void connectivity_stats_get(connectivity_stats_t *stats){
+    *stats = s_connectivity_stats;
 }
 
+// Probe of the host of urrl alone, see connectivity_monitor_start
 void https_ping(const char* urrl){
-    xTaskCreate(&https_pingg, "https_pingg", 4096, urrl, 5, NULL);
+    connectivity_monitor_start(urrl, NULL, NULL);
 }
 
 int check_internet(void)
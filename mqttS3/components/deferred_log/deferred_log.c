@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "deferred_log.h"
+#include "udp_logging.h"
+
+typedef struct {
+    char *line;
+    size_t size;                // Room for the record, the final '\n' not included
+    size_t len;
+} deferred_log_writer_t;
+
+static bool is_escaped(uint8_t byte){
+    return byte == '\n' || byte == '\r' || byte == DEFERRED_LOG_ESCAPE;
+}
+
+// All of data or nothing
+static bool put_bytes(deferred_log_writer_t *w, const void *data, size_t len){
+    const uint8_t *bytes = data;
+    size_t escaped = len;
+
+    for (size_t i = 0; i < len; i++) {
+        escaped += is_escaped(bytes[i]);
+    }
+    if (w->len + escaped > w->size) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (is_escaped(bytes[i])) {
+            w->line[w->len++] = DEFERRED_LOG_ESCAPE;
+            w->line[w->len++] = bytes[i] ^ DEFERRED_LOG_ESCAPE_XOR;
+        } else {
+            w->line[w->len++] = bytes[i];
+        }
+    }
+    return true;
+}
+
+static bool put_varint(deferred_log_writer_t *w, uint64_t value){
+    uint8_t buf[10];
+    size_t len = 0;
+
+    do {
+        buf[len] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            buf[len] |= 0x80;
+        }
+        len++;
+    } while (value != 0);
+    return put_bytes(w, buf, len);
+}
+
+static bool put_signed(deferred_log_writer_t *w, int64_t value){
+    return put_varint(w, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static bool put_u32(deferred_log_writer_t *w, uint32_t value){
+    uint8_t buf[4] = { value, value >> 8, value >> 16, value >> 24 };
+    return put_bytes(w, buf, sizeof(buf));
+}
+
+static bool put_double(deferred_log_writer_t *w, double value){
+    uint64_t bits;
+    uint8_t buf[8];
+
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) {
+        buf[i] = bits >> (8 * i);
+    }
+    return put_bytes(w, buf, sizeof(buf));
+}
+
+static bool put_string(deferred_log_writer_t *w, const char *s){
+    size_t mark = w->len;
+    size_t len;
+
+    if (s == NULL) {
+        s = "(null)";
+    }
+    len = strnlen(s, DEFERRED_LOG_MAX_STRING);
+    if (!put_varint(w, len) || !put_bytes(w, s, len)) {
+        w->len = mark;
+        return false;
+    }
+    return true;
+}
+
+/* The arguments in the order of the conversions of format, read with the type the
+ * conversion gives them (as vprintf does), nothing is formatted. */
+static bool put_args(deferred_log_writer_t *w, const char *format, va_list args){
+    for (const char *p = format; *p != '\0'; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        p++;
+        if (*p == '%') {
+            continue;
+        }
+        while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+            p++;
+        }
+        // Width and precision given as arguments are ints
+        for (int field = 0; field < 2; field++) {
+            if (field == 1) {
+                if (*p != '.') {
+                    break;
+                }
+                p++;
+            }
+            if (*p == '*') {
+                if (!put_signed(w, va_arg(args, int))) {
+                    return false;
+                }
+                p++;
+            }
+            while (*p >= '0' && *p <= '9') {
+                p++;
+            }
+        }
+
+        int longs = 0;
+        char size = 0;
+        while (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't' || *p == 'L') {
+            longs += (*p == 'l');
+            size = *p++;
+        }
+
+        bool ok = true;
+        switch (*p) {
+            case 'd':
+            case 'i':
+                if (longs >= 2 || size == 'j') {
+                    ok = put_signed(w, va_arg(args, long long));
+                } else if (longs == 1) {
+                    ok = put_signed(w, va_arg(args, long));
+                } else if (size == 'z' || size == 't') {
+                    ok = put_signed(w, va_arg(args, ptrdiff_t));
+                } else {
+                    ok = put_signed(w, va_arg(args, int));
+                }
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'c':
+                if (longs >= 2 || size == 'j') {
+                    ok = put_varint(w, va_arg(args, unsigned long long));
+                } else if (longs == 1) {
+                    ok = put_varint(w, va_arg(args, unsigned long));
+                } else if (size == 'z' || size == 't') {
+                    ok = put_varint(w, va_arg(args, size_t));
+                } else {
+                    ok = put_varint(w, va_arg(args, unsigned int));
+                }
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                ok = put_double(w, (size == 'L') ? (double)va_arg(args, long double) : va_arg(args, double));
+                break;
+            case 's':
+                ok = put_string(w, va_arg(args, const char *));
+                break;
+            case 'p':
+                ok = put_varint(w, (uintptr_t)va_arg(args, void *));
+                break;
+            case 'n':
+                (void)va_arg(args, void *);
+                break;
+            case '\0':
+                return true;
+            default:
+                break;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Record of one DLOGx call into line, escaped and ended by '\n'.
+ * @return Length of the record, arguments that do not fit in size are left out and flagged.
+ */
+size_t deferred_log_encode(char *line, size_t size, esp_log_level_t level, uint32_t time_ms,
+                           const char *tag, const char *format, va_list args){
+    deferred_log_writer_t w = {
+        .line = line,
+        .size = size - 1,
+    };
+
+    line[w.len++] = DEFERRED_LOG_MARKER;
+    line[w.len++] = (char)level;
+    if (!put_varint(&w, time_ms) || !put_u32(&w, (uint32_t)(uintptr_t)tag) ||
+        !put_u32(&w, (uint32_t)(uintptr_t)format) || !put_args(&w, format, args)) {
+        line[1] |= DEFERRED_LOG_TRUNCATED;
+    }
+    line[w.len++] = '\n';
+    return w.len;
+}
+
+/**
+ * @brief Log output of DLOGx with DEFERRED_LOG_ENABLE, to the console and udp_logging.
+ *        The level of tag (esp_log_level_set) applies as it does to ESP_LOGx.
+ */
+void deferred_log_write(esp_log_level_t level, const char *tag, const char *format, ...){
+    char line[DEFERRED_LOG_MAX_LEN];
+    va_list args;
+
+    if (level > esp_log_level_get(tag)) {
+        return;
+    }
+    va_start(args, format);
+    size_t len = deferred_log_encode(line, sizeof(line), level, esp_log_timestamp(), tag, format, args);
+    va_end(args);
+
+    fwrite(line, 1, len, stdout);
+    udp_logging_write(line, len);
+}
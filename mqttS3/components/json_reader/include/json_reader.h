@@ -0,0 +1,53 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Tokens over JSON text in place, no heap and no copy of the input:
+ *
+ *   json_token_t tokens[16];
+ *   int count = json_reader_parse(data, len, tokens, 16);     // < 0: invalid or too many tokens
+ *   int params = json_reader_find(data, tokens, 0, "params");  // -1 when missing
+ *   int mac = json_reader_find(data, tokens, params, "mac");
+ *   if (json_reader_equals(data, &tokens[mac], "f4:12:fa:42:a3:dc")) ...
+ *
+ * The input need not be 0 terminated (MQTT event data is not). Tokens are in
+ * document order, a member of an object is a string token (key) followed by
+ * its value. Strings keep their escapes, json_reader_string() resolves them.
+ */
+
+#define JSON_READER_MAX_DEPTH           (16)
+#define JSON_READER_MAX_LEN             (UINT16_MAX)
+
+#define JSON_READER_INVALID             (-1)
+#define JSON_READER_NO_TOKENS           (-2)    // tokens[] too small
+
+typedef enum {
+    JSON_TOKEN_OBJECT,
+    JSON_TOKEN_ARRAY,
+    JSON_TOKEN_STRING,
+    JSON_TOKEN_NUMBER,
+    JSON_TOKEN_TRUE,
+    JSON_TOKEN_FALSE,
+    JSON_TOKEN_NULL,
+} json_token_type_t;
+
+typedef struct {
+    uint8_t type;                               // json_token_type_t
+    uint16_t start;                             // Offset in the text, strings: after the opening quote
+    uint16_t len;                               // Length in the text, strings: without the quotes
+    uint16_t next;                              // Index of the token after this one and its children
+} json_token_t;
+
+int json_reader_parse(const char *json, size_t len, json_token_t *tokens, int max_tokens);
+int json_reader_find(const char *json, const json_token_t *tokens, int object, const char *key);
+
+bool json_reader_equals(const char *json, const json_token_t *token, const char *value);
+bool json_reader_int(const char *json, const json_token_t *token, int32_t *value);
+bool json_reader_bool(const json_token_t *token, bool *value);
+size_t json_reader_string(const char *json, const json_token_t *token, char *buf, size_t size);
+
+#endif // JSON_READER_H
@@ -0,0 +1,361 @@
+#include <string.h>
+#include "json_reader.h"
+
+typedef struct {
+    const char *json;
+    size_t len;
+    size_t pos;
+    json_token_t *tokens;
+    int max_tokens;
+    int count;
+    int error;
+} json_parser_t;
+
+static bool parse_value(json_parser_t *p, int depth);
+
+static void skip_space(json_parser_t *p){
+    while (p->pos < p->len) {
+        char c = p->json[p->pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            break;
+        }
+        p->pos++;
+    }
+}
+
+static bool is_digit(char c){
+    return c >= '0' && c <= '9';
+}
+
+static int hex_value(char c){
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int add_token(json_parser_t *p, json_token_type_t type, size_t start){
+    if (p->count >= p->max_tokens) {
+        p->error = JSON_READER_NO_TOKENS;
+        return -1;
+    }
+    json_token_t *token = &p->tokens[p->count];
+    token->type = type;
+    token->start = start;
+    token->len = 0;
+    token->next = p->count + 1;
+    return p->count++;
+}
+
+// p->pos is on the opening quote
+static bool parse_string(json_parser_t *p){
+    size_t start = ++p->pos;
+
+    while (p->pos < p->len) {
+        unsigned char c = (unsigned char)p->json[p->pos];
+        if (c == '"') {
+            int index = add_token(p, JSON_TOKEN_STRING, start);
+            if (index < 0) {
+                return false;
+            }
+            p->tokens[index].len = p->pos - start;
+            p->pos++;
+            return true;
+        }
+        if (c < 0x20) {
+            return false;
+        }
+        if (c == '\\') {
+            if (++p->pos >= p->len) {
+                return false;
+            }
+            c = (unsigned char)p->json[p->pos];
+            if (c == 'u') {
+                for (int i = 1; i <= 4; i++) {
+                    if (p->pos + i >= p->len || hex_value(p->json[p->pos + i]) < 0) {
+                        return false;
+                    }
+                }
+                p->pos += 4;
+            } else if (strchr("\"\\/bfnrt", c) == NULL) {
+                return false;
+            }
+        }
+        p->pos++;
+    }
+    return false;
+}
+
+static bool parse_number(json_parser_t *p){
+    size_t start = p->pos;
+    size_t digits;
+
+    if (p->json[p->pos] == '-') {
+        p->pos++;
+    }
+    for (digits = 0; p->pos < p->len && is_digit(p->json[p->pos]); digits++) {
+        p->pos++;
+    }
+    if (digits == 0) {
+        return false;
+    }
+    if (p->pos < p->len && p->json[p->pos] == '.') {
+        p->pos++;
+        for (digits = 0; p->pos < p->len && is_digit(p->json[p->pos]); digits++) {
+            p->pos++;
+        }
+        if (digits == 0) {
+            return false;
+        }
+    }
+    if (p->pos < p->len && (p->json[p->pos] == 'e' || p->json[p->pos] == 'E')) {
+        p->pos++;
+        if (p->pos < p->len && (p->json[p->pos] == '+' || p->json[p->pos] == '-')) {
+            p->pos++;
+        }
+        for (digits = 0; p->pos < p->len && is_digit(p->json[p->pos]); digits++) {
+            p->pos++;
+        }
+        if (digits == 0) {
+            return false;
+        }
+    }
+
+    int index = add_token(p, JSON_TOKEN_NUMBER, start);
+    if (index < 0) {
+        return false;
+    }
+    p->tokens[index].len = p->pos - start;
+    return true;
+}
+
+static bool parse_literal(json_parser_t *p, const char *literal, json_token_type_t type){
+    size_t len = strlen(literal);
+
+    if (p->len - p->pos < len || memcmp(p->json + p->pos, literal, len) != 0) {
+        return false;
+    }
+    int index = add_token(p, type, p->pos);
+    if (index < 0) {
+        return false;
+    }
+    p->tokens[index].len = len;
+    p->pos += len;
+    return true;
+}
+
+// Object or array, p->pos is on the opening bracket
+static bool parse_container(json_parser_t *p, int depth, bool object){
+    char close = object ? '}' : ']';
+    int index = add_token(p, object ? JSON_TOKEN_OBJECT : JSON_TOKEN_ARRAY, p->pos);
+
+    if (index < 0 || depth >= JSON_READER_MAX_DEPTH) {
+        return false;
+    }
+    p->pos++;
+    skip_space(p);
+    if (p->pos < p->len && p->json[p->pos] == close) {
+        p->pos++;
+    } else {
+        while (1) {
+            if (object) {
+                skip_space(p);
+                if (p->pos >= p->len || p->json[p->pos] != '"' || !parse_string(p)) {
+                    return false;
+                }
+                skip_space(p);
+                if (p->pos >= p->len || p->json[p->pos] != ':') {
+                    return false;
+                }
+                p->pos++;
+            }
+            if (!parse_value(p, depth + 1)) {
+                return false;
+            }
+            skip_space(p);
+            if (p->pos >= p->len) {
+                return false;
+            }
+            if (p->json[p->pos] == close) {
+                p->pos++;
+                break;
+            }
+            if (p->json[p->pos] != ',') {
+                return false;
+            }
+            p->pos++;
+        }
+    }
+
+    p->tokens[index].len = p->pos - p->tokens[index].start;
+    p->tokens[index].next = p->count;
+    return true;
+}
+
+static bool parse_value(json_parser_t *p, int depth){
+    skip_space(p);
+    if (p->pos >= p->len) {
+        return false;
+    }
+    switch (p->json[p->pos]) {
+        case '{':
+            return parse_container(p, depth, true);
+        case '[':
+            return parse_container(p, depth, false);
+        case '"':
+            return parse_string(p);
+        case 't':
+            return parse_literal(p, "true", JSON_TOKEN_TRUE);
+        case 'f':
+            return parse_literal(p, "false", JSON_TOKEN_FALSE);
+        case 'n':
+            return parse_literal(p, "null", JSON_TOKEN_NULL);
+        default:
+            return parse_number(p);
+    }
+}
+
+/**
+ * @brief Tokenize one JSON value, len bytes of json (no terminating 0 needed).
+ * @return Number of tokens, JSON_READER_INVALID on a syntax error or trailing text,
+ *         JSON_READER_NO_TOKENS when tokens[] is too small.
+ */
+int json_reader_parse(const char *json, size_t len, json_token_t *tokens, int max_tokens){
+    json_parser_t p = {
+        .json = json,
+        .len = len,
+        .tokens = tokens,
+        .max_tokens = max_tokens,
+        .error = JSON_READER_INVALID,
+    };
+
+    if (len > JSON_READER_MAX_LEN) {
+        return JSON_READER_INVALID;
+    }
+    if (!parse_value(&p, 0)) {
+        return p.error;
+    }
+    skip_space(&p);
+    if (p.pos != len) {
+        return JSON_READER_INVALID;
+    }
+    return p.count;
+}
+
+/**
+ * @brief Value of member key in the object at tokens[object].
+ * @return Token index of the value, -1 when object is not an object (or < 0) or has no such key.
+ */
+int json_reader_find(const char *json, const json_token_t *tokens, int object, const char *key){
+    if (object < 0 || tokens[object].type != JSON_TOKEN_OBJECT) {
+        return -1;
+    }
+    int i = object + 1;
+    while (i < tokens[object].next) {
+        int value = i + 1;
+        if (json_reader_equals(json, &tokens[i], key)) {
+            return value;
+        }
+        i = tokens[value].next;
+    }
+    return -1;
+}
+
+/**
+ * @brief true when the string token is value, compared as written (escapes are not resolved).
+ */
+bool json_reader_equals(const char *json, const json_token_t *token, const char *value){
+    size_t len = strlen(value);
+    return token->type == JSON_TOKEN_STRING && token->len == len && memcmp(json + token->start, value, len) == 0;
+}
+
+/**
+ * @brief Integer value of a number token without fraction or exponent.
+ * @return false when the token is not such a number or out of the int32_t range.
+ */
+bool json_reader_int(const char *json, const json_token_t *token, int32_t *value){
+    const char *s = json + token->start;
+    size_t i = 0;
+    bool negative = false;
+    int64_t result = 0;
+
+    if (token->type != JSON_TOKEN_NUMBER) {
+        return false;
+    }
+    if (s[0] == '-') {
+        negative = true;
+        i++;
+    }
+    for (; i < token->len; i++) {
+        if (!is_digit(s[i])) {
+            return false;
+        }
+        result = result * 10 + (s[i] - '0');
+        if (result > (int64_t)INT32_MAX + 1) {
+            return false;
+        }
+    }
+    if (negative) {
+        result = -result;
+    }
+    if (result > INT32_MAX) {
+        return false;
+    }
+    *value = (int32_t)result;
+    return true;
+}
+
+bool json_reader_bool(const json_token_t *token, bool *value){
+    if (token->type != JSON_TOKEN_TRUE && token->type != JSON_TOKEN_FALSE) {
+        return false;
+    }
+    *value = (token->type == JSON_TOKEN_TRUE);
+    return true;
+}
+
+/**
+ * @brief Copy a string token with its escapes resolved, \u above 0x7F becomes '?'.
+ * @return Length copied, the output is cut to size - 1 and always 0 terminated.
+ */
+size_t json_reader_string(const char *json, const json_token_t *token, char *buf, size_t size){
+    const char *s = json + token->start;
+    size_t out = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (token->type != JSON_TOKEN_STRING) {
+        buf[0] = '\0';
+        return 0;
+    }
+    for (size_t i = 0; i < token->len && out + 1 < size; i++) {
+        char c = s[i];
+        if (c == '\\') {
+            c = s[++i];
+            switch (c) {
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'u': {
+                    int code = (hex_value(s[i + 1]) << 12) | (hex_value(s[i + 2]) << 8) |
+                               (hex_value(s[i + 3]) << 4) | hex_value(s[i + 4]);
+                    c = (code < 0x80) ? (char)code : '?';
+                    i += 4;
+                    break;
+                }
+                default: break;             // '"', '\\' and '/' stand for themselves
+            }
+        }
+        buf[out++] = c;
+    }
+    buf[out] = '\0';
+    return out;
+}
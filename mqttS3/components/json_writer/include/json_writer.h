@@ -0,0 +1,50 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Compact JSON written straight into a caller buffer, no heap and no tree:
+ *
+ *   json_writer_t w;
+ *   json_writer_init(&w, buf, sizeof(buf));
+ *   json_writer_begin_object(&w);
+ *   json_writer_key(&w, "ph");
+ *   json_writer_float(&w, 7.21f, 2);
+ *   json_writer_end_object(&w);
+ *   size_t len = json_writer_finish(&w);      // 0 when buf was too small
+ *
+ * Separators are inserted from the nesting state, keys are written as given (not escaped).
+ */
+
+#define JSON_WRITER_MAX_DEPTH           (16)
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;                                 // Characters written, without the terminating 0
+    bool overflow;                              // buf too small, the output is invalid
+    uint8_t depth;
+    uint16_t has_items;                         // Bit i: container at depth i already holds an item
+    bool after_key;                             // Next value belongs to the key just written
+} json_writer_t;
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size);
+size_t json_writer_finish(json_writer_t *w);
+
+void json_writer_begin_object(json_writer_t *w);
+void json_writer_end_object(json_writer_t *w);
+void json_writer_begin_array(json_writer_t *w);
+void json_writer_end_array(json_writer_t *w);
+void json_writer_key(json_writer_t *w, const char *key);
+
+void json_writer_int(json_writer_t *w, int64_t value);
+void json_writer_uint(json_writer_t *w, uint64_t value);
+void json_writer_float(json_writer_t *w, float value, int decimals);
+void json_writer_bool(json_writer_t *w, bool value);
+void json_writer_string(json_writer_t *w, const char *value);
+void json_writer_raw(json_writer_t *w, const char *json, size_t len);
+
+#endif // JSON_WRITER_H
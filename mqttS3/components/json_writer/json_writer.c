@@ -0,0 +1,206 @@
+#include <string.h>
+#include <math.h>
+#include "json_writer.h"
+
+static const uint32_t s_pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+static void put(json_writer_t *w, const char *s, size_t len){
+    if (w->overflow || w->len + len >= w->size) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+static void put_char(json_writer_t *w, char c){
+    put(w, &c, 1);
+}
+
+// Comma before every item of a container but the first, nothing after a key
+static void separator(json_writer_t *w){
+    if (w->after_key) {
+        w->after_key = false;
+        return;
+    }
+    if (w->depth == 0) {
+        return;
+    }
+    uint16_t bit = 1u << (w->depth - 1);
+    if (w->has_items & bit) {
+        put_char(w, ',');
+    }
+    w->has_items |= bit;
+}
+
+static void put_u64(json_writer_t *w, uint64_t value){
+    char digits[20];
+    int n = 0;
+    do {
+        digits[sizeof(digits) - 1 - n++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    put(w, &digits[sizeof(digits) - n], n);
+}
+
+static void begin(json_writer_t *w, char c){
+    separator(w);
+    put_char(w, c);
+    if (w->depth >= JSON_WRITER_MAX_DEPTH) {
+        w->overflow = true;
+        return;
+    }
+    w->depth++;
+    w->has_items &= ~(1u << (w->depth - 1));
+}
+
+static void end(json_writer_t *w, char c){
+    if (w->depth > 0) {
+        w->depth--;
+    }
+    put_char(w, c);
+}
+
+/**
+ * @brief Start writing into buf, the output is always 0 terminated.
+ */
+void json_writer_init(json_writer_t *w, char *buf, size_t size){
+    memset(w, 0, sizeof(json_writer_t));
+    w->buf = buf;
+    w->size = size;
+    if (size > 0) {
+        buf[0] = '\0';
+    } else {
+        w->overflow = true;
+    }
+}
+
+/**
+ * @brief Terminate the output.
+ * @return Length of the JSON text, 0 when it did not fit or a container is still open.
+ */
+size_t json_writer_finish(json_writer_t *w){
+    if (w->overflow || w->depth != 0) {
+        if (w->size > 0) {
+            w->buf[0] = '\0';
+        }
+        return 0;
+    }
+    w->buf[w->len] = '\0';
+    return w->len;
+}
+
+void json_writer_begin_object(json_writer_t *w){
+    begin(w, '{');
+}
+
+void json_writer_end_object(json_writer_t *w){
+    end(w, '}');
+}
+
+void json_writer_begin_array(json_writer_t *w){
+    begin(w, '[');
+}
+
+void json_writer_end_array(json_writer_t *w){
+    end(w, ']');
+}
+
+void json_writer_key(json_writer_t *w, const char *key){
+    separator(w);
+    put_char(w, '"');
+    put(w, key, strlen(key));
+    put(w, "\":", 2);
+    w->after_key = true;
+}
+
+void json_writer_int(json_writer_t *w, int64_t value){
+    separator(w);
+    if (value < 0) {
+        put_char(w, '-');
+        put_u64(w, (uint64_t)0 - (uint64_t)value);
+    } else {
+        put_u64(w, (uint64_t)value);
+    }
+}
+
+void json_writer_uint(json_writer_t *w, uint64_t value){
+    separator(w);
+    put_u64(w, value);
+}
+
+/**
+ * @brief Write value rounded to decimals (0..6) digits after the point, without printf.
+ *
+ * NaN and infinity are not valid JSON numbers, they are written as null.
+ */
+void json_writer_float(json_writer_t *w, float value, int decimals){
+    separator(w);
+    if (!isfinite(value) || fabsf(value) >= 1e12f) {
+        put(w, "null", 4);
+        return;
+    }
+    if (decimals < 0) {
+        decimals = 0;
+    } else if (decimals > 6) {
+        decimals = 6;
+    }
+
+    uint32_t scale = s_pow10[decimals];
+    double scaled = fabs((double)value) * scale + 0.5;
+    uint64_t fixed = (uint64_t)scaled;
+    if (value < 0 && fixed > 0) {
+        put_char(w, '-');
+    }
+    put_u64(w, fixed / scale);
+    if (decimals > 0) {
+        char frac[6];
+        uint32_t rest = fixed % scale;
+        for (int i = decimals - 1; i >= 0; i--) {
+            frac[i] = '0' + (rest % 10);
+            rest /= 10;
+        }
+        put_char(w, '.');
+        put(w, frac, decimals);
+    }
+}
+
+void json_writer_bool(json_writer_t *w, bool value){
+    separator(w);
+    if (value) {
+        put(w, "true", 4);
+    } else {
+        put(w, "false", 5);
+    }
+}
+
+/**
+ * @brief Write a string value, quote, backslash and control characters are escaped.
+ */
+void json_writer_string(json_writer_t *w, const char *value){
+    static const char hex[] = "0123456789abcdef";
+
+    separator(w);
+    put_char(w, '"');
+    for (const char *p = value; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            put(w, escaped, 2);
+        } else if (c < 0x20) {
+            char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F] };
+            put(w, escaped, 6);
+        } else {
+            put_char(w, (char)c);
+        }
+    }
+    put_char(w, '"');
+}
+
+/**
+ * @brief Write a value that is already JSON text.
+ */
+void json_writer_raw(json_writer_t *w, const char *json, size_t len){
+    separator(w);
+    put(w, json, len);
+}
@@ -0,0 +1,53 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Store-and-forward log on the "outbox" SPIFFS partition, for payloads that
+ * cannot be published while WiFi or the broker is down.
+ *
+ * Records are appended to segment files /outbox/<number>, a new segment is
+ * started when the current one is full and at boot (a record torn by a reset
+ * stays at the end of the old tail). When more than OUTBOX_MAX_SEGMENTS exist
+ * the oldest one is deleted, unread or not.
+ *
+ *   [magic 2][len 2][crc32 4][payload len] [magic 2][len 2]...
+ *
+ * The read cursor (segment, offset) is kept in NVS, whose commit is atomic:
+ * after a reset reading resumes at the last committed record. Records read
+ * but not committed are read again.
+ *
+ * Not thread safe, all calls come from the task that publishes telemetry.
+ */
+
+#define OUTBOX_BASE_PATH            "/outbox"
+#define OUTBOX_PARTITION_LABEL      "outbox"
+#define OUTBOX_SEGMENT_SIZE         (32 * 1024)
+#define OUTBOX_MAX_SEGMENTS         (16)            // 512 KB of records at most
+#define OUTBOX_MAX_RECORD           (1024)
+
+typedef struct {
+    uint32_t segment;
+    uint32_t offset;
+} outbox_cursor_t;
+
+typedef struct {
+    uint32_t appended;          // Records written
+    uint32_t append_errors;     // Records lost on a write error
+    uint32_t evicted;           // Segments deleted while still unread
+    uint32_t corrupt;           // Segments cut short by a bad record
+    uint32_t segments;          // Segments on flash, the tail included
+} outbox_stats_t;
+
+bool outbox_init(void);
+bool outbox_append(const void *data, size_t len);
+int outbox_read(outbox_cursor_t *cursor, void *buf, size_t size);
+void outbox_cursor_get(outbox_cursor_t *cursor);
+void outbox_commit(const outbox_cursor_t *cursor);
+bool outbox_empty(void);
+void outbox_stats_get(outbox_stats_t *stats);
+
+#endif // OUTBOX_H
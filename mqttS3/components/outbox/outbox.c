@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_spiffs.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "outbox.h"
+
+#define OUTBOX_RECORD_MAGIC         (0x0B0C)
+#define OUTBOX_NVS_NAMESPACE        "outbox"
+#define OUTBOX_NVS_CURSOR           "cursor"
+#define OUTBOX_PATH_SIZE            (32)
+
+typedef struct {
+    uint16_t magic;
+    uint16_t len;
+    uint32_t crc;               // esp_rom_crc32_le of the payload
+} outbox_record_header_t;
+
+static const char *TAG = "OUTBOX";
+
+static bool s_mounted = false;
+static outbox_cursor_t s_cursor;            // Committed read position, also in NVS
+static uint32_t s_first_segment;            // Oldest segment that may still hold records
+static uint32_t s_last_segment;             // Segment records are appended to
+static uint32_t s_tail_size;                // Bytes written to s_last_segment
+static outbox_stats_t s_stats;
+
+static void segment_path(uint32_t segment, char *path, size_t size){
+    snprintf(path, size, OUTBOX_BASE_PATH "/%08lx", (unsigned long)segment);
+}
+
+static void cursor_load(void){
+    nvs_handle_t handle;
+    size_t len = sizeof(s_cursor);
+
+    memset(&s_cursor, 0, sizeof(s_cursor));
+    if (nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(handle, OUTBOX_NVS_CURSOR, &s_cursor, &len) != ESP_OK || len != sizeof(s_cursor)) {
+        memset(&s_cursor, 0, sizeof(s_cursor));
+    }
+    nvs_close(handle);
+}
+
+// The blob is replaced by one NVS commit, a reset leaves either the old or the new cursor
+static void cursor_save(void){
+    nvs_handle_t handle;
+
+    if (nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGE(TAG, "NVS open failed, cursor not saved");
+        return;
+    }
+    if (nvs_set_blob(handle, OUTBOX_NVS_CURSOR, &s_cursor, sizeof(s_cursor)) != ESP_OK || nvs_commit(handle) != ESP_OK) {
+        ESP_LOGE(TAG, "NVS write failed, cursor not saved");
+    }
+    nvs_close(handle);
+}
+
+// Delete the oldest segment to make room, unread records in it are lost
+static void evict_oldest(void){
+    char path[OUTBOX_PATH_SIZE];
+
+    segment_path(s_first_segment, path, sizeof(path));
+    remove(path);
+    if (s_cursor.segment <= s_first_segment) {
+        ESP_LOGW(TAG, "Outbox full, segment %lu dropped", (unsigned long)s_first_segment);
+        s_stats.evicted++;
+        s_cursor.segment = s_first_segment + 1;
+        s_cursor.offset = 0;
+        cursor_save();
+    }
+    s_first_segment++;
+}
+
+// Continue in a new segment, the old tail is left as it is
+static void next_segment(void){
+    s_last_segment++;
+    s_tail_size = 0;
+    while (s_last_segment - s_first_segment + 1 > OUTBOX_MAX_SEGMENTS) {
+        evict_oldest();
+    }
+}
+
+/**
+ * @brief Mounts the outbox partition and resumes at the committed cursor, NVS must be initialized.
+ * @return false when the partition cannot be mounted, the outbox then stays empty.
+ */
+bool outbox_init(void){
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = OUTBOX_BASE_PATH,
+        .partition_label = OUTBOX_PARTITION_LABEL,
+        .max_files = 2,
+        .format_if_mount_failed = true,
+    };
+    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Mount failed (%s)", esp_err_to_name(ret));
+        return false;
+    }
+
+    uint32_t min_segment = UINT32_MAX;
+    uint32_t max_segment = 0;
+    bool found = false;
+    DIR *dir = opendir(OUTBOX_BASE_PATH);
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char *end;
+            uint32_t segment = strtoul(entry->d_name, &end, 16);
+            if (end == entry->d_name || *end != '\0') {
+                continue;
+            }
+            found = true;
+            if (segment < min_segment) {
+                min_segment = segment;
+            }
+            if (segment > max_segment) {
+                max_segment = segment;
+            }
+        }
+        closedir(dir);
+    }
+
+    cursor_load();
+    if (found) {
+        // The old tail may end with a torn record, never append behind it
+        s_first_segment = min_segment;
+        s_last_segment = max_segment + 1;
+    } else {
+        s_first_segment = s_cursor.segment;
+        s_last_segment = s_cursor.segment;
+    }
+    s_tail_size = 0;
+    if (s_cursor.segment < s_first_segment || s_cursor.segment > s_last_segment) {
+        s_cursor.segment = s_first_segment;
+        s_cursor.offset = 0;
+    }
+    while (s_last_segment - s_first_segment + 1 > OUTBOX_MAX_SEGMENTS) {
+        evict_oldest();
+    }
+    s_mounted = true;
+
+    size_t total = 0, used = 0;
+    esp_spiffs_info(OUTBOX_PARTITION_LABEL, &total, &used);
+    ESP_LOGI(TAG, "Segments %lu..%lu, cursor %lu:%lu, %d of %d B used",
+            (unsigned long)s_first_segment, (unsigned long)s_last_segment,
+            (unsigned long)s_cursor.segment, (unsigned long)s_cursor.offset, (int)used, (int)total);
+    return true;
+}
+
+/**
+ * @brief Appends one record and flushes it to flash.
+ * @return false when the outbox is not mounted, the record too long or the write failed.
+ */
+bool outbox_append(const void *data, size_t len){
+    char path[OUTBOX_PATH_SIZE];
+    outbox_record_header_t header;
+
+    if (!s_mounted || len == 0 || len > OUTBOX_MAX_RECORD) {
+        s_stats.append_errors++;
+        return false;
+    }
+    if (s_tail_size > 0 && s_tail_size + sizeof(header) + len > OUTBOX_SEGMENT_SIZE) {
+        next_segment();
+    }
+
+    header.magic = OUTBOX_RECORD_MAGIC;
+    header.len = len;
+    header.crc = esp_rom_crc32_le(0, data, len);
+
+    segment_path(s_last_segment, path, sizeof(path));
+    FILE *f = fopen(path, "ab");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Open %s failed", path);
+        s_stats.append_errors++;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data, len, 1, f) == 1 &&
+              fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+
+    if (!ok) {
+        // Part of the record may be on flash, the reader stops at it
+        ESP_LOGE(TAG, "Write to %s failed", path);
+        s_stats.append_errors++;
+        next_segment();
+        return false;
+    }
+    s_tail_size += sizeof(header) + len;
+    s_stats.appended++;
+    return true;
+}
+
+/**
+ * @brief Reads the record at cursor and moves cursor past it.
+ *
+ * Segments that were deleted, ended or hold a bad record are skipped.
+ *
+ * @param[in,out] cursor Read position, start from outbox_cursor_get().
+ * @param[out] buf Payload of the record, size should be OUTBOX_MAX_RECORD.
+ * @return Payload length, 0 when there is no record left.
+ */
+int outbox_read(outbox_cursor_t *cursor, void *buf, size_t size){
+    char path[OUTBOX_PATH_SIZE];
+    outbox_record_header_t header;
+
+    if (!s_mounted) {
+        return 0;
+    }
+    while (1) {
+        if (cursor->segment < s_first_segment) {
+            cursor->segment = s_first_segment;
+            cursor->offset = 0;
+        }
+        if (cursor->segment > s_last_segment ||
+            (cursor->segment == s_last_segment && cursor->offset >= s_tail_size)) {
+            return 0;
+        }
+
+        segment_path(cursor->segment, path, sizeof(path));
+        FILE *f = fopen(path, "rb");
+        size_t got = 0;
+        bool valid = false;
+        if (f != NULL) {
+            if (fseek(f, cursor->offset, SEEK_SET) == 0) {
+                got = fread(&header, 1, sizeof(header), f);
+            }
+            if (got == sizeof(header) && header.magic == OUTBOX_RECORD_MAGIC &&
+                header.len > 0 && header.len <= OUTBOX_MAX_RECORD && header.len <= size &&
+                fread(buf, header.len, 1, f) == 1) {
+                valid = (esp_rom_crc32_le(0, buf, header.len) == header.crc);
+            }
+            fclose(f);
+        }
+
+        if (valid) {
+            cursor->offset += sizeof(header) + header.len;
+            return header.len;
+        }
+        if (got != 0) {
+            ESP_LOGW(TAG, "Bad record at %lu:%lu, skip the segment", (unsigned long)cursor->segment, (unsigned long)cursor->offset);
+            s_stats.corrupt++;
+            if (cursor->segment == s_last_segment) {
+                next_segment();
+            }
+        } else if (cursor->segment == s_last_segment) {
+            // Nothing more written yet
+            return 0;
+        }
+        cursor->segment++;
+        cursor->offset = 0;
+    }
+}
+
+void outbox_cursor_get(outbox_cursor_t *cursor){
+    *cursor = s_cursor;
+}
+
+/**
+ * @brief Marks the records before cursor as delivered, deletes the segments left behind.
+ */
+void outbox_commit(const outbox_cursor_t *cursor){
+    char path[OUTBOX_PATH_SIZE];
+
+    if (!s_mounted || (cursor->segment == s_cursor.segment && cursor->offset == s_cursor.offset)) {
+        return;
+    }
+    s_cursor = *cursor;
+    if (s_cursor.segment < s_first_segment) {
+        s_cursor.segment = s_first_segment;
+        s_cursor.offset = 0;
+    }
+    cursor_save();
+
+    while (s_first_segment < s_cursor.segment) {
+        segment_path(s_first_segment, path, sizeof(path));
+        remove(path);
+        s_first_segment++;
+    }
+}
+
+/**
+ * @brief true when every record appended has been committed.
+ */
+bool outbox_empty(void){
+    return !s_mounted || (s_cursor.segment == s_last_segment && s_cursor.offset >= s_tail_size);
+}
+
+void outbox_stats_get(outbox_stats_t *stats){
+    *stats = s_stats;
+    stats->segments = s_mounted ? s_last_segment - s_first_segment + 1 : 0;
+}
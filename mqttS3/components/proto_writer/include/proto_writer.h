@@ -0,0 +1,60 @@
+#ifndef PROTO_WRITER_H
+#define PROTO_WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Protocol Buffers wire format written straight into a caller buffer, no heap and
+ * no generated code, the counterpart of json_writer for binary payloads:
+ *
+ *   proto_writer_t w;
+ *   proto_writer_init(&w, buf, sizeof(buf));
+ *   proto_writer_begin_message(&w, 2);        // TelemetrySample.values
+ *   proto_writer_float(&w, 4, 7.21f);         // TelemetryValues.ph
+ *   proto_writer_end_message(&w);
+ *   size_t len = proto_writer_finish(&w);     // 0 when buf was too small
+ *
+ * Fields are written in call order with the numbers of the .proto schema, the
+ * caller keeps them in sync. A nested message gets one byte of length up front,
+ * the body is moved when it turns out to be 128 bytes or longer.
+ */
+
+#define PROTO_WRITER_MAX_DEPTH          (8)
+
+#define PROTO_WIRE_VARINT               (0)
+#define PROTO_WIRE_FIXED64              (1)
+#define PROTO_WIRE_LEN                  (2)
+#define PROTO_WIRE_FIXED32              (5)
+
+// First byte of a length delimited field, field numbers 1..15
+#define PROTO_TAG_LEN(field)            ((uint8_t)(((field) << 3) | PROTO_WIRE_LEN))
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;                                 // Bytes written
+    bool overflow;                              // buf too small, the output is invalid
+    uint8_t depth;
+    size_t starts[PROTO_WRITER_MAX_DEPTH];      // Length byte of every open message
+} proto_writer_t;
+
+void proto_writer_init(proto_writer_t *w, uint8_t *buf, size_t size);
+size_t proto_writer_finish(proto_writer_t *w);
+
+void proto_writer_begin_message(proto_writer_t *w, uint32_t field);
+void proto_writer_end_message(proto_writer_t *w);
+
+void proto_writer_uint(proto_writer_t *w, uint32_t field, uint64_t value);
+void proto_writer_int(proto_writer_t *w, uint32_t field, int64_t value);
+void proto_writer_sint(proto_writer_t *w, uint32_t field, int64_t value);
+void proto_writer_bool(proto_writer_t *w, uint32_t field, bool value);
+void proto_writer_float(proto_writer_t *w, uint32_t field, float value);
+void proto_writer_double(proto_writer_t *w, uint32_t field, double value);
+void proto_writer_bytes(proto_writer_t *w, uint32_t field, const void *data, size_t len);
+void proto_writer_string(proto_writer_t *w, uint32_t field, const char *value);
+
+size_t proto_varint_size(uint64_t value);
+
+#endif // PROTO_WRITER_H
@@ -0,0 +1,167 @@
+#include <string.h>
+#include "proto_writer.h"
+
+static void put(proto_writer_t *w, const void *data, size_t len){
+    if (w->overflow || w->len + len > w->size) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+// Base 128, low group first, bit 7 set on all bytes but the last
+static size_t varint_encode(uint64_t value, uint8_t *out){
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+static void put_varint(proto_writer_t *w, uint64_t value){
+    uint8_t bytes[10];
+    put(w, bytes, varint_encode(value, bytes));
+}
+
+static void put_tag(proto_writer_t *w, uint32_t field, uint8_t wire_type){
+    put_varint(w, ((uint64_t)field << 3) | wire_type);
+}
+
+// Little endian whatever the host order
+static void put_fixed(proto_writer_t *w, uint64_t value, size_t len){
+    uint8_t bytes[8];
+    for (size_t i = 0; i < len; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+    put(w, bytes, len);
+}
+
+/**
+ * @brief Bytes of value as a varint, 1 to 10.
+ */
+size_t proto_varint_size(uint64_t value){
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Start writing into buf.
+ */
+void proto_writer_init(proto_writer_t *w, uint8_t *buf, size_t size){
+    memset(w, 0, sizeof(proto_writer_t));
+    w->buf = buf;
+    w->size = size;
+}
+
+/**
+ * @brief End of the output.
+ * @return Length of the encoded message, 0 when it did not fit or a message is still open.
+ */
+size_t proto_writer_finish(proto_writer_t *w){
+    if (w->overflow || w->depth != 0) {
+        return 0;
+    }
+    return w->len;
+}
+
+/**
+ * @brief Open a nested message as field, the fields written until proto_writer_end_message are its body.
+ */
+void proto_writer_begin_message(proto_writer_t *w, uint32_t field){
+    put_tag(w, field, PROTO_WIRE_LEN);
+    if (w->depth >= PROTO_WRITER_MAX_DEPTH) {
+        w->overflow = true;
+        return;
+    }
+    w->starts[w->depth++] = w->len;
+    put(w, "", 1);                          // Length, one byte until the body is known
+}
+
+void proto_writer_end_message(proto_writer_t *w){
+    if (w->depth == 0) {
+        w->overflow = true;
+        return;
+    }
+    size_t start = w->starts[--w->depth];
+    if (w->overflow) {
+        return;
+    }
+
+    size_t body = w->len - start - 1;
+    uint8_t bytes[10];
+    size_t n = varint_encode(body, bytes);
+    if (n > 1) {
+        if (w->len + n - 1 > w->size) {
+            w->overflow = true;
+            return;
+        }
+        memmove(w->buf + start + n, w->buf + start + 1, body);
+        w->len += n - 1;
+    }
+    memcpy(w->buf + start, bytes, n);
+}
+
+/**
+ * @brief uint32, uint64 and enum fields.
+ */
+void proto_writer_uint(proto_writer_t *w, uint32_t field, uint64_t value){
+    put_tag(w, field, PROTO_WIRE_VARINT);
+    put_varint(w, value);
+}
+
+/**
+ * @brief int32 and int64 fields, a negative value takes 10 bytes (sint64 takes fewer).
+ */
+void proto_writer_int(proto_writer_t *w, uint32_t field, int64_t value){
+    put_tag(w, field, PROTO_WIRE_VARINT);
+    put_varint(w, (uint64_t)value);
+}
+
+/**
+ * @brief sint32 and sint64 fields, zigzag encoded.
+ */
+void proto_writer_sint(proto_writer_t *w, uint32_t field, int64_t value){
+    put_tag(w, field, PROTO_WIRE_VARINT);
+    put_varint(w, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void proto_writer_bool(proto_writer_t *w, uint32_t field, bool value){
+    put_tag(w, field, PROTO_WIRE_VARINT);
+    put_varint(w, value ? 1 : 0);
+}
+
+void proto_writer_float(proto_writer_t *w, uint32_t field, float value){
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    put_tag(w, field, PROTO_WIRE_FIXED32);
+    put_fixed(w, bits, 4);
+}
+
+void proto_writer_double(proto_writer_t *w, uint32_t field, double value){
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    put_tag(w, field, PROTO_WIRE_FIXED64);
+    put_fixed(w, bits, 8);
+}
+
+/**
+ * @brief bytes fields, also a message encoded beforehand.
+ */
+void proto_writer_bytes(proto_writer_t *w, uint32_t field, const void *data, size_t len){
+    put_tag(w, field, PROTO_WIRE_LEN);
+    put_varint(w, len);
+    put(w, data, len);
+}
+
+void proto_writer_string(proto_writer_t *w, uint32_t field, const char *value){
+    proto_writer_bytes(w, field, value, strlen(value));
+}
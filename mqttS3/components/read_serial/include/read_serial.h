@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include "uart_frame.h"
 
 #define STILL_CONNECTED_MSG         "slave_KEEP_connect"
 #define STILL_CONNECTED_MSG_SIZE    (sizeof(STILL_CONNECTED_MSG))
@@ -14,6 +15,8 @@
 #define WAKE_UP_COMMAND     "WAKE_UP"
 #define MAX_SLAVES                  3
 #define WOKE_UP   "WOKE_UP"
+#define UART_RPC_MAX_PENDING        8       // Requests to C3 outstanding at the same time
+#define UART_CMD_MAX_PAYLOAD        16      // Payload of a command held until C3 is awake
 
 #define RESPONSE_AGREE      "AGREE_connect"
 #define RESPONSE_CONNECTED      "CONNECTED"
@@ -75,18 +78,42 @@ typedef struct {
     sensor_data_t payload;
 } __attribute__((packed)) espnow_data_t;
 
+typedef void (*uart_rpc_cb_t)(int length, const uart_frame_t *frame, void *ctx);
+typedef void (*uart_delta_cb_t)(int index, const table_device_t *record);
+
+typedef struct {
+    uint32_t count;         // Wake ups measured
+    uint32_t failures;      // Wake ups without FRAME_WOKE_UP
+    uint32_t last_us;       // Doorbell to first byte received from C3
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+} uart_wake_stats_t;
+
 // uint8_t mac_massss[6] = {0x34, 0x85, 0x18, 0x25, 0x2d, 0x94};
+// Patched by the rx task under its lock, other tasks read it with uart_table_copy / uart_table_find
 extern table_device_t table_devices[MAX_SLAVES];
 
 void uart_config(void);
 void uart_event_task(void);
 void add_json(void);
 void dump_uart(uint8_t *message, size_t len);
-int get_uart(uint8_t *message, size_t len, int timeout);
+uint16_t send_frame(uint8_t type, const void *payload, size_t len);
+uint16_t uart_rpc_send(uint8_t type, const void *payload, size_t len, uint8_t resp_type, uart_rpc_cb_t cb, void *ctx, int timeout);
+int uart_rpc_call(uint8_t type, const void *payload, size_t len, uint8_t resp_type, void *message, size_t message_len, int timeout);
 int get_data(float *data1, float *data2, float *data3, float *data4);
 void wait_connect_serial();
 int wait_wake_up();
+bool uart_cmd_queue_send(uint8_t type, const void *payload, size_t len, uint8_t resp_type, uart_rpc_cb_t cb, void *ctx, int timeout);
+int uart_cmd_pending(void);
+void uart_wake_stats_get(uart_wake_stats_t *stats);
+void uart_link_stats_get(uart_link_stats_t *stats, bool reset_latency);
 void get_table();
+int uart_subscribe(void);
+bool uart_resync_needed(void);
+bool uart_table_copy(int index, table_device_t *record);
+int uart_table_find(const uint8_t mac[6], table_device_t *record);
+void uart_set_delta_cb(uart_delta_cb_t cb);
 void delay(int x);
 void accept_connect(uint8_t *message);
 void log_table_devices();
@@ -6,11 +6,14 @@ const char *TAG="Read Serial";
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 
 #include "esp_timer.h"
 #include "esp_crc.h"
+#include "esp_random.h"
+#include "uart_cipher.h"
 #include "cJSON.h"
 
 int time_now=0;
@@ -24,10 +27,104 @@ bool connect_check=true;
 #define UART_NUM         UART_NUM_1     // Sử dụng UART1
 #define TX_GPIO_NUM     17    // Chân TX (thay đổi nếu cần)
 #define RX_GPIO_NUM      16    // Chân RX (thay đổi nếu cần)
-#define BAUD_RATE        115200         // Tốc độ baud
+#define RTS_GPIO_NUM     UART_PIN_NO_CHANGE     // RTS pin, UART_PIN_NO_CHANGE when not wired
+#define CTS_GPIO_NUM     UART_PIN_NO_CHANGE     // CTS pin, UART_PIN_NO_CHANGE when not wired
+#define FLOW_CTRL_WIRED  ((RTS_GPIO_NUM >= 0) && (CTS_GPIO_NUM >= 0))
+#define DOORBELL_GPIO_NUM 15            // Wired to GPIO_WAKEUP_NUM of C3, held while S3 talks to C3
+#define DOORBELL_ACTIVE_LEVEL 0         // C3 wakes up from light sleep on a low level
+#define DOORBELL_HOLD_MS (200)          // Release the doorbell after this long without outstanding request
+#define BAUD_RATE        115200         // Tốc độ baud, used until the link is negotiated
+#define MAX_BAUD_RATE    2000000        // Highest rate requested in FRAME_CONNECT_REQUEST
+#define FLOW_CTRL_THRESHOLD (100)       // RX FIFO level that deasserts RTS
+#define LINK_SWITCH_DELAY_MS (10)       // Let C3 switch before FRAME_CONNECTED is sent at the new rate
+#define LINK_CONFIRM_TIMEOUT_MS (200)   // Time to receive the echo of FRAME_CONNECTED
+#define LINK_MAX_FAILURES (3)           // Wake up failures in a row before the link is negotiated again
+#define LINK_ENCRYPT (1)                // Ask C3 to encrypt the frames of the session
+#define LINK_KEY "7832477891326794"     // AES-128 key shared with C3
+#define LINK_BENCHMARK (0)              // 1: measure goodput at every rate after connect
+#define LINK_BENCHMARK_REQUESTS (50)    // GET_FULL_DATA requests per rate
+#define LINK_BENCHMARK_CIPHER_ROUNDS (1000) // Frames encrypted per payload size
 #define BUF_SIZE (5000)
 #define RD_BUF_SIZE (BUF_SIZE)
+#define UART_RX_CHUNK_SIZE (128)         // Bytes read from driver per call, fed to the frame decoder
+#define UART_RX_TIMEOUT_SYMBOLS (3)     // Idle time (in symbols) after which the driver posts UART_DATA
+#define UART_RX_FULL_THRESHOLD (64)     // FIFO level that posts UART_DATA while bytes keep coming
+#define UART_EVENT_QUEUE_SIZE (20)
+#define UART_RPC_TICK_MS (20)           // Max wait of the rx task, bounds the delay of a request timeout
+#define UART_STATS_INTERVAL (10000000)  // Period of the rx throughput report (us)
+#define UART_CMD_QUEUE_SIZE (16)        // Commands held until C3 is awake
+#define TABLE_CHUNK_RECORDS ((UART_FRAME_MAX_PAYLOAD - UART_CIPHER_COUNTER_SIZE - sizeof(uart_chunk_header_t)) / sizeof(table_device_t))
+#define TABLE_CHUNKS ((MAX_SLAVES + TABLE_CHUNK_RECORDS - 1) / TABLE_CHUNK_RECORDS)
+#define TABLE_CHUNK_WINDOW (4)          // FRAME_GET_TABLE_CHUNK outstanding at the same time
+#define TABLE_CHUNK_TIMEOUT_MS (200)
+#define TABLE_CHUNK_ROUNDS (4)          // Passes over the missing chunks before get_table() gives up
 static QueueHandle_t uart0_queue;
+static SemaphoreHandle_t uart_tx_mutex;
+static SemaphoreHandle_t uart_rpc_mutex;
+static SemaphoreHandle_t uart_rpc_window;    // Counts free entries of s_rpc_pending
+static uart_frame_decoder_t s_uart_decoder;
+static uint8_t s_tx_frame[UART_FRAME_ENCODED_SIZE];
+static uint8_t s_tx_payload[UART_FRAME_MAX_PAYLOAD];   // Payload encrypted in place before encoding
+static uart_cipher_t s_cipher;
+static QueueHandle_t uart_cmd_queue;
+static uint16_t s_req_id = 0;
+static uint32_t s_link_baud_rate = BAUD_RATE;
+static int s_link_failures = 0;
+
+typedef struct {
+    bool in_use;
+    uint16_t req_id;
+    uint8_t resp_type;      // Frame type that completes the request
+    int64_t sent_time;      // us
+    int64_t deadline;       // us
+    uart_rpc_cb_t cb;
+    void *ctx;
+} uart_rpc_pending_t;
+
+static uart_rpc_pending_t s_rpc_pending[UART_RPC_MAX_PENDING];
+
+typedef struct {
+    uint8_t type;
+    uint8_t resp_type;
+    uint8_t len;
+    uint8_t payload[UART_CMD_MAX_PAYLOAD];
+    uart_rpc_cb_t cb;       // NULL when no response is expected
+    void *ctx;
+    int timeout;
+} uart_cmd_t;
+
+// Doorbell and wake up latency, protected by uart_rpc_mutex
+static struct {
+    bool held;
+    int64_t last_busy;              // Last time a request was outstanding (us)
+    volatile bool measuring;        // Waiting for the first byte after the doorbell rang
+    uint32_t ring_time;             // Low 32 bits of esp_timer_get_time() when the doorbell rang
+} s_doorbell;
+
+static uart_wake_stats_t s_wake_stats;
+static uart_link_stats_t s_link_stats;      // tx_x under uart_tx_mutex, the rest under uart_rpc_mutex
+
+static uint32_t s_table_version = 0;        // Version of table_devices as last read or patched
+static bool s_table_valid = false;          // table_devices was read since connect
+static bool s_resync_needed = false;        // A delta was missed
+static uart_delta_cb_t s_delta_cb = NULL;
+
+// Chunked read of table_devices, kept across get_table() calls so a broken read resumes
+// where it stopped. Protected by uart_rpc_mutex.
+static struct {
+    bool active;                                // Snapshot version known, read not complete
+    uint32_t version;                           // Version of the snapshot on C3
+    uint16_t total;                             // Records in the snapshot
+    uint16_t cursor;                            // No chunk before it is missing
+    uint8_t received[(TABLE_CHUNKS + 7) / 8];   // Chunks stored
+    uint8_t patched[(MAX_SLAVES + 7) / 8];      // Records changed by a delta newer than the snapshot
+} s_chunk;
+
+static struct {
+    uint64_t rx_bytes;      // Bytes read from the driver since start_time
+    int64_t busy_time;      // Time spent reading and decoding (us)
+    int64_t start_time;     // Start of the report period (us)
+} s_rx_stats;
 
 void uart_config(void){
         uart_config_t uart_config = {
@@ -39,106 +136,876 @@ void uart_config(void){
         .source_clk = UART_SCLK_DEFAULT,
     };
     // uart_driver_install(UART_NUM, BUF_SIZE, BUF_SIZE, 10, &uart0_queue, 0);
-    uart_driver_install(UART_NUM, BUF_SIZE, BUF_SIZE, 0, NULL, 0);
+    uart_driver_install(UART_NUM, BUF_SIZE, BUF_SIZE, UART_EVENT_QUEUE_SIZE, &uart0_queue, 0);
 
     // uart_driver_install(UART_NUM, BUF_SIZE * 2, BUF_SIZE * 2, 20, &uart0_queue, 0);
     uart_param_config(UART_NUM, &uart_config);
     // uart_set_pin(UART_NUM, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    uart_set_pin(UART_NUM, TX_GPIO_NUM, RX_GPIO_NUM, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_set_pin(UART_NUM, TX_GPIO_NUM, RX_GPIO_NUM, RTS_GPIO_NUM, CTS_GPIO_NUM);
         gpio_set_direction(TX_GPIO_NUM, GPIO_MODE_OUTPUT);
 
+    // UART_DATA is posted when the line goes idle or the FIFO fills up, so a frame is not split into many events
+    uart_set_rx_timeout(UART_NUM, UART_RX_TIMEOUT_SYMBOLS);
+    uart_set_rx_full_threshold(UART_NUM, UART_RX_FULL_THRESHOLD);
+
+    uart_tx_mutex = xSemaphoreCreateMutex();
+    uart_rpc_mutex = xSemaphoreCreateMutex();
+    uart_rpc_window = xSemaphoreCreateCounting(UART_RPC_MAX_PENDING, UART_RPC_MAX_PENDING);
+    uart_cmd_queue = xQueueCreate(UART_CMD_QUEUE_SIZE, sizeof(uart_cmd_t));
+    uart_frame_decoder_init(&s_uart_decoder);
+    uart_cipher_init(&s_cipher, (const uint8_t *)LINK_KEY, UART_CIPHER_DIR_S3_TO_C3);
+
+    gpio_config_t doorbell_config = {
+        .pin_bit_mask = BIT64(DOORBELL_GPIO_NUM),
+        .mode = GPIO_MODE_OUTPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+    gpio_set_level(DOORBELL_GPIO_NUM, !DOORBELL_ACTIVE_LEVEL);
+    gpio_config(&doorbell_config);
+
     // uart0_queue = xQueueCreate(10, BUF_SIZE);
     // uart_set_pin(EX_UART_NUM, TX_PIN, RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
 }
 
-#include "mbedtls/aes.h"
-#define BUF_SIZEz 1024
-
-void encrypt_message(const unsigned char *input, unsigned char *output, size_t length) {
-    mbedtls_aes_context aes;
-    unsigned char key[16] = "7832477891326794";
-    unsigned char iv[16] =  "4892137489723148";
-    
-    mbedtls_aes_init(&aes);
-    mbedtls_aes_setkey_enc(&aes, key, 128);
-    mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, length, iv, input, output);
-    mbedtls_aes_free(&aes);
-}
-void decrypt_message(const unsigned char *input, unsigned char *output, size_t length) {
-    mbedtls_aes_context aes;
-    unsigned char key[16] = "7832477891326794";  // Khóa bí mật (same as used for encryption)
-    unsigned char iv[16] =  "4892137489723148";    // Vector khởi tạo (same as used for encryption)
-    mbedtls_aes_init(&aes);
-    mbedtls_aes_setkey_dec(&aes, key, 128);  // Thiết lập khóa giải mã
-    mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT, length, iv, input, output); // Giải mã
-    mbedtls_aes_free(&aes);
-}
 void dump_uart(uint8_t *message, size_t len){
-    printf("send \n");
-    uint8_t encrypted_message[len]; // AES block size = 16 bytes
-    // Mã hóa tin nhắn
-    encrypt_message((unsigned char *)message, encrypted_message, len);
-    // uart_write_bytes(UART_NUM_P2, (const char *)message, sizeof(sensor_data_t));
-    
     uart_write_bytes(UART_NUM, (unsigned char *)message, len);
 }
 
-int get_uart(uint8_t *message, size_t len, int timeout){
-    printf("get \n");
-    uint8_t encrypted_message[len]; // AES block size = 16 bytes
-    // uart_read_bytes(UART_NUM, (unsigned char *)message, len);
-    memset(message, 0, len);
+static uint16_t next_req_id(void){
+    // Id 0 is kept for frames C3 sends on its own (WOKE_UP after GPIO wakeup)
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+    if (++s_req_id == 0) {
+        s_req_id = 1;
+    }
+    uint16_t req_id = s_req_id;
+    xSemaphoreGive(uart_tx_mutex);
+    return req_id;
+}
+
+static void send_frame_id(uint8_t type, uint16_t req_id, const void *payload, size_t len){
+    size_t frame_len = 0;
+
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+
+    if (!s_cipher.enabled) {
+        frame_len = uart_frame_encode(type, 0, req_id, (const uint8_t *)payload, len, s_tx_frame, sizeof(s_tx_frame));
+    } else if (len + UART_CIPHER_COUNTER_SIZE <= sizeof(s_tx_payload)) {
+        if (len > 0) {
+            memcpy(s_tx_payload, payload, len);
+        }
+        len = uart_cipher_encrypt(&s_cipher, s_tx_payload, len, sizeof(s_tx_payload));
+        frame_len = uart_frame_encode(type, UART_FRAME_FLAG_ENCRYPTED, req_id, s_tx_payload, len, s_tx_frame, sizeof(s_tx_frame));
+    }
+    if (frame_len == 0) {
+        ESP_LOGE(TAG, "Encode frame type 0x%02x failed, len %d", type, (int)len);
+    } else {
+        dump_uart(s_tx_frame, frame_len);
+        s_link_stats.tx_bytes += frame_len;
+        s_link_stats.tx_frames++;
+    }
+
+    xSemaphoreGive(uart_tx_mutex);
+}
+
+/**
+ * @brief Encode one frame and write it to C3, no response is expected.
+ * @return Request id of the frame.
+ */
+uint16_t send_frame(uint8_t type, const void *payload, size_t len){
+    uint16_t req_id = next_req_id();
+    send_frame_id(type, req_id, payload, len);
+    return req_id;
+}
+
+/**
+ * @brief Send a request without waiting for its response. Up to UART_RPC_MAX_PENDING
+ *        requests are outstanding at the same time, responses are matched by request id
+ *        in any order. cb is called once from the rx task, with the response or with
+ *        length -1 and frame NULL on NACK or timeout.
+ * @return Request id, 0 when no entry got free within timeout.
+ */
+uint16_t uart_rpc_send(uint8_t type, const void *payload, size_t len, uint8_t resp_type, uart_rpc_cb_t cb, void *ctx, int timeout){
+    if (xSemaphoreTake(uart_rpc_window, pdMS_TO_TICKS(timeout)) != pdTRUE) {
+        ESP_LOGW(TAG, "No free request entry for frame type 0x%02x", type);
+        return 0;
+    }
+
+    uint16_t req_id = next_req_id();
+
+    // Register before sending, the response may come back before send_frame_id() returns
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    for (int i = 0; i < UART_RPC_MAX_PENDING; i++) {
+        if (!s_rpc_pending[i].in_use) {
+            s_rpc_pending[i] = (uart_rpc_pending_t) {
+                .in_use = true,
+                .req_id = req_id,
+                .resp_type = resp_type,
+                .sent_time = now,
+                .deadline = now + (int64_t)timeout * 1000,
+                .cb = cb,
+                .ctx = ctx,
+            };
+            break;
+        }
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+
+    send_frame_id(type, req_id, payload, len);
+    return req_id;
+}
 
-    int length = uart_read_bytes(UART_NUM, message, len+10,  pdMS_TO_TICKS(timeout));
-    uart_flush(UART_NUM);
-                ESP_LOGW(TAG, "Reicv %d bytes : ",length);
-                printf("%s \n",message);
-    return length;
+// Remove entry i and return its callback, called with uart_rpc_mutex held
+static uart_rpc_pending_t uart_rpc_take(int i){
+    uart_rpc_pending_t pending = s_rpc_pending[i];
+    s_rpc_pending[i].in_use = false;
+    xSemaphoreGive(uart_rpc_window);
+    return pending;
 }
 
+// Complete the request answered by frame, return false when no request waits for it
+static bool uart_rpc_complete(const uart_frame_t *frame){
+    uart_rpc_pending_t pending = { .in_use = false };
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    for (int i = 0; i < UART_RPC_MAX_PENDING; i++) {
+        if (!s_rpc_pending[i].in_use) {
+            continue;
+        }
+        bool same_id = (frame->req_id == s_rpc_pending[i].req_id);
+        if ((same_id && (frame->type == s_rpc_pending[i].resp_type || frame->type == FRAME_NACK)) ||
+            (frame->req_id == 0 && frame->type == s_rpc_pending[i].resp_type)) {
+            pending = uart_rpc_take(i);
+            if (frame->type == FRAME_NACK) {
+                s_link_stats.nacks++;
+            } else {
+                uart_latency_hist_add(&s_link_stats.latency, (uint32_t)(esp_timer_get_time() - pending.sent_time));
+            }
+            break;
+        }
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+
+    if (!pending.in_use) {
+        return false;
+    }
+    if (frame->type == FRAME_NACK) {
+        ESP_LOGW(TAG, "NACK for request id %d", frame->req_id);
+        pending.cb(-1, NULL, pending.ctx);
+    } else {
+        pending.cb(frame->len, frame, pending.ctx);
+    }
+    return true;
+}
+
+// Fail expired requests, return the time until the next deadline (ms)
+static int uart_rpc_check_timeouts(void){
+    int64_t now = esp_timer_get_time();
+    int64_t next_deadline = INT64_MAX;
+
+    for (int i = 0; i < UART_RPC_MAX_PENDING; i++) {
+        uart_rpc_pending_t pending = { .in_use = false };
+
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        if (s_rpc_pending[i].in_use) {
+            if (s_rpc_pending[i].deadline <= now) {
+                pending = uart_rpc_take(i);
+                s_link_stats.timeouts++;
+            } else if (s_rpc_pending[i].deadline < next_deadline) {
+                next_deadline = s_rpc_pending[i].deadline;
+            }
+        }
+        xSemaphoreGive(uart_rpc_mutex);
+
+        if (pending.in_use) {
+            ESP_LOGW(TAG, "Timeout of request id %d, waiting type 0x%02x", pending.req_id, pending.resp_type);
+            pending.cb(-1, NULL, pending.ctx);
+        }
+    }
+
+    if (next_deadline == INT64_MAX) {
+        return UART_RPC_TICK_MS;
+    }
+    return (next_deadline - now) / 1000 + 1;
+}
+
+typedef struct {
+    void *message;
+    size_t len;
+    int length;
+    SemaphoreHandle_t done;
+    StaticSemaphore_t done_buffer;
+} uart_rpc_call_t;
+
+static void uart_rpc_call_cb(int length, const uart_frame_t *frame, void *ctx){
+    uart_rpc_call_t *call = (uart_rpc_call_t *)ctx;
+
+    if (frame != NULL) {
+        size_t copy = (frame->len < call->len) ? frame->len : call->len;
+        if (copy > 0) {
+            memcpy(call->message, frame->payload, copy);
+        }
+    }
+    call->length = length;
+    xSemaphoreGive(call->done);
+}
+
+/**
+ * @brief Send a request and wait for its response.
+ * @return Payload length of the response, -1 on timeout or NACK.
+ */
+int uart_rpc_call(uint8_t type, const void *payload, size_t len, uint8_t resp_type, void *message, size_t message_len, int timeout){
+    uart_rpc_call_t call = {
+        .message = message,
+        .len = message_len,
+        .length = -1,
+    };
+    call.done = xSemaphoreCreateBinaryStatic(&call.done_buffer);
+
+    if (uart_rpc_send(type, payload, len, resp_type, uart_rpc_call_cb, &call, timeout) == 0) {
+        return -1;
+    }
+    // The callback always runs, with the response or at the deadline
+    xSemaphoreTake(call.done, portMAX_DELAY);
+    return call.length;
+}
+
+// Change rate and flow control once the frames sent at the old rate are out
+static void uart_link_apply(uint32_t baud_rate, bool flow_ctrl){
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+
+    uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(100));
+    uart_set_baudrate(UART_NUM, baud_rate);
+    uart_set_hw_flow_ctrl(UART_NUM, flow_ctrl ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE, FLOW_CTRL_THRESHOLD);
+    s_link_baud_rate = baud_rate;
 
+    xSemaphoreGive(uart_tx_mutex);
+
+    ESP_LOGI(TAG, "UART link %lu baud, flow control %s", (unsigned long)baud_rate, flow_ctrl ? "RTS/CTS" : "off");
+}
+
+// Start (session_id) or stop (NULL) encryption between two frames sent by other tasks
+static void uart_link_cipher(const uint8_t *session_id){
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+    if (session_id != NULL) {
+        uart_cipher_start(&s_cipher, session_id);
+    } else {
+        uart_cipher_stop(&s_cipher);
+    }
+    xSemaphoreGive(uart_tx_mutex);
+}
+
+/**
+ * @brief Agree on rate, flow control and encryption with C3, then check the link at
+ *        the new rate. Falls back to BAUD_RATE in clear when the check fails, C3 does
+ *        the same on its side.
+ * @return true when the link is up.
+ */
+static bool uart_link_negotiate(uint32_t max_baud_rate, bool encrypt){
+    uart_link_params_t params = {
+        .baud_rate = max_baud_rate,
+        .flow_ctrl = FLOW_CTRL_WIRED,
+        .encrypt = encrypt,
+    };
+    uart_link_params_t agreed;
+    uint8_t session_id[UART_CIPHER_SESSION_ID_SIZE];
+
+    // The handshake is in clear, C3 answers with its half of the session id
+    uart_link_cipher(NULL);
+    esp_fill_random(params.nonce, sizeof(params.nonce));
+
+    int length = uart_rpc_call(FRAME_CONNECT_REQUEST, &params, sizeof(params), FRAME_CONNECT_AGREE, &agreed, sizeof(agreed), 200);
+    if (length < 0) {
+        return false;
+    }
+    if (length < sizeof(agreed)) {
+        // C3 without negotiation stays at the default rate
+        agreed.baud_rate = BAUD_RATE;
+        agreed.flow_ctrl = 0;
+        agreed.encrypt = 0;
+    }
+
+    if (agreed.encrypt) {
+        // Session id = nonce of S3 | nonce of C3
+        memcpy(session_id, params.nonce, sizeof(params.nonce));
+        memcpy(session_id + sizeof(params.nonce), agreed.nonce, sizeof(agreed.nonce));
+        uart_link_cipher(session_id);
+    }
+    uart_link_apply(agreed.baud_rate, agreed.flow_ctrl);
+    vTaskDelay(pdMS_TO_TICKS(LINK_SWITCH_DELAY_MS));
+
+    if (uart_rpc_call(FRAME_CONNECTED, NULL, 0, FRAME_CONNECTED, NULL, 0, LINK_CONFIRM_TIMEOUT_MS) < 0 &&
+        (agreed.baud_rate != BAUD_RATE || agreed.encrypt)) {
+        ESP_LOGW(TAG, "No echo at %lu baud, fall back to %d baud", (unsigned long)agreed.baud_rate, BAUD_RATE);
+        uart_link_cipher(NULL);
+        uart_link_apply(BAUD_RATE, false);
+
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        s_link_stats.link_fallbacks++;
+        xSemaphoreGive(uart_rpc_mutex);
+        return false;
+    }
+
+    s_link_failures = 0;
+    // C3 drops the subscription on FRAME_CONNECT_REQUEST, deltas for a resumed read would be missed
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    s_table_valid = false;
+    s_chunk.active = false;
+    xSemaphoreGive(uart_rpc_mutex);
+    return true;
+}
+
+// Assert the doorbell, a sleeping C3 wakes up on its level and sends FRAME_WOKE_UP on its own
+static void uart_doorbell_ring(void){
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    if (!s_doorbell.held) {
+        s_doorbell.held = true;
+        s_doorbell.ring_time = (uint32_t)esp_timer_get_time();
+        s_doorbell.measuring = true;
+        gpio_set_level(DOORBELL_GPIO_NUM, DOORBELL_ACTIVE_LEVEL);
+    }
+    s_doorbell.last_busy = esp_timer_get_time();
+    xSemaphoreGive(uart_rpc_mutex);
+}
+
+// Called from the rx task, C3 may go back to sleep once the doorbell is released
+static void uart_doorbell_check(void){
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    if (s_doorbell.held) {
+        if (uxSemaphoreGetCount(uart_rpc_window) < UART_RPC_MAX_PENDING) {
+            s_doorbell.last_busy = now;
+        } else if (now - s_doorbell.last_busy >= DOORBELL_HOLD_MS * 1000) {
+            s_doorbell.held = false;
+            s_doorbell.measuring = false;
+            gpio_set_level(DOORBELL_GPIO_NUM, !DOORBELL_ACTIVE_LEVEL);
+        }
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+}
+
+// Doorbell to first byte of C3 as seen by the rx task, called for every chunk read
+static void uart_wake_latency_check(void){
+    if (!s_doorbell.measuring) {
+        return;
+    }
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    if (s_doorbell.measuring) {
+        uint32_t latency = (uint32_t)esp_timer_get_time() - s_doorbell.ring_time;
+        s_doorbell.measuring = false;
+
+        s_wake_stats.last_us = latency;
+        if (s_wake_stats.count == 0 || latency < s_wake_stats.min_us) {
+            s_wake_stats.min_us = latency;
+        }
+        if (latency > s_wake_stats.max_us) {
+            s_wake_stats.max_us = latency;
+        }
+        s_wake_stats.sum_us += latency;
+        s_wake_stats.count++;
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+}
+
+/**
+ * @brief Copy the link counters, the latency histogram is cleared when reset_latency is set.
+ */
+void uart_link_stats_get(uart_link_stats_t *stats, bool reset_latency){
+    xSemaphoreTake(uart_tx_mutex, portMAX_DELAY);
+    uint64_t tx_bytes = s_link_stats.tx_bytes;
+    uint32_t tx_frames = s_link_stats.tx_frames;
+    xSemaphoreGive(uart_tx_mutex);
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    *stats = s_link_stats;
+    if (reset_latency) {
+        memset(&s_link_stats.latency, 0, sizeof(s_link_stats.latency));
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+
+    stats->tx_bytes = tx_bytes;
+    stats->tx_frames = tx_frames;
+    stats->rx_frames = s_uart_decoder.frames_ok;
+    stats->crc_errors = s_uart_decoder.crc_errors;
+    stats->framing_errors = s_uart_decoder.framing_errors;
+    stats->overflow_errors = s_uart_decoder.overflow_errors;
+}
+
+/**
+ * @brief Copy the wake up latency counters.
+ */
+void uart_wake_stats_get(uart_wake_stats_t *stats){
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    *stats = s_wake_stats;
+    xSemaphoreGive(uart_rpc_mutex);
+}
+
+/**
+ * @brief Hold a command until C3 is awake, wait_wake_up() sends every held command in
+ *        one burst. cb is called from the rx task like for uart_rpc_send(), NULL when
+ *        no response is expected.
+ * @return false when the queue is full or the payload too long.
+ */
+bool uart_cmd_queue_send(uint8_t type, const void *payload, size_t len, uint8_t resp_type, uart_rpc_cb_t cb, void *ctx, int timeout){
+    uart_cmd_t cmd = {
+        .type = type,
+        .resp_type = resp_type,
+        .len = len,
+        .cb = cb,
+        .ctx = ctx,
+        .timeout = timeout,
+    };
+
+    if (len > sizeof(cmd.payload)) {
+        return false;
+    }
+    if (len > 0) {
+        memcpy(cmd.payload, payload, len);
+    }
+    return xQueueSend(uart_cmd_queue, &cmd, 0) == pdTRUE;
+}
+
+/**
+ * @brief Number of commands waiting for the next wake up.
+ */
+int uart_cmd_pending(void){
+    return uxQueueMessagesWaiting(uart_cmd_queue);
+}
+
+// Send every held command back to back, responses are matched in the rx task
+static int uart_cmd_flush(void){
+    uart_cmd_t cmd;
+    int sent = 0;
+
+    while (xQueueReceive(uart_cmd_queue, &cmd, 0) == pdTRUE) {
+        if (cmd.cb == NULL) {
+            send_frame(cmd.type, cmd.payload, cmd.len);
+            sent++;
+        } else if (uart_rpc_send(cmd.type, cmd.payload, cmd.len, cmd.resp_type, cmd.cb, cmd.ctx, cmd.timeout) != 0) {
+            sent++;
+        } else {
+            cmd.cb(-1, NULL, cmd.ctx);
+        }
+    }
+    return sent;
+}
+
+/**
+ * @brief Ring the doorbell and wait until C3 is awake, then flush the held commands.
+ *        A sleeping C3 answers by itself once the doorbell wakes it up, an awake C3
+ *        answers the FRAME_WAKE_UP sent at the same time.
+ * @return 1 when C3 is awake, 0 on timeout (held commands stay queued).
+ */
 int wait_wake_up(){
     ESP_LOGI(TAG, "Waiting for wake up");
-    uint8_t message[sizeof(WOKE_UP)];
-
-    dump_uart((uint8_t *)WAKE_UP_COMMAND,sizeof(WAKE_UP_COMMAND));
-    // gpio_set_level(TX_GPIO_NUM, 1);
-    // vTaskDelay(pdMS_TO_TICKS(100));  // 50ms delay
-    // gpio_set_level(TX_GPIO_NUM, 0);
-    // vTaskDelay(pdMS_TO_TICKS(100));  // 50ms delay
-    int length = uart_read_bytes(UART_NUM, message, sizeof(WOKE_UP), pdMS_TO_TICKS(500) );//pdMS_TO_TICKS(500) portMAX_DELAY
-    uart_flush(UART_NUM);
+
+    uart_doorbell_ring();
+    if (uart_rpc_call(FRAME_WAKE_UP, NULL, 0, FRAME_WOKE_UP, NULL, 0, 500) < 0) {
+        ESP_LOGW(TAG, "No wake up message");
+
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        s_wake_stats.failures++;
+        s_link_stats.wake_failures++;
+        xSemaphoreGive(uart_rpc_mutex);
+
+        // C3 may have restarted at the default rate, in clear
+        if (++s_link_failures >= LINK_MAX_FAILURES && (s_link_baud_rate != BAUD_RATE || s_cipher.enabled)) {
+            xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+            s_link_stats.link_fallbacks++;
+            xSemaphoreGive(uart_rpc_mutex);
+            uart_link_apply(BAUD_RATE, false);
+            uart_link_negotiate(MAX_BAUD_RATE, LINK_ENCRYPT);
+        }
+        return 0;
+    }
+    s_link_failures = 0;
+
+    int sent = uart_cmd_flush();
+    ESP_LOGI(TAG, "Received correct wake up message, %d held commands sent", sent);
+    return 1;
+}
+
+#if LINK_BENCHMARK
+typedef struct {
+    uint64_t bytes;
+    int errors;
+    SemaphoreHandle_t done;
+} uart_link_benchmark_t;
+
+static void uart_link_benchmark_cb(int length, const uart_frame_t *frame, void *ctx){
+    uart_link_benchmark_t *bench = (uart_link_benchmark_t *)ctx;
     if (length < 0) {
-        ESP_LOGE(TAG, "Error reading from UART: %d", length);
-        return length;
-    }
-    ESP_LOGW(TAG, "Received %d bytes: %.*s", length, length, message);
-                // printf("%s \n",message);
-    if (length == sizeof(WOKE_UP) && memcmp(message, WOKE_UP, sizeof(WOKE_UP)) == 0) {
-        ESP_LOGI(TAG, "Received correct wake up message");
-        return length;
+        bench->errors++;
     } else {
-        ESP_LOGW(TAG, "Received unexpected message");
-        return 0;
+        bench->bytes += length;
+    }
+    xSemaphoreGive(bench->done);
+}
+
+// Encryption cost per frame against a plain copy of the same payload, no UART involved
+static void uart_cipher_benchmark(void){
+    const size_t sizes[] = {16, 64, 128, UART_FRAME_MAX_PAYLOAD - UART_CIPHER_COUNTER_SIZE};
+    static uint8_t buffer[UART_FRAME_MAX_PAYLOAD];
+    static uint8_t plain[UART_FRAME_MAX_PAYLOAD];
+    uart_cipher_t cipher;
+    uint8_t session_id[UART_CIPHER_SESSION_ID_SIZE] = {0};
+
+    uart_cipher_init(&cipher, (const uint8_t *)LINK_KEY, UART_CIPHER_DIR_S3_TO_C3);
+    uart_cipher_start(&cipher, session_id);
+    esp_fill_random(plain, sizeof(plain));
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int64_t start_time = esp_timer_get_time();
+        for (int n = 0; n < LINK_BENCHMARK_CIPHER_ROUNDS; n++) {
+            memcpy(buffer, plain, sizes[i]);
+        }
+        int64_t copy_time = esp_timer_get_time() - start_time;
+
+        start_time = esp_timer_get_time();
+        for (int n = 0; n < LINK_BENCHMARK_CIPHER_ROUNDS; n++) {
+            memcpy(buffer, plain, sizes[i]);
+            uart_cipher_encrypt(&cipher, buffer, sizes[i], sizeof(buffer));
+        }
+        int64_t cipher_time = esp_timer_get_time() - start_time;
+
+        ESP_LOGI(TAG, "Benchmark cipher %d B: %llu B/s, %.2f us/frame (copy %.2f us/frame)",
+                (int)sizes[i], (uint64_t)sizes[i] * LINK_BENCHMARK_CIPHER_ROUNDS * 1000000ULL / (cipher_time > 0 ? cipher_time : 1),
+                (float)cipher_time / LINK_BENCHMARK_CIPHER_ROUNDS, (float)copy_time / LINK_BENCHMARK_CIPHER_ROUNDS);
+    }
+    mbedtls_aes_free(&cipher.aes);
+}
+
+// Goodput of pipelined GET_FULL_DATA (payload bytes per second) at every rate up to MAX_BAUD_RATE,
+// in clear and encrypted
+static void uart_link_benchmark(void){
+    const uint32_t rates[] = {115200, 230400, 460800, 921600, 1500000, 2000000, 3000000};
+    uart_link_benchmark_t bench;
+    bench.done = xSemaphoreCreateCounting(LINK_BENCHMARK_REQUESTS, 0);
+
+    uart_cipher_benchmark();
+
+    for (int i = 0; i < 2 * (sizeof(rates) / sizeof(rates[0])); i++) {
+        uint32_t rate = rates[i / 2];
+        bool encrypt = (i % 2) != 0;
+        if (rate > MAX_BAUD_RATE) {
+            break;
+        }
+        if (!uart_link_negotiate(rate, encrypt) || !wait_wake_up()) {
+            ESP_LOGE(TAG, "Benchmark: link failed at %lu baud", (unsigned long)rate);
+            continue;
+        }
+
+        bench.bytes = 0;
+        bench.errors = 0;
+        int sent = 0;
+        int64_t start_time = esp_timer_get_time();
+        for (int n = 0; n < LINK_BENCHMARK_REQUESTS; n++) {
+            if (uart_rpc_send(FRAME_GET_FULL_DATA, NULL, 0, FRAME_FULL_DATA, uart_link_benchmark_cb, &bench, 500) != 0) {
+                sent++;
+            }
+        }
+        for (int n = 0; n < sent; n++) {
+            xSemaphoreTake(bench.done, portMAX_DELAY);
+        }
+        int64_t elapsed_time = esp_timer_get_time() - start_time;
+
+        ESP_LOGI(TAG, "Benchmark %lu baud %s: goodput %llu B/s, %d requests, %d errors, %lld us",
+                (unsigned long)s_link_baud_rate, encrypt ? "encrypted" : "clear", bench.bytes * 1000000ULL / elapsed_time, sent, bench.errors, elapsed_time);
+    }
+
+    vSemaphoreDelete(bench.done);
+    uart_link_negotiate(MAX_BAUD_RATE, LINK_ENCRYPT);
+}
+#endif
+
+typedef struct {
+    SemaphoreHandle_t done;             // Given once per finished request
+    StaticSemaphore_t done_buffer;
+    int stored;                         // Chunks stored by this read
+    bool snapshot;                      // The outstanding request takes a new snapshot
+} table_read_t;
+
+static bool table_chunk_is_received(int chunk){
+    return s_chunk.received[chunk / 8] & (1 << (chunk % 8));
+}
+
+// Store a FRAME_TABLE_CHUNK in table_devices, called from the rx task
+static bool table_chunk_store(const uart_frame_t *frame, bool snapshot){
+    uart_chunk_header_t header;
+
+    if (frame->len < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, frame->payload, sizeof(header));
+    if (header.total > MAX_SLAVES || header.first % TABLE_CHUNK_RECORDS != 0 || header.first + header.count > header.total ||
+        (header.count != TABLE_CHUNK_RECORDS && header.first + header.count != header.total) ||
+        frame->len != sizeof(header) + header.count * sizeof(table_device_t)) {
+        ESP_LOGE(TAG, "Bad table chunk, first %d count %d total %d", header.first, header.count, header.total);
+        return false;
+    }
+
+    bool stored = false;
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    if (snapshot) {
+        // Answer of the snapshot request, deltas from now on patch the snapshot
+        memset(&s_chunk, 0, sizeof(s_chunk));
+        s_chunk.active = true;
+        s_chunk.version = header.version;
+        s_chunk.total = header.total;
+        s_table_version = header.version;
+        s_table_valid = false;
+        s_resync_needed = false;
+        memset(&table_devices[header.total], 0, (MAX_SLAVES - header.total) * sizeof(table_device_t));
+    }
+    if (s_chunk.active && header.version == s_chunk.version && header.total == s_chunk.total) {
+        for (int i = 0; i < header.count; i++) {
+            int index = header.first + i;
+            // A record patched by a delta is newer than the snapshot
+            if (!(s_chunk.patched[index / 8] & (1 << (index % 8)))) {
+                memcpy(&table_devices[index], frame->payload + sizeof(header) + i * sizeof(table_device_t), sizeof(table_device_t));
+            }
+        }
+        int chunk = header.first / TABLE_CHUNK_RECORDS;
+        s_chunk.received[chunk / 8] |= 1 << (chunk % 8);
+        stored = true;
     }
-    return length;
+    xSemaphoreGive(uart_rpc_mutex);
+    return stored;
 }
 
+static void table_chunk_cb(int length, const uart_frame_t *frame, void *ctx){
+    table_read_t *read = (table_read_t *)ctx;
+    if (frame != NULL && table_chunk_store(frame, read->snapshot)) {
+        read->stored++;
+    }
+    xSemaphoreGive(read->done);
+}
+
+// Request every missing chunk once, TABLE_CHUNK_WINDOW at a time. Return the number of requests.
+static int table_read_round(table_read_t *read, bool retry){
+    int outstanding = 0;
+    int requested = 0;
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    int chunks = (s_chunk.total + TABLE_CHUNK_RECORDS - 1) / TABLE_CHUNK_RECORDS;
+    while (s_chunk.cursor < chunks && table_chunk_is_received(s_chunk.cursor)) {
+        s_chunk.cursor++;
+    }
+    uart_chunk_request_t request = {
+        .version = s_chunk.version,
+        .count = TABLE_CHUNK_RECORDS,
+        .snapshot = 0,
+    };
+    int cursor = s_chunk.cursor;
+    xSemaphoreGive(uart_rpc_mutex);
+
+    for (int chunk = cursor; chunk < chunks; chunk++) {
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        bool missing = s_chunk.active && !table_chunk_is_received(chunk);
+        xSemaphoreGive(uart_rpc_mutex);
+        if (!missing) {
+            continue;
+        }
+
+        if (outstanding == TABLE_CHUNK_WINDOW) {
+            xSemaphoreTake(read->done, portMAX_DELAY);
+            outstanding--;
+        }
+        request.first = chunk * TABLE_CHUNK_RECORDS;
+        if (uart_rpc_send(FRAME_GET_TABLE_CHUNK, &request, sizeof(request), FRAME_TABLE_CHUNK, table_chunk_cb, read, TABLE_CHUNK_TIMEOUT_MS) != 0) {
+            outstanding++;
+        }
+        requested++;
+    }
+    while (outstanding > 0) {
+        xSemaphoreTake(read->done, portMAX_DELAY);
+        outstanding--;
+    }
+
+    if (retry) {
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        s_link_stats.retries += requested;
+        xSemaphoreGive(uart_rpc_mutex);
+    }
+    return requested;
+}
+
+/**
+ * @brief Read table_devices in chunks. The first chunk takes a snapshot on C3, the other
+ *        chunks are pipelined and only the lost ones are requested again. A read that
+ *        does not complete is resumed by the next call while C3 keeps the snapshot.
+ */
 void get_table(){
-    printf("get_table \n");
-    int length=0;
-    table_device_t message[sizeof(table_device_t)];
-    dump_uart((uint8_t *)GET_FULL_DATA,sizeof(GET_FULL_DATA));
+    table_read_t read = { .stored = 0, .snapshot = false };
+    read.done = xSemaphoreCreateCountingStatic(TABLE_CHUNK_WINDOW, 0, &read.done_buffer);
+    int64_t start_time = esp_timer_get_time();
+    int requests = 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        bool resume = s_chunk.active;
+        xSemaphoreGive(uart_rpc_mutex);
+
+        if (!resume) {
+            uart_chunk_request_t request = {
+                .version = 0,
+                .first = 0,
+                .count = TABLE_CHUNK_RECORDS,
+                .snapshot = 1,
+            };
+            requests++;
+            read.snapshot = true;
+            if (uart_rpc_send(FRAME_GET_TABLE_CHUNK, &request, sizeof(request), FRAME_TABLE_CHUNK, table_chunk_cb, &read, TABLE_CHUNK_TIMEOUT_MS) == 0) {
+                break;
+            }
+            xSemaphoreTake(read.done, portMAX_DELAY);
+            read.snapshot = false;
+            if (read.stored == 0) {
+                ESP_LOGE(TAG, "No table snapshot");
+                break;
+            }
+        } else {
+            ESP_LOGI(TAG, "Resume table read of version %lu at chunk %d", (unsigned long)s_chunk.version, s_chunk.cursor);
+        }
+
+        int stored_before = read.stored;
+        for (int round = 0; round < TABLE_CHUNK_ROUNDS; round++) {
+            int round_stored = read.stored;
+            int requested = table_read_round(&read, round > 0 || resume);
+            requests += requested;
+            if (requested == 0 || read.stored == round_stored) {
+                break;
+            }
+        }
+        if (!resume || read.stored > stored_before) {
+            break;
+        }
+
+        // Nothing came back for the resumed snapshot, C3 has replaced it: start again
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        s_chunk.active = false;
+        xSemaphoreGive(uart_rpc_mutex);
+    }
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    int chunks = (s_chunk.total + TABLE_CHUNK_RECORDS - 1) / TABLE_CHUNK_RECORDS;
+    bool complete = s_chunk.active;
+    for (int chunk = 0; complete && chunk < chunks; chunk++) {
+        complete = table_chunk_is_received(chunk);
+    }
+    if (complete) {
+        s_chunk.active = false;
+        s_table_valid = true;
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+
+    ESP_LOGI(TAG, "Table version %lu %s: %d records, %d chunks stored, %d requests, %lld us",
+            (unsigned long)s_table_version, complete ? "read" : "incomplete", s_chunk.total, read.stored, requests,
+            esp_timer_get_time() - start_time);
+}
+
+void uart_set_delta_cb(uart_delta_cb_t cb){
+    s_delta_cb = cb;
+}
+
+bool uart_resync_needed(void){
+    return s_resync_needed;
+}
+
+/**
+ * @brief Copy record index of table_devices. The rx task patches the table, the other
+ *        tasks read it through this copy only.
+ * @return false when index is out of range or the record has no MAC.
+ */
+bool uart_table_copy(int index, table_device_t *record){
+    if (index < 0 || index >= MAX_SLAVES) {
+        return false;
+    }
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    *record = table_devices[index];
+    xSemaphoreGive(uart_rpc_mutex);
+    return memcmp(record->peer_addr, "\0\0\0\0\0\0", 6) != 0;
+}
+
+/**
+ * @brief Index of the slave in table_devices, its record is copied when record is not NULL.
+ * @return -1 when the MAC is unknown.
+ */
+int uart_table_find(const uint8_t mac[6], table_device_t *record){
+    int index = -1;
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
     for (int i = 0; i < MAX_SLAVES; i++) {
-        length = uart_read_bytes(UART_NUM, message, sizeof(table_device_t), pdMS_TO_TICKS(500) );//pdMS_TO_TICKS(500) portMAX_DELAY
-        // table_devices
-        memcpy(&table_devices[i], message, sizeof(table_device_t));
-        ESP_LOGW(TAG, "Reicv %d bytes : ",length);
+        if (memcmp(table_devices[i].peer_addr, mac, 6) == 0) {
+            index = i;
+            if (record != NULL) {
+                *record = table_devices[i];
+            }
+            break;
+        }
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+    return index;
+}
+
+/**
+ * @brief Subscribe to FRAME_DELTA, also used as keepalive: the returned version shows
+ *        whether a delta was lost while nothing else was received.
+ * @return 1 when table_devices was read again, 0 when it was up to date, -1 on error.
+ */
+int uart_subscribe(void){
+    uint32_t version;
+
+    if (uart_rpc_call(FRAME_SUBSCRIBE, NULL, 0, FRAME_SUBSCRIBED, &version, sizeof(version), 500) != sizeof(version)) {
+        return -1;
+    }
+    if (s_table_valid && !s_resync_needed && version == s_table_version) {
+        return 0;
+    }
+
+    ESP_LOGW(TAG, "Table version %lu, master at %lu, read full table", (unsigned long)s_table_version, (unsigned long)version);
+    get_table();
+    return s_table_valid ? 1 : -1;
+}
+
+// Patch table_devices with a FRAME_DELTA, called from the rx task
+static void uart_delta_received(const uart_frame_t *frame){
+    uart_delta_header_t header;
+    table_device_t record;
+
+    if (frame->len < sizeof(header) + sizeof(record)) {
+        ESP_LOGE(TAG, "Delta too short, len %d", frame->len);
+        return;
+    }
+    memcpy(&header, frame->payload, sizeof(header));
+    memcpy(&record, frame->payload + sizeof(header), sizeof(record));
+
+    xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+    bool apply = false;
+    if (!(s_table_valid || s_chunk.active) || (int32_t)(header.version - s_table_version) <= 0) {
+        // Before the first snapshot, or already contained in the last snapshot
+    } else if (header.version != s_table_version + 1 || header.index >= MAX_SLAVES) {
+        ESP_LOGW(TAG, "Delta gap, version %lu after %lu", (unsigned long)header.version, (unsigned long)s_table_version);
+        s_resync_needed = true;
+        // The snapshot being read can not be brought up to date any more
+        s_chunk.active = false;
+    } else {
+        table_devices[header.index] = record;
+        s_table_version = header.version;
+        if (s_chunk.active) {
+            s_chunk.patched[header.index / 8] |= 1 << (header.index % 8);
+        }
+        apply = true;
+    }
+    xSemaphoreGive(uart_rpc_mutex);
+
+    if (apply && s_delta_cb != NULL) {
+        s_delta_cb(header.index, &record);
     }
-    uart_flush(UART_NUM);
-    // ESP_LOGW(TAG, "Reicv %d bytes : ",length);
-    // printf("%s \n",message);
-    return;
 }
 void add_json(){
     cJSON *json_mac = cJSON_CreateObject();
@@ -165,8 +1032,6 @@ void add_json(){
 
 }
 
-#include "mbedtls/aes.h"
-#define BUF_SIZEz (1024)
 
 
 
@@ -348,88 +1213,135 @@ table_device_t *recv_data;
 
 
 
+// Decrypt the payload in place, return false when the frame must be dropped
+static bool uart_frame_unwrap(uart_frame_t *frame){
+    if (frame->flags & UART_FRAME_FLAG_ENCRYPTED) {
+        int len = s_cipher.enabled ? uart_cipher_decrypt(&s_cipher, frame->payload, frame->len) : -1;
+        if (len < 0) {
+            ESP_LOGW(TAG, "Drop encrypted frame type 0x%02x id %d", frame->type, frame->req_id);
+            return false;
+        }
+        frame->len = len;
+        return true;
+    }
+
+    // C3 answers in clear only before the session is encrypted
+    if (s_cipher.enabled) {
+        ESP_LOGW(TAG, "Drop frame type 0x%02x id %d in clear", frame->type, frame->req_id);
+        return false;
+    }
+    return true;
+}
+
+// Called by the decoder for every frame with a valid CRC
+static void uart_frame_handler(const uart_frame_t *decoded, void *ctx){
+    // Decoder buffer, decrypted in place
+    uart_frame_t *frame = (uart_frame_t *)decoded;
+    if (!uart_frame_unwrap(frame)) {
+        return;
+    }
+
+    if (frame->type == FRAME_DELTA) {
+        uart_delta_received(frame);
+    } else if (!uart_rpc_complete(frame) && frame->type != FRAME_WOKE_UP) {
+        // Late answer of a timed out request, or unsolicited frame.
+        // A second FRAME_WOKE_UP comes when C3 was woken by the doorbell and also got FRAME_WAKE_UP.
+        ESP_LOGW(TAG, "Drop frame type 0x%02x id %d", frame->type, frame->req_id);
+    }
+}
+
+// Report throughput of the rx path and the share of CPU time it uses
+static void log_uart_stats(void){
+    int64_t elapsed_time = esp_timer_get_time() - s_rx_stats.start_time;
+    if (elapsed_time < UART_STATS_INTERVAL) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "UART rx %lu baud: %llu B/s, cpu %.2f%%, frames %lu, crc err %lu, framing err %lu, overflow %lu",
+            (unsigned long)s_link_baud_rate,
+            s_rx_stats.rx_bytes * 1000000ULL / elapsed_time,
+            (float)s_rx_stats.busy_time * 100 / elapsed_time,
+            (unsigned long)s_uart_decoder.frames_ok, (unsigned long)s_uart_decoder.crc_errors,
+            (unsigned long)s_uart_decoder.framing_errors, (unsigned long)s_uart_decoder.overflow_errors);
+
+    uart_wake_stats_t wake;
+    uart_wake_stats_get(&wake);
+    if (wake.count > 0) {
+        ESP_LOGI(TAG, "Wake up to first byte: last %lu us, min %lu us, avg %lu us, max %lu us, %lu wake ups, %lu failures",
+                (unsigned long)wake.last_us, (unsigned long)wake.min_us, (unsigned long)(wake.sum_us / wake.count),
+                (unsigned long)wake.max_us, (unsigned long)wake.count, (unsigned long)wake.failures);
+    }
+
+    s_rx_stats.rx_bytes = 0;
+    s_rx_stats.busy_time = 0;
+    s_rx_stats.start_time = esp_timer_get_time();
+}
+
+// Move everything the driver ring buffer holds into the frame decoder
+static void uart_rx_drain(void){
+    uint8_t dtmp[UART_RX_CHUNK_SIZE];
+    size_t buffered_size = 0;
+    int64_t start_time = esp_timer_get_time();
+
+    size_t drained = 0;
+    uart_get_buffered_data_len(UART_NUM, &buffered_size);
+    while (buffered_size > 0) {
+        size_t chunk = (buffered_size < sizeof(dtmp)) ? buffered_size : sizeof(dtmp);
+        int length = uart_read_bytes(UART_NUM, dtmp, chunk, 0);
+        if (length <= 0) {
+            break;
+        }
+        uart_wake_latency_check();
+        uart_frame_decoder_feed(&s_uart_decoder, dtmp, length, uart_frame_handler, NULL);
+        s_rx_stats.rx_bytes += length;
+        buffered_size -= length;
+        drained += length;
+    }
+
+    if (drained > 0) {
+        xSemaphoreTake(uart_rpc_mutex, portMAX_DELAY);
+        s_link_stats.rx_bytes += drained;
+        xSemaphoreGive(uart_rpc_mutex);
+    }
+
+    s_rx_stats.busy_time += esp_timer_get_time() - start_time;
+}
+
 static void uart_event(void *pvParameters)
 {
     uart_event_t event;
-    char data[100];
-    size_t buffered_size;
-    unsigned char encrypted_message[sizeof(sensor_data_t)];
-    unsigned char decrypted_message[sizeof(sensor_data_t)];
-   
-    while (false){
-        if (xQueueReceive(uart0_queue, (void *)&event, (TickType_t)portMAX_DELAY)) {
-            // bzero(encrypted_message, 20);
-            memset(encrypted_message, 0, event.size);
-                ESP_LOGI(TAG, "[Size DATA]: %d", event.size);
-                int length = uart_read_bytes(UART_NUM, encrypted_message, event.size, 100 / portTICK_PERIOD_MS);
-                uart_flush(UART_NUM);
-                ESP_LOGW(TAG, "Reicv %d bytes : ",length);
-                printf("%s \n",encrypted_message);
-                ESP_LOGW(TAG, "Descrypt: ");
-                decrypt_message(encrypted_message,&decrypted_message, sizeof(decrypted_message));
-                // decrypted_message[length] = '\0';
-                printf("%s \n", decrypted_message);
-                // memcpy(decrypted_message, encrypted_message, sizeof(encrypted_message));
-                // espnow_data_t *recv_data = (espnow_data_t *)encrypted_message;
-
-                recv_data = (table_device_t *)encrypted_message;
-                connect_request* mess=(connect_request*) encrypted_message;
-                // print_hex(recv_data,  event.size);
-
-    // In các giá trị cảm biến
-    // parse_payload(recv_data);
-    // if (!connect_check)
-    // accept_connect((uint8_t *)encrypted_message);
-    // if (!strncmp(REQUEST_CONNECTION_MSG ,(char *)encrypted_message,sizeof(REQUEST_CONNECTION_MSG))){
-    //     dump_uart((uint8_t *)RESPONSE_AGREE,sizeof(RESPONSE_AGREE));
-    //     // connect_check=true;
-    //     ESP_LOGI(TAG, RESPONSE_AGREE);
-    // }
-    // if (!strncmp(RESPONSE_CONNECTED ,(char *)encrypted_message,sizeof(RESPONSE_CONNECTED))){
-    //     // dump_uart((uint8_t *)RESPONSE_AGREE,sizeof(RESPONSE_AGREE));
-    //     connect_check=true;
-    //     ESP_LOGI(TAG, "connected");
-    // }
-    // if ( connect_check)
-    // {
-    //     ESP_LOGI(TAG, "CONNECTED");
-    // }
-    // else{
-    //     ESP_LOGE(TAG, "DISCONNECTED");
-    // }
-    
-    // if (!connect_check)
-    //     if (strcmp((char *)mess, REQUEST_CONNECTION_MSG) == 0) {
-    //             connect_check=true;
-    //             // time_now=esp_timer_get_time(); 
-    //             // time_check=esp_timer_get_time();
-    //             ESP_LOGI(TAG, "CONNECTED");
-    //             memcpy(mess->message, RESPONSE_AGREE, sizeof(RESPONSE_AGREE));
-    //             // dump_uart((const char *)mess->message,  sizeof(mess->message));
-    //             uint8_t mac[6];
-    //             memcpy(mac, mess->mac, sizeof(mess->mac));
-    //             // uint8_t mac[] = mess->mac;
-    //             ESP_LOGI("MAC Address", "MAC: %02X:%02X:%02X:%02X:%02X:%02X",
-    //                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-                
-    //     }
-                // parse_payload(recv_data);
-                //     ESP_LOGI(TAG, "         Message: %s", recv_data->message);
 
-                // parse_payload(&recv_data->payload);
+    s_rx_stats.start_time = esp_timer_get_time();
 
-    if (connect_check){
-        if (memcmp(&recv_data->peer_addr, &recv_data->peer_addr, 6) == 0) {
-            parse_payload(&recv_data->data);
-            // connect_request keep_connect;
-            // memcpy(keep_connect.message,MESSAGES_DATA,sizeof(MESSAGES_DATA));
-            // dump_uart((const char *)keep_connect.message,  sizeof(keep_connect.message));
-            time_now=esp_timer_get_time();
-            
+    while (true) {
+        int wait_ms = uart_rpc_check_timeouts();
+        if (wait_ms > UART_RPC_TICK_MS) {
+            wait_ms = UART_RPC_TICK_MS;
         }
-    }
-
+        if (xQueueReceive(uart0_queue, (void *)&event, pdMS_TO_TICKS(wait_ms))) {
+            switch (event.type) {
+            case UART_DATA:
+                // One drain can take the bytes of several queued events, later events find the buffer empty
+                uart_rx_drain();
+                break;
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                // Bytes were lost, the current frame can not be completed
+                ESP_LOGE(TAG, "UART overflow, event %d", event.type);
+                uart_flush_input(UART_NUM);
+                xQueueReset(uart0_queue);
+                uart_frame_decoder_resync(&s_uart_decoder);
+                break;
+            case UART_FRAME_ERR:
+            case UART_PARITY_ERR:
+                ESP_LOGE(TAG, "UART error, event %d", event.type);
+                break;
+            default:
+                break;
+            }
         }
+        uart_doorbell_check();
+        log_uart_stats();
     }
 
     vTaskDelete(NULL);
@@ -437,8 +1349,8 @@ static void uart_event(void *pvParameters)
 
 void uart_event_task(void){
     // configure_gpio_output();
-    wait_connect_serial();
     xTaskCreate(uart_event, "uart_event", 4096, NULL, 12, NULL);
+    wait_connect_serial();
     // xTaskCreate(check_timeout, "check_timeout", 4096, NULL, 12, NULL);
 
 }
@@ -470,47 +1382,41 @@ void log_table_devices()
         
         for (int i = 0; i < MAX_SLAVES; i++) 
         {
-            if (memcmp(table_devices[i].peer_addr, "\0\0\0\0\0\0", 6) != 0) 
+            table_device_t record;
+            if (uart_table_copy(i, &record)) 
             {
                 char mac_str[18];
                 sprintf(mac_str, "%02X:%02X:%02X:%02X:%02X:%02X", 
-                        table_devices[i].peer_addr[0], table_devices[i].peer_addr[1], table_devices[i].peer_addr[2],
-                        table_devices[i].peer_addr[3], table_devices[i].peer_addr[4], table_devices[i].peer_addr[5]);
+                        record.peer_addr[0], record.peer_addr[1], record.peer_addr[2],
+                        record.peer_addr[3], record.peer_addr[4], record.peer_addr[5]);
 
                 ESP_LOGI(TAG, "| %-17s | %-7s | %-7d | %-12.2f | %-12.2f | %-12.2f | %-8.2f | %-8.2f |",
                          mac_str,
-                         table_devices[i].status ? "Online" : "Offline",
-                         table_devices[i].data.rssi,
-                         table_devices[i].data.temperature_mcu,
-                         table_devices[i].data.temperature_rdo,
-                         table_devices[i].data.temperature_phg,
-                         table_devices[i].data.do_value,
-                         table_devices[i].data.ph_value);
+                         record.status ? "Online" : "Offline",
+                         record.data.rssi,
+                         record.data.temperature_mcu,
+                         record.data.temperature_rdo,
+                         record.data.temperature_phg,
+                         record.data.do_value,
+                         record.data.ph_value);
             }
         }
 
     ESP_LOGI(TAG, "--------------------------------------------------------------------------------------------------------");
 }
 void wait_connect_serial(){
-    uint8_t reponse_connect_uart[20]; 
-    messages_request mess;
-    memcpy(mess.message, REQUEST_UART, sizeof(REQUEST_UART));
     while (true)
     {   
         vTaskDelay(pdMS_TO_TICKS(2000));
         ESP_LOGW(TAG,"wait_connect_serial");
-        uart_flush(UART_NUM);
-        dump_uart((uint8_t *) &mess.message,  sizeof(mess.message));
-
-        memset(reponse_connect_uart, 0, sizeof(reponse_connect_uart));
-
-        uart_read_bytes(UART_NUM, reponse_connect_uart, sizeof(reponse_connect_uart), pdMS_TO_TICKS(200));
-        if (strcmp((char *)reponse_connect_uart, RESPONSE_AGREE) == 0) {
-            ESP_LOGI(TAG, "CONNECTED");
-            dump_uart((uint8_t *) RESPONSE_CONNECTED,  sizeof(RESPONSE_CONNECTED));
+        if (uart_link_negotiate(MAX_BAUD_RATE, LINK_ENCRYPT)) {
+            ESP_LOGI(TAG, "CONNECTED at %lu baud", (unsigned long)s_link_baud_rate);
             break;
         }
     }
+#if LINK_BENCHMARK
+    uart_link_benchmark();
+#endif
     // dump_uart((uint8_t *) GET_FULL_DATA,  sizeof(GET_FULL_DATA));
     wait_wake_up();
     get_table();
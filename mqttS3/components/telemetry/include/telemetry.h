@@ -0,0 +1,86 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "telemetry_codec.h"
+#include "pub_sub_client.h"
+
+#define TELEMETRY_TOPIC                 "v1/devices/me/telemetry"
+#define TELEMETRY_TIME_VALID_S          (1700000000) // Wall clock is taken as set (SNTP) past this time
+
+/* Samples are collected into one ThingsBoard array payload:
+ *
+ *   [{"ts":1718000000000,"values":{"temperature_rdo":28.370,...}},{"ts":...}]
+ *
+ * The batch is published when the next sample does not fit, when it holds
+ * TELEMETRY_BATCH_MAX_SAMPLES samples or when its oldest sample is
+ * TELEMETRY_BATCH_MAX_AGE_MS old. Without a wall clock the entries carry no ts,
+ * ThingsBoard then uses the time of arrival. */
+#define TELEMETRY_BATCH_MAX_SAMPLES     (8)
+#define TELEMETRY_BATCH_MAX_BYTES       (MQTT_PUBLISH_MAX_PAYLOAD)
+#define TELEMETRY_BATCH_MAX_AGE_MS      (5000)
+
+/* Encoding of the batches on TELEMETRY_TOPIC, the other topics (statistics, RPC responses)
+ * stay JSON. TELEMETRY_ENCODING_PROTOBUF sends a TelemetryBatch of telemetry.proto, the
+ * ThingsBoard device profile then needs the MQTT Protobuf payload type with TelemetryBatch
+ * as telemetry schema, and a rule node that splits "samples" into ts/values entries.
+ * Not available in gateway mode. */
+#define TELEMETRY_BATCH_ENCODING        TELEMETRY_ENCODING_JSON
+
+/* Gateway mode (ThingsBoard gateway API, the MQTT user is the token of a gateway device):
+ * every slave is a device of its own, named TELEMETRY_GATEWAY_DEVICE_PREFIX + MAC,
+ * and one payload carries the samples of several devices:
+ *
+ *   v1/gateway/connect     {"device":"slave-f4:12:fa:42:a3:dc","type":"espnow_slave"}
+ *   v1/gateway/telemetry   {"slave-f4:12:fa:42:a3:dc":[{"ts":..,"values":{..}},..],"slave-..":[..]}
+ *   v1/gateway/disconnect  {"device":"slave-f4:12:fa:42:a3:dc"} when the slave goes offline
+ *
+ * A device is announced before its first live sample of every broker session. Stored
+ * payloads are replayed one per publish, joining them could repeat a device key.
+ * Statistics of the gateway itself stay on TELEMETRY_TOPIC. */
+#define TELEMETRY_GATEWAY_MODE          (0)         // 1: gateway API, 0: all samples on TELEMETRY_TOPIC
+#define TELEMETRY_GATEWAY_TOPIC         "v1/gateway/telemetry"
+#define TELEMETRY_GATEWAY_CONNECT_TOPIC "v1/gateway/connect"
+#define TELEMETRY_GATEWAY_DISCONNECT_TOPIC "v1/gateway/disconnect"
+#define TELEMETRY_GATEWAY_DEVICE_PREFIX "slave-"
+#define TELEMETRY_GATEWAY_DEVICE_TYPE   "espnow_slave"
+#define TELEMETRY_GATEWAY_NAME_SIZE     (sizeof(TELEMETRY_GATEWAY_DEVICE_PREFIX) + 17)
+#define TELEMETRY_GATEWAY_MAX_DEVICES   (256)       // Devices remembered as announced, the oldest is forgotten
+
+#if TELEMETRY_GATEWAY_MODE
+#if TELEMETRY_BATCH_ENCODING != TELEMETRY_ENCODING_JSON
+#error "Gateway mode publishes JSON only"
+#endif
+#define TELEMETRY_BATCH_TOPIC           TELEMETRY_GATEWAY_TOPIC
+#else
+#define TELEMETRY_BATCH_TOPIC           TELEMETRY_TOPIC
+#endif
+
+/* While WiFi or the broker is down the batches go to the outbox (flash), they are
+ * replayed in order once it is back, several stored batches joined per payload. */
+#define TELEMETRY_REPLAY_BURST          (4)         // Replay payloads per telemetry_batch_poll
+#define TELEMETRY_REPLAY_MAX_PENDING    (MQTT_PUBLISH_QUEUE_SIZE / 2)
+
+typedef struct {
+    uint32_t samples;       // Samples added
+    uint32_t batches;       // Payloads handed to mqtt_publish
+    uint32_t dropped;       // Samples lost with a batch the publish queue and the outbox refused
+    uint32_t bytes;         // Payload bytes of the batches and replays
+    uint32_t stored;        // Samples written to the outbox
+    uint32_t replayed;      // Payloads sent from the outbox
+    uint32_t connects;      // Devices announced on v1/gateway/connect (gateway mode)
+    uint32_t encode_us;     // Time spent encoding samples
+    uint32_t values_sent;       // Values that passed telemetry_filter_apply
+    uint32_t values_suppressed; // Values left out, within their deadband or min interval
+} telemetry_batch_stats_t;
+
+int64_t telemetry_time_ms(int64_t capture_time_us);
+void telemetry_device_name(const uint8_t mac[6], char *buf, size_t size);
+
+void telemetry_batch_add(const table_device_t *record, int64_t capture_time_us);
+void telemetry_batch_poll(void);
+bool telemetry_batch_flush(void);
+void telemetry_batch_stats_get(telemetry_batch_stats_t *stats);
+
+#endif // TELEMETRY_H
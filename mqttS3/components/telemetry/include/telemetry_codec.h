@@ -0,0 +1,56 @@
+#ifndef TELEMETRY_CODEC_H
+#define TELEMETRY_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "json_writer.h"
+#include "proto_writer.h"
+#include "read_serial.h"
+
+/* Encoders of one sample, free of ESP-IDF so that host tools build them as is.
+ *
+ * JSON:     {"ts":1718000000000,"values":{"temperature_rdo":28.370,...}}
+ * Protobuf: TelemetrySample of telemetry.proto, written as field 1 of TelemetryBatch,
+ *           so that samples (and whole batches) concatenated are a TelemetryBatch. */
+#define TELEMETRY_ENCODING_JSON         (0)
+#define TELEMETRY_ENCODING_PROTOBUF     (1)
+
+#define TELEMETRY_JSON_SIZE             (160)       // Largest telemetry object of one record
+#define TELEMETRY_PROTO_SIZE            (48)        // Largest TelemetryBatch.samples field of one record
+#define TELEMETRY_DECIMALS              (3)
+
+// Values of a sample, bit (1 << metric) of a metrics mask
+typedef enum {
+    TELEMETRY_METRIC_TEMPERATURE_RDO,
+    TELEMETRY_METRIC_DO,
+    TELEMETRY_METRIC_TEMPERATURE_PHG,
+    TELEMETRY_METRIC_PH,
+    TELEMETRY_METRIC_CPU_TEMP,
+    TELEMETRY_METRIC_COUNT,
+} telemetry_metric_t;
+
+#define TELEMETRY_METRICS_ALL           ((1u << TELEMETRY_METRIC_COUNT) - 1)
+
+// Field numbers of telemetry.proto
+#define TELEMETRY_PROTO_BATCH_SAMPLES           (1)
+#define TELEMETRY_PROTO_SAMPLE_TS               (1)
+#define TELEMETRY_PROTO_SAMPLE_VALUES           (2)
+#define TELEMETRY_PROTO_VALUES_TEMPERATURE_RDO  (1)
+#define TELEMETRY_PROTO_VALUES_DO               (2)
+#define TELEMETRY_PROTO_VALUES_TEMPERATURE_PHG  (3)
+#define TELEMETRY_PROTO_VALUES_PH               (4)
+#define TELEMETRY_PROTO_VALUES_CPU_TEMP         (5)
+
+const char *telemetry_metric_name(telemetry_metric_t metric);
+float telemetry_metric_value(const table_device_t *record, telemetry_metric_t metric);
+
+void telemetry_values_write(json_writer_t *w, const table_device_t *record);
+void telemetry_values_write_metrics(json_writer_t *w, const table_device_t *record, uint32_t metrics);
+void telemetry_values_proto(proto_writer_t *w, const table_device_t *record, uint32_t metrics);
+size_t telemetry_json(const table_device_t *record, char *buf, size_t size);
+size_t telemetry_proto(const table_device_t *record, uint8_t *buf, size_t size);
+
+size_t telemetry_entry_json(const table_device_t *record, int64_t ts, uint32_t metrics, char *buf, size_t size);
+size_t telemetry_entry_proto(const table_device_t *record, int64_t ts, uint32_t metrics, uint8_t *buf, size_t size);
+
+#endif // TELEMETRY_CODEC_H
@@ -0,0 +1,32 @@
+#ifndef TELEMETRY_FILTER_H
+#define TELEMETRY_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "telemetry_codec.h"
+
+/* Filter stage between table_devices and the batch: a value of a slave is sent when
+ *
+ *   - it is the first one of the slave, or the slave changed status (online/offline),
+ *   - its last send is max_silence_ms old (heartbeat, ThingsBoard keeps seeing the key),
+ *   - it moved past the deadband since its last send and that send is min_interval_ms old.
+ *
+ * The deadband is the larger of deadband_abs and deadband_pct of the last sent value, a
+ * value only passes beyond both. A sample none of whose values pass is not sent at all.
+ * Free of ESP-IDF, times are passed in (esp_timer_get_time). */
+#define TELEMETRY_FILTER_ENABLE         (1)         // 0: every sample carries all values
+#define TELEMETRY_FILTER_MAX_DEVICES    (16)        // Slaves tracked, the least recently seen is forgotten
+
+typedef struct {
+    float deadband_abs;                 // Change in the unit of the value, 0: any change
+    float deadband_pct;                 // Change in % of the last sent value, 0: off
+    uint32_t min_interval_ms;           // Changes are not sent more often, 0: off
+    uint32_t max_silence_ms;            // Sent at least this often, 0: only on change
+} telemetry_filter_config_t;
+
+void telemetry_filter_set_config(telemetry_metric_t metric, const telemetry_filter_config_t *config);
+void telemetry_filter_get_config(telemetry_metric_t metric, telemetry_filter_config_t *config);
+uint32_t telemetry_filter_apply(const table_device_t *record, int64_t now_us);
+void telemetry_filter_reset(void);
+
+#endif // TELEMETRY_FILTER_H
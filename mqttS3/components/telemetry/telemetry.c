@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "deferred_log.h"
+#include "outbox.h"
+#include "telemetry.h"
+#include "telemetry_filter.h"
+
+static const char *TAG = "TELEMETRY";
+
+typedef struct {
+    uint8_t mac[6];
+    uint16_t offset;                        // Entry in s_entries
+    uint16_t len;
+} telemetry_sample_t;
+
+// Batch being filled, only used by the task that publishes telemetry (mqtt_task)
+static char s_entries[TELEMETRY_BATCH_MAX_BYTES];   // Entries of the samples back to back, no separators
+static size_t s_entries_len = 0;
+static telemetry_sample_t s_samples[TELEMETRY_BATCH_MAX_SAMPLES];
+static char s_batch[TELEMETRY_BATCH_MAX_BYTES + 1]; // Payload assembled by batch_assemble
+static size_t s_batch_len = 0;                      // Length of the payload once assembled
+static int s_batch_count = 0;
+static int64_t s_batch_start_time;         // Time the first sample was added
+static telemetry_batch_stats_t s_batch_stats;
+
+// Replay of the outbox, same task
+static char s_replay[TELEMETRY_BATCH_MAX_BYTES + 1];
+static char s_record[OUTBOX_MAX_RECORD];
+static outbox_cursor_t s_replay_cursor;     // Next record to send, ahead of the committed cursor
+static bool s_replay_active = false;
+
+#define REPLAY_MAX_SENT             (TELEMETRY_REPLAY_MAX_PENDING)
+
+typedef enum {
+    REPLAY_SENT,                            // Queued, waiting for its PUBACK
+    REPLAY_ACKED,
+    REPLAY_FAILED,                          // Deleted or without PUBACK in time, sent again
+} replay_state_t;
+
+typedef struct {
+    outbox_cursor_t end;                    // Cursor past the stored batches of the payload
+    replay_state_t state;
+} replay_sent_t;
+
+// Replay payloads in publish order, settled by replay_done in the MQTT tasks, under s_replay_lock
+static portMUX_TYPE s_replay_lock = portMUX_INITIALIZER_UNLOCKED;
+static replay_sent_t s_replay_sent[REPLAY_MAX_SENT];
+static int s_replay_head = 0;               // Oldest payload
+static int s_replay_count = 0;
+static uint32_t s_replay_generation = 0;    // Bumped when the replay starts over, late results are ignored
+
+#if TELEMETRY_GATEWAY_MODE
+// Stored payloads are objects keyed by device, joined ones could repeat a key
+#define REPLAY_DELIMITED            (1)
+#define REPLAY_OPEN                 '{'
+#define REPLAY_CLOSE                '}'
+#define REPLAY_MAX_JOIN             (1)
+
+// Devices announced on v1/gateway/connect during the broker session s_gateway_session
+static uint8_t s_gateway_devices[TELEMETRY_GATEWAY_MAX_DEVICES][6];
+static int s_gateway_device_count = 0;
+static int s_gateway_device_next = 0;       // Entry replaced when the table is full
+static uint32_t s_gateway_session = 0;      // mqtt_publish_stats_t.connects
+#elif TELEMETRY_BATCH_ENCODING == TELEMETRY_ENCODING_PROTOBUF
+// Stored payloads are TelemetryBatch messages, two concatenated are one with the samples of both
+#define REPLAY_DELIMITED            (0)
+#define REPLAY_MAX_JOIN             (TELEMETRY_BATCH_MAX_BYTES)
+#else
+#define REPLAY_DELIMITED            (1)
+#define REPLAY_OPEN                 '['
+#define REPLAY_CLOSE                ']'
+#define REPLAY_MAX_JOIN             (TELEMETRY_BATCH_MAX_BYTES)
+#endif
+
+/**
+ * @brief Converts a capture time (esp_timer_get_time) into a Unix time in ms.
+ * @return 0 while the wall clock is not set.
+ */
+int64_t telemetry_time_ms(int64_t capture_time_us){
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < TELEMETRY_TIME_VALID_S) {
+        return 0;
+    }
+    int64_t now_ms = (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    return now_ms - (esp_timer_get_time() - capture_time_us) / 1000;
+}
+
+/**
+ * @brief Name of the ThingsBoard device of a slave in gateway mode, "slave-f4:12:fa:42:a3:dc".
+ */
+void telemetry_device_name(const uint8_t mac[6], char *buf, size_t size){
+    snprintf(buf, size, TELEMETRY_GATEWAY_DEVICE_PREFIX MACSTR, MAC2STR(mac));
+}
+
+// Batch entry of one sample in TELEMETRY_BATCH_ENCODING, the values in metrics
+static size_t telemetry_entry(const table_device_t *record, int64_t capture_time_us, uint32_t metrics, char *buf, size_t size){
+    int64_t start_time = esp_timer_get_time();
+    int64_t ts = telemetry_time_ms(capture_time_us);
+#if TELEMETRY_BATCH_ENCODING == TELEMETRY_ENCODING_PROTOBUF
+    size_t len = telemetry_entry_proto(record, ts, metrics, (uint8_t *)buf, size);
+#else
+    size_t len = telemetry_entry_json(record, ts, metrics, buf, size);
+#endif
+    s_batch_stats.encode_us += (uint32_t)(esp_timer_get_time() - start_time);
+    return len;
+}
+
+static void batch_published(size_t len){
+    DLOGI(TAG, "Batch of %d samples, %d B", s_batch_count, (int)len);
+    s_batch_stats.batches++;
+    s_batch_stats.bytes += len;
+}
+
+#if TELEMETRY_GATEWAY_MODE
+static bool batch_has_device(int count, const uint8_t mac[6]){
+    for (int i = 0; i < count; i++) {
+        if (memcmp(s_samples[i].mac, mac, 6) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+// Payload length with one more entry of entry_len for mac
+static size_t batch_len_with(const uint8_t mac[6], size_t entry_len){
+#if TELEMETRY_BATCH_ENCODING == TELEMETRY_ENCODING_PROTOBUF
+    // TelemetryBatch.samples fields back to back
+    return s_batch_len + entry_len;
+#else
+    size_t len = (s_batch_count == 0) ? 2 : s_batch_len;    // "[]" or "{}"
+
+#if TELEMETRY_GATEWAY_MODE
+    if (batch_has_device(s_batch_count, mac)) {
+        return len + 1 + entry_len;
+    }
+    // ,"name":[entry]
+    return len + (s_batch_count > 0 ? 1 : 0) + (TELEMETRY_GATEWAY_NAME_SIZE - 1) + 4 + entry_len + 1;
+#else
+    return len + (s_batch_count > 0 ? 1 : 0) + entry_len;
+#endif
+#endif
+}
+
+static void batch_append(const char *text, size_t len){
+    memcpy(s_batch + s_batch_len, text, len);
+    s_batch_len += len;
+}
+
+// Write the payload of the batch to s_batch, 0 terminated (JSON), return its length
+static size_t batch_assemble(void){
+    s_batch_len = 0;
+#if TELEMETRY_GATEWAY_MODE
+    // {"slave-..":[e,e],"slave-..":[e]}, devices in the order of their first sample
+    char name[TELEMETRY_GATEWAY_NAME_SIZE];
+
+    batch_append("{", 1);
+    for (int i = 0; i < s_batch_count; i++) {
+        if (batch_has_device(i, s_samples[i].mac)) {
+            continue;
+        }
+        if (s_batch_len > 1) {
+            batch_append(",", 1);
+        }
+        telemetry_device_name(s_samples[i].mac, name, sizeof(name));
+        batch_append("\"", 1);
+        batch_append(name, strlen(name));
+        batch_append("\":[", 3);
+        for (int j = i; j < s_batch_count; j++) {
+            if (memcmp(s_samples[j].mac, s_samples[i].mac, 6) != 0) {
+                continue;
+            }
+            if (j != i) {
+                batch_append(",", 1);
+            }
+            batch_append(s_entries + s_samples[j].offset, s_samples[j].len);
+        }
+        batch_append("]", 1);
+    }
+    batch_append("}", 1);
+#elif TELEMETRY_BATCH_ENCODING == TELEMETRY_ENCODING_PROTOBUF
+    batch_append(s_entries, s_entries_len);
+#else
+    batch_append("[", 1);
+    for (int i = 0; i < s_batch_count; i++) {
+        if (i > 0) {
+            batch_append(",", 1);
+        }
+        batch_append(s_entries + s_samples[i].offset, s_samples[i].len);
+    }
+    batch_append("]", 1);
+#endif
+    s_batch[s_batch_len] = '\0';
+    return s_batch_len;
+}
+
+static void batch_clear(void){
+    s_batch_len = 0;
+    s_batch_count = 0;
+    s_entries_len = 0;
+}
+
+#if TELEMETRY_GATEWAY_MODE
+static int gateway_device_find(const uint8_t mac[6]){
+    for (int i = 0; i < s_gateway_device_count; i++) {
+        if (memcmp(s_gateway_devices[i], mac, 6) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Forget the announced devices when the broker session changed, it only knows the devices of its session
+static void gateway_session_check(void){
+    mqtt_publish_stats_t stats;
+
+    mqtt_publish_stats_get(&stats);
+    if (stats.connects != s_gateway_session) {
+        s_gateway_session = stats.connects;
+        s_gateway_device_count = 0;
+        s_gateway_device_next = 0;
+    }
+}
+
+// {"device":"slave-..","type":".."} on v1/gateway/connect, or {"device":".."} on v1/gateway/disconnect
+static bool gateway_device_publish(const char *topic, const uint8_t mac[6], bool with_type){
+    char name[TELEMETRY_GATEWAY_NAME_SIZE];
+    char payload[TELEMETRY_GATEWAY_NAME_SIZE + sizeof(TELEMETRY_GATEWAY_DEVICE_TYPE) + 24];
+    json_writer_t w;
+
+    telemetry_device_name(mac, name, sizeof(name));
+    json_writer_init(&w, payload, sizeof(payload));
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "device");
+    json_writer_string(&w, name);
+    if (with_type) {
+        json_writer_key(&w, "type");
+        json_writer_string(&w, TELEMETRY_GATEWAY_DEVICE_TYPE);
+    }
+    json_writer_end_object(&w);
+    return json_writer_finish(&w) > 0 && mqtt_publish(topic, payload, 1);
+}
+
+// Announce the devices of the batch not yet announced in this session, queued ahead of the batch
+static void gateway_connect_batch(void){
+    gateway_session_check();
+    for (int i = 0; i < s_batch_count; i++) {
+        const uint8_t *mac = s_samples[i].mac;
+        if (batch_has_device(i, mac) || gateway_device_find(mac) >= 0) {
+            continue;
+        }
+        if (!gateway_device_publish(TELEMETRY_GATEWAY_CONNECT_TOPIC, mac, true)) {
+            // ThingsBoard also creates the device from its telemetry, announced again with the next batch
+            continue;
+        }
+        s_batch_stats.connects++;
+        if (s_gateway_device_count < TELEMETRY_GATEWAY_MAX_DEVICES) {
+            memcpy(s_gateway_devices[s_gateway_device_count++], mac, 6);
+        } else {
+            memcpy(s_gateway_devices[s_gateway_device_next], mac, 6);
+            s_gateway_device_next = (s_gateway_device_next + 1) % TELEMETRY_GATEWAY_MAX_DEVICES;
+        }
+    }
+}
+
+// Slave went offline, its device is shown inactive until its next sample
+static void gateway_disconnect(const uint8_t mac[6]){
+    // Samples taken before, sent ahead so they do not announce the device again
+    if (batch_has_device(s_batch_count, mac)) {
+        telemetry_batch_flush();
+    }
+    gateway_session_check();
+    int index = gateway_device_find(mac);
+    if (index < 0 || !mqtt_is_connected()) {
+        return;
+    }
+    if (gateway_device_publish(TELEMETRY_GATEWAY_DISCONNECT_TOPIC, mac, false)) {
+        // Keep the table dense, the entry replaced next may move
+        memcpy(s_gateway_devices[index], s_gateway_devices[--s_gateway_device_count], 6);
+        s_gateway_device_next = 0;
+    }
+}
+#endif
+
+/**
+ * @brief Publishes the batch as one payload, or stores it in the outbox while the broker
+ *        is away or older samples are still stored (publish order is kept).
+ * @return true when the batch is empty, queued or stored, false when neither the publish
+ *         queue nor the outbox took it (the batch is kept for the next attempt).
+ */
+bool telemetry_batch_flush(void){
+    if (s_batch_count == 0) {
+        return true;
+    }
+
+    size_t len = batch_assemble();
+    bool direct = outbox_empty() && mqtt_is_connected();
+#if TELEMETRY_GATEWAY_MODE
+    if (direct) {
+        gateway_connect_batch();
+    }
+#endif
+    if (direct && mqtt_publish_len(TELEMETRY_BATCH_TOPIC, s_batch, len, 1)) {
+        batch_published(len);
+    } else if (outbox_append(s_batch, len)) {
+        DLOGI(TAG, "Batch of %d samples stored", s_batch_count);
+        s_batch_stats.stored += s_batch_count;
+    } else if (!direct && mqtt_publish_len(TELEMETRY_BATCH_TOPIC, s_batch, len, 1)) {
+        // No outbox, the publish task holds it until the broker is back
+        batch_published(len);
+    } else {
+        return false;
+    }
+
+    batch_clear();
+    return true;
+}
+
+/**
+ * @brief Adds one sample to the batch, publishes the batch first when the sample does not fit.
+ *
+ * Only the values telemetry_filter_apply lets through are written, a sample without any is left out.
+ *
+ * @param[in] record Values of the slave, in gateway mode an offline slave is disconnected
+ *            instead of sampled.
+ * @param[in] capture_time_us esp_timer_get_time() when the values were read, older samples
+ *            (history kept while offline) get their own timestamp.
+ */
+void telemetry_batch_add(const table_device_t *record, int64_t capture_time_us){
+    char entry[TELEMETRY_JSON_SIZE + 48];      // Also holds TELEMETRY_PROTO_SIZE
+
+    uint32_t metrics = telemetry_filter_apply(record, capture_time_us);
+#if TELEMETRY_GATEWAY_MODE
+    if (!record->status) {
+        // The filter saw the status, all values go out once the slave is back
+        gateway_disconnect(record->peer_addr);
+        return;
+    }
+#endif
+    int sent = __builtin_popcount(metrics);
+    s_batch_stats.values_sent += sent;
+    s_batch_stats.values_suppressed += TELEMETRY_METRIC_COUNT - sent;
+    if (metrics == 0) {
+        return;
+    }
+
+    size_t entry_len = telemetry_entry(record, capture_time_us, metrics, entry, sizeof(entry));
+    if (entry_len == 0) {
+        ESP_LOGE(TAG, "Sample does not fit in %d bytes", (int)sizeof(entry));
+        return;
+    }
+
+    if (s_batch_count > 0 && batch_len_with(record->peer_addr, entry_len) > TELEMETRY_BATCH_MAX_BYTES) {
+        if (!telemetry_batch_flush()) {
+            ESP_LOGW(TAG, "Publish queue and outbox full, drop batch of %d samples", s_batch_count);
+            s_batch_stats.dropped += s_batch_count;
+            batch_clear();
+        }
+    }
+
+    if (s_batch_count == 0) {
+        s_batch_start_time = esp_timer_get_time();
+    }
+    s_batch_len = batch_len_with(record->peer_addr, entry_len);
+    telemetry_sample_t *sample = &s_samples[s_batch_count++];
+    memcpy(sample->mac, record->peer_addr, 6);
+    sample->offset = s_entries_len;
+    sample->len = entry_len;
+    memcpy(s_entries + s_entries_len, entry, entry_len);
+    s_entries_len += entry_len;
+    s_batch_stats.samples++;
+
+    if (s_batch_count >= TELEMETRY_BATCH_MAX_SAMPLES) {
+        telemetry_batch_flush();
+    }
+}
+
+// A record of the outbox is one batch payload as it was to be published
+static bool replay_record_valid(int record_len){
+#if REPLAY_DELIMITED
+    return record_len > 2 && s_record[0] == REPLAY_OPEN && s_record[record_len - 1] == REPLAY_CLOSE;
+#else
+    return record_len > 0 && (uint8_t)s_record[0] == PROTO_TAG_LEN(TELEMETRY_PROTO_BATCH_SAMPLES);
+#endif
+}
+
+/* Joins the stored batches from s_replay_cursor on into one payload, as many as fit (gateway
+ * mode: one batch). Returns the number of batches joined, cursor is moved past them. */
+static int replay_collect(outbox_cursor_t *cursor, size_t *len){
+    int count = 0;
+
+    *len = 0;
+#if REPLAY_DELIMITED
+    s_replay[(*len)++] = REPLAY_OPEN;
+#endif
+    while (count < REPLAY_MAX_JOIN) {
+        outbox_cursor_t next = *cursor;
+        int record_len = outbox_read(&next, s_record, sizeof(s_record));
+        if (record_len <= 0) {
+            *cursor = next;
+            break;
+        }
+        if (!replay_record_valid(record_len)) {
+            ESP_LOGW(TAG, "Stored record is not a batch, skip it");
+            *cursor = next;
+            continue;
+        }
+
+        // Entries of the record without its brackets, read again next time when they do not fit
+        size_t entries_len = record_len - 2 * REPLAY_DELIMITED;
+        size_t separator = (count > 0) ? REPLAY_DELIMITED : 0;
+        if (count > 0 && *len + separator + entries_len + REPLAY_DELIMITED > TELEMETRY_BATCH_MAX_BYTES) {
+            break;
+        }
+        if (separator > 0) {
+            s_replay[(*len)++] = ',';
+        }
+        memcpy(s_replay + *len, s_record + REPLAY_DELIMITED, entries_len);
+        *len += entries_len;
+        count++;
+        *cursor = next;
+    }
+#if REPLAY_DELIMITED
+    s_replay[(*len)++] = REPLAY_CLOSE;
+#endif
+    s_replay[*len] = '\0';
+    return count;
+}
+
+// PUBACK (or not) of a replay payload, ctx holds its slot and generation
+static void replay_done(bool acked, void *ctx){
+    uint32_t tag = (uint32_t)(uintptr_t)ctx;
+    int slot = tag % REPLAY_MAX_SENT;
+
+    taskENTER_CRITICAL(&s_replay_lock);
+    if (tag / REPLAY_MAX_SENT == s_replay_generation) {
+        s_replay_sent[slot].state = acked ? REPLAY_ACKED : REPLAY_FAILED;
+    }
+    taskEXIT_CRITICAL(&s_replay_lock);
+}
+
+/* Commits the cursor past the payloads acknowledged in a row from the oldest on. A payload
+ * without PUBACK starts the replay over at the committed cursor, the later ones are sent
+ * again as well. */
+static void replay_settle(void){
+    outbox_cursor_t commit;
+    bool advance = false;
+    bool failed = false;
+
+    taskENTER_CRITICAL(&s_replay_lock);
+    while (s_replay_count > 0 && s_replay_sent[s_replay_head].state == REPLAY_ACKED) {
+        commit = s_replay_sent[s_replay_head].end;
+        advance = true;
+        s_replay_head = (s_replay_head + 1) % REPLAY_MAX_SENT;
+        s_replay_count--;
+    }
+    for (int i = 0; i < s_replay_count; i++) {
+        if (s_replay_sent[(s_replay_head + i) % REPLAY_MAX_SENT].state == REPLAY_FAILED) {
+            failed = true;
+        }
+    }
+    if (failed) {
+        s_replay_generation++;
+        s_replay_count = 0;
+    } else if (s_replay_count == 0 && s_replay_active) {
+        // Everything before it was acknowledged or skipped as not a batch
+        commit = s_replay_cursor;
+        advance = true;
+    }
+    taskEXIT_CRITICAL(&s_replay_lock);
+
+    if (advance) {
+        outbox_commit(&commit);
+    }
+    if (failed) {
+        DLOGW(TAG, "Replay payload without PUBACK, send again from the committed cursor");
+        outbox_cursor_get(&s_replay_cursor);
+    }
+}
+
+/* Sends the outbox oldest first once the broker is back. Up to TELEMETRY_REPLAY_BURST payloads
+ * per call while fewer than TELEMETRY_REPLAY_MAX_PENDING messages wait in the publish pipeline,
+ * the rest of the queue stays free for live traffic. The cursor is committed past the payloads
+ * the broker acknowledged, a reset before that sends the uncommitted batches again (same ts,
+ * ThingsBoard overwrites them). */
+static void telemetry_replay_poll(void){
+    replay_settle();
+    if (!mqtt_is_connected()) {
+        return;
+    }
+    if (outbox_empty()) {
+        s_replay_active = false;
+        return;
+    }
+    if (!s_replay_active) {
+        outbox_cursor_get(&s_replay_cursor);
+        s_replay_active = true;
+    }
+
+    for (int i = 0; i < TELEMETRY_REPLAY_BURST && s_replay_count < REPLAY_MAX_SENT &&
+                    mqtt_publish_pending() < TELEMETRY_REPLAY_MAX_PENDING; i++) {
+        outbox_cursor_t cursor = s_replay_cursor;
+        size_t len;
+        int count = replay_collect(&cursor, &len);
+        if (count == 0) {
+            s_replay_cursor = cursor;
+            break;
+        }
+
+        // Recorded before the publish, its PUBACK may come first
+        taskENTER_CRITICAL(&s_replay_lock);
+        int slot = (s_replay_head + s_replay_count) % REPLAY_MAX_SENT;
+        s_replay_sent[slot] = (replay_sent_t) { .end = cursor, .state = REPLAY_SENT };
+        s_replay_count++;
+        uint32_t tag = s_replay_generation * REPLAY_MAX_SENT + slot;
+        taskEXIT_CRITICAL(&s_replay_lock);
+
+        if (!mqtt_publish_tracked(TELEMETRY_BATCH_TOPIC, s_replay, len, replay_done, (void *)(uintptr_t)tag)) {
+            taskENTER_CRITICAL(&s_replay_lock);
+            s_replay_count--;
+            taskEXIT_CRITICAL(&s_replay_lock);
+            break;
+        }
+        DLOGI(TAG, "Replay of %d stored batches, %d B", count, (int)len);
+        s_replay_cursor = cursor;
+        s_batch_stats.replayed++;
+        s_batch_stats.bytes += len;
+    }
+}
+
+/**
+ * @brief Publishes the batch once its oldest sample waited TELEMETRY_BATCH_MAX_AGE_MS and
+ *        replays the outbox, call at least once per second.
+ */
+void telemetry_batch_poll(void){
+    if (s_batch_count > 0 && (esp_timer_get_time() - s_batch_start_time) >= TELEMETRY_BATCH_MAX_AGE_MS * 1000LL) {
+        telemetry_batch_flush();
+    }
+    telemetry_replay_poll();
+}
+
+void telemetry_batch_stats_get(telemetry_batch_stats_t *stats){
+    *stats = s_batch_stats;
+}
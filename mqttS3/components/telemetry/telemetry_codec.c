@@ -0,0 +1,133 @@
+#include "telemetry_codec.h"
+
+// Keys are those of the former "key: value" telemetry string
+static const struct {
+    const char *key;
+    uint32_t field;                         // TelemetryValues
+} s_metrics[TELEMETRY_METRIC_COUNT] = {
+    [TELEMETRY_METRIC_TEMPERATURE_RDO] = { "temperature_rdo", TELEMETRY_PROTO_VALUES_TEMPERATURE_RDO },
+    [TELEMETRY_METRIC_DO]              = { "do",              TELEMETRY_PROTO_VALUES_DO },
+    [TELEMETRY_METRIC_TEMPERATURE_PHG] = { "temperature_phg", TELEMETRY_PROTO_VALUES_TEMPERATURE_PHG },
+    [TELEMETRY_METRIC_PH]              = { "ph",              TELEMETRY_PROTO_VALUES_PH },
+    [TELEMETRY_METRIC_CPU_TEMP]        = { "cpu_temp",        TELEMETRY_PROTO_VALUES_CPU_TEMP },
+};
+
+const char *telemetry_metric_name(telemetry_metric_t metric){
+    return s_metrics[metric].key;
+}
+
+float telemetry_metric_value(const table_device_t *record, telemetry_metric_t metric){
+    switch (metric) {
+        case TELEMETRY_METRIC_TEMPERATURE_RDO:
+            return record->data.temperature_rdo;
+        case TELEMETRY_METRIC_DO:
+            return record->data.do_value;
+        case TELEMETRY_METRIC_TEMPERATURE_PHG:
+            return record->data.temperature_phg;
+        case TELEMETRY_METRIC_PH:
+            return record->data.ph_value;
+        default:
+            return record->data.temperature_mcu;
+    }
+}
+
+/**
+ * @brief Writes the values of one record as members of the current object.
+ */
+void telemetry_values_write(json_writer_t *w, const table_device_t *record){
+    telemetry_values_write_metrics(w, record, TELEMETRY_METRICS_ALL);
+}
+
+/**
+ * @brief Writes the values of one record in metrics (bit per telemetry_metric_t) as members of the current object.
+ */
+void telemetry_values_write_metrics(json_writer_t *w, const table_device_t *record, uint32_t metrics){
+    for (int metric = 0; metric < TELEMETRY_METRIC_COUNT; metric++) {
+        if (metrics & (1u << metric)) {
+            json_writer_key(w, s_metrics[metric].key);
+            json_writer_float(w, telemetry_metric_value(record, metric), TELEMETRY_DECIMALS);
+        }
+    }
+}
+
+/**
+ * @brief Writes the values of one record in metrics as the fields of a TelemetryValues message.
+ *
+ * The floats go out as read, not rounded to TELEMETRY_DECIMALS, zero values are written too.
+ */
+void telemetry_values_proto(proto_writer_t *w, const table_device_t *record, uint32_t metrics){
+    for (int metric = 0; metric < TELEMETRY_METRIC_COUNT; metric++) {
+        if (metrics & (1u << metric)) {
+            proto_writer_float(w, s_metrics[metric].field, telemetry_metric_value(record, metric));
+        }
+    }
+}
+
+/**
+ * @brief Compact telemetry object of one record.
+ * @return Length written to buf, 0 when it does not fit.
+ */
+size_t telemetry_json(const table_device_t *record, char *buf, size_t size){
+    json_writer_t w;
+
+    json_writer_init(&w, buf, size);
+    json_writer_begin_object(&w);
+    telemetry_values_write(&w, record);
+    json_writer_end_object(&w);
+    return json_writer_finish(&w);
+}
+
+/**
+ * @brief TelemetryValues message of one record, the binary counterpart of telemetry_json.
+ * @return Length written to buf, 0 when it does not fit.
+ */
+size_t telemetry_proto(const table_device_t *record, uint8_t *buf, size_t size){
+    proto_writer_t w;
+
+    proto_writer_init(&w, buf, size);
+    telemetry_values_proto(&w, record, TELEMETRY_METRICS_ALL);
+    return proto_writer_finish(&w);
+}
+
+/**
+ * @brief Batch entry of one sample, {"ts":..,"values":{..}} or {..} when ts is 0 (no wall clock),
+ *        with the values in metrics.
+ * @return Length written to buf, 0 when it does not fit.
+ */
+size_t telemetry_entry_json(const table_device_t *record, int64_t ts, uint32_t metrics, char *buf, size_t size){
+    json_writer_t w;
+
+    json_writer_init(&w, buf, size);
+    json_writer_begin_object(&w);
+    if (ts > 0) {
+        json_writer_key(&w, "ts");
+        json_writer_int(&w, ts);
+        json_writer_key(&w, "values");
+        json_writer_begin_object(&w);
+        telemetry_values_write_metrics(&w, record, metrics);
+        json_writer_end_object(&w);
+    } else {
+        telemetry_values_write_metrics(&w, record, metrics);
+    }
+    json_writer_end_object(&w);
+    return json_writer_finish(&w);
+}
+
+/**
+ * @brief Batch entry of one sample, TelemetryBatch.samples holding ts (left out when 0) and the values in metrics.
+ * @return Length written to buf, 0 when it does not fit.
+ */
+size_t telemetry_entry_proto(const table_device_t *record, int64_t ts, uint32_t metrics, uint8_t *buf, size_t size){
+    proto_writer_t w;
+
+    proto_writer_init(&w, buf, size);
+    proto_writer_begin_message(&w, TELEMETRY_PROTO_BATCH_SAMPLES);
+    if (ts > 0) {
+        proto_writer_int(&w, TELEMETRY_PROTO_SAMPLE_TS, ts);
+    }
+    proto_writer_begin_message(&w, TELEMETRY_PROTO_SAMPLE_VALUES);
+    telemetry_values_proto(&w, record, metrics);
+    proto_writer_end_message(&w);
+    proto_writer_end_message(&w);
+    return proto_writer_finish(&w);
+}
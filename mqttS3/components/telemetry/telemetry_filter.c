@@ -0,0 +1,118 @@
+#include <math.h>
+#include <string.h>
+#include "telemetry_filter.h"
+
+typedef struct {
+    uint8_t mac[6];
+    bool used;
+    bool status;
+    int64_t seen_time;                          // Last sample, picks the entry replaced
+    float sent[TELEMETRY_METRIC_COUNT];         // Last value sent
+    int64_t sent_time[TELEMETRY_METRIC_COUNT];
+} telemetry_filter_device_t;
+
+/* Pond chemistry moves slowly, a sensor reading jitters by a few units of its last digit.
+ * Heartbeat every 5 min, the CPU temperature of the slave every 10 min. */
+static telemetry_filter_config_t s_configs[TELEMETRY_METRIC_COUNT] = {
+    [TELEMETRY_METRIC_TEMPERATURE_RDO] = { .deadband_abs = 0.1f,  .min_interval_ms = 10000, .max_silence_ms = 300000 },
+    [TELEMETRY_METRIC_DO]              = { .deadband_abs = 0.05f, .deadband_pct = 1.0f, .min_interval_ms = 10000, .max_silence_ms = 300000 },
+    [TELEMETRY_METRIC_TEMPERATURE_PHG] = { .deadband_abs = 0.1f,  .min_interval_ms = 10000, .max_silence_ms = 300000 },
+    [TELEMETRY_METRIC_PH]              = { .deadband_abs = 0.02f, .min_interval_ms = 10000, .max_silence_ms = 300000 },
+    [TELEMETRY_METRIC_CPU_TEMP]        = { .deadband_abs = 1.0f,  .min_interval_ms = 60000, .max_silence_ms = 600000 },
+};
+
+// Only used by the task that publishes telemetry (mqtt_task)
+static telemetry_filter_device_t s_devices[TELEMETRY_FILTER_MAX_DEVICES];
+
+/**
+ * @brief Replaces the filter of one metric, takes effect with the next sample.
+ */
+void telemetry_filter_set_config(telemetry_metric_t metric, const telemetry_filter_config_t *config){
+    if (metric < TELEMETRY_METRIC_COUNT) {
+        s_configs[metric] = *config;
+    }
+}
+
+void telemetry_filter_get_config(telemetry_metric_t metric, telemetry_filter_config_t *config){
+    if (metric < TELEMETRY_METRIC_COUNT) {
+        *config = s_configs[metric];
+    }
+}
+
+/**
+ * @brief Forgets the values sent, the next sample of every slave is sent in full.
+ */
+void telemetry_filter_reset(void){
+    memset(s_devices, 0, sizeof(s_devices));
+}
+
+#if TELEMETRY_FILTER_ENABLE
+// Entry of mac, a new one (all values sent) replaces a free or the least recently seen entry
+static telemetry_filter_device_t *filter_device(const uint8_t mac[6], bool *is_new){
+    telemetry_filter_device_t *oldest = &s_devices[0];
+
+    for (int i = 0; i < TELEMETRY_FILTER_MAX_DEVICES; i++) {
+        telemetry_filter_device_t *device = &s_devices[i];
+        if (device->used && memcmp(device->mac, mac, 6) == 0) {
+            *is_new = false;
+            return device;
+        }
+        if (!device->used) {
+            oldest = device;
+        } else if (oldest->used && device->seen_time < oldest->seen_time) {
+            oldest = device;
+        }
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    memcpy(oldest->mac, mac, 6);
+    oldest->used = true;
+    *is_new = true;
+    return oldest;
+}
+
+static bool filter_moved(const telemetry_filter_config_t *config, float sent, float value){
+    // A sensor going to or coming back from NaN is a change
+    if (isnan(sent) || isnan(value)) {
+        return isnan(sent) != isnan(value);
+    }
+    float threshold = config->deadband_abs;
+    float relative = fabsf(sent) * config->deadband_pct / 100.0f;
+    if (relative > threshold) {
+        threshold = relative;
+    }
+    float change = fabsf(value - sent);
+    return (threshold > 0.0f) ? change >= threshold : change > 0.0f;
+}
+#endif
+
+/**
+ * @brief Values of record to send now, their last sent value and time are updated.
+ * @return Bit (1 << metric) per value to send, 0 when the sample can be left out.
+ */
+uint32_t telemetry_filter_apply(const table_device_t *record, int64_t now_us){
+#if TELEMETRY_FILTER_ENABLE
+    bool is_new;
+    telemetry_filter_device_t *device = filter_device(record->peer_addr, &is_new);
+    bool all = is_new || device->status != record->status;
+    uint32_t metrics = 0;
+
+    device->status = record->status;
+    device->seen_time = now_us;
+    for (int metric = 0; metric < TELEMETRY_METRIC_COUNT; metric++) {
+        const telemetry_filter_config_t *config = &s_configs[metric];
+        float value = telemetry_metric_value(record, metric);
+        int64_t silence_ms = (now_us - device->sent_time[metric]) / 1000;
+        bool send = all ||
+                (config->max_silence_ms > 0 && silence_ms >= config->max_silence_ms) ||
+                (silence_ms >= config->min_interval_ms && filter_moved(config, device->sent[metric], value));
+        if (send) {
+            metrics |= 1u << metric;
+            device->sent[metric] = value;
+            device->sent_time[metric] = now_us;
+        }
+    }
+    return metrics;
+#else
+    return TELEMETRY_METRICS_ALL;
+#endif
+}
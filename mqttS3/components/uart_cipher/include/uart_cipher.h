@@ -0,0 +1,46 @@
+#ifndef UART_CIPHER_H
+#define UART_CIPHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "mbedtls/aes.h"
+
+/*
+ * AES-128-CTR for the payload of uart_frame frames.
+ *
+ * The key is expanded once, the context lives as long as the link.
+ * Counter block of a frame:
+ *
+ *   session_id[8] | direction[1] | frame_counter[4] | block_counter[3]
+ *
+ * session_id is agreed in FRAME_CONNECT_REQUEST / FRAME_CONNECT_AGREE (one half from each
+ * side), so a counter is never reused with the same key, even after a restart.
+ * frame_counter is sent in clear before the ciphertext and must increase, old frames are refused.
+ */
+
+#define UART_CIPHER_KEY_SIZE            16
+#define UART_CIPHER_SESSION_ID_SIZE     8
+#define UART_CIPHER_COUNTER_SIZE        4           // Bytes in front of the ciphertext
+
+typedef enum {
+    UART_CIPHER_DIR_S3_TO_C3 = 0,
+    UART_CIPHER_DIR_C3_TO_S3 = 1,
+} uart_cipher_dir_t;
+
+typedef struct {
+    mbedtls_aes_context aes;
+    uint8_t session_id[UART_CIPHER_SESSION_ID_SIZE];
+    uint8_t tx_dir;                                 // uart_cipher_dir_t of frames this side sends
+    bool enabled;
+    uint32_t tx_counter;                            // Counter of the next frame sent
+    uint32_t rx_counter;                            // Next counter accepted
+} uart_cipher_t;
+
+void uart_cipher_init(uart_cipher_t *cipher, const uint8_t key[UART_CIPHER_KEY_SIZE], uart_cipher_dir_t tx_dir);
+void uart_cipher_start(uart_cipher_t *cipher, const uint8_t session_id[UART_CIPHER_SESSION_ID_SIZE]);
+void uart_cipher_stop(uart_cipher_t *cipher);
+size_t uart_cipher_encrypt(uart_cipher_t *cipher, uint8_t *data, size_t len, size_t size);
+int uart_cipher_decrypt(uart_cipher_t *cipher, uint8_t *data, size_t len);
+
+#endif // UART_CIPHER_H
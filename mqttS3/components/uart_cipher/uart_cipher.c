@@ -0,0 +1,88 @@
+#include <string.h>
+#include "uart_cipher.h"
+
+static void uart_cipher_counter_block(const uart_cipher_t *cipher, uint8_t dir, uint32_t frame_counter, uint8_t block[16])
+{
+    memset(block, 0, 16);
+    memcpy(block, cipher->session_id, UART_CIPHER_SESSION_ID_SIZE);
+    block[8] = dir;
+    block[9] = (uint8_t)(frame_counter >> 24);
+    block[10] = (uint8_t)(frame_counter >> 16);
+    block[11] = (uint8_t)(frame_counter >> 8);
+    block[12] = (uint8_t)frame_counter;
+}
+
+static void uart_cipher_crypt(uart_cipher_t *cipher, uint8_t dir, uint32_t frame_counter, uint8_t *data, size_t len)
+{
+    uint8_t nonce_counter[16];
+    uint8_t stream_block[16];
+    size_t nc_off = 0;
+
+    uart_cipher_counter_block(cipher, dir, frame_counter, nonce_counter);
+    mbedtls_aes_crypt_ctr(&cipher->aes, len, &nc_off, nonce_counter, stream_block, data, data);
+}
+
+void uart_cipher_init(uart_cipher_t *cipher, const uint8_t key[UART_CIPHER_KEY_SIZE], uart_cipher_dir_t tx_dir)
+{
+    memset(cipher, 0, sizeof(uart_cipher_t));
+    mbedtls_aes_init(&cipher->aes);
+    mbedtls_aes_setkey_enc(&cipher->aes, key, UART_CIPHER_KEY_SIZE * 8);
+    cipher->tx_dir = tx_dir;
+}
+
+/* Start a session, counters of both directions restart at 0. */
+void uart_cipher_start(uart_cipher_t *cipher, const uint8_t session_id[UART_CIPHER_SESSION_ID_SIZE])
+{
+    memcpy(cipher->session_id, session_id, UART_CIPHER_SESSION_ID_SIZE);
+    cipher->tx_counter = 0;
+    cipher->rx_counter = 0;
+    cipher->enabled = true;
+}
+
+void uart_cipher_stop(uart_cipher_t *cipher)
+{
+    cipher->enabled = false;
+}
+
+/* data holds len bytes of plaintext and has room for size bytes. The plaintext is moved
+   behind the frame counter and encrypted in place. Return the new length, 0 when it does not fit. */
+size_t uart_cipher_encrypt(uart_cipher_t *cipher, uint8_t *data, size_t len, size_t size)
+{
+    if (len + UART_CIPHER_COUNTER_SIZE > size)
+    {
+        return 0;
+    }
+
+    uint32_t frame_counter = cipher->tx_counter++;
+
+    memmove(data + UART_CIPHER_COUNTER_SIZE, data, len);
+    data[0] = (uint8_t)frame_counter;
+    data[1] = (uint8_t)(frame_counter >> 8);
+    data[2] = (uint8_t)(frame_counter >> 16);
+    data[3] = (uint8_t)(frame_counter >> 24);
+    uart_cipher_crypt(cipher, cipher->tx_dir, frame_counter, data + UART_CIPHER_COUNTER_SIZE, len);
+
+    return len + UART_CIPHER_COUNTER_SIZE;
+}
+
+/* Decrypt in place, the plaintext starts at data. Return its length, -1 for a short or replayed frame. */
+int uart_cipher_decrypt(uart_cipher_t *cipher, uint8_t *data, size_t len)
+{
+    if (len < UART_CIPHER_COUNTER_SIZE)
+    {
+        return -1;
+    }
+
+    uint32_t frame_counter = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    if (frame_counter < cipher->rx_counter)
+    {
+        return -1;
+    }
+    cipher->rx_counter = frame_counter + 1;
+
+    len -= UART_CIPHER_COUNTER_SIZE;
+    memmove(data, data + UART_CIPHER_COUNTER_SIZE, len);
+    uart_cipher_crypt(cipher, cipher->tx_dir ^ 1, frame_counter, data, len);
+
+    return (int)len;
+}
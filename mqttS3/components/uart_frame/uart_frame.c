@@ -0,0 +1,227 @@
+#include <string.h>
+#include "uart_frame.h"
+
+// CRC16-CCITT (poly 0x1021), 4-bit table to keep it small
+static const uint16_t s_crc16_table[16] =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+uint16_t uart_frame_crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (crc << 4) ^ s_crc16_table[((crc >> 12) ^ (data[i] >> 4)) & 0x0F];
+        crc = (crc << 4) ^ s_crc16_table[((crc >> 12) ^ (data[i] & 0x0F)) & 0x0F];
+    }
+    return crc;
+}
+
+/* Encode one frame into out (COBS + delimiter). Return the number of bytes to send, 0 on error. */
+size_t uart_frame_encode(uint8_t type, uint8_t flags, uint16_t req_id, const uint8_t *payload, size_t len, uint8_t *out, size_t out_size)
+{
+    uint8_t header[UART_FRAME_HEADER_SIZE];
+    uint8_t crc_bytes[UART_FRAME_CRC_SIZE];
+
+    if (len > UART_FRAME_MAX_PAYLOAD || (len > 0 && payload == NULL))
+    {
+        return 0;
+    }
+
+    size_t raw_len = UART_FRAME_HEADER_SIZE + len + UART_FRAME_CRC_SIZE;
+    if (out_size < raw_len + (raw_len / 254) + 2)
+    {
+        return 0;
+    }
+
+    header[0] = type;
+    header[1] = flags;
+    header[2] = (uint8_t)(req_id & 0xFF);
+    header[3] = (uint8_t)(req_id >> 8);
+    header[4] = (uint8_t)(len & 0xFF);
+    header[5] = (uint8_t)(len >> 8);
+
+    uint16_t crc = uart_frame_crc16(UINT16_MAX, header, UART_FRAME_HEADER_SIZE);
+    crc = uart_frame_crc16(crc, payload, len);
+    crc_bytes[0] = (uint8_t)(crc & 0xFF);
+    crc_bytes[1] = (uint8_t)(crc >> 8);
+
+    // COBS encode header | payload | crc without copying them into a raw buffer first
+    size_t code_index = 0;
+    size_t out_index = 1;
+    uint8_t code = 1;
+
+    for (size_t i = 0; i < raw_len; i++)
+    {
+        uint8_t byte;
+        if (i < UART_FRAME_HEADER_SIZE)
+        {
+            byte = header[i];
+        }
+        else if (i < UART_FRAME_HEADER_SIZE + len)
+        {
+            byte = payload[i - UART_FRAME_HEADER_SIZE];
+        }
+        else
+        {
+            byte = crc_bytes[i - UART_FRAME_HEADER_SIZE - len];
+        }
+
+        if (byte == 0)
+        {
+            out[code_index] = code;
+            code_index = out_index++;
+            code = 1;
+        }
+        else
+        {
+            out[out_index++] = byte;
+            code++;
+            if (code == 0xFF)
+            {
+                out[code_index] = code;
+                code_index = out_index++;
+                code = 1;
+            }
+        }
+    }
+    out[code_index] = code;
+    out[out_index++] = UART_FRAME_DELIMITER;
+
+    return out_index;
+}
+
+// COBS decode in place, return decoded length or 0 when the block structure is broken
+static size_t cobs_decode(uint8_t *buf, size_t len)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < len)
+    {
+        uint8_t code = buf[in++];
+        if (code == 0)
+        {
+            return 0;
+        }
+        for (uint8_t i = 1; i < code; i++)
+        {
+            if (in >= len)
+            {
+                return 0;
+            }
+            buf[out++] = buf[in++];
+        }
+        if (code < 0xFF && in < len)
+        {
+            buf[out++] = 0;
+        }
+    }
+    return out;
+}
+
+void uart_frame_decoder_init(uart_frame_decoder_t *decoder)
+{
+    memset(decoder, 0, sizeof(uart_frame_decoder_t));
+}
+
+/* Drop the partial frame after bytes were lost (e.g. FIFO overflow), restart at the next delimiter. */
+void uart_frame_decoder_resync(uart_frame_decoder_t *decoder)
+{
+    decoder->len = 0;
+    decoder->overflow = true;
+    decoder->overflow_errors++;
+}
+
+static bool uart_frame_decode(uart_frame_decoder_t *decoder)
+{
+    size_t raw_len = cobs_decode(decoder->buffer, decoder->len);
+    if (raw_len < UART_FRAME_HEADER_SIZE + UART_FRAME_CRC_SIZE)
+    {
+        decoder->framing_errors++;
+        return false;
+    }
+
+    const uint8_t *raw = decoder->buffer;
+    uint16_t len = raw[4] | (raw[5] << 8);
+    if (len > UART_FRAME_MAX_PAYLOAD || raw_len != (size_t)UART_FRAME_HEADER_SIZE + len + UART_FRAME_CRC_SIZE)
+    {
+        decoder->framing_errors++;
+        return false;
+    }
+
+    uint16_t crc = raw[raw_len - 2] | (raw[raw_len - 1] << 8);
+    if (uart_frame_crc16(UINT16_MAX, raw, raw_len - UART_FRAME_CRC_SIZE) != crc)
+    {
+        decoder->crc_errors++;
+        return false;
+    }
+
+    decoder->frame.type = raw[0];
+    decoder->frame.flags = raw[1];
+    decoder->frame.req_id = raw[2] | (raw[3] << 8);
+    decoder->frame.len = len;
+    memcpy(decoder->frame.payload, &raw[UART_FRAME_HEADER_SIZE], len);
+    decoder->frames_ok++;
+
+    return true;
+}
+
+/* Feed received bytes, handler is called once per valid frame. Return the number of valid frames. */
+size_t uart_frame_decoder_feed(uart_frame_decoder_t *decoder, const uint8_t *data, size_t len, uart_frame_handler_t handler, void *ctx)
+{
+    size_t frames = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        uint8_t byte = data[i];
+
+        if (byte == UART_FRAME_DELIMITER)
+        {
+            if (!decoder->overflow && decoder->len > 0 && uart_frame_decode(decoder))
+            {
+                frames++;
+                if (handler != NULL)
+                {
+                    handler(&decoder->frame, ctx);
+                }
+            }
+            decoder->len = 0;
+            decoder->overflow = false;
+        }
+        else if (decoder->overflow)
+        {
+            continue;
+        }
+        else if (decoder->len < sizeof(decoder->buffer))
+        {
+            decoder->buffer[decoder->len++] = byte;
+        }
+        else
+        {
+            decoder->overflow = true;
+            decoder->overflow_errors++;
+        }
+    }
+
+    return frames;
+}
+
+void uart_latency_hist_add(uart_latency_hist_t *hist, uint32_t latency_us)
+{
+    static const uint32_t bounds[UART_LATENCY_BUCKETS - 1] = UART_LATENCY_BOUNDS_US;
+    int i = 0;
+
+    while (i < UART_LATENCY_BUCKETS - 1 && latency_us > bounds[i])
+    {
+        i++;
+    }
+    hist->bucket[i]++;
+    hist->count++;
+    hist->sum_us += latency_us;
+    if (latency_us > hist->max_us)
+    {
+        hist->max_us = latency_us;
+    }
+}
@@ -1,113 +1,263 @@
+#include <errno.h>
+#include <stdatomic.h>
 #include "udp_logging.h"
 
-int udp_log_fd;
-static struct sockaddr_in serveraddr;
-static uint8_t buf[UDP_LOGGING_MAX_PAYLOAD_LEN];
-
-int get_socket_error_code(int socket)
-{
-	int result;
-	u32_t optlen = sizeof(int);
-	if(getsockopt(socket, SOL_SOCKET, SO_ERROR, &result, &optlen) == -1) {
-	printf("getsockopt failed");
-	return -1;
-	}
-	return result;
+static const char *TAG = "UDP_LOGGING";
+
+_Static_assert((UDP_LOGGING_SLOTS & (UDP_LOGGING_SLOTS - 1)) == 0, "UDP_LOGGING_SLOTS must be a power of 2");
+
+typedef struct {
+    atomic_bool ready;                  // Written, the shipper may take it
+    uint16_t len;
+    char text[UDP_LOGGING_LINE_MAX];
+} udp_log_slot_t;
+
+/* Ring of log lines. A logging task reserves a slot with a compare and swap on s_head, formats
+ * its line into it and marks it ready, only the shipper task advances s_tail. Nothing in the
+ * logging path blocks or takes a lock: a full ring drops the line. A task preempted between
+ * reserve and ready holds back the lines after its own until it runs again. */
+static udp_log_slot_t s_slots[UDP_LOGGING_SLOTS];
+static atomic_uint s_head;
+static atomic_uint s_tail;
+static atomic_uint s_lines;
+static atomic_uint s_dropped;
+static atomic_uint s_truncated;
+static atomic_bool s_enabled;
+
+// Set by udp_logging_init, taken over by the shipper before its next send
+static struct sockaddr_in s_new_addr;
+static atomic_bool s_addr_changed;
+
+// Shipper task only
+static TaskHandle_t s_shipper = NULL;
+static struct sockaddr_in s_server_addr;
+static int s_fd = -1;
+static uint8_t s_datagram[UDP_LOGGING_MAX_PAYLOAD_LEN];
+static size_t s_datagram_len = 0;
+static uint32_t s_dropped_reported = 0;
+static int64_t s_retry_time = 0;
+static uint32_t s_backoff_ms = 0;
+static uint32_t s_datagrams = 0;
+static uint32_t s_bytes = 0;
+static uint32_t s_send_errors = 0;
+static uint32_t s_reconnects = 0;
+
+// Free slot for one line, NULL (line dropped) when the ring is full
+static udp_log_slot_t *ring_reserve(unsigned int *used){
+    unsigned int head = atomic_load_explicit(&s_head, memory_order_relaxed);
+
+    do {
+        *used = head - atomic_load_explicit(&s_tail, memory_order_acquire);
+        if (*used >= UDP_LOGGING_SLOTS) {
+            atomic_fetch_add_explicit(&s_dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&s_head, &head, head + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return &s_slots[head & (UDP_LOGGING_SLOTS - 1)];
 }
 
-int show_socket_error_reason(int socket)
-{
-	int err = get_socket_error_code(socket);
-	printf("UDP socket error %d %s", err, strerror(err));
-	return err;
+static void ring_commit(udp_log_slot_t *slot, size_t len, unsigned int used){
+    slot->len = (uint16_t)len;
+    atomic_fetch_add_explicit(&s_lines, 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->ready, true, memory_order_release);
+
+    // Half full, do not wait for the flush period
+    if (used == UDP_LOGGING_SLOTS / 2 && s_shipper != NULL && !xPortInIsrContext()) {
+        xTaskNotifyGive(s_shipper);
+    }
 }
 
-void udp_logging_free(va_list l) {
-	int err = 0;
-	char *err_buf;
-    esp_log_set_vprintf(vprintf);
-    if( (err = shutdown(udp_log_fd, 2)) == 0 )
-	{
-		vprintf("\nUDP socket shutdown!", l);
-	}else
-	{
-		asprintf(&err_buf, "\nShutting-down UDP socket failed: %d!\n", err);
-		vprintf(err_buf, l);
-	}
-
-    if( (err = close( udp_log_fd )) == 0 )
-    {
-		vprintf("\nUDP socket closed!", l);
-	}else
-	{
-		asprintf(&err_buf, "\n Closing UDP socket failed: %d!\n", err);
-		vprintf(err_buf, l);
-	}
-    udp_log_fd = 0;
+static void ring_put(const char *str, va_list l){
+    unsigned int used;
+    udp_log_slot_t *slot = ring_reserve(&used);
+
+    if (slot == NULL) {
+        return;
+    }
+    int len = vsnprintf(slot->text, sizeof(slot->text), str, l);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= (int)sizeof(slot->text)) {
+        len = sizeof(slot->text) - 1;
+        slot->text[len - 1] = '\n';
+        atomic_fetch_add_explicit(&s_truncated, 1, memory_order_relaxed);
+    }
+    ring_commit(slot, len, used);
+}
+
+// Ready lines in ring order while they fit, a line still being written stops the copy
+static void datagram_fill(void){
+    unsigned int tail = atomic_load_explicit(&s_tail, memory_order_relaxed);
+
+    if (s_datagram_len == 0) {
+        uint32_t dropped = atomic_load_explicit(&s_dropped, memory_order_relaxed);
+        if (dropped != s_dropped_reported) {
+            s_datagram_len = snprintf((char *)s_datagram, sizeof(s_datagram), "udp_logging: %lu lines dropped\n",
+                                      (unsigned long)(dropped - s_dropped_reported));
+            s_dropped_reported = dropped;
+        }
+    }
+    while (tail != atomic_load_explicit(&s_head, memory_order_acquire)) {
+        udp_log_slot_t *slot = &s_slots[tail & (UDP_LOGGING_SLOTS - 1)];
+        if (!atomic_load_explicit(&slot->ready, memory_order_acquire) ||
+            s_datagram_len + slot->len > sizeof(s_datagram)) {
+            break;
+        }
+        memcpy(s_datagram + s_datagram_len, slot->text, slot->len);
+        s_datagram_len += slot->len;
+        atomic_store_explicit(&slot->ready, false, memory_order_relaxed);
+        atomic_store_explicit(&s_tail, ++tail, memory_order_release);
+    }
 }
-int vsprintfunc(const char* buf, const char *str, va_list l)
-{
-	while(*str != '\0')
-	{
-		if(*str == '%')
-		{
-			str++;
-			if(*str == 's')
-			{
-				char *s = va_arg(l, char*);
-				printf("s: %s\n", s);
-			}
-		str++;
-		}
-	}
-	int len = vsprintf((char*)buf, str, l);
-	return len;
+
+static void socket_close(void){
+    if (s_fd >= 0) {
+        close(s_fd);
+        s_fd = -1;
+    }
 }
-int udp_logging_vprintf( const char *str, va_list l )
-{
-    int err = 0;
-	int len;
-	char task_name[16];
-	char *cur_task = pcTaskGetName(xTaskGetCurrentTaskHandle());
-	strncpy(task_name, cur_task, 16);
-	task_name[15] = '\0';
-	if (strncmp(task_name, "tiT", 16) != 0)
-	{
-		len = vsprintf((char*)buf, str, l);
-		if( (err = sendto(udp_log_fd, buf, len, 0, (struct sockaddr *)&serveraddr, sizeof(serveraddr))) < 0 )
-		{
-			show_socket_error_reason(udp_log_fd);
-			vprintf("\nFreeing UDP Logging. sendto failed!\n", l);
-			udp_logging_free(l);
-			return vprintf("UDP Logging freed!\n\n", l);
-		}
-	}
-	return vprintf( str, l );
+
+// Nothing here logs, a failed send would log into the ring it is emptying
+static bool datagram_send(void){
+    if (atomic_exchange(&s_addr_changed, false)) {
+        s_server_addr = s_new_addr;
+        socket_close();
+    }
+    if (s_fd < 0) {
+        s_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s_fd < 0) {
+            s_send_errors++;
+            return false;
+        }
+        s_reconnects++;
+    }
+    if (sendto(s_fd, s_datagram, s_datagram_len, MSG_DONTWAIT,
+               (struct sockaddr *)&s_server_addr, sizeof(s_server_addr)) < 0) {
+        s_send_errors++;
+        // Out of lwIP buffers is worth another try on the same socket
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOMEM) {
+            socket_close();
+        }
+        return false;
+    }
+    s_datagrams++;
+    s_bytes += s_datagram_len;
+    s_datagram_len = 0;
+    return true;
 }
+
+static void udp_logging_task(void *arg){
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(UDP_LOGGING_FLUSH_MS));
+        if (!atomic_load(&s_enabled)) {
+            socket_close();
+            continue;
+        }
+        // A new address (Wi-Fi back) ends the backoff
+        if (esp_timer_get_time() < s_retry_time && !atomic_load(&s_addr_changed)) {
+            continue;
+        }
+        while (1) {
+            datagram_fill();
+            if (s_datagram_len == 0) {
+                break;
+            }
+            if (!datagram_send()) {
+                s_backoff_ms = (s_backoff_ms == 0) ? UDP_LOGGING_BACKOFF_MIN_MS : MIN(s_backoff_ms * 2, UDP_LOGGING_BACKOFF_MAX_MS);
+                s_retry_time = esp_timer_get_time() + (int64_t)s_backoff_ms * 1000;
+                break;
+            }
+            s_backoff_ms = 0;
+            s_retry_time = 0;
+        }
+    }
+}
+
+/**
+ * Send the log to ipaddr:port over UDP, func (udp_logging_vprintf) becomes the log output.
+ * Called again on every IP_EVENT_STA_GOT_IP: the address is replaced and the shipper opens
+ * a new socket right away.
+ */
 int udp_logging_init(const char *ipaddr, unsigned long port, vprintf_like_t func) {
-	struct timeval send_timeout = {1,0};
-	udp_log_fd = 0;
-	ESP_LOGI("UDP_LOGGING", "initializing udp logging...");
-    if( (udp_log_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
-        ESP_LOGE("UDP_LOGGING", "Cannot open socket!");
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_aton(ipaddr, &addr.sin_addr) == 0) {
+        ESP_LOGE(TAG, "Invalid address %s", ipaddr);
+        return -1;
+    }
+    if (s_shipper == NULL &&
+        xTaskCreate(udp_logging_task, "udp_logging", 3072, NULL, tskIDLE_PRIORITY + 1, &s_shipper) != pdPASS) {
+        ESP_LOGE(TAG, "Cannot start the shipper task");
         return -1;
     }
+    s_new_addr = addr;
+    atomic_store(&s_addr_changed, true);
+    atomic_store(&s_enabled, true);
+    ESP_LOGI(TAG, "Logging to %s:%lu", ipaddr, port);
 
-    uint32_t ip_addr_bytes;
-    inet_aton(ipaddr, &ip_addr_bytes);
-    ESP_LOGI("UDP_LOGGING", "Logging to 0x%lx", ip_addr_bytes);
+    esp_log_set_vprintf(func);
+    xTaskNotifyGive(s_shipper);
+    return 0;
+}
 
-    memset( &serveraddr, 0, sizeof(serveraddr) );
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons( port );
-    serveraddr.sin_addr.s_addr = ip_addr_bytes;
+/**
+ * Log output of udp_logging_init: prints the line as vprintf does and queues it for the
+ * shipper task, a full queue drops it.
+ */
+int udp_logging_vprintf( const char *str, va_list l ){
+    if (atomic_load_explicit(&s_enabled, memory_order_relaxed)) {
+        va_list copy;
+        va_copy(copy, l);
+        ring_put(str, copy);
+        va_end(copy);
+    }
+    return vprintf(str, l);
+}
 
-    int err = setsockopt(udp_log_fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&send_timeout, sizeof(send_timeout));
-	if (err < 0) {
-        ESP_LOGE("UDP_LOGGING", "Failed to set SO_SNDTIMEO. Error %d", err);
-	}
+/**
+ * Queue a line built elsewhere (a deferred_log record), as is and without printing it.
+ * A line longer than UDP_LOGGING_LINE_MAX is dropped, a cut record could not be decoded.
+ */
+void udp_logging_write(const char *line, size_t len){
+    unsigned int used;
+    udp_log_slot_t *slot;
 
-    esp_log_set_vprintf(func);
+    if (!atomic_load_explicit(&s_enabled, memory_order_relaxed)) {
+        return;
+    }
+    if (len > UDP_LOGGING_LINE_MAX) {
+        atomic_fetch_add_explicit(&s_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    slot = ring_reserve(&used);
+    if (slot != NULL) {
+        memcpy(slot->text, line, len);
+        ring_commit(slot, len, used);
+    }
+}
 
-    return 0;
-}
\ No newline at end of file
+/**
+ * Back to the console only, the shipper closes its socket. Lines still queued are sent after
+ * the next udp_logging_init.
+ */
+void udp_logging_free(void){
+    esp_log_set_vprintf(vprintf);
+    atomic_store(&s_enabled, false);
+    if (s_shipper != NULL) {
+        xTaskNotifyGive(s_shipper);
+    }
+}
+
+void udp_logging_stats_get(udp_logging_stats_t *stats){
+    stats->lines = atomic_load(&s_lines);
+    stats->dropped = atomic_load(&s_dropped);
+    stats->truncated = atomic_load(&s_truncated);
+    stats->datagrams = s_datagrams;
+    stats->bytes = s_bytes;
+    stats->send_errors = s_send_errors;
+    stats->reconnects = s_reconnects;
+}
@@ -12,6 +12,12 @@
 #include "pub_sub_client.h"
 #include "read_serial.h"
 #include "iot_button.h"
+#include "telemetry.h"
+#include "outbox.h"
+#include "json_reader.h"
+#include "udp_logging.h"
+#include "esp_netif_sntp.h"
+#include "esp_heap_caps.h"
 
 static const char *TAG = "ESP-NOW Master";
 
@@ -44,103 +50,851 @@ uint16_t data2mqtt[120];
     float do_value;
 
 
-int compare_mac_addresses(const char *mac_s, const uint8_t *mac_m) {
-    uint8_t mac_bytes[6];
-    int values[6];
-    
-    // Parse the string MAC address
-    if (sscanf(mac_s, "%x:%x:%x:%x:%x:%x", &values[0], &values[1], &values[2],
-               &values[3], &values[4], &values[5]) != 6) {
-        return 0; // Invalid format
+// "f4:12:fa:42:a3:dc" (or '-' separated) of len characters, not 0 terminated
+static bool parse_mac(const char *text, size_t len, uint8_t mac[6]) {
+    if (len != 17) {
+        return false;
     }
-    
-    // Convert parsed values to bytes
     for (int i = 0; i < 6; i++) {
-        mac_bytes[i] = (uint8_t)values[i];
+        uint8_t byte = 0;
+        for (int j = 0; j < 2; j++) {
+            char c = text[i * 3 + j];
+            byte <<= 4;
+            if (c >= '0' && c <= '9') {
+                byte |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                byte |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                byte |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        if (i < 5 && text[i * 3 + 2] != ':' && text[i * 3 + 2] != '-') {
+            return false;
+        }
+        mac[i] = byte;
     }
-    
-    // Compare the two MAC addresses
-    return memcmp(mac_bytes, mac_m, 6) == 0;
+    return true;
 }
 
-void send_data(table_device_t sensor_data){
-    char data[200];
-    // uint8_t data_u[100];
-    ESP_LOGI(TAG,"Receive data from queue successfully");
-            // get_data(&temperature_rdo, &do_value, &temperature_phg, &ph_value);     //temperature_rdo  do_value temperature_phg ph_value
-            sprintf(data, "temperature_rdo: %f, do: %f, temperature_phg: %f, ph: %f, cpu_temp: %f ",sensor_data.data.temperature_rdo,sensor_data.data.do_value,sensor_data.data.temperature_phg, sensor_data.data.ph_value, sensor_data.data.temperature_mcu);
-            // xEventGroupWaitBits(g_wifi_event, g_constant_wifi_connected_bit, pdFALSE, pdTRUE, portMAX_DELAY);
-            //g_index_queue=0;
-            data_to_mqtt(data, "v1/devices/me/telemetry",500, 1);
+#define TELEMETRY_BENCHMARK (0)             // 1: compare the telemetry encoders once MQTT is connected
+#define TELEMETRY_BENCHMARK_ROUNDS (1000)   // Payloads encoded per encoder
+#define TELEMETRY_BENCHMARK_PUBLISHES (100) // Payloads published at QoS 0 per encoder
+#define SNTP_SERVER "pool.ntp.org"          // Wall clock for the ts of batched telemetry
+
+// Samples are published in batches by telemetry_batch_x, from mqtt_task only
+static void send_data(const table_device_t *record){
+    telemetry_batch_add(record, esp_timer_get_time());
+}
+
+#define RPC_MAX_TOKENS (32)                 // Tokens of one RPC request, requests with more are refused
+#define RPC_BENCHMARK (0)                   // 1: compare the RPC handlers once MQTT is connected
+#define RPC_BENCHMARK_BURST (200)           // Requests handled back to back per handler
+
+// params.mac of a tokenized request, parsed to binary
+static bool rpc_param_mac(const char *data, const json_token_t *tokens, int params, uint8_t mac[6]) {
+    int mac_index = json_reader_find(data, tokens, params, "mac");
+
+    if (mac_index < 0 || tokens[mac_index].type != JSON_TOKEN_STRING) {
+        return false;
+    }
+    if (!parse_mac(data + tokens[mac_index].start, tokens[mac_index].len, mac)) {
+        ESP_LOGW(TAG, "Invalid MAC %.*s", tokens[mac_index].len, data + tokens[mac_index].start);
+        return false;
+    }
+    return true;
+}
+
+// Answer of a tokenized RPC request {"method":..,"params":{"mac":"..","messages":..}}, "{}" when the MAC is unknown
+static size_t rpc_read_reply(const char *data, const json_token_t *tokens, char *reply, size_t size) {
+    uint8_t mac[6];
+    int params = json_reader_find(data, tokens, 0, "params");
+
+    if (json_reader_find(data, tokens, params, "messages") < 0 || !rpc_param_mac(data, tokens, params, mac)) {
+        return 0;
+    }
+
+    table_device_t record;
+    if (uart_table_find(mac, &record) < 0) {
+        return strlcpy(reply, "{}", size);
+    }
+    return telemetry_json(&record, reply, size);
+}
+
+/*
+ * RPC requests routed to a slave: {"method":"toggleRelay","params":{"mac":".."}}
+ *
+ *   MQTT request id -> route entry -> FRAME_SLAVE_COMMAND (UART req_id) -> ESP-NOW command
+ *   -> answer of the slave -> FRAME_SLAVE_RESULT -> v1/devices/me/rpc/response/<id>
+ *
+ * The command is held until the master is awake (mqtt_task wakes it when commands are
+ * pending). The reply carries the latency of each stage:
+ *   gateway  request received to result, minus the time on the master (command held,
+ *            wake up, UART both ways)
+ *   master   command received by the master to ESP-NOW send
+ *   espnow   ESP-NOW send to answer of the slave
+ *   total    request received to reply queued
+ * A request without result after RPC_ROUTE_TIMEOUT_US is answered with an error, its late
+ * result is dropped.
+ *
+ * {"method":"toggleRelayGroup","params":{}} takes the same route to every online slave at once,
+ * one group command of the master. Its reply counts the targets and their acknowledgements.
+ */
+#define RPC_ROUTE_METHOD "toggleRelay"
+#define RPC_ROUTE_GROUP_METHOD "toggleRelayGroup"
+#define RPC_ROUTE_MAX (4)                   // Routed requests waiting for their slave at the same time
+#define RPC_ROUTE_SLAVE_TIMEOUT_MS (1000)   // Wait of the master for the answer of the slave
+#define RPC_ROUTE_GROUP_TIMEOUT_MS (4000)   // Group command on the master, up to three rounds of ack slots
+#define RPC_ROUTE_UART_MARGIN_MS (500)      // UART round trip on top of the slave timeout
+#define RPC_ROUTE_TIMEOUT_US (5 * 1000000)  // Request to reply, covers a master that does not wake up
+#define RPC_ROUTE_REPLY_SIZE (256)
+
+typedef struct {
+    bool in_use;
+    bool group;                             // toggleRelayGroup, mac unused
+    uint8_t seq;                            // Tells a late UART result from the current request
+    uint8_t mac[6];
+    int64_t received_time;                  // Request received from the broker
+    char topic[MQTT_PUBLISH_TOPIC_SIZE];    // Request topic, the reply goes to .../response/<id>
+} rpc_route_t;
+
+typedef struct {
+    uint32_t requests;
+    uint32_t ok;
+    uint32_t busy;                          // No free entry or command queue full
+    uint32_t offline;                       // Slave unknown to the gateway or the master
+    uint32_t master_errors;                 // NACK or no FRAME_SLAVE_RESULT in time
+    uint32_t slave_timeouts;                // No answer of the slave on the master
+    uint32_t expired;                       // No result within RPC_ROUTE_TIMEOUT_US
+    uint32_t total_max_us;
+    uint32_t gateway_max_us;
+    uint32_t master_max_us;
+    uint32_t espnow_max_us;
+    uint64_t total_sum_us;                  // Of the requests answered ok
+} rpc_route_stats_t;
+
+static rpc_route_t s_routes[RPC_ROUTE_MAX];
+static rpc_route_stats_t s_route_stats;
+static uint8_t s_route_seq = 0;
+static SemaphoreHandle_t s_route_mutex;     // Routes and stats, used by the MQTT, UART rx and mqtt_task tasks
+static TaskHandle_t s_mqtt_task_handle = NULL;
+
+static void max_update(uint32_t *max, uint32_t value) {
+    if (value > *max) {
+        *max = value;
+    }
+}
+
+// Publish the reply of a request taken from s_routes, result NULL when the master sent none
+static void rpc_route_reply(const rpc_route_t *route, const char *error, const uart_slave_result_t *result, const table_device_t *record,
+                            const uart_group_result_t *group) {
+    char reply[RPC_ROUTE_REPLY_SIZE];
+    char mac[18];
+    json_writer_t w;
+    uint32_t total_us = (uint32_t)(esp_timer_get_time() - route->received_time);
+    uint32_t master_us = (result != NULL) ? result->queue_us + result->espnow_us : 0;
+
+    snprintf(mac, sizeof(mac), MACSTR, MAC2STR(route->mac));
+    json_writer_init(&w, reply, sizeof(reply));
+    json_writer_begin_object(&w);
+    if (!route->group) {
+        json_writer_key(&w, "mac");
+        json_writer_string(&w, mac);
+    }
+    if (error != NULL) {
+        json_writer_key(&w, "error");
+        json_writer_string(&w, error);
+    }
+    if (record != NULL) {
+        json_writer_key(&w, "relay");
+        json_writer_bool(&w, record->data.relay_state);
+        json_writer_key(&w, "values");
+        json_writer_begin_object(&w);
+        telemetry_values_write(&w, record);
+        json_writer_end_object(&w);
+    }
+    if (group != NULL) {
+        json_writer_key(&w, "targets");
+        json_writer_uint(&w, group->targets);
+        json_writer_key(&w, "acked");
+        json_writer_uint(&w, group->acked);
+    }
+    json_writer_key(&w, "latency_us");
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "total");
+    json_writer_uint(&w, total_us);
+    if (result != NULL) {
+        json_writer_key(&w, "gateway");
+        json_writer_uint(&w, (total_us > master_us) ? total_us - master_us : 0);
+        json_writer_key(&w, "master");
+        json_writer_uint(&w, result->queue_us);
+        json_writer_key(&w, "espnow");
+        json_writer_uint(&w, result->espnow_us);
+    }
+    json_writer_end_object(&w);
+    json_writer_end_object(&w);
+
+    if (json_writer_finish(&w) == 0) {
+        strlcpy(reply, "{\"error\":\"reply too long\"}", sizeof(reply));
+    }
+    ESP_LOGI(TAG, "RPC reply %s: %s", route->topic, reply);
+    response_mqtt(reply, route->topic);
+
+    xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+    max_update(&s_route_stats.total_max_us, total_us);
+    if (result != NULL) {
+        max_update(&s_route_stats.gateway_max_us, (total_us > master_us) ? total_us - master_us : 0);
+        max_update(&s_route_stats.master_max_us, result->queue_us);
+        max_update(&s_route_stats.espnow_max_us, result->espnow_us);
+    }
+    if (error == NULL) {
+        s_route_stats.ok++;
+        s_route_stats.total_sum_us += total_us;
+    }
+    xSemaphoreGive(s_route_mutex);
 }
 
+// Runs in the UART rx task with the FRAME_SLAVE_RESULT of a route, ctx is its index and seq
+static void rpc_route_result_cb(int length, const uart_frame_t *frame, void *ctx)
+{
+    uintptr_t tag = (uintptr_t)ctx;
+    int index = tag & 0xFF;
+    rpc_route_t route = { .in_use = false };
+    uart_slave_result_t result;
+    uart_group_result_t group;
+    const uart_group_result_t *group_result = NULL;
+
+    xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+    if (s_routes[index].in_use && s_routes[index].seq == (uint8_t)(tag >> 8)) {
+        route = s_routes[index];
+        s_routes[index].in_use = false;
+    }
+    xSemaphoreGive(s_route_mutex);
+
+    if (!route.in_use) {
+        // Already answered as expired
+        return;
+    }
+    if (length < (int)sizeof(result)) {
+        xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+        s_route_stats.master_errors++;
+        xSemaphoreGive(s_route_mutex);
+        rpc_route_reply(&route, "no result from master", NULL, NULL, NULL);
+        return;
+    }
+
+    memcpy(&result, frame->payload, sizeof(result));
+    if (route.group && length >= (int)(sizeof(result) + sizeof(uart_group_result_t))) {
+        memcpy(&group, frame->payload + sizeof(result), sizeof(group));
+        group_result = &group;
+    }
+    if (result.status == UART_SLAVE_OK && group_result != NULL) {
+        rpc_route_reply(&route, NULL, &result, NULL, group_result);
+        return;
+    }
+    if (result.status == UART_SLAVE_OK && !route.group && length >= (int)(sizeof(result) + sizeof(table_device_t))) {
+        table_device_t record;
+        memcpy(&record, frame->payload + sizeof(result), sizeof(record));
+        rpc_route_reply(&route, NULL, &result, &record, NULL);
+        return;
+    }
+
+    const char *error = "slave answer invalid";
+    xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+    if (result.status == UART_SLAVE_TIMEOUT) {
+        error = route.group ? "slaves missing" : "slave timeout";
+        s_route_stats.slave_timeouts++;
+    } else if (result.status == UART_SLAVE_OFFLINE) {
+        error = route.group ? "no slave online" : "slave offline";
+        s_route_stats.offline++;
+    } else {
+        s_route_stats.master_errors++;
+    }
+    xSemaphoreGive(s_route_mutex);
+    rpc_route_reply(&route, error, &result, NULL, group_result);
+}
+
+// Reply right away, the request was not routed
+static void rpc_route_refuse(const uint8_t mac[6], bool group, const char *topic, int64_t received_time, const char *error) {
+    rpc_route_t route = { .group = group, .received_time = received_time };
+
+    memcpy(route.mac, mac, sizeof(route.mac));
+    strlcpy(route.topic, topic, sizeof(route.topic));
+    rpc_route_reply(&route, error, NULL, NULL, NULL);
+}
+
+// Hold the command of a routed request, answered by rpc_route_result_cb or rpc_route_poll
+static void rpc_route_start(const char *data, const json_token_t *tokens, const char *topic, bool group) {
+    int64_t received_time = esp_timer_get_time();
+    uint8_t mac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    int index = -1;
+    uint8_t seq = 0;
+
+    if (!group && !rpc_param_mac(data, tokens, json_reader_find(data, tokens, 0, "params"), mac)) {
+        return;
+    }
+    // The master knows which slaves are online for a group
+    bool known = group || uart_table_find(mac, NULL) >= 0;
+
+    xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+    s_route_stats.requests++;
+    if (!known) {
+        s_route_stats.offline++;
+    } else {
+        for (int i = 0; i < RPC_ROUTE_MAX; i++) {
+            if (!s_routes[i].in_use) {
+                index = i;
+                seq = ++s_route_seq;
+                s_routes[i] = (rpc_route_t) {
+                    .in_use = true,
+                    .group = group,
+                    .seq = seq,
+                    .received_time = received_time,
+                };
+                memcpy(s_routes[i].mac, mac, sizeof(mac));
+                strlcpy(s_routes[i].topic, topic, sizeof(s_routes[i].topic));
+                break;
+            }
+        }
+        if (index < 0) {
+            s_route_stats.busy++;
+        }
+    }
+    xSemaphoreGive(s_route_mutex);
+
+    if (!known) {
+        rpc_route_refuse(mac, group, topic, received_time, "slave unknown");
+        return;
+    }
+    if (index < 0) {
+        rpc_route_refuse(mac, group, topic, received_time, "busy");
+        return;
+    }
+
+    uart_slave_command_t command = {
+        .command = group ? UART_SLAVE_CMD_RELAY_GROUP : UART_SLAVE_CMD_RELAY,
+        .timeout_ms = RPC_ROUTE_SLAVE_TIMEOUT_MS,
+    };
+    memcpy(command.mac, mac, sizeof(mac));
+    void *ctx = (void *)(uintptr_t)((seq << 8) | index);
+    uint32_t master_timeout_ms = group ? RPC_ROUTE_GROUP_TIMEOUT_MS : RPC_ROUTE_SLAVE_TIMEOUT_MS;
+    if (!uart_cmd_queue_send(FRAME_SLAVE_COMMAND, &command, sizeof(command), FRAME_SLAVE_RESULT, rpc_route_result_cb, ctx,
+                             master_timeout_ms + RPC_ROUTE_UART_MARGIN_MS)) {
+        xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+        s_routes[index].in_use = false;
+        s_route_stats.busy++;
+        xSemaphoreGive(s_route_mutex);
+        rpc_route_refuse(mac, group, topic, received_time, "busy");
+        return;
+    }
+    // Wake the master now rather than at the next round of mqtt_task
+    if (s_mqtt_task_handle != NULL) {
+        xTaskNotifyGive(s_mqtt_task_handle);
+    }
+}
+
+/**
+ * @brief Answers the routed requests that waited RPC_ROUTE_TIMEOUT_US, called by mqtt_task.
+ */
+static void rpc_route_poll(void) {
+    int64_t now = esp_timer_get_time();
+
+    for (int i = 0; i < RPC_ROUTE_MAX; i++) {
+        rpc_route_t route = { .in_use = false };
+
+        xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+        if (s_routes[i].in_use && (now - s_routes[i].received_time) > RPC_ROUTE_TIMEOUT_US) {
+            route = s_routes[i];
+            s_routes[i].in_use = false;
+            s_route_stats.expired++;
+        }
+        xSemaphoreGive(s_route_mutex);
+
+        if (route.in_use) {
+            rpc_route_reply(&route, "master not reached", NULL, NULL, NULL);
+        }
+    }
+}
+
+// Runs in the MQTT client task for every message of the RPC topic
 void mqtt_subcriber(esp_mqtt_event_handle_t event)
 {
-    char data_receiv[50];
-    char data[200];
-    strncpy(data_receiv,event->data,event->data_len);
-    data_receiv[event->data_len] = '\0';
-            ESP_LOGI(TAG, "Other event id:%d", event->event_id);
-            ESP_LOGI(TAG, "Other event len:%d", event->data_len);
-            ESP_LOGI(TAG, "Other event data:%s",data_receiv);
-    cJSON* data_sub=cJSON_Parse(data_receiv);
-    cJSON *params=cJSON_GetObjectItem(data_sub,"params");
-    cJSON *command = cJSON_GetObjectItem(params, "abc");
+    char topic[MQTT_PUBLISH_TOPIC_SIZE];
+    char reply[TELEMETRY_JSON_SIZE];
+    json_token_t tokens[RPC_MAX_TOKENS];
+
+    if (event->current_data_offset != 0 || event->data_len != event->total_data_len ||
+        event->topic_len >= sizeof(topic)) {
+        ESP_LOGW(TAG, "RPC request too long, ignored");
+        return;
+    }
+    memcpy(topic, event->topic, event->topic_len);
+    topic[event->topic_len] = '\0';
+    ESP_LOGI(TAG, "RPC %s: %.*s", topic, event->data_len, event->data);
+
+    if (json_reader_parse(event->data, event->data_len, tokens, RPC_MAX_TOKENS) < 0) {
+        ESP_LOGW(TAG, "Invalid RPC request");
+        return;
+    }
+    int method = json_reader_find(event->data, tokens, 0, "method");
+    if (method >= 0 && json_reader_equals(event->data, &tokens[method], RPC_ROUTE_METHOD)) {
+        rpc_route_start(event->data, tokens, topic, false);
+    } else if (method >= 0 && json_reader_equals(event->data, &tokens[method], RPC_ROUTE_GROUP_METHOD)) {
+        rpc_route_start(event->data, tokens, topic, true);
+    } else if (rpc_read_reply(event->data, tokens, reply, sizeof(reply)) > 0) {
+        response_mqtt(reply, topic);
+    }
+}
+
+#if RPC_BENCHMARK
+static uint32_t s_rpc_allocs;
+
+static void *rpc_bench_malloc(size_t size){
+    s_rpc_allocs++;
+    return malloc(size);
+}
+
+/**
+ * @brief Answer of an RPC request {"method":..,"params":{"mac":"..","messages":..}}.
+ *
+ * Tokenized in place, the MAC is parsed to binary once and looked up in table_devices.
+ *
+ * @param[in] data Payload of the request, len bytes, not 0 terminated.
+ * @param[out] reply Telemetry of the slave, "{}" when the MAC is unknown.
+ * @return Length of reply, 0 when the request is invalid or not answered.
+ */
+static size_t rpc_reply(const char *data, size_t len, char *reply, size_t size) {
+    json_token_t tokens[RPC_MAX_TOKENS];
+
+    if (json_reader_parse(data, len, tokens, RPC_MAX_TOKENS) < 0) {
+        ESP_LOGW(TAG, "Invalid RPC request");
+        return 0;
+    }
+    return rpc_read_reply(data, tokens, reply, size);
+}
+
+// Former path: copy to a 0 terminated buffer, cJSON tree, sscanf of the MAC for every slave
+static size_t rpc_reply_legacy(const char *data, size_t len, char *reply, size_t size) {
+    char data_receiv[256];
+    size_t copy_len = (len < sizeof(data_receiv) - 1) ? len : sizeof(data_receiv) - 1;
+    size_t reply_len = 0;
+
+    memcpy(data_receiv, data, copy_len);
+    data_receiv[copy_len] = '\0';
+    cJSON *data_sub = cJSON_Parse(data_receiv);
+    cJSON *params = cJSON_GetObjectItem(data_sub, "params");
     cJSON *messages = cJSON_GetObjectItem(params, "messages");
     cJSON *mac_j = cJSON_GetObjectItem(params, "mac");
+    if (messages != NULL && mac_j != NULL) {
+        reply_len = strlcpy(reply, "{}", size);
+        for (int i = 0; i < MAX_SLAVES; i++) {
+            uint8_t mac[6];
+            unsigned int values[6];
+            if (sscanf(mac_j->valuestring, "%x:%x:%x:%x:%x:%x", &values[0], &values[1], &values[2],
+                       &values[3], &values[4], &values[5]) != 6) {
+                continue;
+            }
+            for (int j = 0; j < 6; j++) {
+                mac[j] = (uint8_t)values[j];
+            }
+            table_device_t record;
+            if (uart_table_copy(i, &record) && memcmp(mac, record.peer_addr, 6) == 0) {
+                reply_len = telemetry_json(&record, reply, size);
+            }
+        }
+    }
+    cJSON_Delete(data_sub);
+    return reply_len;
+}
 
-    if (command != NULL) 
-        ESP_LOGI(TAG,"ABC: %d\n", command->valueint);
+typedef size_t (*rpc_handler_t)(const char *data, size_t len, char *reply, size_t size);
+
+// Handling only, the reply is not published
+static void rpc_benchmark_run(const char *name, rpc_handler_t handle, const char *request){
+    char reply[TELEMETRY_JSON_SIZE];
+    size_t len = strlen(request);
+    int64_t max_time = 0;
+
+    s_rpc_allocs = 0;
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    size_t stack_before = uxTaskGetStackHighWaterMark(NULL);
+    int64_t start_time = esp_timer_get_time();
+    for (int i = 0; i < RPC_BENCHMARK_BURST; i++) {
+        int64_t request_time = esp_timer_get_time();
+        handle(request, len, reply, sizeof(reply));
+        request_time = esp_timer_get_time() - request_time;
+        if (request_time > max_time) {
+            max_time = request_time;
+        }
+    }
+    int64_t burst_time = esp_timer_get_time() - start_time;
+
+    ESP_LOGI(TAG, "RPC %s: avg %lld us, max %lld us per request, %lu allocs per request, heap delta %d B, stack words left %d->%d",
+            name, burst_time / RPC_BENCHMARK_BURST, max_time, (unsigned long)(s_rpc_allocs / RPC_BENCHMARK_BURST),
+            (int)heap_caps_get_free_size(MALLOC_CAP_DEFAULT) - (int)free_before,
+            (int)stack_before, (int)uxTaskGetStackHighWaterMark(NULL));
+}
 
-    ESP_LOGI(TAG,"Topic: %s\n",event->topic);
-    if ((messages != NULL)&&(mac_j != NULL)){
-        ESP_LOGI(TAG,"Messages: %s\n", messages->valuestring);
-        ESP_LOGI(TAG,"MAC: %s\n", mac_j->valuestring);
-        const char *mac_s = mac_j->valuestring;
-    for (int i = 0; i < MAX_SLAVES; i++){
-        // if (memcmp(mess_get->mac, table_devices[i].peer_addr, 6)==0){
-        if (compare_mac_addresses(mac_s, table_devices[i].peer_addr)) {
-        sprintf(data, "temperature_rdo: %f, do: %f, temperature_phg: %f, ph: %f, cpu_temp: %f ",table_devices[i].data.temperature_rdo,table_devices[i].data.do_value,table_devices[i].data.temperature_phg, table_devices[i].data.ph_value, table_devices[i].data.temperature_mcu);
+static void rpc_benchmark(void){
+    cJSON_Hooks hooks = { .malloc_fn = rpc_bench_malloc, .free_fn = free };
+    uint8_t mac[6] = {0xf4, 0x12, 0xfa, 0x42, 0xa3, 0xdc};
+    table_device_t record;
+    char request[128];
+
+    // A slave of the table, the fixed MAC is answered "{}" while the table is empty
+    for (int i = 0; i < MAX_SLAVES; i++) {
+        if (uart_table_copy(i, &record)) {
+            memcpy(mac, record.peer_addr, sizeof(mac));
+            break;
+        }
     }
+    snprintf(request, sizeof(request), "{\"method\":\"getData\",\"params\":{\"messages\":\"get\",\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\"}}",
+            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    cJSON_InitHooks(&hooks);
+    rpc_benchmark_run("cJSON+sscanf", rpc_reply_legacy, request);
+    rpc_benchmark_run("json_reader", rpc_reply, request);
+    cJSON_InitHooks(NULL);
+}
+#endif
+
+#if TELEMETRY_BENCHMARK
+extern esp_mqtt_client_handle_t g_mqtt_client;
+static uint32_t s_bench_allocs;
+static uint32_t s_bench_alloc_bytes;
+
+static void *bench_malloc(size_t size){
+    s_bench_allocs++;
+    s_bench_alloc_bytes += size;
+    return malloc(size);
+}
+
+// Former path: sprintf, strdup + strtok back into numbers, cJSON tree, pretty cJSON_Print
+static size_t telemetry_legacy(const table_device_t *record, char *buf, size_t size){
+    char data[200];
+    sprintf(data, "temperature_rdo: %f, do: %f, temperature_phg: %f, ph: %f, cpu_temp: %f ",record->data.temperature_rdo,record->data.do_value,record->data.temperature_phg, record->data.ph_value, record->data.temperature_mcu);
+
+    cJSON *json_obj = cJSON_CreateObject();
+    char *input_copy = bench_malloc(strlen(data) + 1);
+    strcpy(input_copy, data);
+    char *obj = strtok(input_copy, ": ");
+    char *val = strtok(NULL, ", ");
+    while (obj != NULL && val != NULL) {
+        cJSON_AddNumberToObject(json_obj, obj, strtod(val, NULL));
+        obj = strtok(NULL, ": ");
+        val = strtok(NULL, ", ");
     }
-    response_mqtt(data,event->topic);
+    free(input_copy);
+
+    char *json_data = cJSON_Print(json_obj);
+    size_t len = strlen(json_data);
+    strlcpy(buf, json_data, size);
+    cJSON_Delete(json_obj);
+    cJSON_free(json_data);
+    return len;
+}
+
+// TelemetryValues of telemetry.proto, the binary counterpart of telemetry_json
+static size_t telemetry_protobuf(const table_device_t *record, char *buf, size_t size){
+    return telemetry_proto(record, (uint8_t *)buf, size);
+}
+
+typedef size_t (*telemetry_encoder_t)(const table_device_t *record, char *buf, size_t size);
+
+static void telemetry_benchmark_run(const char *name, telemetry_encoder_t encode, const table_device_t *record){
+    char data[256];
+    size_t len = 0;
+
+    s_bench_allocs = 0;
+    s_bench_alloc_bytes = 0;
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    int64_t start_time = esp_timer_get_time();
+    for (int i = 0; i < TELEMETRY_BENCHMARK_ROUNDS; i++) {
+        len = encode(record, data, sizeof(data));
     }
+    int64_t encode_time = esp_timer_get_time() - start_time;
+    uint32_t encode_allocs = s_bench_allocs;
+    uint32_t encode_alloc_bytes = s_bench_alloc_bytes;
+
+    // Encode and hand over to the client, QoS 0 so that the broker round trip is not measured
+    start_time = esp_timer_get_time();
+    for (int i = 0; i < TELEMETRY_BENCHMARK_PUBLISHES; i++) {
+        len = encode(record, data, sizeof(data));
+        esp_mqtt_client_publish(g_mqtt_client, TELEMETRY_TOPIC, data, len, 0, 0);
+    }
+    int64_t publish_time = esp_timer_get_time() - start_time;
+
+    ESP_LOGI(TAG, "Benchmark %s: %d B, %lld encodes/s, %lld publishes/s, %lu allocs (%lu B) per payload, heap %d B",
+            name, (int)len,
+            TELEMETRY_BENCHMARK_ROUNDS * 1000000LL / encode_time,
+            TELEMETRY_BENCHMARK_PUBLISHES * 1000000LL / publish_time,
+            (unsigned long)(encode_allocs / TELEMETRY_BENCHMARK_ROUNDS), (unsigned long)(encode_alloc_bytes / TELEMETRY_BENCHMARK_ROUNDS),
+            (int)heap_caps_get_free_size(MALLOC_CAP_DEFAULT) - (int)free_before);
+}
+
+static void telemetry_benchmark(void){
+    cJSON_Hooks hooks = { .malloc_fn = bench_malloc, .free_fn = free };
+    table_device_t record = {
+        .peer_addr = {0xf4, 0x12, 0xfa, 0x42, 0xa3, 0xdc},
+        .status = true,
+        .data = { .temperature_mcu = 41.5f, .temperature_rdo = 28.37f, .do_value = 6.82f, .temperature_phg = 28.41f, .ph_value = 7.24f },
+    };
 
+    cJSON_InitHooks(&hooks);
+    telemetry_benchmark_run("sprintf+strtok+cJSON", telemetry_legacy, &record);
+    telemetry_benchmark_run("json_writer", telemetry_json, &record);
+    telemetry_benchmark_run("proto_writer", telemetry_protobuf, &record);
+    cJSON_InitHooks(NULL);
 }
+#endif
+
 QueueHandle_t g_mqtt_queue;
-connect_request mess_button;
 
-static void mqtt_task(void *pvParameters)
+#define GET_DATA_TIMEOUT_MS 500
+#define SUBSCRIBE_REFRESH_US (30 * 1000000)     // Keepalive of the subscription, detects a restarted master
+#define LINK_STATS_INTERVAL_US (60 * 1000000)   // Period of the uart_link telemetry
+
+// Runs in the UART rx task, hand the response over to mqtt_task
+static void get_data_cb(int length, const uart_frame_t *frame, void *ctx)
 {
-    sensor_data_t sensor_data;
-    connect_request mess_getdata;
-    table_device_t res_getdata;
+    if (length == sizeof(table_device_t)) {
+        xQueueSend(g_mqtt_queue, frame->payload, 0);
+    } else {
+        ESP_LOGE(TAG, "Failed to get data, length %d", length);
+    }
+}
 
+// Runs in the UART rx task for every change pushed by the master
+static void delta_cb(int index, const table_device_t *record)
+{
+    if (xQueueSend(g_mqtt_queue, record, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "MQTT queue full, drop delta of index %d", index);
+        return;
+    }
+    xTaskNotifyGive(s_mqtt_task_handle);
+}
+
+// Polling mode for a master without FRAME_SUBSCRIBE
+static void poll_slaves(void)
+{
+    table_device_t res_getdata;
     uint8_t mac_m[] = {0xf4, 0x12, 0xfa, 0x42, 0xa3, 0xdc};
-    memcpy(mess_getdata.message, GET_DATA, sizeof(GET_DATA));
-    memcpy(mess_getdata.mac, mac_m, 6);
-    while(1){
-        vTaskDelay(5000/ portTICK_PERIOD_MS);
 
-        if (!wait_wake_up()) {
-            ESP_LOGE(TAG, "Failed to wake up");
+    // Hold a request for every known slave, they go out in one burst once the master is awake
+    int requests = 0;
+    for (int i = 0; i < MAX_SLAVES; i++) {
+        table_device_t record;
+        if (!uart_table_copy(i, &record)) {
             continue;
         }
-        dump_uart(&mess_getdata, sizeof(mess_getdata));
-        int ret =get_uart(&res_getdata,sizeof(res_getdata),500);
-        if (ret){
-            parse_payload(&res_getdata.data);
-            // xQueueReceive(g_mqtt_queue,&sensor_data,(TickType_t)portMAX_DELAY);
-            // if(xQueueReceive(g_mqtt_queue,&sensor_data,500/ portTICK_PERIOD_MS)){
-                send_data(res_getdata);
-            // }
+        if (uart_cmd_queue_send(FRAME_GET_DATA, record.peer_addr, 6, FRAME_DATA, get_data_cb, NULL, GET_DATA_TIMEOUT_MS)) {
+            requests++;
         }
-        else {
-            ESP_LOGE(TAG, "Failed to get_uart");
-            continue;
+    }
+    if (requests == 0 && uart_cmd_queue_send(FRAME_GET_DATA, mac_m, sizeof(mac_m), FRAME_DATA, get_data_cb, NULL, GET_DATA_TIMEOUT_MS)) {
+        requests++;
+    }
+    if (!wait_wake_up()) {
+        return;
+    }
+
+    // Publish in arrival order, stop when the last outstanding request has timed out
+    while (requests > 0 && xQueueReceive(g_mqtt_queue, &res_getdata, pdMS_TO_TICKS(GET_DATA_TIMEOUT_MS + 100))) {
+        requests--;
+        parse_payload(&res_getdata.data);
+        send_data(&res_getdata);
+    }
+}
+
+// Doorbell to first byte of the master, as telemetry of the gateway
+static void send_wake_stats(void)
+{
+    char data[160];
+    uart_wake_stats_t wake;
+
+    uart_wake_stats_get(&wake);
+    if (wake.count == 0) {
+        return;
+    }
+    snprintf(data, sizeof(data), "{\"wake_latency_us\":%lu,\"wake_latency_max_us\":%lu,\"wake_latency_avg_us\":%lu,\"wake_failures\":%lu}",
+            (unsigned long)wake.last_us, (unsigned long)wake.max_us, (unsigned long)(wake.sum_us / wake.count), (unsigned long)wake.failures);
+    mqtt_publish(TELEMETRY_TOPIC, data, 1);
+}
+
+// Counters of the UART link since boot, request latency histogram of the last period.
+// Buckets of lat: <=1, 2, 5, 10, 20, 50, 100, >100 ms (UART_LATENCY_BOUNDS_US).
+static void send_link_stats(void)
+{
+    char data[400];
+    uart_link_stats_t stats;
+
+    uart_link_stats_get(&stats, true);
+    const uart_latency_hist_t *lat = &stats.latency;
+    snprintf(data, sizeof(data),
+            "{\"uart_link\":{\"tx\":[%llu,%lu],\"rx\":[%llu,%lu],\"err\":[%lu,%lu,%lu],\"timeout\":%lu,\"nack\":%lu,"
+            "\"retry\":%lu,\"wake_fail\":%lu,\"fallback\":%lu,\"lat\":[%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu],\"lat_avg_us\":%lu,\"lat_max_us\":%lu}}",
+            stats.tx_bytes, (unsigned long)stats.tx_frames, stats.rx_bytes, (unsigned long)stats.rx_frames,
+            (unsigned long)stats.crc_errors, (unsigned long)stats.framing_errors, (unsigned long)stats.overflow_errors,
+            (unsigned long)stats.timeouts, (unsigned long)stats.nacks, (unsigned long)stats.retries,
+            (unsigned long)stats.wake_failures, (unsigned long)stats.link_fallbacks,
+            (unsigned long)lat->bucket[0], (unsigned long)lat->bucket[1], (unsigned long)lat->bucket[2], (unsigned long)lat->bucket[3],
+            (unsigned long)lat->bucket[4], (unsigned long)lat->bucket[5], (unsigned long)lat->bucket[6], (unsigned long)lat->bucket[7],
+            (unsigned long)(lat->count ? lat->sum_us / lat->count : 0), (unsigned long)lat->max_us);
+    mqtt_publish(TELEMETRY_TOPIC, data, 1);
+}
+
+// Counters of the publish pipeline and of the outbox since boot
+static void send_publish_stats(void)
+{
+    char data[640];
+    mqtt_publish_stats_t stats;
+    telemetry_batch_stats_t batch;
+    outbox_stats_t outbox;
+
+    mqtt_publish_stats_get(&stats);
+    telemetry_batch_stats_get(&batch);
+    outbox_stats_get(&outbox);
+    snprintf(data, sizeof(data), "{\"mqtt_pub\":{\"queued\":%lu,\"dropped\":%lu,\"sent\":%lu,\"acked\":%lu,\"failed\":%lu,\"ack_max_us\":%lu,"
+            "\"connects\":%lu,\"resumed\":%lu,\"connect_us\":%lu,\"reconnect_us\":%lu,"
+            "\"samples\":%lu,\"batches\":%lu,\"batch_bytes\":%lu,\"samples_dropped\":%lu,\"samples_stored\":%lu,\"replays\":%lu,\"device_connects\":%lu,\"encode_us\":%lu,"
+            "\"values_sent\":%lu,\"values_suppressed\":%lu},"
+            "\"outbox\":{\"segments\":%lu,\"appended\":%lu,\"errors\":%lu,\"evicted\":%lu,\"corrupt\":%lu}}",
+            (unsigned long)stats.queued, (unsigned long)stats.dropped, (unsigned long)stats.sent,
+            (unsigned long)stats.acked, (unsigned long)stats.failed, (unsigned long)stats.ack_max_us,
+            (unsigned long)stats.connects, (unsigned long)stats.resumed, (unsigned long)stats.connect_us, (unsigned long)stats.reconnect_us,
+            (unsigned long)batch.samples, (unsigned long)batch.batches, (unsigned long)batch.bytes, (unsigned long)batch.dropped,
+            (unsigned long)batch.stored, (unsigned long)batch.replayed, (unsigned long)batch.connects, (unsigned long)batch.encode_us,
+            (unsigned long)batch.values_sent, (unsigned long)batch.values_suppressed,
+            (unsigned long)outbox.segments, (unsigned long)outbox.appended, (unsigned long)outbox.append_errors,
+            (unsigned long)outbox.evicted, (unsigned long)outbox.corrupt);
+    mqtt_publish(TELEMETRY_TOPIC, data, 1);
+}
 
+// Routed RPC requests since boot, max latency of each stage
+static void send_rpc_stats(void)
+{
+    char data[320];
+    rpc_route_stats_t stats;
+
+    xSemaphoreTake(s_route_mutex, portMAX_DELAY);
+    stats = s_route_stats;
+    xSemaphoreGive(s_route_mutex);
+    if (stats.requests == 0) {
+        return;
+    }
+    snprintf(data, sizeof(data), "{\"rpc_route\":{\"requests\":%lu,\"ok\":%lu,\"busy\":%lu,\"offline\":%lu,\"master_err\":%lu,"
+            "\"slave_timeout\":%lu,\"expired\":%lu,\"total_avg_us\":%lu,\"max_us\":{\"total\":%lu,\"gateway\":%lu,\"master\":%lu,\"espnow\":%lu}}}",
+            (unsigned long)stats.requests, (unsigned long)stats.ok, (unsigned long)stats.busy, (unsigned long)stats.offline,
+            (unsigned long)stats.master_errors, (unsigned long)stats.slave_timeouts, (unsigned long)stats.expired,
+            (unsigned long)(stats.ok ? stats.total_sum_us / stats.ok : 0), (unsigned long)stats.total_max_us,
+            (unsigned long)stats.gateway_max_us, (unsigned long)stats.master_max_us, (unsigned long)stats.espnow_max_us);
+    mqtt_publish(TELEMETRY_TOPIC, data, 1);
+}
+
+// Lines of the UDP log shipper since boot, lost ones included
+static void send_log_stats(void)
+{
+    char data[224];
+    udp_logging_stats_t stats;
+
+    udp_logging_stats_get(&stats);
+    if (stats.lines == 0 && stats.dropped == 0) {
+        return;
+    }
+    snprintf(data, sizeof(data), "{\"udp_log\":{\"lines\":%lu,\"dropped\":%lu,\"truncated\":%lu,\"datagrams\":%lu,\"bytes\":%lu,"
+            "\"send_errors\":%lu,\"reconnects\":%lu}}",
+            (unsigned long)stats.lines, (unsigned long)stats.dropped, (unsigned long)stats.truncated,
+            (unsigned long)stats.datagrams, (unsigned long)stats.bytes, (unsigned long)stats.send_errors,
+            (unsigned long)stats.reconnects);
+    mqtt_publish(TELEMETRY_TOPIC, data, 1);
+}
+
+// Link of the connectivity monitor since boot
+static void send_connectivity_stats(void)
+{
+    char data[224];
+    connectivity_stats_t stats;
+
+    connectivity_stats_get(&stats);
+    snprintf(data, sizeof(data), "{\"connectivity\":{\"link_checks\":%lu,\"probes\":%lu,\"dns_failures\":%lu,\"tcp_failures\":%lu,"
+            "\"changes\":%lu,\"probe_max_us\":%lu,\"interval_ms\":%lu}}",
+            (unsigned long)stats.link_checks, (unsigned long)stats.probes, (unsigned long)stats.dns_failures,
+            (unsigned long)stats.tcp_failures, (unsigned long)stats.changes, (unsigned long)stats.probe_max_us,
+            (unsigned long)stats.interval_ms);
+    mqtt_publish(TELEMETRY_TOPIC, data, 1);
+}
+
+// Internet back: reconnect the broker now and let mqtt_task replay the outbox without waiting
+static void connectivity_changed(INTERNET_CHECK state)
+{
+    if (state != Internet) {
+        return;
+    }
+    mqtt_reconnect();
+    if (s_mqtt_task_handle != NULL) {
+        xTaskNotifyGive(s_mqtt_task_handle);
+    }
+}
+
+static void mqtt_task(void *pvParameters)
+{
+    table_device_t record;
+    bool subscribed = false;
+    int64_t last_subscribe = 0;
+    int64_t last_link_stats = esp_timer_get_time();
+
+    uart_set_delta_cb(delta_cb);
+    while(1){
+        rpc_route_poll();
+        if (!subscribed || uart_resync_needed() || (esp_timer_get_time() - last_subscribe) > SUBSCRIBE_REFRESH_US) {
+            if (!wait_wake_up()) {
+                ESP_LOGE(TAG, "Failed to wake up");
+                vTaskDelay(5000/ portTICK_PERIOD_MS);
+                continue;
+            }
+
+            int ret = uart_subscribe();
+            if (ret < 0) {
+                ESP_LOGE(TAG, "Subscribe failed, poll the master");
+                subscribed = false;
+                poll_slaves();
+                vTaskDelay(5000/ portTICK_PERIOD_MS);
+                continue;
+            }
+
+            // Publish the whole table after a (re)sync, deltas follow from its version
+            if (ret > 0 || !subscribed) {
+                for (int i = 0; i < MAX_SLAVES; i++) {
+                    table_device_t record;
+                    if (uart_table_copy(i, &record)) {
+                        send_data(&record);
+                    }
+                }
+            }
+            subscribed = true;
+            last_subscribe = esp_timer_get_time();
+            send_wake_stats();
+        } else if (uart_cmd_pending() > 0 && !wait_wake_up()) {
+            // Commands held by other tasks, they stay queued until the master wakes up
+            ESP_LOGE(TAG, "Failed to wake up");
+        }
+
+        if ((esp_timer_get_time() - last_link_stats) > LINK_STATS_INTERVAL_US) {
+            send_link_stats();
+            send_publish_stats();
+            send_rpc_stats();
+            send_log_stats();
+            send_connectivity_stats();
+            last_link_stats = esp_timer_get_time();
         }
 
+        // Woken by a delta pushed by the master or a routed RPC, no UART traffic while nothing changes
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+        while (xQueueReceive(g_mqtt_queue, &record, 0)) {
+            parse_payload(&record.data);
+            send_data(&record);
+        }
+        telemetry_batch_poll();
     }
     vTaskDelete(NULL);
 }
@@ -150,16 +904,14 @@ static void mqtt_task(void *pvParameters)
 
 static void button_longpress_cb(void *arg, void *usr_data)
 {
-    // memcpy(mess_button.message, BUTTON_MSG, sizeof(BUTTON_MSG));
-    memcpy(mess_button.message, BUTTON_MSG, sizeof(BUTTON_MSG));
-    // dump_uart(&mess_button, sizeof(mess_button));
-    wait_wake_up();
-    // delay(500);
-        get_table();
+    // table_devices is kept up to date by the deltas
     log_table_devices();
     
     ESP_ERROR_CHECK(!(BUTTON_LONG_PRESS_START == iot_button_get_event(arg)));
-    dump_uart(&mess_button, sizeof(mess_button));
+    // Sent by mqtt_task with the next wake up
+    if (!uart_cmd_queue_send(FRAME_BUTTON, NULL, 0, 0, NULL, NULL, 0)) {
+        ESP_LOGE(TAG, "Command queue full, drop button");
+    }
     ESP_LOGI(TAG, "long press");
 }
 
@@ -194,7 +946,8 @@ void button_init(){
 #define TOPIC "v1/devices/me/rpc/request/+"
 #define MAX_RSSI 20
 void app_main(void) {
-    g_mqtt_queue = xQueueCreate(10, sizeof(sensor_data_t));
+    g_mqtt_queue = xQueueCreate(UART_RPC_MAX_PENDING, sizeof(table_device_t));
+    s_route_mutex = xSemaphoreCreateMutex();
 
     button_init();
     uart_config();
@@ -206,13 +959,34 @@ void app_main(void) {
     // }
 
     wifi_init();
+    // NVS is up, samples taken while offline go to flash
+    outbox_init();
     wifi_init_sta(SSID,PASS);
+    // No HTTPS probe, the broker session is the link, its host is probed while the session is down.
+    // Started before anything waits on the broker, the session is not up before mqtt_init
+    connectivity_monitor_start(BROKER, mqtt_is_connected, connectivity_changed);
+
+    esp_sntp_config_t sntp_config = ESP_NETIF_SNTP_DEFAULT_CONFIG(SNTP_SERVER);
+    esp_netif_sntp_init(&sntp_config);
 
     
 
     mqtt_init(BROKER, USER_NAME, NULL);
+    // Subscribed once the broker is reached, again in every new session
     subcribe_to_topic(TOPIC,1);
-    xTaskCreate(mqtt_task, "mqtt_task", 5000, NULL, 5, NULL);
+    // Before any wait on the broker, samples are stored in the outbox while it is away
+    xTaskCreate(mqtt_task, "mqtt_task", 5000, NULL, 5, &s_mqtt_task_handle);
+#if TELEMETRY_BENCHMARK || RPC_BENCHMARK
+    while (!mqtt_is_connected()) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+#endif
+#if TELEMETRY_BENCHMARK
+    telemetry_benchmark();
+#endif
+#if RPC_BENCHMARK
+    rpc_benchmark();
+#endif
 
     // data_read=0;
 
@@ -0,0 +1,107 @@
+#include "slave_espnow_protocol.h"
+
+static uint8_t s_own_mac[ESP_NOW_ETH_ALEN];
+static uint8_t send_buffer_group[MAX_DATA_LEN];
+static uint16_t s_group_seq = 0;
+static int16_t s_last_group_id = -1;        // Id of the last executed group command, -1 when none
+static uint8_t s_ack_group_id;
+static TimerHandle_t group_ack_timer;
+
+// Send GROUP_ack to master when the slot of this slave is reached
+static void group_ack_timer_cb(TimerHandle_t xTimer)
+{
+    espnow_group_data_t *buf = (espnow_group_data_t *)send_buffer_group;
+
+    memset(send_buffer_group, 0, sizeof(send_buffer_group));
+    buf->type = ESPNOW_DATA_UNICAST;
+    buf->seq_num = s_group_seq++;
+    buf->crc = 0;
+    strncpy(buf->message, GROUP_ACK_MSG, PACKED_MSG_SIZE - 1);
+    buf->group_id = s_ack_group_id;
+    buf->crc = esp_crc16_le(UINT16_MAX, (uint8_t const *)buf, MAX_DATA_LEN);
+
+    ESP_LOGW(TAG, "Response %s id %d to MAC " MACSTR, GROUP_ACK_MSG, s_ack_group_id, MAC2STR(s_master_unicast_mac.peer_addr));
+
+    if (esp_now_send(s_master_unicast_mac.peer_addr, send_buffer_group, MAX_DATA_LEN) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Send error");
+    }
+}
+
+void group_command_init(void)
+{
+    esp_wifi_get_mac(ESPNOW_WIFI_IF, s_own_mac);
+    group_ack_timer = xTimerCreate("group_ack", 1, pdFALSE, NULL, group_ack_timer_cb);
+}
+
+/* Execute group command if this slave is one of the targets, then answer in its slot.
+ * Called for every broadcast of the saved master, connected or not. */
+void group_command_received(const uint8_t *data, int len)
+{
+    espnow_group_data_t *buf = (espnow_group_data_t *)data;
+    uint16_t crc, crc_cal = 0;
+
+    if (len < sizeof(espnow_group_data_t))
+    {
+        ESP_LOGE(TAG, "Receive group data too short, len:%d", len);
+        return;
+    }
+
+    if (strncmp(buf->message, GROUP_COMMAND_MSG, PACKED_MSG_SIZE) != 0)
+    {
+        return;
+    }
+
+    crc = buf->crc;
+    buf->crc = 0;
+    crc_cal = esp_crc16_le(UINT16_MAX, (uint8_t const *)buf, len);
+    if (crc_cal != crc)
+    {
+        ESP_LOGE(TAG, "CRC check failed. Calculated CRC: %d, Received CRC: %d", crc_cal, crc);
+        return;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < buf->count && i < MAX_GROUP_TARGETS; i++)
+    {
+        if (memcmp(buf->targets[i], s_own_mac, ESP_NOW_ETH_ALEN) == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0)
+    {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Group command %s id %d, slot %d", buf->command, buf->group_id, slot);
+
+    /* A retransmission of an executed command is only acknowledged again. It also reaches a slave
+     * its DISCONNECT left unconnected, the master resends until it gets the lost GROUP_ack. */
+    if (s_last_group_id != buf->group_id)
+    {
+        if (!s_master_unicast_mac.connected)
+        {
+            return;
+        }
+        s_last_group_id = buf->group_id;
+
+        if (strncmp(buf->command, CONTROL_RELAY_MSG, PACKED_MSG_SIZE) == 0)
+        {
+            handle_device(DEVICE_RELAY, false);
+        }
+        else if (strncmp(buf->command, DISCONNECT_NODE_MSG, PACKED_MSG_SIZE) == 0)
+        {
+            handle_device(DISCONNECT_NODE, false);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Unknown group command %s", buf->command);
+        }
+    }
+
+    s_ack_group_id = buf->group_id;
+    TickType_t ticks = pdMS_TO_TICKS((slot + 1) * buf->slot_time_ms);
+    xTimerChangePeriod(group_ack_timer, (ticks > 0) ? ticks : 1, 0);
+}
@@ -70,6 +70,10 @@
 #define STILL_CONNECTED_MSG         "KEEP_connect"
 #define CONTROL_RELAY_MSG           "CONTROL_relay"
 #define DISCONNECT_NODE_MSG         "DISCONNECT_node"
+#define UPLINK_DATA_MSG             "UPLINK_data"
+#define UPLINK_ACK_MSG              "UPLINK_ack"
+#define GROUP_COMMAND_MSG           "GROUP_cmd"
+#define GROUP_ACK_MSG               "GROUP_ack"
 #define NVS_NAMESPACE               "storage"
 #define NVS_KEY_CONNECTED           "connected"
 #define NVS_KEY_KEEP_CONNECT        "keep_connect"
@@ -85,6 +89,17 @@
 #define MAX_PAYLOAD_LEN             120 
 #define PACKED_MSG_SIZE             20
 #define IS_BROADCAST_ADDR(addr)     (memcmp(addr, s_slave_broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
+#define MAX_GROUP_TARGETS           32                   // Max slaves addressed by one group frame
+#define UPLINK_MIN_INTERVAL         (5 * 1000 * 1000)    // 5 seconds between two pushes caused by value change
+#define UPLINK_MIN_EVENT_INTERVAL   (300 * 1000)         // 300 mili seconds between two pushes caused by relay/threshold event
+#define UPLINK_ACK_TIMEOUT          (200 * 1000)         // 200 mili seconds to wait for UPLINK_ack
+#define UPLINK_MAX_RETRY            3
+#define UPLINK_DELTA_TEMPERATURE    0.5                  // Deadband of temperatures (°C)
+#define UPLINK_DELTA_DO             0.2                  // Deadband of DO (mg/L)
+#define UPLINK_DELTA_PH             0.1                  // Deadband of pH
+#define UPLINK_DO_LOW_THRESHOLD     4.0                  // DO alarm level (mg/L)
+#define UPLINK_PH_LOW_THRESHOLD     6.5                  // pH alarm low level
+#define UPLINK_PH_HIGH_THRESHOLD    8.5                  // pH alarm high level
 
 typedef struct {
     uint8_t peer_addr[ESP_NOW_ETH_ALEN];
@@ -146,6 +161,27 @@ typedef struct {
     sensor_data_t payload;
 } __attribute__((packed)) espnow_data_t;
 
+typedef struct {
+    uint8_t type;                                           //[1 bytes]   Broadcast or unicast ESPNOW data.
+    uint16_t seq_num;                                       //[2 bytes]   Sequence number of ESPNOW data.
+    uint16_t crc;                                           //[2 bytes]   CRC16 value of ESPNOW data.
+    char message[PACKED_MSG_SIZE];                          //[20 bytes]  GROUP_cmd or GROUP_ack
+    char command[PACKED_MSG_SIZE];                          //[20 bytes]  Command executed by the targets
+    uint8_t group_id;                                       //[1 bytes]   Id of the command, kept for retransmission
+    uint8_t slot_time_ms;                                   //[1 bytes]   Duration of one ack slot
+    uint8_t count;                                          //[1 bytes]   Number of targets
+    uint8_t targets[MAX_GROUP_TARGETS][ESP_NOW_ETH_ALEN];   //[192 bytes] Target MAC, its position is the ack slot
+} __attribute__((packed)) espnow_group_data_t;
+
+typedef struct {
+    sensor_data_t last_sent;              // Last sample acknowledged by the master
+    sensor_data_t pending;                // Sample waiting for UPLINK_ack
+    bool has_last_sent;                   // last_sent holds a valid sample
+    bool waiting_ack;                     // An UPLINK_data is in flight
+    int retry;                            // Number of resends of the pending sample
+    int64_t last_send_time;               // Time of the last UPLINK_data sent
+} uplink_state_t;
+
 /* Parameters of sending ESPNOW data. */
 typedef struct {
     bool unicast;                         //Send unicast ESPNOW data.
@@ -176,14 +212,26 @@ float read_internal_temperature_sensor(void);
 void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 void slave_wifi_init(void);
 
+// Function to group command
+void group_command_init(void);
+void group_command_received(const uint8_t *data, int len);
+
+// Function to uplink
+void uplink_reset(void);
+void uplink_ack_received(void);
+void uplink_process(void);
+
 // Function to slave espnow
+void read_sensor_data(sensor_data_t *sensor_data);
 void prepare_payload(espnow_data_t *espnow_data, float temperature_mcu, int rssi, float temperature_rdo, float do_value, float temperature_phg, float ph_value, bool relay_state); 
 void parse_payload(espnow_data_t *espnow_data);
 void espnow_data_prepare(slave_espnow_send_param_t *send_param, const char *message);
+void espnow_data_prepare_sample(slave_espnow_send_param_t *send_param, const char *message, const sensor_data_t *sensor_data);
 void espnow_data_parse(uint8_t *data, uint16_t data_len);
 void erase_peer(const uint8_t *peer_mac);
 void add_peer(const uint8_t *peer_mac, bool encrypt); 
 esp_err_t response_specified_mac(const uint8_t *dest_mac, const char *message);
+esp_err_t response_specified_sample(const uint8_t *dest_mac, const char *message, const sensor_data_t *sensor_data);
 void slave_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status);
 void slave_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *data, int len);
 void slave_espnow_task(void *pvParameter);
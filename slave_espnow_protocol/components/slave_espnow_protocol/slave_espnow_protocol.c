@@ -5,11 +5,24 @@ static char message_packed[MAX_PAYLOAD_LEN];
 static const uint8_t s_slave_broadcast_mac[ESP_NOW_ETH_ALEN] = SLAVE_BROADCAST_MAC;
 static slave_espnow_send_param_t send_param;
 static slave_espnow_send_param_t send_param_specified;
+static SemaphoreHandle_t send_specified_mutex;             // send_param_specified is shared by slave_espnow_task and the WiFi task
 static uint16_t s_espnow_seq[ESPNOW_DATA_MAX] = { 0, 0 };
 mac_master_t s_master_unicast_mac;
 TaskHandle_t slave_espnow_handle = NULL;
 EventGroupHandle_t xEventGroupLightSleep;
 
+/* Read the current sensor values of the node. */
+void read_sensor_data(sensor_data_t *sensor_data)
+{
+    sensor_data->temperature_mcu = read_internal_temperature_sensor();
+    sensor_data->rssi = rssi;
+    sensor_data->temperature_rdo = 23.1;
+    sensor_data->do_value = 7.6;
+    sensor_data->temperature_phg = 24.0;
+    sensor_data->ph_value = 7.2;
+    sensor_data->relay_state = relay_state;
+}
+
 /* Prepare ESPNOW data payload to be sent. */
 void prepare_payload(espnow_data_t *espnow_data, float temperature_mcu, int rssi, float temperature_rdo, float do_value, float temperature_phg, float ph_value, bool relay_state) 
 {
@@ -49,6 +62,15 @@ void parse_payload(espnow_data_t *espnow_data)
 
 /* Prepare ESPNOW data to be sent. */
 void espnow_data_prepare(slave_espnow_send_param_t *send_param, const char *message)
+{
+    sensor_data_t sensor_data;
+
+    read_sensor_data(&sensor_data);
+    espnow_data_prepare_sample(send_param, message, &sensor_data);
+}
+
+/* Prepare ESPNOW data to be sent with a given sample as payload. */
+void espnow_data_prepare_sample(slave_espnow_send_param_t *send_param, const char *message, const sensor_data_t *sensor_data)
 {
     espnow_data_t *buf = (espnow_data_t *)send_param->buffer;
 
@@ -73,8 +95,8 @@ void espnow_data_prepare(slave_espnow_send_param_t *send_param, const char *mess
     ESP_LOGI(TAG, "     crc: %d", buf->crc);
     ESP_LOGI(TAG, "     message: %s", buf->message);
 
-    float temperature = read_internal_temperature_sensor();
-    prepare_payload(buf, temperature, rssi, 23.1, 7.6, 24.0, 7.2, relay_state);
+    prepare_payload(buf, sensor_data->temperature_mcu, sensor_data->rssi, sensor_data->temperature_rdo, sensor_data->do_value, 
+                    sensor_data->temperature_phg, sensor_data->ph_value, sensor_data->relay_state);
 
     buf->crc = esp_crc16_le(UINT16_MAX, (uint8_t const *)buf, send_param->len);
 }
@@ -167,9 +189,20 @@ void add_peer(const uint8_t *peer_mac, bool encrypt)
 /* Function to send a unicast response*/
 esp_err_t response_specified_mac(const uint8_t *dest_mac, const char *message)
 {
+    sensor_data_t sensor_data;
+
+    read_sensor_data(&sensor_data);
+    return response_specified_sample(dest_mac, message, &sensor_data);
+}
+
+/* Function to send a unicast response carrying a given sample*/
+esp_err_t response_specified_sample(const uint8_t *dest_mac, const char *message, const sensor_data_t *sensor_data)
+{
+    xSemaphoreTake(send_specified_mutex, portMAX_DELAY);
+
     send_param_specified.len = MAX_DATA_LEN;
     memcpy(send_param_specified.dest_mac, dest_mac, ESP_NOW_ETH_ALEN);
-    espnow_data_prepare(&send_param_specified, message);
+    espnow_data_prepare_sample(&send_param_specified, message, sensor_data);
 
     // Send the unicast response
     if (esp_now_send(send_param_specified.dest_mac, send_param_specified.buffer, send_param_specified.len) != ESP_OK) 
@@ -179,6 +212,8 @@ esp_err_t response_specified_mac(const uint8_t *dest_mac, const char *message)
         // vTaskDelete(NULL);
     }
 
+    xSemaphoreGive(send_specified_mutex);
+
     return ESP_OK;
 }
 
@@ -250,6 +285,7 @@ void slave_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *d
                     ESP_LOGW(TAG, "Response to MAC " MACSTR " SAVED MAC Master", MAC2STR(s_master_unicast_mac.peer_addr));
 
                     s_master_unicast_mac.connected = true;
+                    uplink_reset();
                     save_to_nvs(NVS_KEY_CONNECTED, NVS_KEY_KEEP_CONNECT, NVS_KEY_PEER_ADDR, s_master_unicast_mac.connected, s_master_unicast_mac.count_keep_connect, s_master_unicast_mac.peer_addr);
                     // On LED CONNECT
                     handle_device(DEVICE_LED_CONNECT, s_master_unicast_mac.connected);
@@ -272,6 +308,8 @@ void slave_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *d
 
                     ESP_LOGW(TAG, "Response to MAC " MACSTR " %s", MAC2STR(s_master_unicast_mac.peer_addr),STILL_CONNECTED_MSG);
                     response_specified_mac(s_master_unicast_mac.peer_addr, STILL_CONNECTED_MSG);
+                    // KEEP_connect carries the latest sample, it becomes the new uplink reference
+                    uplink_reset();
                     s_master_unicast_mac.count_keep_connect = 0;
                     start_time_light_sleep = esp_timer_get_time();
 
@@ -301,10 +339,23 @@ void slave_espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *d
 
                     // xEventGroupClearBits(xEventGroupLightSleep, LIGHT_SLEEP_BIT);
                 }
+                // Master acknowledged the pushed data
+                else if (recv_cb->data_len >= strlen(UPLINK_ACK_MSG) && strstr((char *)message_packed, UPLINK_ACK_MSG) != NULL) 
+                {
+                    uplink_ack_received();
+                }
                 
                 break;
         }
-    }         
+    }
+    // Group command broadcast by the saved master, a disconnected slave still acknowledges its DISCONNECT again
+    else if (memcmp(recv_cb->mac_addr, s_master_unicast_mac.peer_addr, ESP_NOW_ETH_ALEN) == 0)
+    {
+        ESP_LOGI(TAG, "_________________________________");
+        ESP_LOGI(TAG, "Receive broadcast ESPNOW data from master");
+
+        group_command_received(recv_cb->data, recv_cb->data_len);
+    }
 }
 
 void slave_espnow_task(void *pvParameter)
@@ -349,6 +400,11 @@ void slave_espnow_task(void *pvParameter)
                     handle_device(DEVICE_LED_CONNECT, s_master_unicast_mac.connected);
                     erase_peer(s_master_unicast_mac.peer_addr);
                 }
+                else
+                {
+                    // Push relay change, threshold event or value change to master
+                    uplink_process();
+                }
                 break;
         }
         vTaskDelay(pdMS_TO_TICKS(100));
@@ -359,6 +415,8 @@ esp_err_t slave_espnow_init(void)
 {
     /* Initialize ESPNOW and register sending and receiving callback function. */
     ESP_ERROR_CHECK( esp_now_init() );
+    // Before the receive callback answers with it
+    send_specified_mutex = xSemaphoreCreateMutex();
     ESP_ERROR_CHECK( esp_now_register_send_cb(slave_espnow_send_cb) );
     ESP_ERROR_CHECK( esp_now_register_recv_cb(slave_espnow_recv_cb) );
 #if CONFIG_ESPNOW_ENABLE_POWER_SAVE
@@ -405,6 +463,8 @@ void slave_espnow_protocol()
     handle_device(DEVICE_LED_CONNECT, s_master_unicast_mac.connected);
     //  End----------Process values ​​from nvs----------
 
+    // Timer and own MAC of group commands, a group broadcast may come as soon as espnow receives
+    group_command_init();
     // Initialize espnow
     slave_espnow_init();
 
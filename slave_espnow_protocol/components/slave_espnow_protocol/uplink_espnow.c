@@ -0,0 +1,169 @@
+#include "slave_espnow_protocol.h"
+
+// Shared by slave_espnow_task (uplink_process) and the WiFi task (ACK, reset), under s_uplink_lock
+static uplink_state_t s_uplink;
+static portMUX_TYPE s_uplink_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Return the alarm zone of a value: -1 below low threshold, 1 above high threshold, 0 normal
+static int uplink_zone(float value, float low, float high)
+{
+    if (value < low)
+    {
+        return -1;
+    }
+    if (value > high)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// Check relay change or threshold crossing between two samples
+static bool uplink_is_event(const sensor_data_t *last, const sensor_data_t *sample)
+{
+    if (last->relay_state != sample->relay_state)
+    {
+        return true;
+    }
+    if (uplink_zone(last->do_value, UPLINK_DO_LOW_THRESHOLD, INFINITY) != uplink_zone(sample->do_value, UPLINK_DO_LOW_THRESHOLD, INFINITY))
+    {
+        return true;
+    }
+    if (uplink_zone(last->ph_value, UPLINK_PH_LOW_THRESHOLD, UPLINK_PH_HIGH_THRESHOLD) != uplink_zone(sample->ph_value, UPLINK_PH_LOW_THRESHOLD, UPLINK_PH_HIGH_THRESHOLD))
+    {
+        return true;
+    }
+    return false;
+}
+
+// Check if any value moved out of its deadband
+static bool uplink_is_changed(const sensor_data_t *last, const sensor_data_t *sample)
+{
+    return (fabsf(last->temperature_mcu - sample->temperature_mcu) >= UPLINK_DELTA_TEMPERATURE) ||
+           (fabsf(last->temperature_rdo - sample->temperature_rdo) >= UPLINK_DELTA_TEMPERATURE) ||
+           (fabsf(last->temperature_phg - sample->temperature_phg) >= UPLINK_DELTA_TEMPERATURE) ||
+           (fabsf(last->do_value - sample->do_value) >= UPLINK_DELTA_DO) ||
+           (fabsf(last->ph_value - sample->ph_value) >= UPLINK_DELTA_PH);
+}
+
+// Push the pending sample, the one an ACK records as last_sent
+static void uplink_send(int retry, const sensor_data_t *pending)
+{
+    // Stay awake until the master acknowledges
+    xEventGroupClearBits(xEventGroupLightSleep, LIGHT_SLEEP_BIT);
+
+    ESP_LOGW(TAG, "Push %s to MAC " MACSTR " (retry %d)", UPLINK_DATA_MSG, MAC2STR(s_master_unicast_mac.peer_addr), retry);
+    response_specified_sample(s_master_unicast_mac.peer_addr, UPLINK_DATA_MSG, pending);
+}
+
+// Runs in the WiFi task (espnow recv callback)
+void uplink_reset(void)
+{
+    taskENTER_CRITICAL(&s_uplink_lock);
+    memset(&s_uplink, 0, sizeof(uplink_state_t));
+    taskEXIT_CRITICAL(&s_uplink_lock);
+}
+
+// Runs in the WiFi task (espnow recv callback)
+void uplink_ack_received(void)
+{
+    int64_t elapsed_time;
+
+    taskENTER_CRITICAL(&s_uplink_lock);
+    if (!s_uplink.waiting_ack)
+    {
+        taskEXIT_CRITICAL(&s_uplink_lock);
+        return;
+    }
+    s_uplink.last_sent = s_uplink.pending;
+    s_uplink.has_last_sent = true;
+    s_uplink.waiting_ack = false;
+    s_uplink.retry = 0;
+    elapsed_time = esp_timer_get_time() - s_uplink.last_send_time;
+    taskEXIT_CRITICAL(&s_uplink_lock);
+
+    ESP_LOGI(TAG, "Received %s after %lld us", UPLINK_ACK_MSG, elapsed_time);
+
+    start_time_light_sleep = esp_timer_get_time();
+    xEventGroupSetBits(xEventGroupLightSleep, LIGHT_SLEEP_BIT);
+}
+
+// Called periodically by slave_espnow_task while connected to the master
+void uplink_process(void)
+{
+    int64_t current_time = esp_timer_get_time();
+    bool waiting_ack;
+    bool give_up = false;
+    int retry = -1;             // >= 0: push the pending sample again
+    sensor_data_t pending;
+
+    taskENTER_CRITICAL(&s_uplink_lock);
+    waiting_ack = s_uplink.waiting_ack;
+    if (waiting_ack && (current_time - s_uplink.last_send_time) >= UPLINK_ACK_TIMEOUT)
+    {
+        if (s_uplink.retry < UPLINK_MAX_RETRY)
+        {
+            s_uplink.retry++;
+            s_uplink.last_send_time = current_time;
+            retry = s_uplink.retry;
+            pending = s_uplink.pending;
+        }
+        else
+        {
+            s_uplink.waiting_ack = false;
+            s_uplink.retry = 0;
+            give_up = true;
+        }
+    }
+    taskEXIT_CRITICAL(&s_uplink_lock);
+
+    if (waiting_ack)
+    {
+        if (retry >= 0)
+        {
+            uplink_send(retry, &pending);
+        }
+        else if (give_up)
+        {
+            // Give up, the sample is pushed again at the next change or the next CHECK_connect
+            ESP_LOGE(TAG, "No %s from MAC " MACSTR ", drop pushed data", UPLINK_ACK_MSG, MAC2STR(s_master_unicast_mac.peer_addr));
+            xEventGroupSetBits(xEventGroupLightSleep, LIGHT_SLEEP_BIT);
+        }
+        return;
+    }
+
+    sensor_data_t sample;
+    bool send = false;
+    read_sensor_data(&sample);
+
+    taskENTER_CRITICAL(&s_uplink_lock);
+    if (!s_uplink.has_last_sent)
+    {
+        // First sample after connect is the reference, it is delivered by KEEP_connect
+        s_uplink.last_sent = sample;
+        s_uplink.has_last_sent = true;
+    }
+    else
+    {
+        int64_t elapsed_time = current_time - s_uplink.last_send_time;
+        bool event = uplink_is_event(&s_uplink.last_sent, &sample);
+        bool changed = uplink_is_changed(&s_uplink.last_sent, &sample);
+
+        // Rate limit, events are allowed to go out faster than value changes
+        if ((event && elapsed_time >= UPLINK_MIN_EVENT_INTERVAL) || (changed && elapsed_time >= UPLINK_MIN_INTERVAL))
+        {
+            // Complete before waiting_ack lets an ACK copy it
+            s_uplink.pending = sample;
+            s_uplink.waiting_ack = true;
+            s_uplink.retry = 0;
+            s_uplink.last_send_time = current_time;
+            send = true;
+        }
+    }
+    taskEXIT_CRITICAL(&s_uplink_lock);
+
+    if (send)
+    {
+        uplink_send(0, &sample);
+    }
+}
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include "telemetry_codec.h"
+#include "telemetry_filter.h"
+#include "proto_decode.h"
+
+/*
+ * Encodes the telemetry samples of the gateway in JSON and in protobuf
+ * (telemetry.proto), decodes the protobuf payloads with a stand-in decoder
+ * and prints payload size and encode time of both per batch size. Then runs
+ * telemetry_filter over a synthetic day of one slave and prints the values
+ * and JSON bytes it leaves out.
+ */
+
+#define CODEC_BATCH_MAX_BYTES       (1024)      // MQTT_PUBLISH_MAX_PAYLOAD of the gateway
+#define CODEC_BATCH_MAX_SAMPLES     (8)         // TELEMETRY_BATCH_MAX_SAMPLES of the gateway
+#define CODEC_TS_BASE               (1718000000000LL)
+#define CODEC_TS_STEP               (5000)
+#define CODEC_FILTER_PERIOD_US      (5000000LL) // Sample period of a slave
+#define CODEC_FILTER_SAMPLES        (17280)     // One day
+
+typedef size_t (*codec_batch_encoder_t)(const table_device_t *records, int count, int64_t ts, uint8_t *buf, size_t size);
+
+static table_device_t s_records[CODEC_BATCH_MAX_SAMPLES];
+static int s_failures = 0;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --rounds N        batches encoded per encoding and batch size (default 100000)\n"
+            "  --dump FILE       write a protobuf batch of %d samples to FILE, for\n"
+            "                    protoc --decode=tepbac.TelemetryBatch telemetry.proto < FILE\n",
+            name, CODEC_BATCH_MAX_SAMPLES);
+}
+
+#define CHECK(cond, fmt, ...) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+            s_failures++; \
+        } \
+    } while (0)
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Values a pond slave reports, a little different per sample
+static void records_init(void)
+{
+    for (int i = 0; i < CODEC_BATCH_MAX_SAMPLES; i++)
+    {
+        table_device_t *record = &s_records[i];
+        memset(record, 0, sizeof(*record));
+        record->peer_addr[5] = (uint8_t)i;
+        record->status = true;
+        record->data.temperature_mcu = 41.5f + 0.25f * i;
+        record->data.temperature_rdo = 28.37f + 0.013f * i;
+        record->data.do_value = 6.82f - 0.021f * i;
+        record->data.temperature_phg = 28.41f + 0.011f * i;
+        record->data.ph_value = 7.24f + 0.003f * i;
+    }
+}
+
+// [{"ts":..,"values":{..}},..] as telemetry.c assembles it
+static size_t batch_json(const table_device_t *records, int count, int64_t ts, uint8_t *buf, size_t size)
+{
+    char *out = (char *)buf;
+    size_t len = 0;
+
+    out[len++] = '[';
+    for (int i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            out[len++] = ',';
+        }
+        size_t entry_len = telemetry_entry_json(&records[i], ts > 0 ? ts + i * CODEC_TS_STEP : 0, TELEMETRY_METRICS_ALL, out + len, size - len - 1);
+        if (entry_len == 0)
+        {
+            return 0;
+        }
+        len += entry_len;
+    }
+    out[len++] = ']';
+    return len;
+}
+
+// TelemetryBatch, the samples fields back to back
+static size_t batch_proto(const table_device_t *records, int count, int64_t ts, uint8_t *buf, size_t size)
+{
+    size_t len = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        size_t entry_len = telemetry_entry_proto(&records[i], ts > 0 ? ts + i * CODEC_TS_STEP : 0, TELEMETRY_METRICS_ALL, buf + len, size - len);
+        if (entry_len == 0)
+        {
+            return 0;
+        }
+        len += entry_len;
+    }
+    return len;
+}
+
+static bool float_same(float a, float b)
+{
+    return memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+// Decoded samples against the records, bit for bit
+static void check_samples(const proto_decoded_sample_t *samples, int count, int expected, int64_t ts)
+{
+    CHECK(count == expected, "decoded %d samples, expected %d", count, expected);
+    for (int i = 0; i < count && i < expected; i++)
+    {
+        const table_device_t *record = &s_records[i % CODEC_BATCH_MAX_SAMPLES];
+        int64_t expected_ts = ts > 0 ? ts + (i % CODEC_BATCH_MAX_SAMPLES) * CODEC_TS_STEP : 0;
+        CHECK(samples[i].ts == expected_ts, "sample %d ts %lld, expected %lld", i, (long long)samples[i].ts, (long long)expected_ts);
+        CHECK(samples[i].has_values, "sample %d without values", i);
+        CHECK(float_same(samples[i].temperature_rdo, record->data.temperature_rdo), "sample %d temperature_rdo", i);
+        CHECK(float_same(samples[i].do_value, record->data.do_value), "sample %d do", i);
+        CHECK(float_same(samples[i].temperature_phg, record->data.temperature_phg), "sample %d temperature_phg", i);
+        CHECK(float_same(samples[i].ph, record->data.ph_value), "sample %d ph", i);
+        CHECK(float_same(samples[i].cpu_temp, record->data.temperature_mcu), "sample %d cpu_temp", i);
+    }
+}
+
+static void check_proto(void)
+{
+    uint8_t buf[2 * CODEC_BATCH_MAX_BYTES];
+    proto_decoded_sample_t samples[PROTO_DECODE_MAX_SAMPLES];
+
+    for (int count = 1; count <= CODEC_BATCH_MAX_SAMPLES; count++)
+    {
+        size_t len = batch_proto(s_records, count, CODEC_TS_BASE, buf, sizeof(buf));
+        CHECK(len > 0, "batch of %d samples does not fit", count);
+        check_samples(samples, proto_decode_batch(buf, len, samples, PROTO_DECODE_MAX_SAMPLES), count, CODEC_TS_BASE);
+
+        // No wall clock, ts left out
+        len = batch_proto(s_records, count, 0, buf, sizeof(buf));
+        check_samples(samples, proto_decode_batch(buf, len, samples, PROTO_DECODE_MAX_SAMPLES), count, 0);
+    }
+
+    // Two stored batches joined on replay are one batch with the samples of both
+    size_t len = batch_proto(s_records, CODEC_BATCH_MAX_SAMPLES, CODEC_TS_BASE, buf, sizeof(buf));
+    memcpy(buf + len, buf, len);
+    check_samples(samples, proto_decode_batch(buf, 2 * len, samples, PROTO_DECODE_MAX_SAMPLES), 2 * CODEC_BATCH_MAX_SAMPLES, CODEC_TS_BASE);
+
+    // Entry too large for the buffer
+    CHECK(telemetry_entry_proto(&s_records[0], CODEC_TS_BASE, TELEMETRY_METRICS_ALL, buf, 10) == 0, "overflow not reported");
+
+    // Nested message of 128 bytes and more, its length takes two bytes
+    uint8_t body[200];
+    proto_writer_t w;
+    memset(body, 0x5A, sizeof(body));
+    proto_writer_init(&w, buf, sizeof(buf));
+    proto_writer_begin_message(&w, 1);
+    proto_writer_bytes(&w, 3, body, sizeof(body));
+    proto_writer_end_message(&w);
+    len = proto_writer_finish(&w);
+    size_t body_len = 1 + 2 + sizeof(body);         // Tag, two bytes of length, bytes
+    CHECK(len == 1 + 2 + body_len, "long message of %d B", (int)len);
+    CHECK(buf[1] == (uint8_t)(body_len | 0x80) && buf[2] == (uint8_t)(body_len >> 7), "length of long message");
+    CHECK(buf[3] == PROTO_TAG_LEN(3) && memcmp(buf + 6, body, sizeof(body)) == 0, "body of long message moved");
+    CHECK(proto_decode_batch(buf, len, samples, PROTO_DECODE_MAX_SAMPLES) == 1, "long message not decoded");
+}
+
+static double encode_ns(codec_batch_encoder_t encode, int count, int rounds, size_t *len)
+{
+    uint8_t buf[CODEC_BATCH_MAX_BYTES];
+    volatile size_t sink = 0;
+
+    int64_t start = now_ns();
+    for (int i = 0; i < rounds; i++)
+    {
+        sink += encode(s_records, count, CODEC_TS_BASE + i, buf, sizeof(buf));
+    }
+    int64_t elapsed = now_ns() - start;
+    *len = encode(s_records, count, CODEC_TS_BASE, buf, sizeof(buf));
+    (void)sink;
+    return (double)elapsed / rounds / count;
+}
+
+static void benchmark(int rounds)
+{
+    static const int counts[] = { 1, 4, CODEC_BATCH_MAX_SAMPLES };
+
+    printf("%-8s %10s %12s %8s %14s %18s\n", "samples", "json B", "protobuf B", "ratio", "json ns/sample", "protobuf ns/sample");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        size_t json_len;
+        size_t proto_len;
+        double json_ns = encode_ns(batch_json, counts[i], rounds, &json_len);
+        double proto_ns = encode_ns(batch_proto, counts[i], rounds, &proto_len);
+        printf("%-8d %10zu %12zu %7.0f%% %14.1f %18.1f\n", counts[i], json_len, proto_len,
+               100.0 * proto_len / json_len, json_ns, proto_ns);
+    }
+}
+
+// Deterministic jitter in [-1, 1]
+static float noise(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return (float)(*state >> 8) / (float)(1u << 23) - 1.0f;
+}
+
+// A day of one slave: slow daily swing, sensor jitter of a few units of the last digit
+static void filter_simulation(void)
+{
+    table_device_t record;
+    uint32_t state = 1;
+    uint64_t values_sent = 0;
+    uint64_t samples_sent = 0;
+    uint64_t bytes_all = 0;
+    uint64_t bytes_filtered = 0;
+    char entry[TELEMETRY_JSON_SIZE + 48];
+
+    memset(&record, 0, sizeof(record));
+    record.status = true;
+    telemetry_filter_reset();
+    for (int i = 0; i < CODEC_FILTER_SAMPLES; i++)
+    {
+        double day = 2.0 * M_PI * i / CODEC_FILTER_SAMPLES;
+        int64_t now_us = i * CODEC_FILTER_PERIOD_US;
+        int64_t ts = CODEC_TS_BASE + now_us / 1000;
+
+        record.data.temperature_rdo = 28.0f + 1.5f * (float)sin(day) + 0.03f * noise(&state);
+        record.data.do_value = 6.5f + 1.2f * (float)sin(day - 0.5) + 0.02f * noise(&state);
+        record.data.temperature_phg = 28.1f + 1.5f * (float)sin(day) + 0.03f * noise(&state);
+        record.data.ph_value = 7.2f + 0.15f * (float)sin(day) + 0.005f * noise(&state);
+        record.data.temperature_mcu = 41.0f + 2.0f * (float)sin(day) + 0.5f * noise(&state);
+
+        uint32_t metrics = telemetry_filter_apply(&record, now_us);
+        bytes_all += telemetry_entry_json(&record, ts, TELEMETRY_METRICS_ALL, entry, sizeof(entry)) + 1;
+        if (metrics != 0)
+        {
+            samples_sent++;
+            values_sent += __builtin_popcount(metrics);
+            bytes_filtered += telemetry_entry_json(&record, ts, metrics, entry, sizeof(entry)) + 1;
+        }
+    }
+
+    uint64_t values_all = (uint64_t)CODEC_FILTER_SAMPLES * TELEMETRY_METRIC_COUNT;
+    printf("\nDeadband filter, one slave, %d samples every %lld s (synthetic)\n",
+           CODEC_FILTER_SAMPLES, CODEC_FILTER_PERIOD_US / 1000000);
+    printf("%-16s %10s %10s\n", "", "all", "filtered");
+    printf("%-16s %10d %10llu\n", "samples", CODEC_FILTER_SAMPLES, (unsigned long long)samples_sent);
+    printf("%-16s %10llu %10llu (%.1f%%)\n", "values", (unsigned long long)values_all,
+           (unsigned long long)values_sent, 100.0 * values_sent / values_all);
+    printf("%-16s %10llu %10llu (%.1f%%)\n", "json B", (unsigned long long)bytes_all,
+           (unsigned long long)bytes_filtered, 100.0 * bytes_filtered / bytes_all);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "rounds",         required_argument, NULL, 'n' },
+        { "dump",           required_argument, NULL, 'd' },
+        { "help",           no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 },
+    };
+    int rounds = 100000;
+    const char *dump = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            case 'd':
+                dump = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (rounds < 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    records_init();
+    check_proto();
+    if (s_failures > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", s_failures);
+        return 1;
+    }
+    printf("Protobuf batches decoded and equal to the records\n\n");
+
+    if (dump != NULL)
+    {
+        uint8_t buf[CODEC_BATCH_MAX_BYTES];
+        size_t len = batch_proto(s_records, CODEC_BATCH_MAX_SAMPLES, CODEC_TS_BASE, buf, sizeof(buf));
+        FILE *file = fopen(dump, "wb");
+        if (file == NULL || fwrite(buf, 1, len, file) != len)
+        {
+            perror(dump);
+            return 1;
+        }
+        fclose(file);
+        printf("Batch of %d samples written to %s, %zu B\n\n", CODEC_BATCH_MAX_SAMPLES, dump, len);
+    }
+
+    benchmark(rounds);
+    filter_simulation();
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <string.h>
+#include "proto_decode.h"
+
+typedef struct
+{
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+} proto_reader_t;
+
+static bool read_varint(proto_reader_t *r, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (r->pos >= r->len)
+        {
+            return false;
+        }
+        uint8_t byte = r->buf[r->pos++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_fixed32(proto_reader_t *r, uint32_t *value)
+{
+    if (r->len - r->pos < 4)
+    {
+        return false;
+    }
+    *value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        *value |= (uint32_t)r->buf[r->pos++] << (8 * i);
+    }
+    return true;
+}
+
+static bool read_float(proto_reader_t *r, float *value)
+{
+    uint32_t bits;
+    if (!read_fixed32(r, &bits))
+    {
+        return false;
+    }
+    memcpy(value, &bits, sizeof(*value));
+    return true;
+}
+
+// Body of a length delimited field as a reader of its own
+static bool read_len(proto_reader_t *r, proto_reader_t *body)
+{
+    uint64_t len;
+    if (!read_varint(r, &len) || len > r->len - r->pos)
+    {
+        return false;
+    }
+    body->buf = r->buf + r->pos;
+    body->len = (size_t)len;
+    body->pos = 0;
+    r->pos += (size_t)len;
+    return true;
+}
+
+static bool read_tag(proto_reader_t *r, uint32_t *field, uint8_t *wire_type)
+{
+    uint64_t tag;
+    if (!read_varint(r, &tag) || (tag >> 3) == 0)
+    {
+        return false;
+    }
+    *field = (uint32_t)(tag >> 3);
+    *wire_type = tag & 0x07;
+    return true;
+}
+
+// Unknown fields are skipped like every protobuf decoder does
+static bool skip(proto_reader_t *r, uint8_t wire_type)
+{
+    uint64_t value;
+    proto_reader_t body;
+
+    switch (wire_type)
+    {
+        case 0:
+            return read_varint(r, &value);
+        case 1:
+            if (r->len - r->pos < 8)
+            {
+                return false;
+            }
+            r->pos += 8;
+            return true;
+        case 2:
+            return read_len(r, &body);
+        case 5:
+            if (r->len - r->pos < 4)
+            {
+                return false;
+            }
+            r->pos += 4;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool decode_values(proto_reader_t *r, proto_decoded_sample_t *sample)
+{
+    uint32_t field;
+    uint8_t wire_type;
+
+    while (r->pos < r->len)
+    {
+        if (!read_tag(r, &field, &wire_type))
+        {
+            return false;
+        }
+        float *value = NULL;
+        switch (field)
+        {
+            case 1: value = &sample->temperature_rdo; break;
+            case 2: value = &sample->do_value; break;
+            case 3: value = &sample->temperature_phg; break;
+            case 4: value = &sample->ph; break;
+            case 5: value = &sample->cpu_temp; break;
+            default: break;
+        }
+        if (value != NULL && wire_type == 5)
+        {
+            if (!read_float(r, value))
+            {
+                return false;
+            }
+        }
+        else if (!skip(r, wire_type))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool decode_sample(proto_reader_t *r, proto_decoded_sample_t *sample)
+{
+    uint32_t field;
+    uint8_t wire_type;
+
+    memset(sample, 0, sizeof(*sample));
+    while (r->pos < r->len)
+    {
+        if (!read_tag(r, &field, &wire_type))
+        {
+            return false;
+        }
+        if (field == 1 && wire_type == 0)
+        {
+            uint64_t ts;
+            if (!read_varint(r, &ts))
+            {
+                return false;
+            }
+            sample->ts = (int64_t)ts;
+        }
+        else if (field == 2 && wire_type == 2)
+        {
+            // A message field seen twice is merged, like protobuf does
+            proto_reader_t values;
+            if (!read_len(r, &values) || !decode_values(&values, sample))
+            {
+                return false;
+            }
+            sample->has_values = true;
+        }
+        else if (!skip(r, wire_type))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int proto_decode_batch(const uint8_t *buf, size_t len, proto_decoded_sample_t *samples, int max_samples)
+{
+    proto_reader_t r = { .buf = buf, .len = len, .pos = 0 };
+    uint32_t field;
+    uint8_t wire_type;
+    int count = 0;
+
+    while (r.pos < r.len)
+    {
+        if (!read_tag(&r, &field, &wire_type))
+        {
+            return -1;
+        }
+        if (field == 1 && wire_type == 2)
+        {
+            proto_reader_t sample;
+            if (count >= max_samples || !read_len(&r, &sample) || !decode_sample(&sample, &samples[count]))
+            {
+                return -1;
+            }
+            count++;
+        }
+        else if (!skip(&r, wire_type))
+        {
+            return -1;
+        }
+    }
+    return count;
+}
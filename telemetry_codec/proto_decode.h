@@ -0,0 +1,30 @@
+#ifndef PROTO_DECODE_H
+#define PROTO_DECODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Stand-in for the decoder of the broker side (protoc --decode, protobuf-c, ThingsBoard):
+ * a plain reader of the wire format and the TelemetryBatch of telemetry.proto on top.
+ * Written from the encoding rules, it shares no code with proto_writer.
+ */
+
+#define PROTO_DECODE_MAX_SAMPLES    (64)
+
+typedef struct
+{
+    int64_t ts;                     // 0 when absent
+    bool has_values;
+    float temperature_rdo;
+    float do_value;
+    float temperature_phg;
+    float ph;
+    float cpu_temp;
+} proto_decoded_sample_t;
+
+// Number of samples decoded, -1 when buf is not a valid TelemetryBatch
+int proto_decode_batch(const uint8_t *buf, size_t len, proto_decoded_sample_t *samples, int max_samples);
+
+#endif // PROTO_DECODE_H
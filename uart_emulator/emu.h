@@ -0,0 +1,101 @@
+#ifndef EMU_H
+#define EMU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "uart_frame.h"
+
+/*
+ * Host emulator of the C3 (master_espnow_protocol) <-> S3 (mqttS3) UART link.
+ *
+ *   C3 emulator <-> pty <-> fault relay <-> pty <-> S3 emulator
+ *
+ * Both ends use the real uart_frame codec. The relay paces the bytes at the
+ * negotiated baud rate and drops, corrupts or delays them on request.
+ */
+
+#define EMU_BAUD_RATE               115200      // Default rate of both sides, BAUD_RATE of read_serial
+#define EMU_MAX_BAUD_RATE           2000000     // MAX_BAUD_RATE of read_serial
+#define EMU_MAX_SLAVES              3           // MAX_SLAVES of master_espnow_protocol
+#define EMU_LINK_SWITCH_DELAY_MS    10          // LINK_SWITCH_DELAY_MS of S3
+#define EMU_LINK_CONFIRM_TIMEOUT_MS 200         // LINK_CONFIRM_TIMEOUT_MS of both sides
+#define EMU_WINDOW_MAX              64          // Outstanding requests of the S3 emulator
+
+#define LOG(fmt, ...)               fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+
+/* Record of table_devices as sent on the link, same layout as table_device_tt of C3. */
+typedef struct {
+    float temperature_mcu;
+    int rssi;
+    float temperature_rdo;
+    float do_value;
+    float temperature_phg;
+    float ph_value;
+    bool relay_state;
+} emu_sensor_data_t;
+
+typedef struct {
+    uint8_t peer_addr[6];
+    bool status;
+    emu_sensor_data_t data;
+} emu_table_device_t;
+
+/* Faults of the wire, applied to each direction on its own. */
+typedef struct {
+    double drop;                                // Probability that a byte is lost
+    double corrupt;                             // Probability that a byte gets one bit flipped
+    uint32_t delay_us;                          // Propagation delay added to every byte
+    uint32_t jitter_us;                         // Random extra delay, the byte order is kept
+    unsigned int seed;
+} emu_link_config_t;
+
+typedef struct {
+    uint64_t bytes;                             // Bytes written by the sender
+    uint64_t dropped;
+    uint64_t corrupted;
+} emu_link_stats_t;
+
+enum {
+    EMU_DIR_C3_TO_S3,
+    EMU_DIR_S3_TO_C3,
+    EMU_DIR_MAX,
+};
+
+/* Result of one benchmark pass. */
+typedef struct {
+    uint32_t baud_rate;
+    int sent;
+    int completed;
+    int nacks;
+    int timeouts;
+    int64_t elapsed_us;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t p999_us;
+    uint32_t max_us;
+    uart_latency_hist_t latency;
+} emu_bench_result_t;
+
+int64_t emu_time_us(void);
+
+// Wire between the two ptys
+bool emu_link_start(const emu_link_config_t *config, int *c3_fd, int *s3_fd);
+void emu_link_stop(void);
+void emu_link_set_baud(uint32_t baud_rate);
+void emu_link_stats_get(int dir, emu_link_stats_t *stats);
+
+// C3 side, answers the requests of S3 in its own thread
+bool emu_master_start(int fd, uint32_t max_baud_rate, uint32_t handling_us);
+void emu_master_stop(void);
+void emu_master_stats_get(uart_link_stats_t *stats);
+
+// S3 side, runs in the calling thread
+void emu_gateway_init(int fd);
+bool emu_gateway_negotiate(uint32_t max_baud_rate);
+bool emu_gateway_wake_up(void);
+bool emu_gateway_bench(int requests, int window, int timeout_ms, emu_bench_result_t *result);
+void emu_gateway_stats_get(uart_link_stats_t *stats);
+
+#endif // EMU_H
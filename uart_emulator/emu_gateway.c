@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include "emu.h"
+
+// S3 side of the link, follows uart_rpc_x and uart_link_negotiate of mqttS3/components/read_serial
+
+#define EMU_RX_CHUNK_SIZE           (128)           // UART_RX_CHUNK_SIZE of S3
+#define EMU_RPC_TICK_MS             (1)             // Max wait for bytes before timeouts are checked
+
+typedef struct {
+    bool used;
+    uint16_t req_id;
+    uint8_t resp_type;
+    int64_t sent_time;
+    int64_t timeout_time;
+    int length;                                     // Payload length of the response, -1 on NACK or timeout
+    bool done;
+} emu_rpc_t;
+
+static int s_fd = -1;
+static uart_frame_decoder_t s_decoder;
+static uint8_t s_tx_frame[UART_FRAME_ENCODED_SIZE];
+static uart_link_stats_t s_link_stats;
+static emu_rpc_t s_rpc[EMU_WINDOW_MAX];
+static uint16_t s_req_id = 0;
+static uint32_t s_link_baud_rate = EMU_BAUD_RATE;
+static uart_frame_t s_response;                     // Response of the last uart_rpc_call
+static uint32_t *s_latencies;                       // Latency of every completed benchmark request
+static int s_latency_count;
+
+static uint16_t next_req_id(void)
+{
+    // 0 is the req_id of unsolicited frames
+    if (++s_req_id == 0)
+    {
+        s_req_id = 1;
+    }
+    return s_req_id;
+}
+
+static void send_frame_id(uint8_t type, uint16_t req_id, const void *payload, size_t len)
+{
+    size_t frame_len = uart_frame_encode(type, 0, req_id, (const uint8_t *)payload, len, s_tx_frame, sizeof(s_tx_frame));
+    if (frame_len == 0)
+    {
+        LOG("S3: encode frame type 0x%02x failed, len %d", type, (int)len);
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < frame_len)
+    {
+        int written = write(s_fd, s_tx_frame + offset, frame_len - offset);
+        if (written <= 0)
+        {
+            return;
+        }
+        offset += written;
+    }
+    s_link_stats.tx_bytes += frame_len;
+    s_link_stats.tx_frames++;
+}
+
+// Send a request and keep its slot until the response, return the slot or -1 when the window is full
+static int rpc_send(uint8_t type, const void *payload, size_t len, uint8_t resp_type, int timeout_ms)
+{
+    for (int i = 0; i < EMU_WINDOW_MAX; i++)
+    {
+        if (!s_rpc[i].used)
+        {
+            emu_rpc_t *rpc = &s_rpc[i];
+            rpc->used = true;
+            rpc->done = false;
+            rpc->req_id = next_req_id();
+            rpc->resp_type = resp_type;
+            rpc->sent_time = emu_time_us();
+            rpc->timeout_time = rpc->sent_time + timeout_ms * 1000LL;
+            send_frame_id(type, rpc->req_id, payload, len);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void rpc_complete(const uart_frame_t *frame)
+{
+    for (int i = 0; i < EMU_WINDOW_MAX; i++)
+    {
+        emu_rpc_t *rpc = &s_rpc[i];
+        if (!rpc->used || rpc->done || rpc->req_id != frame->req_id)
+        {
+            continue;
+        }
+        if (frame->type != rpc->resp_type && frame->type != FRAME_NACK)
+        {
+            continue;
+        }
+
+        uint32_t latency_us = (uint32_t)(emu_time_us() - rpc->sent_time);
+        rpc->done = true;
+        if (frame->type == FRAME_NACK)
+        {
+            rpc->length = -1;
+            s_link_stats.nacks++;
+        }
+        else
+        {
+            rpc->length = frame->len;
+            uart_latency_hist_add(&s_link_stats.latency, latency_us);
+            if (s_latencies != NULL)
+            {
+                s_latencies[s_latency_count++] = latency_us;
+            }
+        }
+        s_response = *frame;
+        return;
+    }
+}
+
+static void frame_handler(const uart_frame_t *frame, void *ctx)
+{
+    // FRAME_DELTA and unmatched responses are not used by the emulator
+    rpc_complete(frame);
+}
+
+// Feed the bytes that arrive within timeout_ms and expire the requests that are overdue
+static void rx_poll(int timeout_ms)
+{
+    uint8_t dtmp[EMU_RX_CHUNK_SIZE];
+    struct pollfd pfd = { .fd = s_fd, .events = POLLIN };
+
+    if (poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN))
+    {
+        int length = read(s_fd, dtmp, sizeof(dtmp));
+        if (length > 0)
+        {
+            uart_frame_decoder_feed(&s_decoder, dtmp, length, frame_handler, NULL);
+            s_link_stats.rx_bytes += length;
+        }
+    }
+
+    int64_t now = emu_time_us();
+    for (int i = 0; i < EMU_WINDOW_MAX; i++)
+    {
+        emu_rpc_t *rpc = &s_rpc[i];
+        if (rpc->used && !rpc->done && now > rpc->timeout_time)
+        {
+            rpc->done = true;
+            rpc->length = -2;
+            s_link_stats.timeouts++;
+        }
+    }
+}
+
+// Blocking request, return the payload length of the response or -1
+static int rpc_call(uint8_t type, const void *payload, size_t len, uint8_t resp_type, void *message, size_t message_len, int timeout_ms)
+{
+    int slot = rpc_send(type, payload, len, resp_type, timeout_ms);
+    if (slot < 0)
+    {
+        return -1;
+    }
+
+    while (!s_rpc[slot].done)
+    {
+        rx_poll(EMU_RPC_TICK_MS);
+    }
+
+    int length = s_rpc[slot].length;
+    s_rpc[slot].used = false;
+    if (length < 0)
+    {
+        return -1;
+    }
+    if (message != NULL)
+    {
+        memcpy(message, s_response.payload, ((size_t)length < message_len) ? (size_t)length : message_len);
+    }
+    return length;
+}
+
+void emu_gateway_init(int fd)
+{
+    s_fd = fd;
+    uart_frame_decoder_init(&s_decoder);
+    memset(s_rpc, 0, sizeof(s_rpc));
+}
+
+/* FRAME_CONNECT_REQUEST / FRAME_CONNECT_AGREE / FRAME_CONNECTED at the agreed rate, as uart_link_negotiate. */
+bool emu_gateway_negotiate(uint32_t max_baud_rate)
+{
+    uart_link_params_t params = { .baud_rate = max_baud_rate, .flow_ctrl = 0, .encrypt = 0 };
+    uart_link_params_t agreed;
+
+    emu_link_set_baud(EMU_BAUD_RATE);
+
+    int length = rpc_call(FRAME_CONNECT_REQUEST, &params, sizeof(params), FRAME_CONNECT_AGREE, &agreed, sizeof(agreed), 200);
+    if (length < 0)
+    {
+        LOG("S3: no FRAME_CONNECT_AGREE");
+        return false;
+    }
+    if (length < sizeof(agreed))
+    {
+        agreed.baud_rate = EMU_BAUD_RATE;
+    }
+
+    usleep(EMU_LINK_SWITCH_DELAY_MS * 1000);
+
+    if (rpc_call(FRAME_CONNECTED, NULL, 0, FRAME_CONNECTED, NULL, 0, EMU_LINK_CONFIRM_TIMEOUT_MS) < 0)
+    {
+        LOG("S3: no echo at %lu baud, fall back to %d baud", (unsigned long)agreed.baud_rate, EMU_BAUD_RATE);
+        emu_link_set_baud(EMU_BAUD_RATE);
+        s_link_baud_rate = EMU_BAUD_RATE;
+        s_link_stats.link_fallbacks++;
+        return false;
+    }
+
+    s_link_baud_rate = agreed.baud_rate;
+    LOG("S3: connected at %lu baud", (unsigned long)agreed.baud_rate);
+    return true;
+}
+
+bool emu_gateway_wake_up(void)
+{
+    if (rpc_call(FRAME_WAKE_UP, NULL, 0, FRAME_WOKE_UP, NULL, 0, 500) < 0)
+    {
+        s_link_stats.wake_failures++;
+        return false;
+    }
+    return true;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, int count, int per_mille)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    int i = (int)(((int64_t)count * per_mille + 999) / 1000) - 1;
+    return sorted[(i < 0) ? 0 : i];
+}
+
+/* Send requests GET_DATA round robin over the slaves with up to window requests outstanding,
+   like poll_slaves does through uart_rpc_send. Latency is request written to response decoded. */
+bool emu_gateway_bench(int requests, int window, int timeout_ms, emu_bench_result_t *result)
+{
+    static const uint8_t macs[EMU_MAX_SLAVES][6] = {
+        { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01 },
+        { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x02 },
+        { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x03 },
+    };
+    int outstanding = 0;
+
+    if (window < 1 || window > EMU_WINDOW_MAX)
+    {
+        return false;
+    }
+    s_latencies = malloc(requests * sizeof(uint32_t));
+    if (s_latencies == NULL)
+    {
+        return false;
+    }
+    s_latency_count = 0;
+    memset(result, 0, sizeof(emu_bench_result_t));
+    result->baud_rate = s_link_baud_rate;
+    memset(&s_link_stats.latency, 0, sizeof(s_link_stats.latency));
+
+    int64_t start_time = emu_time_us();
+    while (result->sent < requests || outstanding > 0)
+    {
+        while (result->sent < requests && outstanding < window)
+        {
+            if (rpc_send(FRAME_GET_DATA, macs[result->sent % EMU_MAX_SLAVES], 6, FRAME_DATA, timeout_ms) < 0)
+            {
+                break;
+            }
+            result->sent++;
+            outstanding++;
+        }
+
+        rx_poll(EMU_RPC_TICK_MS);
+
+        for (int i = 0; i < EMU_WINDOW_MAX; i++)
+        {
+            emu_rpc_t *rpc = &s_rpc[i];
+            if (!rpc->used || !rpc->done)
+            {
+                continue;
+            }
+            if (rpc->length >= 0)
+            {
+                result->completed++;
+            }
+            else if (rpc->length == -1)
+            {
+                result->nacks++;
+            }
+            else
+            {
+                result->timeouts++;
+            }
+            rpc->used = false;
+            outstanding--;
+        }
+    }
+    result->elapsed_us = emu_time_us() - start_time;
+
+    qsort(s_latencies, s_latency_count, sizeof(uint32_t), compare_u32);
+    result->p50_us = percentile(s_latencies, s_latency_count, 500);
+    result->p90_us = percentile(s_latencies, s_latency_count, 900);
+    result->p99_us = percentile(s_latencies, s_latency_count, 990);
+    result->p999_us = percentile(s_latencies, s_latency_count, 999);
+    result->max_us = (s_latency_count > 0) ? s_latencies[s_latency_count - 1] : 0;
+    result->latency = s_link_stats.latency;
+
+    free(s_latencies);
+    s_latencies = NULL;
+    return true;
+}
+
+void emu_gateway_stats_get(uart_link_stats_t *stats)
+{
+    *stats = s_link_stats;
+    stats->rx_frames = s_decoder.frames_ok;
+    stats->crc_errors = s_decoder.crc_errors;
+    stats->framing_errors = s_decoder.framing_errors;
+    stats->overflow_errors = s_decoder.overflow_errors;
+}
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "emu.h"
+
+#define EMU_LINK_QUEUE_SIZE         (64 * 1024)     // Bytes on the wire per direction, the sender blocks when full
+#define EMU_LINK_READ_SIZE          (512)
+#define EMU_LINK_MAX_WAIT_US        (10000)
+
+typedef struct {
+    uint8_t byte;
+    int64_t due_time;                               // Time the last bit arrives at the receiver
+} emu_wire_byte_t;
+
+// One direction of the wire: bytes are read from src and written to dst when they are due
+typedef struct {
+    int src;
+    int dst;
+    emu_wire_byte_t queue[EMU_LINK_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    int64_t line_free_time;                         // End of the last byte put on the wire
+    int64_t last_due_time;
+    emu_link_stats_t stats;
+} emu_wire_t;
+
+static emu_wire_t s_wire[EMU_DIR_MAX];
+static emu_link_config_t s_config;
+static int s_pty_master[EMU_DIR_MAX] = { -1, -1 };  // Relay end of the pty of C3 and of S3
+static int s_pty_slave[EMU_DIR_MAX] = { -1, -1 };   // Emulator end
+static volatile uint32_t s_baud_rate = EMU_BAUD_RATE;
+static volatile bool s_running = false;
+static pthread_t s_relay_thread;
+static pthread_mutex_t s_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int64_t emu_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static double emu_random(unsigned int *seed)
+{
+    return (double)rand_r(seed) / ((double)RAND_MAX + 1.0);
+}
+
+// Open a pty in raw mode so that every byte goes through unchanged
+static bool emu_pty_open(int *master, int *slave)
+{
+    struct termios tio;
+
+    if (openpty(master, slave, NULL, NULL, NULL) < 0)
+    {
+        LOG("openpty: %s", strerror(errno));
+        return false;
+    }
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    fcntl(*master, F_SETFL, fcntl(*master, F_GETFL) | O_NONBLOCK);
+
+    return true;
+}
+
+// Put received bytes on the wire, a byte takes 10 bit times at the current rate
+static void emu_wire_receive(emu_wire_t *wire, unsigned int *seed)
+{
+    uint8_t buf[EMU_LINK_READ_SIZE];
+    size_t room = EMU_LINK_QUEUE_SIZE - wire->count;
+    int length = read(wire->src, buf, (room < sizeof(buf)) ? room : sizeof(buf));
+    if (length <= 0)
+    {
+        return;
+    }
+
+    int64_t now = emu_time_us();
+    int64_t byte_time_ns = 10LL * 1000000000LL / s_baud_rate;
+
+    pthread_mutex_lock(&s_stats_mutex);
+    for (int i = 0; i < length; i++)
+    {
+        uint8_t byte = buf[i];
+
+        if (wire->line_free_time < now * 1000)
+        {
+            wire->line_free_time = now * 1000;
+        }
+        wire->line_free_time += byte_time_ns;
+        wire->stats.bytes++;
+
+        if (s_config.drop > 0 && emu_random(seed) < s_config.drop)
+        {
+            wire->stats.dropped++;
+            continue;
+        }
+        if (s_config.corrupt > 0 && emu_random(seed) < s_config.corrupt)
+        {
+            byte ^= (uint8_t)(1 << (rand_r(seed) % 8));
+            wire->stats.corrupted++;
+        }
+
+        int64_t due_time = wire->line_free_time / 1000 + s_config.delay_us;
+        if (s_config.jitter_us > 0)
+        {
+            due_time += rand_r(seed) % s_config.jitter_us;
+        }
+        if (due_time < wire->last_due_time)
+        {
+            due_time = wire->last_due_time;
+        }
+        wire->last_due_time = due_time;
+
+        emu_wire_byte_t *entry = &wire->queue[(wire->head + wire->count) % EMU_LINK_QUEUE_SIZE];
+        entry->byte = byte;
+        entry->due_time = due_time;
+        wire->count++;
+    }
+    pthread_mutex_unlock(&s_stats_mutex);
+}
+
+// Deliver the bytes that are due, return the time of the next one (or -1)
+static int64_t emu_wire_deliver(emu_wire_t *wire)
+{
+    uint8_t buf[EMU_LINK_READ_SIZE];
+    int64_t now = emu_time_us();
+    size_t n = 0;
+
+    while (n < wire->count && n < sizeof(buf))
+    {
+        const emu_wire_byte_t *entry = &wire->queue[(wire->head + n) % EMU_LINK_QUEUE_SIZE];
+        if (entry->due_time > now)
+        {
+            break;
+        }
+        buf[n++] = entry->byte;
+    }
+
+    if (n > 0)
+    {
+        int written = write(wire->dst, buf, n);
+        if (written > 0)
+        {
+            wire->head = (wire->head + written) % EMU_LINK_QUEUE_SIZE;
+            wire->count -= written;
+        }
+    }
+
+    return (wire->count > 0) ? wire->queue[wire->head].due_time : -1;
+}
+
+static void *emu_relay_task(void *arg)
+{
+    unsigned int seed = s_config.seed;
+
+    while (s_running)
+    {
+        struct pollfd fds[EMU_DIR_MAX];
+        int64_t next_time = -1;
+
+        for (int dir = 0; dir < EMU_DIR_MAX; dir++)
+        {
+            int64_t due_time = emu_wire_deliver(&s_wire[dir]);
+            if (due_time >= 0 && (next_time < 0 || due_time < next_time))
+            {
+                next_time = due_time;
+            }
+
+            // A full wire stops reading, the sender then blocks like on a full FIFO
+            fds[dir].fd = s_wire[dir].src;
+            fds[dir].events = (s_wire[dir].count < EMU_LINK_QUEUE_SIZE) ? POLLIN : 0;
+            fds[dir].revents = 0;
+        }
+
+        // Sub-millisecond wait, the byte time at 2 Mbaud is 5 us
+        int64_t wait_us = EMU_LINK_MAX_WAIT_US;
+        if (next_time >= 0 && next_time - emu_time_us() < wait_us)
+        {
+            wait_us = next_time - emu_time_us();
+            if (wait_us < 0)
+            {
+                wait_us = 0;
+            }
+        }
+        struct timespec timeout = { .tv_sec = 0, .tv_nsec = wait_us * 1000 };
+
+        if (ppoll(fds, EMU_DIR_MAX, &timeout, NULL) <= 0)
+        {
+            continue;
+        }
+        for (int dir = 0; dir < EMU_DIR_MAX; dir++)
+        {
+            if (fds[dir].revents & POLLIN)
+            {
+                emu_wire_receive(&s_wire[dir], &seed);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Create the pty of both emulators and start the relay between them. */
+bool emu_link_start(const emu_link_config_t *config, int *c3_fd, int *s3_fd)
+{
+    s_config = *config;
+
+    for (int i = 0; i < EMU_DIR_MAX; i++)
+    {
+        if (!emu_pty_open(&s_pty_master[i], &s_pty_slave[i]))
+        {
+            return false;
+        }
+    }
+
+    memset(s_wire, 0, sizeof(s_wire));
+    // Index of s_pty_x: 0 = C3, 1 = S3
+    s_wire[EMU_DIR_C3_TO_S3].src = s_pty_master[0];
+    s_wire[EMU_DIR_C3_TO_S3].dst = s_pty_master[1];
+    s_wire[EMU_DIR_S3_TO_C3].src = s_pty_master[1];
+    s_wire[EMU_DIR_S3_TO_C3].dst = s_pty_master[0];
+
+    s_running = true;
+    if (pthread_create(&s_relay_thread, NULL, emu_relay_task, NULL) != 0)
+    {
+        s_running = false;
+        return false;
+    }
+
+    *c3_fd = s_pty_slave[0];
+    *s3_fd = s_pty_slave[1];
+    return true;
+}
+
+void emu_link_stop(void)
+{
+    if (s_running)
+    {
+        s_running = false;
+        pthread_join(s_relay_thread, NULL);
+    }
+    for (int i = 0; i < EMU_DIR_MAX; i++)
+    {
+        close(s_pty_master[i]);
+        close(s_pty_slave[i]);
+    }
+}
+
+/* Both sides switch at the same time in the emulator, a rate mismatch is not emulated. */
+void emu_link_set_baud(uint32_t baud_rate)
+{
+    s_baud_rate = baud_rate;
+}
+
+void emu_link_stats_get(int dir, emu_link_stats_t *stats)
+{
+    pthread_mutex_lock(&s_stats_mutex);
+    *stats = s_wire[dir].stats;
+    pthread_mutex_unlock(&s_stats_mutex);
+}
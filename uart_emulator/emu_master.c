@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "emu.h"
+
+// C3 side of the link, follows uart_frame_process of master_espnow_protocol/components/read_serial
+
+#define EMU_RX_CHUNK_SIZE           (128)           // UART_RX_CHUNK_SIZE of C3
+#define EMU_TABLE_CHUNK_RECORDS     ((UART_FRAME_MAX_PAYLOAD - 4 - sizeof(uart_chunk_header_t)) / sizeof(emu_table_device_t))
+
+static int s_fd = -1;
+static uint32_t s_max_baud_rate;
+static uint32_t s_handling_us;
+static pthread_t s_master_thread;
+static volatile bool s_running = false;
+static pthread_mutex_t s_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uart_frame_decoder_t s_decoder;
+static uint8_t s_tx_frame[UART_FRAME_ENCODED_SIZE];
+static uart_link_stats_t s_link_stats;
+static emu_table_device_t s_table[EMU_MAX_SLAVES];
+static uint32_t s_table_version = 1;
+static emu_table_device_t s_table_snapshot[EMU_MAX_SLAVES];
+static uint32_t s_snapshot_version;
+static bool s_snapshot_valid = false;
+static bool s_connected = false;
+static bool s_link_pending = false;
+static int64_t s_switch_time;
+
+static void send_frame(uint8_t type, uint16_t req_id, const void *payload, size_t len)
+{
+    size_t frame_len = uart_frame_encode(type, 0, req_id, (const uint8_t *)payload, len, s_tx_frame, sizeof(s_tx_frame));
+    if (frame_len == 0)
+    {
+        LOG("C3: encode frame type 0x%02x failed, len %d", type, (int)len);
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < frame_len)
+    {
+        int written = write(s_fd, s_tx_frame + offset, frame_len - offset);
+        if (written <= 0)
+        {
+            return;
+        }
+        offset += written;
+    }
+
+    pthread_mutex_lock(&s_stats_mutex);
+    s_link_stats.tx_bytes += frame_len;
+    s_link_stats.tx_frames++;
+    pthread_mutex_unlock(&s_stats_mutex);
+}
+
+static void send_nack(const uart_frame_t *frame)
+{
+    pthread_mutex_lock(&s_stats_mutex);
+    s_link_stats.nacks++;
+    pthread_mutex_unlock(&s_stats_mutex);
+    send_frame(FRAME_NACK, frame->req_id, &frame->type, 1);
+}
+
+static void link_fallback(const char *reason)
+{
+    s_link_pending = false;
+    LOG("C3: link fallback to %d baud: %s", EMU_BAUD_RATE, reason);
+    emu_link_set_baud(EMU_BAUD_RATE);
+    uart_frame_decoder_resync(&s_decoder);
+
+    pthread_mutex_lock(&s_stats_mutex);
+    s_link_stats.link_fallbacks++;
+    pthread_mutex_unlock(&s_stats_mutex);
+}
+
+// Same selection as uart_link_accept, encryption is refused (no cipher on the host)
+static void link_accept(const uart_frame_t *frame)
+{
+    uart_link_params_t agreed = { .baud_rate = EMU_BAUD_RATE, .flow_ctrl = 0, .encrypt = 0 };
+
+    if (frame->len >= sizeof(uart_link_params_t))
+    {
+        uart_link_params_t request;
+        memcpy(&request, frame->payload, sizeof(request));
+
+        agreed.baud_rate = (request.baud_rate < s_max_baud_rate) ? request.baud_rate : s_max_baud_rate;
+        if (agreed.baud_rate < EMU_BAUD_RATE)
+        {
+            agreed.baud_rate = EMU_BAUD_RATE;
+        }
+    }
+
+    send_frame(FRAME_CONNECT_AGREE, frame->req_id, &agreed, sizeof(agreed));
+    // One rate for both directions: the tail of the agree frame may be paced at the new rate
+    emu_link_set_baud(agreed.baud_rate);
+
+    s_link_pending = true;
+    s_switch_time = emu_time_us();
+}
+
+static void send_table_chunk(const uart_frame_t *frame)
+{
+    uart_chunk_request_t request;
+    uart_chunk_header_t header;
+    uint8_t payload[sizeof(uart_chunk_header_t) + EMU_TABLE_CHUNK_RECORDS * sizeof(emu_table_device_t)];
+
+    if (frame->len < sizeof(request))
+    {
+        send_nack(frame);
+        return;
+    }
+    memcpy(&request, frame->payload, sizeof(request));
+
+    if (request.snapshot)
+    {
+        memcpy(s_table_snapshot, s_table, sizeof(s_table));
+        s_snapshot_version = s_table_version;
+        s_snapshot_valid = true;
+    }
+    else if (!s_snapshot_valid || request.version != s_snapshot_version)
+    {
+        send_nack(frame);
+        return;
+    }
+
+    if (request.first >= EMU_MAX_SLAVES)
+    {
+        send_nack(frame);
+        return;
+    }
+
+    header.version = s_snapshot_version;
+    header.total = EMU_MAX_SLAVES;
+    header.first = request.first;
+    header.count = request.count;
+    if (header.count > EMU_MAX_SLAVES - header.first)
+    {
+        header.count = EMU_MAX_SLAVES - header.first;
+    }
+    if (header.count > EMU_TABLE_CHUNK_RECORDS)
+    {
+        header.count = EMU_TABLE_CHUNK_RECORDS;
+    }
+
+    memcpy(payload, &header, sizeof(header));
+    memcpy(payload + sizeof(header), &s_table_snapshot[header.first], header.count * sizeof(emu_table_device_t));
+    send_frame(FRAME_TABLE_CHUNK, frame->req_id, payload, sizeof(header) + header.count * sizeof(emu_table_device_t));
+}
+
+static void frame_process(const uart_frame_t *frame)
+{
+    switch (frame->type)
+    {
+        case FRAME_CONNECT_REQUEST:
+            link_accept(frame);
+            return;
+
+        case FRAME_CONNECTED:
+            s_link_pending = false;
+            send_frame(FRAME_CONNECTED, frame->req_id, NULL, 0);
+            s_connected = true;
+            return;
+
+        default:
+            break;
+    }
+
+    if (!s_connected)
+    {
+        send_nack(frame);
+        return;
+    }
+
+    // Time spent by C3 on a request, e.g. waiting for table_devices_mutex
+    if (s_handling_us > 0)
+    {
+        usleep(s_handling_us);
+    }
+
+    switch (frame->type)
+    {
+        case FRAME_WAKE_UP:
+            send_frame(FRAME_WOKE_UP, frame->req_id, NULL, 0);
+            break;
+
+        case FRAME_GET_DATA:
+        {
+            bool found = false;
+            for (int i = 0; i < EMU_MAX_SLAVES && frame->len >= 6; i++)
+            {
+                if (memcmp(frame->payload, s_table[i].peer_addr, 6) == 0)
+                {
+                    send_frame(FRAME_DATA, frame->req_id, &s_table[i], sizeof(emu_table_device_t));
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+            {
+                send_nack(frame);
+            }
+            break;
+        }
+
+        case FRAME_GET_FULL_DATA:
+        {
+            uint8_t payload[sizeof(uint32_t) + sizeof(s_table)];
+            memcpy(payload, &s_table_version, sizeof(uint32_t));
+            memcpy(payload + sizeof(uint32_t), s_table, sizeof(s_table));
+            send_frame(FRAME_FULL_DATA, frame->req_id, payload, sizeof(payload));
+            break;
+        }
+
+        case FRAME_GET_TABLE_CHUNK:
+            send_table_chunk(frame);
+            break;
+
+        case FRAME_SUBSCRIBE:
+            send_frame(FRAME_SUBSCRIBED, frame->req_id, &s_table_version, sizeof(uint32_t));
+            break;
+
+        case FRAME_BUTTON:
+            break;
+
+        default:
+            send_nack(frame);
+            break;
+    }
+}
+
+static void frame_handler(const uart_frame_t *frame, void *ctx)
+{
+    int64_t start_time = emu_time_us();
+
+    frame_process(frame);
+
+    pthread_mutex_lock(&s_stats_mutex);
+    uart_latency_hist_add(&s_link_stats.latency, (uint32_t)(emu_time_us() - start_time));
+    pthread_mutex_unlock(&s_stats_mutex);
+}
+
+static void *emu_master_task(void *arg)
+{
+    uint8_t dtmp[EMU_RX_CHUNK_SIZE];
+    struct pollfd pfd = { .fd = s_fd, .events = POLLIN };
+
+    while (s_running)
+    {
+        if (poll(&pfd, 1, 20) > 0 && (pfd.revents & POLLIN))
+        {
+            int length = read(s_fd, dtmp, sizeof(dtmp));
+            if (length > 0)
+            {
+                uart_frame_decoder_feed(&s_decoder, dtmp, length, frame_handler, NULL);
+
+                pthread_mutex_lock(&s_stats_mutex);
+                s_link_stats.rx_bytes += length;
+                s_link_stats.rx_frames = s_decoder.frames_ok;
+                s_link_stats.crc_errors = s_decoder.crc_errors;
+                s_link_stats.framing_errors = s_decoder.framing_errors;
+                s_link_stats.overflow_errors = s_decoder.overflow_errors;
+                pthread_mutex_unlock(&s_stats_mutex);
+            }
+        }
+
+        if (s_link_pending && (emu_time_us() - s_switch_time) > EMU_LINK_CONFIRM_TIMEOUT_MS * 1000)
+        {
+            link_fallback("no FRAME_CONNECTED");
+        }
+    }
+
+    return NULL;
+}
+
+/* Start the C3 emulator on fd, max_baud_rate is the highest rate it agrees to. */
+bool emu_master_start(int fd, uint32_t max_baud_rate, uint32_t handling_us)
+{
+    s_fd = fd;
+    s_max_baud_rate = max_baud_rate;
+    s_handling_us = handling_us;
+    uart_frame_decoder_init(&s_decoder);
+
+    for (int i = 0; i < EMU_MAX_SLAVES; i++)
+    {
+        uint8_t mac[6] = { 0x24, 0x0a, 0xc4, 0x00, 0x00, (uint8_t)(i + 1) };
+        memcpy(s_table[i].peer_addr, mac, sizeof(mac));
+        s_table[i].status = true;
+        s_table[i].data.temperature_mcu = 30.0f + i;
+        s_table[i].data.rssi = -50 - i;
+        s_table[i].data.do_value = 6.5f;
+        s_table[i].data.ph_value = 7.2f;
+    }
+
+    s_running = true;
+    if (pthread_create(&s_master_thread, NULL, emu_master_task, NULL) != 0)
+    {
+        s_running = false;
+        return false;
+    }
+    return true;
+}
+
+void emu_master_stop(void)
+{
+    if (s_running)
+    {
+        s_running = false;
+        pthread_join(s_master_thread, NULL);
+    }
+}
+
+void emu_master_stats_get(uart_link_stats_t *stats)
+{
+    pthread_mutex_lock(&s_stats_mutex);
+    *stats = s_link_stats;
+    pthread_mutex_unlock(&s_stats_mutex);
+}
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "emu.h"
+
+#define EMU_NEGOTIATE_ATTEMPTS      (5)
+
+typedef struct {
+    emu_link_config_t link;
+    uint32_t baud_rate;                             // Highest rate requested by S3
+    uint32_t master_baud_rate;                      // Highest rate accepted by C3
+    uint32_t handling_us;
+    int requests;
+    int window;
+    int timeout_ms;
+    bool sweep;
+} emu_options_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --drop P          probability that a byte is lost (0..1)\n"
+            "  --corrupt P       probability that a byte gets one bit flipped (0..1)\n"
+            "  --delay-us N      propagation delay of every byte\n"
+            "  --jitter-us N     random extra delay, byte order is kept\n"
+            "  --baud N          highest rate requested by S3 (default %d)\n"
+            "  --master-baud N   highest rate accepted by C3 (default %d)\n"
+            "  --handling-us N   time C3 spends on every request\n"
+            "  --requests N      GET_DATA requests per pass (default 1000)\n"
+            "  --window N        requests outstanding at once, 1..%d (default 4)\n"
+            "  --timeout-ms N    request timeout (default 200)\n"
+            "  --sweep           one pass per rate from %d to --baud\n"
+            "  --seed N          seed of the fault generator\n",
+            name, EMU_MAX_BAUD_RATE, EMU_MAX_BAUD_RATE, EMU_WINDOW_MAX, EMU_BAUD_RATE);
+}
+
+static bool parse_options(int argc, char **argv, emu_options_t *options)
+{
+    static const struct option long_options[] = {
+        { "drop",           required_argument, NULL, 'd' },
+        { "corrupt",        required_argument, NULL, 'c' },
+        { "delay-us",       required_argument, NULL, 'l' },
+        { "jitter-us",      required_argument, NULL, 'j' },
+        { "baud",           required_argument, NULL, 'b' },
+        { "master-baud",    required_argument, NULL, 'm' },
+        { "handling-us",    required_argument, NULL, 'h' },
+        { "requests",       required_argument, NULL, 'n' },
+        { "window",         required_argument, NULL, 'w' },
+        { "timeout-ms",     required_argument, NULL, 't' },
+        { "sweep",          no_argument,       NULL, 's' },
+        { "seed",           required_argument, NULL, 'r' },
+        { "help",           no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 },
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': options->link.drop = atof(optarg); break;
+            case 'c': options->link.corrupt = atof(optarg); break;
+            case 'l': options->link.delay_us = strtoul(optarg, NULL, 0); break;
+            case 'j': options->link.jitter_us = strtoul(optarg, NULL, 0); break;
+            case 'b': options->baud_rate = strtoul(optarg, NULL, 0); break;
+            case 'm': options->master_baud_rate = strtoul(optarg, NULL, 0); break;
+            case 'h': options->handling_us = strtoul(optarg, NULL, 0); break;
+            case 'n': options->requests = atoi(optarg); break;
+            case 'w': options->window = atoi(optarg); break;
+            case 't': options->timeout_ms = atoi(optarg); break;
+            case 's': options->sweep = true; break;
+            case 'r': options->link.seed = strtoul(optarg, NULL, 0); break;
+            default: return false;
+        }
+    }
+
+    return options->requests > 0 && options->window >= 1 && options->window <= EMU_WINDOW_MAX &&
+           options->baud_rate >= EMU_BAUD_RATE && options->timeout_ms > 0;
+}
+
+static void print_result(const emu_bench_result_t *result)
+{
+    const uart_latency_hist_t *lat = &result->latency;
+    double seconds = result->elapsed_us / 1e6;
+
+    printf("%8lu %9.1f %6d %6d %6d %8lu %8lu %8lu %8lu %8lu  [%lu %lu %lu %lu %lu %lu %lu %lu]\n",
+            (unsigned long)result->baud_rate, (seconds > 0) ? result->completed / seconds : 0.0,
+            result->completed, result->nacks, result->timeouts,
+            (unsigned long)result->p50_us, (unsigned long)result->p90_us, (unsigned long)result->p99_us,
+            (unsigned long)result->p999_us, (unsigned long)result->max_us,
+            (unsigned long)lat->bucket[0], (unsigned long)lat->bucket[1], (unsigned long)lat->bucket[2], (unsigned long)lat->bucket[3],
+            (unsigned long)lat->bucket[4], (unsigned long)lat->bucket[5], (unsigned long)lat->bucket[6], (unsigned long)lat->bucket[7]);
+}
+
+static void print_link_stats(const char *name, const uart_link_stats_t *stats)
+{
+    printf("%s: tx %llu B %lu frames, rx %llu B %lu frames, crc err %lu, framing err %lu, overflow %lu, nack %lu, timeout %lu, fallback %lu\n",
+            name, (unsigned long long)stats->tx_bytes, (unsigned long)stats->tx_frames,
+            (unsigned long long)stats->rx_bytes, (unsigned long)stats->rx_frames,
+            (unsigned long)stats->crc_errors, (unsigned long)stats->framing_errors, (unsigned long)stats->overflow_errors,
+            (unsigned long)stats->nacks, (unsigned long)stats->timeouts, (unsigned long)stats->link_fallbacks);
+}
+
+// Negotiate until both sides run at the same rate, as wait_connect_serial retries
+static bool connect(uint32_t baud_rate)
+{
+    for (int i = 0; i < EMU_NEGOTIATE_ATTEMPTS; i++)
+    {
+        if (emu_gateway_negotiate(baud_rate) && emu_gateway_wake_up())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t rates[] = { 115200, 230400, 460800, 921600, 1500000, 2000000, 3000000 };
+    emu_options_t options = {
+        .link = { .seed = (unsigned int)time(NULL) },
+        .baud_rate = EMU_MAX_BAUD_RATE,
+        .master_baud_rate = EMU_MAX_BAUD_RATE,
+        .requests = 1000,
+        .window = 4,
+        .timeout_ms = 200,
+    };
+    int c3_fd, s3_fd;
+    int failed = 0;
+
+    if (!parse_options(argc, argv, &options))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!emu_link_start(&options.link, &c3_fd, &s3_fd) || !emu_master_start(c3_fd, options.master_baud_rate, options.handling_us))
+    {
+        return 1;
+    }
+    emu_gateway_init(s3_fd);
+
+    printf("drop %g, corrupt %g, delay %lu us, jitter %lu us, handling %lu us, window %d, seed %u\n",
+            options.link.drop, options.link.corrupt, (unsigned long)options.link.delay_us, (unsigned long)options.link.jitter_us,
+            (unsigned long)options.handling_us, options.window, options.link.seed);
+    printf("    baud     req/s     ok   nack  tmout  p50(us)  p90(us)  p99(us) p999(us)  max(us)  [<=1 <=2 <=5 <=10 <=20 <=50 <=100 >100 ms]\n");
+
+    for (int i = 0; i < sizeof(rates) / sizeof(rates[0]) + 1; i++)
+    {
+        uint32_t rate = options.baud_rate;
+        if (options.sweep)
+        {
+            if (i >= sizeof(rates) / sizeof(rates[0]) || rates[i] > options.baud_rate)
+            {
+                break;
+            }
+            rate = rates[i];
+        }
+        else if (i > 0)
+        {
+            break;
+        }
+
+        emu_bench_result_t result;
+        if (!connect(rate))
+        {
+            fprintf(stderr, "Link failed at %lu baud\n", (unsigned long)rate);
+            failed++;
+            continue;
+        }
+        emu_gateway_bench(options.requests, options.window, options.timeout_ms, &result);
+        print_result(&result);
+    }
+
+    uart_link_stats_t stats;
+    emu_link_stats_t wire;
+    emu_gateway_stats_get(&stats);
+    print_link_stats("S3", &stats);
+    emu_master_stats_get(&stats);
+    print_link_stats("C3", &stats);
+    for (int dir = 0; dir < EMU_DIR_MAX; dir++)
+    {
+        emu_link_stats_get(dir, &wire);
+        printf("%s: %llu B, dropped %llu, corrupted %llu\n", (dir == EMU_DIR_C3_TO_S3) ? "C3 -> S3" : "S3 -> C3",
+                (unsigned long long)wire.bytes, (unsigned long long)wire.dropped, (unsigned long long)wire.corrupted);
+    }
+
+    emu_master_stop();
+    emu_link_stop();
+
+    return failed ? 1 : 0;
+}